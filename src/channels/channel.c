@@ -36,3 +36,16 @@ void destroy_channel(channel_t *channel) {
     
     free(channel);
 }
+
+pubsub_pattern_t *create_pubsub_pattern(struct client *client, const char *pattern) {
+    size_t len = strlen(pattern);
+    pubsub_pattern_t *pat = malloc(sizeof(pubsub_pattern_t) + len + 1);
+    if (!pat) {
+        return NULL;
+    }
+
+    pat->client = client;
+    memcpy(pat->pattern, pattern, len + 1);
+    glob_compile(&pat->glob, pat->pattern, len);
+    return pat;
+}
@@ -1,6 +1,7 @@
 #ifndef CHANNEL_H
 #define CHANNEL_H
 #include "../lib/list.h"
+#include "../lib/glob.h"
 
 typedef struct channel
 {
@@ -13,5 +14,19 @@ typedef struct channel
 channel_t *create_channel(char *name);
 void destroy_channel(channel_t *name);
 
+/*
+ * One PSUBSCRIBE of one client. The glob is compiled when subscribing so
+ * PUBLISH only runs the matcher, and literal-prefix patterns never reach it.
+ */
+typedef struct pubsub_pattern
+{
+  struct client *client;
+  glob_pattern_t glob;        // points into pattern below
+  char pattern[];
+}pubsub_pattern_t;
+
+// A single allocation, released with free()
+pubsub_pattern_t *create_pubsub_pattern(struct client *client, const char *pattern);
+
 
 #endif
\ No newline at end of file
@@ -2,10 +2,20 @@
 #include <stdlib.h>
 #include <string.h>
 #include <sys/time.h>
+#include <sys/uio.h>
+#include <limits.h>
+#include <math.h>
+#include <errno.h>
 #include "../lib/list.h"
 #include "client.h"
+#include "../event_loop/event_loop.h"
+#include "../lib/utils.h"
 #include <time.h>
 
+#ifndef IOV_MAX
+#define IOV_MAX 1024
+#endif
+
 
 client_t *create_client(int fd)
 {
@@ -15,15 +25,35 @@ client_t *create_client(int fd)
     
     client->fd = fd;
     client->block_timeout = 0;
+    client->block_timer = NULL;
     client->is_blocked = 0;
     client->blocked_key = NULL;
     client->subscribed_channels = 0;
+    client->subscribed_patterns = 0;
     client->sub_mode = 0;
     client->transaction_commands = NULL; // Explicitly initialize
     client->xread_streams = NULL;
     client->xread_start_ids = NULL;
     client->xread_num_streams = 0;
     client->stream_block = false;
+    client->querybuf = NULL;
+    client->querybuf_len = 0;
+    client->querybuf_cap = 0;
+    resp_parser_init(&client->parser);
+    client->reply_bufpos = 0;
+    client->reply_sentlen = 0;
+    client->reply_chunks = NULL;
+    client->reply_bytes = 0;
+    client->pending_write = 0;
+    client->write_registered = 0;
+    client->pending_read = 0;
+    client->io_status = CLIENT_IO_OK;
+    client->parsed_cmds = NULL;
+    client->parsed_count = 0;
+    client->parsed_cap = 0;
+    client->shard.target = -1;
+    client->shard.txn_target = -1;
+    client->shard.origin = -1;
     
     return client;
 }
@@ -42,6 +72,11 @@ void remove_client_from_list(redis_list_t *list, client_t *client) {
 void free_client(client_t *client) {
     if (!client) return;
     
+    if (client->block_timer) {
+        event_loop_del_timer(client->block_timer);
+        client->block_timer = NULL;
+    }
+
     if (client->blocked_key) {
         free(client->blocked_key);
         client->blocked_key = NULL;
@@ -50,6 +85,12 @@ void free_client(client_t *client) {
     if(client->transaction_commands) {
         cleanup_transaction(client);
     }
+
+    // The server's watched key index must be cleared first, see unwatch_all_keys()
+    if (client->watched_keys) {
+        list_destroy_with_free(client->watched_keys, free);
+        client->watched_keys = NULL;
+    }
     
     if (client->xread_streams) {
         for (int i = 0; i < client->xread_num_streams; i++) {
@@ -72,10 +113,60 @@ void free_client(client_t *client) {
     }
     
     client->xread_num_streams = 0;
+
+    resp_parser_free(&client->parser);
+    free(client->querybuf);
+    client_clear_parsed_commands(client);
+    free(client->parsed_cmds);
+
+    if (client->reply_chunks) {
+        list_destroy_with_free(client->reply_chunks, free);
+        client->reply_chunks = NULL;
+    }
+    free(client->shard.acc);
+    free(client->shard.acc_error);
     
     free(client);
 }
 
+/* Make room for at least readlen more bytes at the end of the query buffer
+ * and return a pointer to the free space. One byte is always kept spare so
+ * the buffer can stay NUL terminated. */
+char *client_querybuf_reserve(client_t *client, size_t readlen)
+{
+    if (!client) return NULL;
+
+    size_t needed = client->querybuf_len + readlen + 1;
+    if (needed > client->querybuf_cap) {
+        size_t new_cap = client->querybuf_cap ? client->querybuf_cap : CLIENT_QUERYBUF_READ_LEN;
+        while (new_cap < needed) {
+            new_cap *= 2;
+        }
+
+        char *new_buf = realloc(client->querybuf, new_cap);
+        if (!new_buf) return NULL;
+
+        client->querybuf = new_buf;
+        client->querybuf_cap = new_cap;
+    }
+
+    return client->querybuf + client->querybuf_len;
+}
+
+/* Drop the first len bytes (already executed frames) from the query buffer. */
+void client_querybuf_consume(client_t *client, size_t len)
+{
+    if (!client || len == 0) return;
+
+    if (len >= client->querybuf_len) {
+        client->querybuf_len = 0;
+    } else {
+        memmove(client->querybuf, client->querybuf + len, client->querybuf_len - len);
+        client->querybuf_len -= len;
+    }
+    client->querybuf[client->querybuf_len] = '\0';
+}
+
 
 void client_block(client_t *client, const char *key, int timeout_timestamp)
 {
@@ -109,6 +200,11 @@ void client_unblock(client_t *client) {
     
     client->is_blocked = 0;
     client->block_timeout = 0;
+    client->block_timeout_ms = 0;
+    if (client->block_timer) {
+        event_loop_del_timer(client->block_timer);
+        client->block_timer = NULL;
+    }
     
     if (client->blocked_key) {
         free(client->blocked_key);
@@ -151,8 +247,7 @@ void client_unblock_stream(client_t *client)
     if (c->transaction_commands) {
         list_node_t *node = c->transaction_commands->head;
         while (node) {
-            char *command_buffer = (char *)node->data;
-            free(command_buffer);  
+            free(node->data);   // transaction_command_t and its arguments are one block
             node = node->next;
         }
         
@@ -161,4 +256,321 @@ void client_unblock_stream(client_t *client)
     }
     
     c->is_queued = 0;
-}
\ No newline at end of file
+    c->txn_dirty = 0;
+    c->shard.txn_target = -1;
+}
+int client_add_parsed_command(client_t *client, size_t frame_len, char **args, int argc)
+{
+    if (client->parsed_count == client->parsed_cap) {
+        int new_cap = client->parsed_cap ? client->parsed_cap * 2 : 16;
+        parsed_command_t *cmds = realloc(client->parsed_cmds, new_cap * sizeof(parsed_command_t));
+        if (!cmds) return -1;
+        client->parsed_cmds = cmds;
+        client->parsed_cap = new_cap;
+    }
+
+    parsed_command_t *cmd = &client->parsed_cmds[client->parsed_count++];
+    cmd->frame_len = frame_len;
+    cmd->args = args;
+    cmd->argc = argc;
+    return 0;
+}
+
+/* Free parsed commands that did not run; their frames stay in the
+ * query buffer and are simply parsed again later. */
+void client_clear_parsed_commands(client_t *client)
+{
+    for (int i = 0; i < client->parsed_count; i++) {
+        parsed_command_t *cmd = &client->parsed_cmds[i];
+        free(cmd->args);
+    }
+    client->parsed_count = 0;
+}
+
+/* Append reply bytes to the client's output buffers. Nothing is written to
+ * the socket here; the server flushes pending clients once per loop iteration. */
+int client_add_reply(client_t *client, const char *data, size_t len)
+{
+    if (!client || !data || len == 0) return 0;
+
+    // Fast path: nothing overflowed yet and the fixed buffer has room
+    if ((!client->reply_chunks || client->reply_chunks->length == 0) &&
+        CLIENT_REPLY_BUF_SIZE - client->reply_bufpos >= len) {
+        memcpy(client->reply_buf + client->reply_bufpos, data, len);
+        client->reply_bufpos += len;
+        return 0;
+    }
+
+    if (!client->reply_chunks) {
+        client->reply_chunks = list_create();
+        if (!client->reply_chunks) return -1;
+    }
+
+    reply_chunk_t *tail = client->reply_chunks->tail ? client->reply_chunks->tail->data : NULL;
+    if (tail && tail->size - tail->used > 0) {
+        size_t avail = tail->size - tail->used;
+        size_t copy = len < avail ? len : avail;
+        memcpy(tail->buf + tail->used, data, copy);
+        tail->used += copy;
+        client->reply_bytes += copy;
+        data += copy;
+        len -= copy;
+    }
+
+    if (len > 0) {
+        size_t size = len > CLIENT_REPLY_CHUNK_SIZE ? len : CLIENT_REPLY_CHUNK_SIZE;
+        reply_chunk_t *chunk = malloc(sizeof(reply_chunk_t) + size);
+        if (!chunk) return -1;
+        chunk->size = size;
+        chunk->used = len;
+        memcpy(chunk->buf, data, len);
+        list_rpush(client->reply_chunks, chunk);
+        client->reply_bytes += len;
+    }
+
+    return 0;
+}
+
+/*
+ * Reply builders: encode RESP straight into the output buffers, so a handler
+ * never allocates a reply string and nothing is measured with strlen twice.
+ * Like client_add_reply they are no-ops for a NULL client (commands applied
+ * from the replication stream). Each returns -1 only when out of memory.
+ */
+
+/* "<type><n>\r\n", the header shared by integers, arrays and bulk strings */
+static int client_add_reply_header(client_t *client, char type, long long n)
+{
+    const shared_reply_t *shared = shared_reply_header(type, n);
+    if (shared) {
+        return client_add_reply(client, shared->buf, shared->len);
+    }
+
+    char buf[32];
+    int len = 0;
+
+    buf[len++] = type;
+    len += ll_to_str(buf + len, n);
+    buf[len++] = '\r';
+    buf[len++] = '\n';
+    return client_add_reply(client, buf, len);
+}
+
+int client_add_reply_shared(client_t *client, const shared_reply_t *reply)
+{
+    return client_add_reply(client, reply->buf, reply->len);
+}
+
+int client_add_reply_simple(client_t *client, const char *str)
+{
+    if (!client) return 0;
+    if (client_add_reply(client, "+", 1) < 0 ||
+        client_add_reply(client, str, strlen(str)) < 0) {
+        return -1;
+    }
+    return client_add_reply(client, "\r\n", 2);
+}
+
+/* msg carries its own error code, e.g. "ERR syntax error" or "WRONGTYPE ..." */
+int client_add_reply_error(client_t *client, const char *msg)
+{
+    if (!client) return 0;
+    if (client_add_reply(client, "-", 1) < 0 ||
+        client_add_reply(client, msg, strlen(msg)) < 0) {
+        return -1;
+    }
+    return client_add_reply(client, "\r\n", 2);
+}
+
+int client_add_reply_integer(client_t *client, long long value)
+{
+    if (!client) return 0;
+    return client_add_reply_header(client, ':', value);
+}
+
+int client_add_reply_array_len(client_t *client, long long count)
+{
+    if (!client) return 0;
+    return client_add_reply_header(client, '*', count);
+}
+
+int client_add_reply_bulk(client_t *client, const char *data, size_t len)
+{
+    if (!client) return 0;
+    if (client_add_reply_header(client, '$', (long long)len) < 0 ||
+        client_add_reply(client, data, len) < 0) {
+        return -1;
+    }
+    return client_add_reply(client, "\r\n", 2);
+}
+
+int client_add_reply_bulk_cstr(client_t *client, const char *str)
+{
+    return client_add_reply_bulk(client, str, strlen(str));
+}
+
+int client_add_reply_bulk_ll(client_t *client, long long value)
+{
+    char buf[32];
+    return client_add_reply_bulk(client, buf, ll_to_str(buf, value));
+}
+
+/* Scores go out as bulk strings: integral values without a fraction, the
+ * rest with enough digits to round-trip */
+int client_add_reply_double(client_t *client, double value)
+{
+    // The cast is only defined for finite values within long long's range
+    if (isfinite(value) && value >= (double)LLONG_MIN && value < -(double)LLONG_MIN &&
+        value == (long long)value) {
+        return client_add_reply_bulk_ll(client, (long long)value);
+    }
+
+    char buf[32];
+    int len = snprintf(buf, sizeof(buf), "%.17g", value);
+    return client_add_reply_bulk(client, buf, len);
+}
+
+int client_add_reply_null(client_t *client)
+{
+    return client_add_reply_shared(client, &shared_replies.null_bulk);
+}
+
+int client_add_reply_null_array(client_t *client)
+{
+    return client_add_reply_shared(client, &shared_replies.null_array);
+}
+
+int client_has_pending_replies(client_t *client)
+{
+    if (!client) return 0;
+    return client->reply_bufpos > 0 ||
+           (client->reply_chunks && client->reply_chunks->length > 0);
+}
+
+size_t client_pending_output(client_t *client)
+{
+    return client->reply_bufpos + client->reply_bytes - client->reply_sentlen;
+}
+
+client_type_t client_get_type(client_t *client)
+{
+    return client->subscribed_channels + client->subscribed_patterns > 0 ? CLIENT_TYPE_PUBSUB : CLIENT_TYPE_NORMAL;
+}
+
+/* Checked each time output is queued, so a stalled reader is caught while it
+ * is still being fed. Returns 1 when the client should be disconnected. */
+int client_output_limit_reached(client_t *client, const client_output_limit_t *limit, time_t now)
+{
+    size_t pending = client_pending_output(client);
+
+    if (limit->hard_bytes && pending >= limit->hard_bytes) {
+        return 1;
+    }
+    if (!limit->soft_bytes || pending < limit->soft_bytes) {
+        client->output_soft_limit_since = 0;
+        return 0;
+    }
+    if (client->output_soft_limit_since == 0) {
+        client->output_soft_limit_since = now;
+        return 0;
+    }
+    return now - client->output_soft_limit_since > limit->soft_seconds;
+}
+
+/* Move all pending output into one malloc'd string and reset the output
+ * buffers. Used for clients that have no socket of their own. */
+char *client_take_replies(client_t *client, size_t *len)
+{
+    // reply_sentlen applies to the first pending block, whichever that is
+    size_t total = client->reply_bufpos + client->reply_bytes - client->reply_sentlen;
+    char *data = malloc(total + 1);
+    if (!data) return NULL;
+
+    size_t pos = 0;
+    size_t offset = client->reply_sentlen;
+    if (client->reply_bufpos > 0) {
+        pos = client->reply_bufpos - offset;
+        memcpy(data, client->reply_buf + offset, pos);
+        offset = 0;
+    }
+    if (client->reply_chunks) {
+        reply_chunk_t *chunk;
+        while ((chunk = list_lpop(client->reply_chunks)) != NULL) {
+            memcpy(data + pos, chunk->buf + offset, chunk->used - offset);
+            pos += chunk->used - offset;
+            offset = 0;
+            free(chunk);
+        }
+    }
+    data[pos] = '\0';
+
+    client->reply_bufpos = 0;
+    client->reply_sentlen = 0;
+    client->reply_bytes = 0;
+    *len = pos;
+    return data;
+}
+
+/* Write as much pending output as the socket accepts with writev.
+ * Returns 1 when everything was written, 0 if the socket is full and
+ * -1 on a write error (the connection should be closed). */
+int client_write_replies(client_t *client)
+{
+    while (client_has_pending_replies(client)) {
+        struct iovec iov[IOV_MAX];
+        int iovcnt = 0;
+        size_t offset = client->reply_sentlen;
+
+        if (client->reply_bufpos > 0) {
+            iov[iovcnt].iov_base = client->reply_buf + offset;
+            iov[iovcnt].iov_len = client->reply_bufpos - offset;
+            iovcnt++;
+            offset = 0;
+        }
+
+        list_node_t *node = client->reply_chunks ? client->reply_chunks->head : NULL;
+        while (node && iovcnt < IOV_MAX) {
+            reply_chunk_t *chunk = node->data;
+            iov[iovcnt].iov_base = chunk->buf + offset;
+            iov[iovcnt].iov_len = chunk->used - offset;
+            iovcnt++;
+            offset = 0;
+            node = node->next;
+        }
+
+        ssize_t written = writev(client->fd, iov, iovcnt);
+        if (written < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) return 0;
+            if (errno == EINTR) continue;
+            return -1;
+        }
+
+        // Release every block that went out completely
+        size_t remaining = (size_t)written;
+        if (client->reply_bufpos > 0) {
+            size_t pending = client->reply_bufpos - client->reply_sentlen;
+            if (remaining < pending) {
+                client->reply_sentlen += remaining;
+                return 0;
+            }
+            remaining -= pending;
+            client->reply_bufpos = 0;
+            client->reply_sentlen = 0;
+        }
+
+        while (client->reply_chunks && client->reply_chunks->head) {
+            reply_chunk_t *chunk = client->reply_chunks->head->data;
+            size_t pending = chunk->used - client->reply_sentlen;
+            if (remaining < pending) {
+                client->reply_sentlen += remaining;
+                return 0;
+            }
+            remaining -= pending;
+            client->reply_bytes -= chunk->used;
+            client->reply_sentlen = 0;
+            free(list_lpop(client->reply_chunks));
+        }
+    }
+
+    return 1;
+}
@@ -5,30 +5,137 @@
 #include <string.h>
 #include <sys/time.h>
 #include <stdbool.h>
+#include <sys/types.h>
 #include "../lib/list.h"
+#include "../resp_praser/resp_parser.h"
+#include "shared_replies.h"
+
+#define CLIENT_QUERYBUF_READ_LEN (1024 * 16)
+#define CLIENT_DEFAULT_MAX_QUERYBUF_LEN (1024 * 1024 * 1024)
+#define CLIENT_REPLY_BUF_SIZE (1024 * 16)
+#define CLIENT_REPLY_CHUNK_SIZE (1024 * 16)
+
+/* Default output limits for subscribers, the same as Redis' "pubsub 32mb 8mb 60" */
+#define CLIENT_PUBSUB_OUTPUT_HARD_LIMIT (1024 * 1024 * 32)
+#define CLIENT_PUBSUB_OUTPUT_SOFT_LIMIT (1024 * 1024 * 8)
+#define CLIENT_PUBSUB_OUTPUT_SOFT_SECONDS 60
+
+/* Output limits are configured per class of client */
+typedef enum {
+    CLIENT_TYPE_NORMAL,
+    CLIENT_TYPE_PUBSUB,
+    CLIENT_TYPE_COUNT
+} client_type_t;
+
+/*
+ * A client is disconnected once its pending output passes hard_bytes, or
+ * stays above soft_bytes for more than soft_seconds. Zero disables a limit.
+ */
+typedef struct client_output_limit {
+    size_t hard_bytes;
+    size_t soft_bytes;
+    time_t soft_seconds;
+} client_output_limit_t;
+
+/* Outcome of a socket read/write done on an I/O thread */
+typedef enum {
+    CLIENT_IO_OK,
+    CLIENT_IO_EOF,
+    CLIENT_IO_ERROR,
+    CLIENT_IO_OVERFLOW
+} client_io_status_t;
+
+/* A command parsed ahead of execution (by an I/O thread) */
+typedef struct parsed_command {
+    size_t frame_len;          /* raw RESP bytes at the head of the query buffer */
+    char **args;
+    int argc;
+} parsed_command_t;
+
+/* Routing state used when the keyspace is split across shards */
+typedef struct client_shard_state {
+    int pending;               /* replies still expected from other shards */
+    int target;                /* shard running our forwarded command, -1 for fan-outs */
+    int txn_target;            /* shard owning the keys queued in MULTI, -1 if none yet */
+    int fanout;                /* how fan-out replies are merged, see shard.h */
+    long long acc_int;
+    size_t acc_count;
+    char *acc;                 /* merged fan-out reply body */
+    size_t acc_len;
+    char *acc_error;
+    int origin;                /* pseudo-client for a forwarded command: the shard that asked, else -1 */
+    int origin_fd;
+    unsigned long long origin_id;
+} client_shard_state_t;
+
+/* Overflow reply storage once the fixed reply_buf is full */
+typedef struct reply_chunk {
+    size_t size;
+    size_t used;
+    char buf[];
+} reply_chunk_t;
 
 typedef struct client {
     int fd;
+    unsigned long long id;     /* unique per server, fds get reused */
+    char *querybuf;            /* bytes read but not yet executed, may end in a partial frame */
+    size_t querybuf_len;
+    size_t querybuf_cap;
+    resp_parser_t parser;      /* progress through the frame at querybuf + (bytes already executed) */
     int is_blocked;
     time_t block_timeout;
     long long block_timeout_ms;
+    struct event_timer *block_timer;   /* fires the BLPOP/XREAD timeout, NULL when blocked forever */
     char *blocked_key;
     bool stream_block;
     char **xread_streams;      
     char **xread_start_ids;   
     int xread_num_streams; 
     int is_queued; /* is the client queueing commands using multi*/
+    int in_exec;               /* running the queued commands of EXEC */
+    int txn_dirty;             /* a command failed to queue, EXEC answers EXECABORT */
+    redis_list_t *watched_keys; /* watched_key_t added by WATCH, NULL when none */
+    int watch_dirty;           /* a watched key was written to, EXEC fails */
     redis_list_t *transaction_commands;
     int subscribed_channels;
+    int subscribed_patterns;   /* PSUBSCRIBE patterns, in server->pubsub_patterns */
     int sub_mode;
+    char reply_buf[CLIENT_REPLY_BUF_SIZE]; /* replies are staged here first */
+    size_t reply_bufpos;
+    size_t reply_sentlen;      /* bytes of the first pending block already written */
+    redis_list_t *reply_chunks; /* reply_chunk_t list used after reply_buf fills up */
+    size_t reply_bytes;        /* bytes held in reply_chunks */
+    int pending_write;         /* queued on the server's pending write list */
+    int write_registered;      /* EPOLLOUT installed because the socket was full */
+    int pending_read;          /* queued for a threaded read + parse */
+    int pending_unblocked;     /* queued to run its buffered commands after being unblocked */
+    client_io_status_t io_status;
+    time_t output_soft_limit_since; /* when pending output went over the soft limit, 0 if under */
+    int close_asap;            /* output limit hit: drop its input and output, freed from before_sleep */
+    int write_status;          /* client_write_replies() result from the last threaded flush */
+    parsed_command_t *parsed_cmds;
+    int parsed_count;
+    int parsed_cap;
+    client_shard_state_t shard;
 }client_t;
 
+struct redis_command;
+
+/* A command queued by MULTI, resolved and parsed once; one allocation holds it all */
 typedef struct transaction_command {
-    char *buffer;       // Original command buffer
-    char **args;        // Parsed arguments  
-    int argc;          
+    struct redis_command *cmd;
+    char **args;
+    int argc;
+    char *buffer;       // raw frame, propagated to replicas and forwarded between shards as is
+    size_t len;
 } transaction_command_t;
 
+/* A key named by WATCH; the key is stored right behind the struct */
+typedef struct watched_key {
+    int expired;        // already expired when it was watched, so expiring is no change
+    char key[];
+} watched_key_t;
+
 client_t *create_client(int fd);
 void add_client_to_list(redis_list_t *list, client_t *client);
 void remove_client_from_list(redis_list_t *list, client_t *client);
@@ -37,5 +144,27 @@ void client_unblock_stream(client_t *client);
 void client_unblock(client_t *client);
 void cleanup_transaction(client_t *c);
 void free_client(client_t *client);
+char *client_querybuf_reserve(client_t *client, size_t readlen);
+void client_querybuf_consume(client_t *client, size_t len);
+int client_add_reply(client_t *client, const char *data, size_t len);
+int client_add_reply_shared(client_t *client, const shared_reply_t *reply);
+int client_add_reply_simple(client_t *client, const char *str);
+int client_add_reply_error(client_t *client, const char *msg);
+int client_add_reply_integer(client_t *client, long long value);
+int client_add_reply_array_len(client_t *client, long long count);
+int client_add_reply_bulk(client_t *client, const char *data, size_t len);
+int client_add_reply_bulk_cstr(client_t *client, const char *str);
+int client_add_reply_bulk_ll(client_t *client, long long value);
+int client_add_reply_double(client_t *client, double value);
+int client_add_reply_null(client_t *client);
+int client_add_reply_null_array(client_t *client);
+int client_add_parsed_command(client_t *client, size_t frame_len, char **args, int argc);
+void client_clear_parsed_commands(client_t *client);
+int client_has_pending_replies(client_t *client);
+size_t client_pending_output(client_t *client);
+client_type_t client_get_type(client_t *client);
+int client_output_limit_reached(client_t *client, const client_output_limit_t *limit, time_t now);
+char *client_take_replies(client_t *client, size_t *len);
+int client_write_replies(client_t *client);
 
 #endif
\ No newline at end of file
@@ -0,0 +1,76 @@
+#include <stdlib.h>
+#include "shared_replies.h"
+#include "../lib/utils.h"
+
+#define SHARED_REPLY(str) { str, sizeof(str) - 1 }
+#define SHARED_REPLY_MAX_HEADER 24      /* type, 20 digits, \r\n */
+
+const shared_replies_t shared_replies = {
+    .ok = SHARED_REPLY("+OK\r\n"),
+    .pong = SHARED_REPLY("+PONG\r\n"),
+    .queued = SHARED_REPLY("+QUEUED\r\n"),
+    .null_bulk = SHARED_REPLY("$-1\r\n"),
+    .null_array = SHARED_REPLY("*-1\r\n"),
+    .empty_array = SHARED_REPLY("*0\r\n"),
+    .czero = SHARED_REPLY(":0\r\n"),
+    .cone = SHARED_REPLY(":1\r\n"),
+    .wrongtype = SHARED_REPLY("-WRONGTYPE Operation against a key holding the wrong kind of value\r\n"),
+    .syntax_error = SHARED_REPLY("-ERR syntax error\r\n"),
+    .not_integer = SHARED_REPLY("-ERR value is not an integer or out of range\r\n"),
+    .oom = SHARED_REPLY("-ERR out of memory\r\n"),
+};
+
+/* Integers, array lengths and bulk lengths, indexed by value */
+static const char header_types[] = {':', '*', '$'};
+static shared_reply_t *header_tables[3];
+static long long header_counts[3];
+
+static shared_reply_t *build_header_table(char type, long long count)
+{
+    shared_reply_t *table = malloc(count * sizeof(shared_reply_t));
+    char *buf = malloc(count * SHARED_REPLY_MAX_HEADER);
+    if (!table || !buf) {
+        free(table);
+        free(buf);
+        return NULL;
+    }
+
+    // One block for all entries; it lives as long as the process
+    char *pos = buf;
+    for (long long i = 0; i < count; i++) {
+        table[i].buf = pos;
+        *pos++ = type;
+        pos += ll_to_str(pos, i);
+        *pos++ = '\r';
+        *pos++ = '\n';
+        table[i].len = pos - table[i].buf;
+    }
+    return table;
+}
+
+int shared_replies_init(long long integers)
+{
+    long long counts[3] = {integers, SHARED_REPLY_HEADERS, SHARED_REPLY_HEADERS};
+
+    for (int i = 0; i < 3; i++) {
+        if (counts[i] <= 0) {
+            continue;
+        }
+        header_tables[i] = build_header_table(header_types[i], counts[i]);
+        if (!header_tables[i]) {
+            return -1;
+        }
+        header_counts[i] = counts[i];
+    }
+    return 0;
+}
+
+/* "<type><n>\r\n" for ':', '*' or '$', or NULL when n is not prebuilt */
+const shared_reply_t *shared_reply_header(char type, long long n)
+{
+    int i = type == ':' ? 0 : type == '*' ? 1 : 2;
+    if (n < 0 || n >= header_counts[i]) {
+        return NULL;
+    }
+    return &header_tables[i][n];
+}
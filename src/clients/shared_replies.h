@@ -0,0 +1,39 @@
+#ifndef SHARED_REPLIES_H
+#define SHARED_REPLIES_H
+
+#include <stddef.h>
+
+#define SHARED_REPLY_INTEGERS_DEFAULT 10000   /* ":<n>\r\n" is prebuilt for 0 <= n < this */
+#define SHARED_REPLY_INTEGERS_MAX 1000000
+#define SHARED_REPLY_HEADERS 32               /* "*<n>\r\n" and "$<n>\r\n" are prebuilt below this */
+
+/* An already encoded reply. Never modified or freed, so every thread (and
+ * shard) can use the same copy. */
+typedef struct shared_reply {
+    const char *buf;
+    size_t len;
+} shared_reply_t;
+
+typedef struct shared_replies {
+    shared_reply_t ok;
+    shared_reply_t pong;
+    shared_reply_t queued;
+    shared_reply_t null_bulk;       /* $-1 */
+    shared_reply_t null_array;      /* *-1 */
+    shared_reply_t empty_array;
+    shared_reply_t czero;
+    shared_reply_t cone;
+    shared_reply_t wrongtype;
+    shared_reply_t syntax_error;
+    shared_reply_t not_integer;
+    shared_reply_t oom;
+} shared_replies_t;
+
+extern const shared_replies_t shared_replies;
+
+/* Build the integer and length header tables. Call once, before any server
+ * thread starts; until then every lookup below misses. */
+int shared_replies_init(long long integers);
+const shared_reply_t *shared_reply_header(char type, long long n);
+
+#endif
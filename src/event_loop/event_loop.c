@@ -1,4 +1,5 @@
 #include "event_loop.h"
+#include "event_loop_backend.h"
 #include <stdlib.h>
 #include <unistd.h>
 #include <fcntl.h>
@@ -6,22 +7,292 @@
 #include <errno.h>
 #include <stdio.h>
 #include <sys/timerfd.h>
+#include <sys/resource.h>
+#include <time.h>
 
 
+static const event_loop_backend_t *default_backend = &event_loop_epoll_backend;
+
+/* Selects the backend used by loops created afterwards: "epoll" or "io_uring". */
+int event_loop_set_default_backend(const char *name)
+{
+    if (strcmp(name, event_loop_epoll_backend.name) == 0)
+    {
+        default_backend = &event_loop_epoll_backend;
+        return 0;
+    }
+    if (strcmp(name, event_loop_uring_backend.name) == 0)
+    {
+        default_backend = &event_loop_uring_backend;
+        return 0;
+    }
+    return -1;
+}
+
+const char *event_loop_backend_name(event_loop_t *event_loop)
+{
+    return event_loop->backend->name;
+}
+
+static int open_files_limit(void)
+{
+    struct rlimit limit;
+    if (getrlimit(RLIMIT_NOFILE, &limit) < 0 || limit.rlim_cur == RLIM_INFINITY ||
+        limit.rlim_cur > INT32_MAX)
+    {
+        return INT32_MAX;
+    }
+    return (int)limit.rlim_cur;
+}
+
+// Make room for fd in the handler table, doubling it as connections grow
+static int event_loop_reserve_fd(event_loop_t *event_loop, int fd)
+{
+    if (fd < event_loop->handlers_size)
+        return 0;
+    if (fd >= event_loop->max_fds)
+    {
+        errno = EMFILE;
+        return -1;
+    }
+
+    long new_size = event_loop->handlers_size;
+    while (new_size <= fd)
+    {
+        new_size *= 2;
+    }
+    if (new_size > event_loop->max_fds)
+        new_size = event_loop->max_fds;
+
+    event_handler_entry_t *handlers = realloc(event_loop->handlers, new_size * sizeof(event_handler_entry_t));
+    if (!handlers)
+        return -1;
+
+    memset(handlers + event_loop->handlers_size, 0,
+           (new_size - event_loop->handlers_size) * sizeof(event_handler_entry_t));
+    event_loop->handlers = handlers;
+    event_loop->handlers_size = (int)new_size;
+    return 0;
+}
+
+long long event_loop_now_ms(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static void timer_heap_swap(event_loop_t *event_loop, int a, int b)
+{
+    event_timer_t *tmp = event_loop->timers[a];
+    event_loop->timers[a] = event_loop->timers[b];
+    event_loop->timers[b] = tmp;
+    event_loop->timers[a]->heap_index = a;
+    event_loop->timers[b]->heap_index = b;
+}
+
+static void timer_heap_up(event_loop_t *event_loop, int i)
+{
+    while (i > 0)
+    {
+        int parent = (i - 1) / 2;
+        if (event_loop->timers[parent]->when_ms <= event_loop->timers[i]->when_ms)
+            break;
+        timer_heap_swap(event_loop, i, parent);
+        i = parent;
+    }
+}
+
+static void timer_heap_down(event_loop_t *event_loop, int i)
+{
+    for (;;)
+    {
+        int smallest = i;
+        int left = 2 * i + 1;
+        int right = left + 1;
+        if (left < event_loop->timers_count &&
+            event_loop->timers[left]->when_ms < event_loop->timers[smallest]->when_ms)
+            smallest = left;
+        if (right < event_loop->timers_count &&
+            event_loop->timers[right]->when_ms < event_loop->timers[smallest]->when_ms)
+            smallest = right;
+        if (smallest == i)
+            break;
+        timer_heap_swap(event_loop, i, smallest);
+        i = smallest;
+    }
+}
+
+static int timer_heap_push(event_loop_t *event_loop, event_timer_t *timer)
+{
+    if (event_loop->timers_count == event_loop->timers_size)
+    {
+        int new_size = event_loop->timers_size ? event_loop->timers_size * 2 : 16;
+        event_timer_t **timers = realloc(event_loop->timers, new_size * sizeof(event_timer_t *));
+        if (!timers)
+            return -1;
+        event_loop->timers = timers;
+        event_loop->timers_size = new_size;
+    }
+
+    timer->heap_index = event_loop->timers_count++;
+    event_loop->timers[timer->heap_index] = timer;
+    timer_heap_up(event_loop, timer->heap_index);
+    return 0;
+}
+
+static void timer_heap_remove(event_loop_t *event_loop, event_timer_t *timer)
+{
+    int i = timer->heap_index;
+    int last = --event_loop->timers_count;
+    if (i != last)
+    {
+        timer_heap_swap(event_loop, i, last);
+        timer_heap_down(event_loop, i);
+        timer_heap_up(event_loop, i);
+    }
+    timer->heap_index = -1;
+}
+
+/* Schedules handler to run once delay_ms from now; the handler may ask to be rescheduled */
+event_timer_t *event_loop_add_timer(event_loop_t *event_loop, long long delay_ms,
+                                    event_timer_handler_t handler, void *data)
+{
+    if (!event_loop || !handler)
+        return NULL;
+
+    event_timer_t *timer = malloc(sizeof(event_timer_t));
+    if (!timer)
+        return NULL;
+
+    timer->when_ms = event_loop_now_ms() + (delay_ms > 0 ? delay_ms : 0);
+    timer->handler = handler;
+    timer->data = data;
+    timer->loop = event_loop;
+    if (timer_heap_push(event_loop, timer) < 0)
+    {
+        free(timer);
+        return NULL;
+    }
+    return timer;
+}
+
+void event_loop_del_timer(event_timer_t *timer)
+{
+    if (!timer)
+        return;
+
+    event_loop_t *event_loop = timer->loop;
+    if (timer == event_loop->firing_timer)
+    {
+        // freed by event_loop_run_timers once the handler returns
+        timer->handler = NULL;
+        return;
+    }
+    timer_heap_remove(event_loop, timer);
+    free(timer);
+}
+
+static void event_loop_run_timers(event_loop_t *event_loop)
+{
+    long long now = event_loop_now_ms();
+    while (event_loop->timers_count > 0 && event_loop->timers[0]->when_ms <= now)
+    {
+        event_timer_t *timer = event_loop->timers[0];
+        timer_heap_remove(event_loop, timer);
+
+        event_loop->firing_timer = timer;
+        long long next = timer->handler(event_loop, timer, timer->data);
+        event_loop->firing_timer = NULL;
+
+        if (next == EVENT_TIMER_NOMORE || !timer->handler)
+        {
+            free(timer);
+            continue;
+        }
+        // at least 1ms out, so a zero interval cannot keep this loop spinning
+        timer->when_ms = now + (next > 0 ? next : 1);
+        if (timer_heap_push(event_loop, timer) < 0)
+            free(timer);
+    }
+}
+
+// Point timer_fd at the earliest deadline; only touches the kernel when it moved
+static void event_loop_arm_timer(event_loop_t *event_loop)
+{
+    if (event_loop->timer_fd < 0)
+        return;
+
+    long long when = event_loop->timers_count > 0 ? event_loop->timers[0]->when_ms : 0;
+    if (when == event_loop->timer_armed_ms)
+        return;
+
+    struct itimerspec spec;
+    memset(&spec, 0, sizeof(spec));
+    spec.it_value.tv_sec = when / 1000;
+    spec.it_value.tv_nsec = (when % 1000) * 1000000;
+    if (timerfd_settime(event_loop->timer_fd, TFD_TIMER_ABSTIME, &spec, NULL) == -1)
+    {
+        perror("timerfd_settime");
+        return;
+    }
+    event_loop->timer_armed_ms = when;
+}
+
+static void event_loop_handle_timer_fd(event_loop_t *event_loop, int fd, uint32_t events, void *data)
+{
+    (void)events;
+    (void)data;
+    uint64_t expirations;
+    while (read(fd, &expirations, sizeof(expirations)) > 0)
+        ;
+    event_loop->timer_armed_ms = 0;
+    event_loop_run_timers(event_loop);
+}
+
 event_loop_t *event_loop_create(void)
 {
     event_loop_t *event_loop = calloc(1, sizeof(event_loop_t));
     if (!event_loop)
         return NULL;
 
-    event_loop->epoll_fd = epoll_create1(0);
-    if (event_loop->epoll_fd < 0)
+    event_loop->max_fds = open_files_limit();
+    event_loop->handlers_size = EVENT_LOOP_INITIAL_FDS < event_loop->max_fds ? EVENT_LOOP_INITIAL_FDS : event_loop->max_fds;
+    event_loop->handlers = calloc(event_loop->handlers_size, sizeof(event_handler_entry_t));
+    if (!event_loop->handlers)
     {
         free(event_loop);
         return NULL;
     }
+
+    event_loop->backend = default_backend;
+    if (event_loop->backend->create(event_loop) < 0)
+    {
+        if (event_loop->backend == &event_loop_epoll_backend)
+        {
+            free(event_loop->handlers);
+            free(event_loop);
+            return NULL;
+        }
+        // io_uring may be missing or disabled (seccomp, sysctl), epoll always works
+        fprintf(stderr, "%s backend unavailable (%s), falling back to epoll\n",
+                event_loop->backend->name, strerror(errno));
+        event_loop->backend = &event_loop_epoll_backend;
+        if (event_loop->backend->create(event_loop) < 0)
+        {
+            free(event_loop->handlers);
+            free(event_loop);
+            return NULL;
+        }
+    }
     event_loop->timer_fd = setup_timer_fd();
+    if (event_loop->timer_fd >= 0 &&
+        event_loop_add_fd(event_loop, event_loop->timer_fd, EPOLLIN, event_loop_handle_timer_fd, NULL) < 0)
+    {
+        perror("event_loop_add_fd timer");
+    }
     event_loop->running = false;
+    printf("Event loop using %s backend\n", event_loop->backend->name);
     return event_loop;
 }
 
@@ -30,51 +301,116 @@ void event_loop_destroy(event_loop_t *event_loop)
     if (!event_loop)
         return;
 
-    if (event_loop->epoll_fd >= 0)
-    {
-        close(event_loop->epoll_fd);
-    }
+    event_loop->backend->destroy(event_loop);
     if(event_loop->timer_fd >= 0)
       close(event_loop->timer_fd);
+    for (int i = 0; i < event_loop->timers_count; i++)
+    {
+        free(event_loop->timers[i]);
+    }
+    free(event_loop->timers);
+    free(event_loop->handlers);
     free(event_loop);
 }
 
 int event_loop_add_fd(event_loop_t *event_loop, int fd, uint32_t events,
                       event_handler_t handler, void *data)
 {
-    struct epoll_event ev;
-    ev.data.fd = fd;
-    ev.events = events;
-    
-    if (epoll_ctl(event_loop->epoll_fd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+    if (!event_loop || fd < 0 || event_loop_reserve_fd(event_loop, fd) < 0)
+    {
+        return -1;
+    }
+
+    if (event_loop->backend->add(event_loop, fd, events) < 0) {
         return -1;
     }
     
     event_loop->handlers[fd].handler = handler;
+    event_loop->handlers[fd].on_accept = NULL;
+    event_loop->handlers[fd].on_read = NULL;
     event_loop->handlers[fd].data = data;
     
     return 0;  
 }
 
+static int event_loop_set_io(event_loop_t *event_loop, int fd, int io)
+{
+    if (!event_loop || fd < 0 || fd >= event_loop->handlers_size || !event_loop->handlers[fd].handler)
+    {
+        errno = EINVAL;
+        return -1;
+    }
+    if (!event_loop->backend->set_io)
+    {
+        errno = EOPNOTSUPP;
+        return -1;
+    }
+    return event_loop->backend->set_io(event_loop, fd, io);
+}
+
+/*
+ * Let the backend do the I/O of an fd added with event_loop_add_fd() and
+ * hand over the results: every accepted connection, or every chunk read.
+ * io_uring runs these as multishot requests, so a busy listener or client
+ * costs no accept()/read() syscalls. Returns -1 with EOPNOTSUPP when the
+ * backend cannot (epoll); the fd then keeps getting readiness events. The
+ * backend may also drop back to readiness later (older kernels), so the
+ * readiness handler must still be able to do the I/O itself.
+ */
+int event_loop_accept_completions(event_loop_t *event_loop, int fd, event_accept_handler_t handler)
+{
+    if (event_loop_set_io(event_loop, fd, EVENT_IO_ACCEPT) < 0)
+        return -1;
+    event_loop->handlers[fd].on_accept = handler;
+    return 0;
+}
+
+int event_loop_read_completions(event_loop_t *event_loop, int fd, event_read_handler_t handler)
+{
+    if (event_loop_set_io(event_loop, fd, EVENT_IO_READ) < 0)
+        return -1;
+    event_loop->handlers[fd].on_read = handler;
+    return 0;
+}
+
+int event_loop_modify_fd(event_loop_t *event_loop, int fd, uint32_t events)
+{
+    if (!event_loop || fd < 0 || fd >= event_loop->handlers_size)
+    {
+        return -1;
+    }
+
+    return event_loop->backend->modify(event_loop, fd, events);
+}
 
 int event_loop_remove_fd(event_loop_t *event_loop, int fd)
 {
-    if (!event_loop || fd < 0 || fd >= MAX_EVENTS)
+    if (!event_loop || fd < 0 || fd >= event_loop->handlers_size)
     {
         return -1;
     }
 
-    if (epoll_ctl(event_loop->epoll_fd, EPOLL_CTL_DEL, fd, NULL) < 0)
+    if (event_loop->backend->remove(event_loop, fd) < 0)
     {
         return -1;
     }
 
     event_loop->handlers[fd].handler = NULL;
+    event_loop->handlers[fd].on_accept = NULL;
+    event_loop->handlers[fd].on_read = NULL;
     event_loop->handlers[fd].data = NULL;
 
     return 0;
 }
 
+static void event_loop_run_hooks(event_loop_t *event_loop, event_loop_hook_entry_t *hooks, int count)
+{
+    for (int i = 0; i < count; i++)
+    {
+        hooks[i].hook(event_loop, hooks[i].data);
+    }
+}
+
 void event_loop_run(event_loop_t *event_loop)
 {
     if (!event_loop)
@@ -83,20 +419,77 @@ void event_loop_run(event_loop_t *event_loop)
     event_loop->running = true;
     while (event_loop->running)
     {
-        int ndfs = epoll_wait(event_loop->epoll_fd, event_loop->events, MAX_EVENTS, -1);
+        event_loop_run_hooks(event_loop, event_loop->before_sleep, event_loop->before_sleep_count);
+        event_loop_arm_timer(event_loop);
+
+        event_loop->completions_count = 0;
+        int ndfs = event_loop->backend->poll(event_loop, -1);
+        event_loop_run_hooks(event_loop, event_loop->after_wake, event_loop->after_wake_count);
         for (int i = 0; i < ndfs; i++)
         {
             int fd = event_loop->events[i].data.fd;
             uint32_t events = event_loop->events[i].events;
             
-            if (fd < MAX_EVENTS && event_loop->handlers[fd].handler) {
+            if (fd < event_loop->handlers_size && event_loop->handlers[fd].handler) {
                 event_loop->handlers[fd].handler(event_loop, fd, events, 
                                                 event_loop->handlers[fd].data);  
             }
         }
+        for (int i = 0; i < event_loop->completions_count; i++)
+        {
+            event_completion_t *completion = &event_loop->completions[i];
+            if (completion->fd >= event_loop->handlers_size)
+                continue;
+
+            // A handler above may have removed the fd; then both are NULL
+            event_handler_entry_t *entry = &event_loop->handlers[completion->fd];
+            if (entry->on_accept)
+                entry->on_accept(event_loop, completion->fd, completion->res, entry->data);
+            else if (entry->on_read)
+                entry->on_read(event_loop, completion->fd, completion->buf, completion->res, entry->data);
+        }
     }
 }
 
+// Handler registered for fd, or NULL
+event_handler_entry_t *event_loop_get_handler(event_loop_t *event_loop, int fd)
+{
+    if (!event_loop || fd < 0 || fd >= event_loop->handlers_size || !event_loop->handlers[fd].handler)
+        return NULL;
+    return &event_loop->handlers[fd];
+}
+
+static int event_loop_add_hook(event_loop_hook_entry_t *hooks, int *count, event_loop_hook_t hook, void *data)
+{
+    if (!hook || *count >= EVENT_LOOP_MAX_HOOKS)
+        return -1;
+
+    hooks[*count].hook = hook;
+    hooks[*count].data = data;
+    (*count)++;
+    return 0;
+}
+
+/*
+ * Work that should happen once per iteration rather than once per event,
+ * such as flushing every client's output, goes in a before_sleep hook.
+ */
+int event_loop_add_before_sleep(event_loop_t *event_loop, event_loop_hook_t hook, void *data)
+{
+    if (!event_loop)
+        return -1;
+
+    return event_loop_add_hook(event_loop->before_sleep, &event_loop->before_sleep_count, hook, data);
+}
+
+int event_loop_add_after_wake(event_loop_t *event_loop, event_loop_hook_t hook, void *data)
+{
+    if (!event_loop)
+        return -1;
+
+    return event_loop_add_hook(event_loop->after_wake, &event_loop->after_wake_count, hook, data);
+}
+
 void event_loop_stop(event_loop_t *loop)
 {
     if (loop)
@@ -116,31 +509,12 @@ int set_nonblocking(int fd)
     return fcntl(fd, F_SETFL, flags | O_NONBLOCK);
 }
 
+// Created disarmed; event_loop_arm_timer sets it to the next timer deadline
 int setup_timer_fd() {
-    // Create the timer
     int timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
     if (timer_fd == -1) {
         perror("timerfd_create");
         return -1;
     }
-    
-    struct itimerspec timer_spec;
-    
-    // Interval for periodic timer (100ms)
-    timer_spec.it_interval.tv_sec = 0;         
-    timer_spec.it_interval.tv_nsec = 100000000; 
-    
-    // Initial expiration (also 100ms)
-    timer_spec.it_value.tv_sec = 0;
-    timer_spec.it_value.tv_nsec = 100000000;
-    
-    // Arm the timer
-    if (timerfd_settime(timer_fd, 0, &timer_spec, NULL) == -1) {
-        perror("timerfd_settime");
-        close(timer_fd);
-        return -1;
-    }
-    
-    printf("Timer created: will fire every 100ms\n");
     return timer_fd;
-}
\ No newline at end of file
+}
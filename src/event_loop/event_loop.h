@@ -4,30 +4,97 @@
 #include <sys/epoll.h>
 #include <stdbool.h>
 
-#define MAX_EVENTS 1024
+#define MAX_EVENTS 1024              // ready events handled per wakeup
+#define EVENT_LOOP_INITIAL_FDS 1024
+#define EVENT_TIMER_NOMORE -1
+#define EVENT_LOOP_MAX_HOOKS 8
 
 typedef struct event_loop event_loop_t;
+typedef struct event_loop_backend event_loop_backend_t;
 
 typedef void (*event_handler_t) (event_loop_t *event_loop, int fd, uint32_t events, void *data);
+typedef void (*event_loop_hook_t) (event_loop_t *event_loop, void *data);
+/* Completion-style I/O, see event_loop_accept_completions(): client_fd is the accepted
+ * connection or -errno; len is the bytes in buf, 0 at EOF or -errno */
+typedef void (*event_accept_handler_t) (event_loop_t *event_loop, int fd, int client_fd, void *data);
+typedef void (*event_read_handler_t) (event_loop_t *event_loop, int fd, const char *buf, int len, void *data);
+
+typedef struct event_timer event_timer_t;
+/* Returns EVENT_TIMER_NOMORE to drop the timer, or the delay in ms before it fires again */
+typedef long long (*event_timer_handler_t) (event_loop_t *event_loop, event_timer_t *timer, void *data);
+
+struct event_timer {
+    long long when_ms;              // CLOCK_MONOTONIC deadline
+    event_timer_handler_t handler;
+    void *data;
+    event_loop_t *loop;
+    int heap_index;                 // -1 while the handler runs
+};
+
+typedef struct event_handler_entry {
+    event_handler_t handler;
+    event_accept_handler_t on_accept;   // set when the backend accepts for this fd
+    event_read_handler_t on_read;       // set when the backend reads for this fd
+    void *data;
+} event_handler_entry_t;
+
+/* I/O a backend did itself, handed to on_accept/on_read */
+typedef struct event_completion {
+    int fd;
+    int res;                // accepted fd or bytes read, 0 at EOF, -errno on failure
+    const char *buf;        // the bytes read; only valid until the next poll
+} event_completion_t;
+
+typedef struct event_loop_hook_entry {
+    event_loop_hook_t hook;
+    void *data;
+} event_loop_hook_entry_t;
 
 typedef struct event_loop {
-    int epoll_fd;
-    int timer_fd;
+    const event_loop_backend_t *backend;
+    void *backend_state;
+    int timer_fd;                       // one-shot, re-armed to the earliest timer deadline
+    long long timer_armed_ms;           // deadline timer_fd is armed for, 0 when disarmed
+    event_timer_t **timers;             // binary min-heap ordered by when_ms
+    int timers_count;
+    int timers_size;
+    event_timer_t *firing_timer;
     bool running;
     struct epoll_event events[MAX_EVENTS];
-    struct {
-        event_handler_t handler;
-        void *data;
-    } handlers [MAX_EVENTS];
+    event_completion_t completions[MAX_EVENTS];
+    int completions_count;              // filled by the backend's poll next to events
+    event_handler_entry_t *handlers;    // indexed by fd, grows on demand up to max_fds
+    int handlers_size;
+    int max_fds;                        // RLIMIT_NOFILE when the loop was created
     void *server_data;
+    /* Run in registration order once per iteration: before_sleep just before
+     * waiting for events, after_wake as soon as the wait returns */
+    event_loop_hook_entry_t before_sleep[EVENT_LOOP_MAX_HOOKS];
+    int before_sleep_count;
+    event_loop_hook_entry_t after_wake[EVENT_LOOP_MAX_HOOKS];
+    int after_wake_count;
 } event_loop_t;
 
 event_loop_t* event_loop_create(void);
+int event_loop_set_default_backend(const char *name);
+const char *event_loop_backend_name(event_loop_t *event_loop);
 void event_loop_destroy(event_loop_t *event_loop);
 
 int event_loop_add_fd(event_loop_t *event_loop, int fd, uint32_t events, 
                       event_handler_t handler, void *data);
+int event_loop_modify_fd(event_loop_t *event_loop, int fd, uint32_t events);
 int event_loop_remove_fd(event_loop_t *event_loop, int fd);
+int event_loop_accept_completions(event_loop_t *event_loop, int fd, event_accept_handler_t handler);
+int event_loop_read_completions(event_loop_t *event_loop, int fd, event_read_handler_t handler);
+int event_loop_add_before_sleep(event_loop_t *event_loop, event_loop_hook_t hook, void *data);
+int event_loop_add_after_wake(event_loop_t *event_loop, event_loop_hook_t hook, void *data);
+
+event_timer_t *event_loop_add_timer(event_loop_t *event_loop, long long delay_ms,
+                                    event_timer_handler_t handler, void *data);
+void event_loop_del_timer(event_timer_t *timer);
+long long event_loop_now_ms(void);
+
+event_handler_entry_t *event_loop_get_handler(event_loop_t *event_loop, int fd);
 
 void event_loop_run(event_loop_t *event_loop);
 void event_loop_stop(event_loop_t *event_loop);
@@ -0,0 +1,32 @@
+#ifndef EVENT_LOOP_BACKEND_H
+#define EVENT_LOOP_BACKEND_H
+
+#include "event_loop.h"
+
+#define EVENT_IO_ACCEPT 1
+#define EVENT_IO_READ   2
+
+/*
+ * Readiness backend behind event_loop_t. Backends report ready fds in
+ * event_loop->events using epoll event bits, so handlers do not care
+ * which one is in use. A backend that can do the I/O itself (io_uring)
+ * also implements set_io and reports its results as completions.
+ */
+typedef struct event_loop_backend {
+    const char *name;
+    int (*create) (event_loop_t *event_loop);
+    void (*destroy) (event_loop_t *event_loop);
+    int (*add) (event_loop_t *event_loop, int fd, uint32_t events);
+    int (*modify) (event_loop_t *event_loop, int fd, uint32_t events);
+    int (*remove) (event_loop_t *event_loop, int fd);
+    /* Waits up to timeout_ms (-1 blocks), returns number of entries filled in
+     * event_loop->events; completed I/O goes to event_loop->completions */
+    int (*poll) (event_loop_t *event_loop, int timeout_ms);
+    // Optional: take over the accept()s or reads of a registered fd, EVENT_IO_*
+    int (*set_io) (event_loop_t *event_loop, int fd, int io);
+} event_loop_backend_t;
+
+extern const event_loop_backend_t event_loop_epoll_backend;
+extern const event_loop_backend_t event_loop_uring_backend;
+
+#endif
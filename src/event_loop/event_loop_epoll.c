@@ -0,0 +1,80 @@
+#include "event_loop_backend.h"
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+
+typedef struct epoll_state {
+    int epoll_fd;
+} epoll_state_t;
+
+static int epoll_backend_create(event_loop_t *event_loop)
+{
+    epoll_state_t *state = malloc(sizeof(epoll_state_t));
+    if (!state)
+        return -1;
+
+    state->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (state->epoll_fd < 0)
+    {
+        free(state);
+        return -1;
+    }
+    event_loop->backend_state = state;
+    return 0;
+}
+
+static void epoll_backend_destroy(event_loop_t *event_loop)
+{
+    epoll_state_t *state = event_loop->backend_state;
+    if (!state)
+        return;
+
+    close(state->epoll_fd);
+    free(state);
+    event_loop->backend_state = NULL;
+}
+
+static int epoll_backend_ctl(event_loop_t *event_loop, int op, int fd, uint32_t events)
+{
+    epoll_state_t *state = event_loop->backend_state;
+    struct epoll_event ev;
+    ev.data.fd = fd;
+    ev.events = events;
+    return epoll_ctl(state->epoll_fd, op, fd, &ev);
+}
+
+static int epoll_backend_add(event_loop_t *event_loop, int fd, uint32_t events)
+{
+    return epoll_backend_ctl(event_loop, EPOLL_CTL_ADD, fd, events);
+}
+
+static int epoll_backend_modify(event_loop_t *event_loop, int fd, uint32_t events)
+{
+    return epoll_backend_ctl(event_loop, EPOLL_CTL_MOD, fd, events);
+}
+
+static int epoll_backend_remove(event_loop_t *event_loop, int fd)
+{
+    epoll_state_t *state = event_loop->backend_state;
+    return epoll_ctl(state->epoll_fd, EPOLL_CTL_DEL, fd, NULL);
+}
+
+static int epoll_backend_poll(event_loop_t *event_loop, int timeout_ms)
+{
+    epoll_state_t *state = event_loop->backend_state;
+    int nfds = epoll_wait(state->epoll_fd, event_loop->events, MAX_EVENTS, timeout_ms);
+    if (nfds < 0 && errno == EINTR)
+        return 0;
+    return nfds;
+}
+
+const event_loop_backend_t event_loop_epoll_backend = {
+    .name = "epoll",
+    .create = epoll_backend_create,
+    .destroy = epoll_backend_destroy,
+    .add = epoll_backend_add,
+    .modify = epoll_backend_modify,
+    .remove = epoll_backend_remove,
+    .poll = epoll_backend_poll,
+    .set_io = NULL,
+};
@@ -0,0 +1,727 @@
+#include "event_loop_backend.h"
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <stdio.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/socket.h>
+#include <linux/io_uring.h>
+
+/*
+ * io_uring backend, talking to the kernel through the raw
+ * syscalls so there is no liburing dependency.
+ *
+ * Every registered fd gets a POLL_ADD request. Edge-triggered
+ * registrations use multishot polls, which keep posting completions
+ * until removed, so an idle connection costs no syscalls at all.
+ * Level-triggered ones (listener, timerfd) use one-shot polls that are
+ * re-armed after each completion, which re-checks readiness just like
+ * epoll does. Registration changes are only queued in the SQ ring and
+ * go to the kernel in the same io_uring_enter() that waits for
+ * completions, so a loop iteration is a single syscall no matter how
+ * many fds changed interest.
+ *
+ * Fds handed over with set_io skip readiness altogether. A listener gets
+ * a multishot ACCEPT that posts one completion per connection. A client
+ * gets a multishot RECV that picks its buffer from a ring registered with
+ * the kernel (provided buffers), so data arrives without read() calls and
+ * without a buffer pinned per idle connection; buffers go back to the
+ * ring at the start of the next poll, once the handlers have copied them.
+ * A client still gets a POLL_ADD for the rest of its interest (EPOLLOUT).
+ * Kernels without multishot ACCEPT/RECV reject them with EINVAL; the fd
+ * then quietly goes back to readiness polling.
+ */
+
+#define URING_ENTRIES 4096
+#define URING_REMOVE_TAG UINT64_MAX
+#define URING_BUFFER_GROUP 0
+#define URING_BUFFER_COUNT 512          // power of two, the kernel's ring requires it
+#define URING_BUFFER_SIZE (16 * 1024)
+
+// What a request is, kept in user_data next to the fd and its generation
+enum {
+    URING_OP_POLL,
+    URING_OP_ACCEPT,
+    URING_OP_RECV,
+};
+
+typedef struct uring_fd_state {
+    uint32_t events;
+    uint32_t poll_gen;  // bumped whenever the poll is replaced so stale completions are dropped
+    uint32_t io_gen;    // same for the ACCEPT/RECV request
+    bool registered;
+    bool poll_armed;
+    bool io_armed;
+    int io;             // EVENT_IO_* the kernel does for this fd, 0 for readiness only
+} uring_fd_state_t;
+
+typedef struct uring_state {
+    int ring_fd;
+    void *sq_ring;
+    size_t sq_ring_size;
+    void *cq_ring;
+    size_t cq_ring_size;
+    struct io_uring_sqe *sqes;
+    size_t sqes_size;
+
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned *sq_mask;
+    unsigned *sq_entries;
+    unsigned *sq_array;
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned *cq_mask;
+    struct io_uring_cqe *cqes;
+
+    unsigned sqe_tail;      // local tail, published on submit
+    unsigned to_submit;
+    uring_fd_state_t *fds;  // indexed by fd, grown like the loop's handler table
+    int fds_size;
+
+    // Provided buffers for multishot RECV, NULL when the kernel lacks them
+    struct io_uring_buf_ring *buf_ring;
+    size_t buf_ring_size;
+    char *buffers;
+    uint16_t buf_tail;      // local tail, published with the buffers given back
+    uint16_t lent[URING_BUFFER_COUNT];   // handed to handlers this round
+    int lent_count;
+    bool no_multishot;      // the kernel refused multishot ACCEPT/RECV once
+} uring_state_t;
+
+static int uring_setup(unsigned entries, struct io_uring_params *params)
+{
+    return (int)syscall(__NR_io_uring_setup, entries, params);
+}
+
+static int uring_enter(int ring_fd, unsigned to_submit, unsigned min_complete,
+                       unsigned flags, void *arg, size_t argsz)
+{
+    return (int)syscall(__NR_io_uring_enter, ring_fd, to_submit, min_complete, flags, arg, argsz);
+}
+
+static int uring_register(int ring_fd, unsigned opcode, void *arg, unsigned nr_args)
+{
+    return (int)syscall(__NR_io_uring_register, ring_fd, opcode, arg, nr_args);
+}
+
+static void uring_unmap(uring_state_t *state)
+{
+    if (state->sqes && state->sqes != MAP_FAILED)
+        munmap(state->sqes, state->sqes_size);
+    if (state->cq_ring && state->cq_ring != MAP_FAILED && state->cq_ring != state->sq_ring)
+        munmap(state->cq_ring, state->cq_ring_size);
+    if (state->sq_ring && state->sq_ring != MAP_FAILED)
+        munmap(state->sq_ring, state->sq_ring_size);
+}
+
+static void uring_free_buffers(uring_state_t *state)
+{
+    if (state->buf_ring)
+        munmap(state->buf_ring, state->buf_ring_size);
+    if (state->buffers)
+        munmap(state->buffers, (size_t)URING_BUFFER_COUNT * URING_BUFFER_SIZE);
+    state->buf_ring = NULL;
+    state->buffers = NULL;
+}
+
+static void uring_give_buffer(uring_state_t *state, uint16_t bid)
+{
+    struct io_uring_buf *buf = &state->buf_ring->bufs[state->buf_tail & (URING_BUFFER_COUNT - 1)];
+    buf->addr = (uint64_t)(uintptr_t)(state->buffers + (size_t)bid * URING_BUFFER_SIZE);
+    buf->len = URING_BUFFER_SIZE;
+    buf->bid = bid;
+    state->buf_tail++;
+}
+
+static void uring_publish_buffers(uring_state_t *state)
+{
+    __atomic_store_n(&state->buf_ring->tail, state->buf_tail, __ATOMIC_RELEASE);
+}
+
+/*
+ * Register the provided-buffer ring multishot RECV reads into (5.19+).
+ * Failing is fine: clients are then read on readiness as with epoll.
+ */
+static void uring_setup_buffers(uring_state_t *state)
+{
+    state->buf_ring_size = URING_BUFFER_COUNT * sizeof(struct io_uring_buf);
+    state->buf_ring = mmap(NULL, state->buf_ring_size, PROT_READ | PROT_WRITE,
+                           MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    state->buffers = mmap(NULL, (size_t)URING_BUFFER_COUNT * URING_BUFFER_SIZE, PROT_READ | PROT_WRITE,
+                          MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (state->buf_ring == MAP_FAILED)
+        state->buf_ring = NULL;
+    if (state->buffers == MAP_FAILED)
+        state->buffers = NULL;
+    if (!state->buf_ring || !state->buffers)
+    {
+        uring_free_buffers(state);
+        return;
+    }
+
+    struct io_uring_buf_reg reg;
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (uint64_t)(uintptr_t)state->buf_ring;
+    reg.ring_entries = URING_BUFFER_COUNT;
+    reg.bgid = URING_BUFFER_GROUP;
+    if (uring_register(state->ring_fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0)
+    {
+        uring_free_buffers(state);
+        return;
+    }
+
+    for (int bid = 0; bid < URING_BUFFER_COUNT; bid++)
+    {
+        uring_give_buffer(state, (uint16_t)bid);
+    }
+    uring_publish_buffers(state);
+}
+
+static int uring_backend_create(event_loop_t *event_loop)
+{
+    uring_state_t *state = calloc(1, sizeof(uring_state_t));
+    if (!state)
+        return -1;
+
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    state->ring_fd = uring_setup(URING_ENTRIES, &params);
+    if (state->ring_fd < 0)
+    {
+        free(state);
+        return -1;
+    }
+
+    // Waiting with a timeout needs IORING_ENTER_EXT_ARG (5.11+)
+    if (!(params.features & IORING_FEAT_EXT_ARG))
+    {
+        close(state->ring_fd);
+        free(state);
+        errno = ENOSYS;
+        return -1;
+    }
+
+    state->sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    state->cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP)
+    {
+        if (state->cq_ring_size > state->sq_ring_size)
+            state->sq_ring_size = state->cq_ring_size;
+        state->cq_ring_size = state->sq_ring_size;
+    }
+
+    state->sq_ring = mmap(NULL, state->sq_ring_size, PROT_READ | PROT_WRITE,
+                          MAP_SHARED | MAP_POPULATE, state->ring_fd, IORING_OFF_SQ_RING);
+    if (state->sq_ring == MAP_FAILED)
+        goto fail;
+
+    if (params.features & IORING_FEAT_SINGLE_MMAP)
+    {
+        state->cq_ring = state->sq_ring;
+    }
+    else
+    {
+        state->cq_ring = mmap(NULL, state->cq_ring_size, PROT_READ | PROT_WRITE,
+                              MAP_SHARED | MAP_POPULATE, state->ring_fd, IORING_OFF_CQ_RING);
+        if (state->cq_ring == MAP_FAILED)
+            goto fail;
+    }
+
+    state->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    state->sqes = mmap(NULL, state->sqes_size, PROT_READ | PROT_WRITE,
+                       MAP_SHARED | MAP_POPULATE, state->ring_fd, IORING_OFF_SQES);
+    if (state->sqes == MAP_FAILED)
+        goto fail;
+
+    char *sq = state->sq_ring;
+    char *cq = state->cq_ring;
+    state->sq_head = (unsigned *)(sq + params.sq_off.head);
+    state->sq_tail = (unsigned *)(sq + params.sq_off.tail);
+    state->sq_mask = (unsigned *)(sq + params.sq_off.ring_mask);
+    state->sq_entries = (unsigned *)(sq + params.sq_off.ring_entries);
+    state->sq_array = (unsigned *)(sq + params.sq_off.array);
+    state->cq_head = (unsigned *)(cq + params.cq_off.head);
+    state->cq_tail = (unsigned *)(cq + params.cq_off.tail);
+    state->cq_mask = (unsigned *)(cq + params.cq_off.ring_mask);
+    state->cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+    state->sqe_tail = *state->sq_tail;
+    uring_setup_buffers(state);
+
+    event_loop->backend_state = state;
+    return 0;
+
+fail:
+    uring_unmap(state);
+    close(state->ring_fd);
+    free(state);
+    return -1;
+}
+
+static void uring_backend_destroy(event_loop_t *event_loop)
+{
+    uring_state_t *state = event_loop->backend_state;
+    if (!state)
+        return;
+
+    uring_unmap(state);
+    close(state->ring_fd);
+    uring_free_buffers(state);
+    free(state->fds);
+    free(state);
+    event_loop->backend_state = NULL;
+}
+
+static int uring_submit(uring_state_t *state, unsigned min_complete, int timeout_ms)
+{
+    unsigned flags = min_complete ? IORING_ENTER_GETEVENTS : 0;
+    struct io_uring_getevents_arg arg;
+    struct __kernel_timespec ts;
+    void *argp = NULL;
+    size_t argsz = 0;
+
+    if (min_complete && timeout_ms >= 0)
+    {
+        ts.tv_sec = timeout_ms / 1000;
+        ts.tv_nsec = (long long)(timeout_ms % 1000) * 1000000;
+        memset(&arg, 0, sizeof(arg));
+        arg.ts = (uint64_t)(uintptr_t)&ts;
+        flags |= IORING_ENTER_EXT_ARG;
+        argp = &arg;
+        argsz = sizeof(arg);
+    }
+
+    // Publish queued SQEs before the kernel looks at the ring
+    __atomic_store_n(state->sq_tail, state->sqe_tail, __ATOMIC_RELEASE);
+
+    int ret = uring_enter(state->ring_fd, state->to_submit, min_complete, flags, argp, argsz);
+    if (ret >= 0)
+    {
+        state->to_submit = 0;
+        return 0;
+    }
+    if (errno == ETIME || errno == EINTR)
+    {
+        // Waiting was cut short, but the submissions went through
+        state->to_submit = 0;
+        return 0;
+    }
+    return -1;
+}
+
+static struct io_uring_sqe *uring_get_sqe(uring_state_t *state)
+{
+    unsigned head = __atomic_load_n(state->sq_head, __ATOMIC_ACQUIRE);
+    if (state->sqe_tail - head >= *state->sq_entries)
+    {
+        // Ring full: hand what we have to the kernel and retry
+        if (uring_submit(state, 0, -1) < 0)
+            return NULL;
+        head = __atomic_load_n(state->sq_head, __ATOMIC_ACQUIRE);
+        if (state->sqe_tail - head >= *state->sq_entries)
+            return NULL;
+    }
+
+    unsigned index = state->sqe_tail & *state->sq_mask;
+    struct io_uring_sqe *sqe = &state->sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    state->sq_array[index] = index;
+    state->sqe_tail++;
+    state->to_submit++;
+    return sqe;
+}
+
+// gen (30 bits) | op (2 bits) | fd (32 bits); URING_REMOVE_TAG has an op no request uses
+#define URING_GEN_MASK 0x3fffffffu
+
+static uint64_t uring_user_data(uring_state_t *state, int fd, int op)
+{
+    uint32_t gen = op == URING_OP_POLL ? state->fds[fd].poll_gen : state->fds[fd].io_gen;
+    return ((uint64_t)(gen & URING_GEN_MASK) << 34) | ((uint64_t)op << 32) | (uint32_t)fd;
+}
+
+// The readiness the poll still watches: the kernel's own I/O covers the rest
+static uint32_t uring_poll_events(uring_fd_state_t *fs)
+{
+    uint32_t events = fs->events & ~(uint32_t)EPOLLET;
+    if (fs->io == EVENT_IO_ACCEPT)
+        return 0;
+    if (fs->io == EVENT_IO_READ)
+        events &= ~(uint32_t)(EPOLLIN | EPOLLRDHUP);
+    return events;
+}
+
+static int uring_arm_poll(uring_state_t *state, int fd)
+{
+    uring_fd_state_t *fs = &state->fds[fd];
+    uint32_t events = uring_poll_events(fs);
+    if (!events)
+        return 0;
+
+    struct io_uring_sqe *sqe = uring_get_sqe(state);
+    if (!sqe)
+    {
+        errno = EBUSY;
+        return -1;
+    }
+
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = fd;
+    sqe->poll32_events = events;
+    if (fs->events & EPOLLET)
+        sqe->len = IORING_POLL_ADD_MULTI;
+    sqe->user_data = uring_user_data(state, fd, URING_OP_POLL);
+    fs->poll_armed = true;
+    return 0;
+}
+
+static int uring_cancel_poll(uring_state_t *state, int fd)
+{
+    uring_fd_state_t *fs = &state->fds[fd];
+    if (!fs->poll_armed)
+        return 0;
+
+    struct io_uring_sqe *sqe = uring_get_sqe(state);
+    if (!sqe)
+    {
+        errno = EBUSY;
+        return -1;
+    }
+
+    sqe->opcode = IORING_OP_POLL_REMOVE;
+    sqe->fd = -1;
+    sqe->addr = uring_user_data(state, fd, URING_OP_POLL);
+    sqe->user_data = URING_REMOVE_TAG;
+    fs->poll_armed = false;
+    fs->poll_gen++;
+    return 0;
+}
+
+// Multishot ACCEPT or RECV, depending on what the fd was handed over for
+static int uring_arm_io(uring_state_t *state, int fd)
+{
+    uring_fd_state_t *fs = &state->fds[fd];
+    struct io_uring_sqe *sqe = uring_get_sqe(state);
+    if (!sqe)
+    {
+        errno = EBUSY;
+        return -1;
+    }
+
+    sqe->fd = fd;
+    if (fs->io == EVENT_IO_ACCEPT)
+    {
+        sqe->opcode = IORING_OP_ACCEPT;
+        sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+        sqe->accept_flags = SOCK_NONBLOCK | SOCK_CLOEXEC;
+        sqe->user_data = uring_user_data(state, fd, URING_OP_ACCEPT);
+    }
+    else
+    {
+        sqe->opcode = IORING_OP_RECV;
+        sqe->ioprio = IORING_RECV_MULTISHOT;
+        sqe->flags = IOSQE_BUFFER_SELECT;
+        sqe->buf_group = URING_BUFFER_GROUP;
+        sqe->user_data = uring_user_data(state, fd, URING_OP_RECV);
+    }
+    fs->io_armed = true;
+    return 0;
+}
+
+static int uring_cancel_io(uring_state_t *state, int fd)
+{
+    uring_fd_state_t *fs = &state->fds[fd];
+    if (!fs->io_armed)
+        return 0;
+
+    struct io_uring_sqe *sqe = uring_get_sqe(state);
+    if (!sqe)
+    {
+        errno = EBUSY;
+        return -1;
+    }
+
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->fd = -1;
+    sqe->addr = uring_user_data(state, fd, fs->io == EVENT_IO_ACCEPT ? URING_OP_ACCEPT : URING_OP_RECV);
+    sqe->user_data = URING_REMOVE_TAG;
+    fs->io_armed = false;
+    fs->io_gen++;
+    return 0;
+}
+
+static int uring_reserve_fd(uring_state_t *state, int fd)
+{
+    if (fd < state->fds_size)
+        return 0;
+
+    int new_size = state->fds_size ? state->fds_size : EVENT_LOOP_INITIAL_FDS;
+    while (new_size <= fd)
+    {
+        new_size *= 2;
+    }
+
+    uring_fd_state_t *fds = realloc(state->fds, new_size * sizeof(uring_fd_state_t));
+    if (!fds)
+        return -1;
+
+    memset(fds + state->fds_size, 0, (new_size - state->fds_size) * sizeof(uring_fd_state_t));
+    state->fds = fds;
+    state->fds_size = new_size;
+    return 0;
+}
+
+static int uring_backend_add(event_loop_t *event_loop, int fd, uint32_t events)
+{
+    uring_state_t *state = event_loop->backend_state;
+    if (fd < 0)
+    {
+        errno = EINVAL;
+        return -1;
+    }
+    if (uring_reserve_fd(state, fd) < 0)
+        return -1;
+    if (state->fds[fd].registered)
+    {
+        errno = EEXIST;
+        return -1;
+    }
+
+    uring_fd_state_t *fs = &state->fds[fd];
+    fs->poll_gen++;
+    fs->io_gen++;
+    fs->events = events;
+    fs->io = 0;
+    fs->poll_armed = false;
+    fs->io_armed = false;
+    fs->registered = true;
+    if (uring_arm_poll(state, fd) < 0)
+    {
+        fs->registered = false;
+        return -1;
+    }
+    return 0;
+}
+
+static int uring_backend_modify(event_loop_t *event_loop, int fd, uint32_t events)
+{
+    uring_state_t *state = event_loop->backend_state;
+    if (fd >= state->fds_size || !state->fds[fd].registered)
+    {
+        errno = ENOENT;
+        return -1;
+    }
+    if (state->fds[fd].events == events)
+        return 0;
+
+    if (uring_cancel_poll(state, fd) < 0)
+        return -1;
+    state->fds[fd].events = events;
+    return uring_arm_poll(state, fd);
+}
+
+static int uring_backend_remove(event_loop_t *event_loop, int fd)
+{
+    uring_state_t *state = event_loop->backend_state;
+    if (fd >= state->fds_size || !state->fds[fd].registered)
+    {
+        errno = ENOENT;
+        return -1;
+    }
+
+    // Pending requests hold their own file reference, so the fd may be
+    // closed before these cancellations reach the kernel.
+    uring_cancel_poll(state, fd);
+    uring_cancel_io(state, fd);
+    state->fds[fd].registered = false;
+    return 0;
+}
+
+static int uring_backend_set_io(event_loop_t *event_loop, int fd, int io)
+{
+    uring_state_t *state = event_loop->backend_state;
+    if (fd >= state->fds_size || !state->fds[fd].registered)
+    {
+        errno = ENOENT;
+        return -1;
+    }
+    if (state->no_multishot || (io == EVENT_IO_READ && !state->buf_ring))
+    {
+        errno = EOPNOTSUPP;
+        return -1;
+    }
+
+    // Both requests are only queued, so the poll armed by add never costs a syscall
+    uring_fd_state_t *fs = &state->fds[fd];
+    if (uring_cancel_poll(state, fd) < 0 || uring_cancel_io(state, fd) < 0)
+        return -1;
+    fs->io = io;
+    if (uring_arm_io(state, fd) < 0)
+    {
+        fs->io = 0;
+        uring_arm_poll(state, fd);
+        return -1;
+    }
+    return uring_arm_poll(state, fd);
+}
+
+// The kernel turned multishot I/O down: poll the fd for readiness like any other
+static void uring_fall_back_to_poll(uring_state_t *state, int fd)
+{
+    if (!state->no_multishot)
+        fprintf(stderr, "io_uring: no multishot accept/recv on this kernel, polling for readiness\n");
+    state->no_multishot = true;
+    uring_cancel_poll(state, fd);
+    state->fds[fd].io = 0;
+    uring_arm_poll(state, fd);
+}
+
+static bool uring_room_for(event_loop_t *event_loop, int nevents)
+{
+    return nevents < MAX_EVENTS && event_loop->completions_count < MAX_EVENTS;
+}
+
+static void uring_add_completion(event_loop_t *event_loop, int fd, int res, const char *buf)
+{
+    event_completion_t *completion = &event_loop->completions[event_loop->completions_count++];
+    completion->fd = fd;
+    completion->res = res;
+    completion->buf = buf;
+}
+
+static void uring_handle_io_cqe(event_loop_t *event_loop, uring_state_t *state,
+                                struct io_uring_cqe *cqe, int fd, int op, bool current)
+{
+    uring_fd_state_t *fs = &state->fds[fd];
+    bool more = cqe->flags & IORING_CQE_F_MORE;
+    const char *buf = NULL;
+
+    if (cqe->flags & IORING_CQE_F_BUFFER)
+    {
+        uint16_t bid = (uint16_t)(cqe->flags >> IORING_CQE_BUFFER_SHIFT);
+        if (!current)
+        {
+            uring_give_buffer(state, bid);
+            return;
+        }
+        buf = state->buffers + (size_t)bid * URING_BUFFER_SIZE;
+        state->lent[state->lent_count++] = bid;
+    }
+    if (!current)
+    {
+        // A connection accepted after its listener went away has no taker
+        if (op == URING_OP_ACCEPT && cqe->res >= 0)
+            close(cqe->res);
+        return;
+    }
+
+    if (!more)
+        fs->io_armed = false;
+    if (cqe->res == -EINVAL && !more)
+    {
+        uring_fall_back_to_poll(state, fd);
+        return;
+    }
+    if (op == URING_OP_RECV && cqe->res == -ENOBUFS)
+    {
+        // Every buffer is out; they are back in the ring before this is submitted
+        uring_arm_io(state, fd);
+        return;
+    }
+
+    uring_add_completion(event_loop, fd, cqe->res, buf);
+    // Stopped but not finished (CQ overflow, or accept's transient errors): keep going
+    if (!more && (op == URING_OP_ACCEPT || cqe->res > 0))
+        uring_arm_io(state, fd);
+}
+
+static int uring_backend_poll(event_loop_t *event_loop, int timeout_ms)
+{
+    uring_state_t *state = event_loop->backend_state;
+    unsigned head = *state->cq_head;
+
+    // Handlers are done with last round's buffers
+    if (state->buf_ring)
+    {
+        for (int i = 0; i < state->lent_count; i++)
+        {
+            uring_give_buffer(state, state->lent[i]);
+        }
+        state->lent_count = 0;
+        uring_publish_buffers(state);
+    }
+
+    // Only block when nothing is left over from the previous round
+    unsigned wait = __atomic_load_n(state->cq_tail, __ATOMIC_ACQUIRE) == head ? 1 : 0;
+    if ((state->to_submit || wait) && uring_submit(state, wait, timeout_ms) < 0)
+    {
+        perror("io_uring_enter");
+        return -1;
+    }
+
+    int nevents = 0;
+    unsigned tail = __atomic_load_n(state->cq_tail, __ATOMIC_ACQUIRE);
+    while (head != tail && uring_room_for(event_loop, nevents))
+    {
+        struct io_uring_cqe *cqe = &state->cqes[head & *state->cq_mask];
+        head++;
+
+        if (cqe->user_data == URING_REMOVE_TAG)
+            continue;
+
+        int fd = (int)(cqe->user_data & 0xffffffffu);
+        int op = (int)((cqe->user_data >> 32) & 3);
+        uint32_t gen = (uint32_t)(cqe->user_data >> 34);
+        if (fd < 0 || fd >= state->fds_size)
+            continue;
+
+        uring_fd_state_t *fs = &state->fds[fd];
+        if (op != URING_OP_POLL)
+        {
+            bool current = fs->registered && (fs->io_gen & URING_GEN_MASK) == gen;
+            uring_handle_io_cqe(event_loop, state, cqe, fd, op, current);
+            continue;
+        }
+        if (!fs->registered || (fs->poll_gen & URING_GEN_MASK) != gen)
+            continue;
+
+        uint32_t events;
+        if (cqe->res >= 0)
+            events = (uint32_t)cqe->res;
+        else if (cqe->res == -ECANCELED)
+            events = 0;
+        else
+            events = EPOLLERR;
+
+        // One-shot polls, and multishot ones the kernel stopped, need a new request
+        if (!(cqe->flags & IORING_CQE_F_MORE))
+        {
+            fs->poll_armed = false;
+            uring_arm_poll(state, fd);
+        }
+
+        if (events)
+        {
+            event_loop->events[nevents].data.fd = fd;
+            event_loop->events[nevents].events = events;
+            nevents++;
+        }
+    }
+    __atomic_store_n(state->cq_head, head, __ATOMIC_RELEASE);
+
+    return nevents;
+}
+
+const event_loop_backend_t event_loop_uring_backend = {
+    .name = "io_uring",
+    .create = uring_backend_create,
+    .destroy = uring_backend_destroy,
+    .add = uring_backend_add,
+    .modify = uring_backend_modify,
+    .remove = uring_backend_remove,
+    .poll = uring_backend_poll,
+    .set_io = uring_backend_set_io,
+};
@@ -2,16 +2,41 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stddef.h>
+#include <time.h>
+#include "../lib/siphash.h"
 
-static size_t hash(const char *key, size_t size)
+#define HASH_TABLE_EMPTY_VISITS 10      // empty buckets one rehash step may skip per bucket moved
+
+static uint8_t hash_seed[SIPHASH_KEY_LEN];
+
+// Set once at startup, before any table is filled
+void hash_table_set_seed(const uint8_t seed[16])
 {
-    size_t hash = 5381;
-    int c;
-    while ((c = *key++))
-    {
-        hash = ((hash << 5) + hash) + c;
-    }
-    return hash % size;
+    memcpy(hash_seed, seed, sizeof(hash_seed));
+}
+
+static uint64_t hash_bytes(const char *key, size_t len)
+{
+    return siphash((const uint8_t *)key, len, hash_seed);
+}
+
+uint64_t hash_table_hash_key(const char *key)
+{
+    return hash_bytes(key, strlen(key));
+}
+
+static int is_rehashing(const hash_table_t *ht)
+{
+    return ht->rehash_idx != -1;
+}
+
+static size_t next_power(size_t size)
+{
+    size_t power = HASH_TABLE_MIN_SIZE;
+    while (power < size)
+        power <<= 1;
+    return power;
 }
 
 hash_table_t *hash_table_create(size_t size)
@@ -19,10 +44,12 @@ hash_table_t *hash_table_create(size_t size)
     hash_table_t *ht = calloc(1, sizeof(hash_table_t));
     if (!ht)
         return NULL;
-    ht->size = size;
-    ht->count = 0;
-    ht->buckets = calloc(size, sizeof(hash_entry_t*));
-    if (!ht->buckets)
+    ht->rehash_idx = -1;
+
+    // size is only a hint for the first array
+    ht->tables[0].size = next_power(size);
+    ht->tables[0].slots = calloc(ht->tables[0].size, sizeof(hash_entry_t *));
+    if (!ht->tables[0].slots)
     {
         free(ht);
         return NULL;
@@ -31,126 +58,405 @@ hash_table_t *hash_table_create(size_t size)
     return ht;
 }
 
-void hash_table_set (hash_table_t *ht, const char *key, void *value)
+// Start moving everything into a new array of size buckets
+static void hash_table_resize(hash_table_t *ht, size_t size)
 {
-    size_t index = hash(key, ht->size);
-    hash_entry_t *entry = ht->buckets[index];
-    while (entry) {
-        if (strcmp(entry->key, key) == 0) {
-            entry->value = value;
-            return;
+    if (is_rehashing(ht) || size == ht->tables[0].size)
+        return;
+
+    hash_entry_t **slots = calloc(size, sizeof(hash_entry_t *));
+    if (!slots)
+        return;     // keep going with longer chains
+
+    ht->tables[1].slots = slots;
+    ht->tables[1].size = size;
+    ht->tables[1].used = 0;
+    ht->rehash_idx = 0;
+}
+
+/*
+ * Moves up to buckets non-empty buckets of tables[0] over; gives up early
+ * after too many empty ones so a sparse table cannot stall the caller.
+ */
+static void rehash_step(hash_table_t *ht, size_t buckets)
+{
+    hash_table_buckets_t *from = &ht->tables[0];
+    hash_table_buckets_t *to = &ht->tables[1];
+    size_t empty_visits = buckets * HASH_TABLE_EMPTY_VISITS;
+
+    while (buckets-- && from->used > 0) {
+        while (!from->slots[ht->rehash_idx]) {
+            ht->rehash_idx++;
+            if (--empty_visits == 0)
+                return;
+        }
+
+        hash_entry_t *entry = from->slots[ht->rehash_idx];
+        while (entry) {
+            hash_entry_t *next = entry->next;
+            size_t index = entry->hash & (to->size - 1);
+            entry->next = to->slots[index];
+            to->slots[index] = entry;
+            from->used--;
+            to->used++;
+            entry = next;
         }
-        entry = entry->next;
+        from->slots[ht->rehash_idx++] = NULL;
     }
 
-    hash_entry_t *new_entry = malloc(sizeof(hash_entry_t));
-    if (!new_entry) return;
-    new_entry->key = strdup(key);
-    new_entry->value = value;
-    new_entry->next = ht->buckets[index];
-    ht->buckets[index] = new_entry;
-    ht->count++;
+    if (from->used == 0) {
+        free(from->slots);
+        *from = *to;
+        memset(to, 0, sizeof(*to));
+        ht->rehash_idx = -1;
+    }
 }
 
-void *hash_table_get(hash_table_t *ht, const char *key)
+// Operations pay for the rehash one bucket at a time, unless an iterator is walking the table
+static void rehash_if_needed(hash_table_t *ht)
 {
-    size_t index = hash(key, ht->size);
-    hash_entry_t * entry = ht->buckets[index];
-    while(entry)
-    {
-        if(strcmp(entry->key, key) == 0){
-            return entry->value;
+    if (is_rehashing(ht) && ht->iterators == 0)
+        rehash_step(ht, 1);
+}
+
+// Rehash for up to ms milliseconds; returns 1 if there is still work left
+int hash_table_rehash_ms(hash_table_t *ht, int ms)
+{
+    if (!ht || !is_rehashing(ht) || ht->iterators > 0)
+        return 0;
+
+    struct timespec start, now;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    do {
+        rehash_step(ht, 100);
+        clock_gettime(CLOCK_MONOTONIC, &now);
+    } while (is_rehashing(ht) &&
+             (now.tv_sec - start.tv_sec) * 1000 + (now.tv_nsec - start.tv_nsec) / 1000000 < ms);
+
+    return is_rehashing(ht);
+}
+
+// tables[0] buckets below rehash_idx were already moved over
+static int bucket_moved(hash_table_t *ht, uint64_t hash)
+{
+    return is_rehashing(ht) && (hash & (ht->tables[0].size - 1)) < (size_t)ht->rehash_idx;
+}
+
+// Where a key that predates the rehash lives; only a hint for prefetching
+static hash_entry_t **bucket_for(hash_table_t *ht, uint64_t hash)
+{
+    hash_table_buckets_t *table = &ht->tables[bucket_moved(ht, hash) ? 1 : 0];
+    return &table->slots[hash & (table->size - 1)];
+}
+
+// Embedded values start at the first 8-byte boundary after the key's NUL
+static size_t entry_payload_offset(size_t key_len)
+{
+    return (offsetof(hash_entry_t, key) + key_len + 1 + 7) & ~(size_t)7;
+}
+
+static hash_entry_t *entry_create(const char *key, size_t key_len, uint64_t hash, size_t payload)
+{
+    size_t size = payload ? entry_payload_offset(key_len) + payload
+                          : offsetof(hash_entry_t, key) + key_len + 1;
+    hash_entry_t *entry = malloc(size);
+    if (!entry)
+        return NULL;
+
+    entry->hash = hash;
+    entry->next = NULL;
+    entry->key_len = (uint32_t)key_len;
+    entry->embedded = payload > 0;
+    entry->value = payload ? (char *)entry + entry_payload_offset(key_len) : NULL;
+    memcpy(entry->key, key, key_len + 1);
+    return entry;
+}
+
+/*
+ * The link (bucket slot or previous entry's next) pointing at key's entry,
+ * NULL if absent. While rehashing the key may sit in either array: its old
+ * bucket may not be moved yet, and new keys always go to tables[1].
+ */
+static hash_entry_t **find_link(hash_table_t *ht, const char *key, size_t key_len, uint64_t hash,
+                                hash_table_buckets_t **owner)
+{
+    int last = is_rehashing(ht) ? 1 : 0;
+    for (int t = bucket_moved(ht, hash) ? 1 : 0; t <= last; t++) {
+        hash_table_buckets_t *table = &ht->tables[t];
+        for (hash_entry_t **link = &table->slots[hash & (table->size - 1)]; *link; link = &(*link)->next) {
+            hash_entry_t *entry = *link;
+            if (entry->hash == hash && entry->key_len == key_len && memcmp(entry->key, key, key_len) == 0) {
+                if (owner)
+                    *owner = table;
+                return link;
+            }
         }
-        entry = entry->next;
     }
     return NULL;
 }
 
-void hash_table_delete(hash_table_t *ht, const char *key)
+static void insert_entry(hash_table_t *ht, hash_entry_t *entry)
 {
-    size_t index = hash(key, ht->size);
-    hash_entry_t *entry = ht->buckets[index];
-    hash_entry_t *prev = NULL;
-    while (entry) {
-        hash_entry_t *next = entry->next;
-        if (strcmp(entry->key, key) == 0) {
-            if (prev) {
-                prev->next = entry->next;
-            } else {
-                ht->buckets[index] = entry->next;
-            }
-            free(entry->key);
-            free(entry);
-            ht->count--;
-            break; // assume unique keys, stop after deletion
-        }
-        prev = entry;
-        entry = next;
+    if (!is_rehashing(ht) && ht->tables[0].used >= ht->tables[0].size)
+        hash_table_resize(ht, next_power(ht->tables[0].used * 2));
+
+    hash_table_buckets_t *table = &ht->tables[is_rehashing(ht) ? 1 : 0];
+    size_t index = entry->hash & (table->size - 1);
+    entry->next = table->slots[index];
+    table->slots[index] = entry;
+    table->used++;
+    ht->count++;
+}
+
+// Swap entry in for *link's entry at the same chain position; the old one is freed
+static void replace_entry(hash_entry_t **link, hash_entry_t *entry)
+{
+    hash_entry_t *old = *link;
+    entry->next = old->next;
+    *link = entry;
+    free(old);
+}
+
+void hash_table_set (hash_table_t *ht, const char *key, void *value)
+{
+    rehash_if_needed(ht);
+
+    size_t key_len = strlen(key);
+    uint64_t hash = hash_bytes(key, key_len);
+    hash_entry_t **link = find_link(ht, key, key_len, hash, NULL);
+    if (link && !(*link)->embedded) {
+        (*link)->value = value;
+        return;
     }
+
+    // key may point into the entry being replaced, so copy it before freeing that one
+    hash_entry_t *entry = entry_create(key, key_len, hash, 0);
+    if (!entry) return;
+    entry->value = value;
+
+    if (link)
+        replace_entry(link, entry);
+    else
+        insert_entry(ht, entry);
 }
 
-void hash_table_destroy(hash_table_t *ht) {
-    if (!ht) return;
-    
-    // Free all entries
-    for (size_t i = 0; i < ht->size; i++) {
-        hash_entry_t *entry = ht->buckets[i];
-        while (entry) {
-            hash_entry_t *next = entry->next;
-            free(entry->key);
-            free(entry);
-            entry = next;
-        }
+void *hash_table_set_embedded(hash_table_t *ht, const char *key, size_t size)
+{
+    rehash_if_needed(ht);
+
+    size_t key_len = strlen(key);
+    uint64_t hash = hash_bytes(key, key_len);
+    hash_entry_t **link = find_link(ht, key, key_len, hash, NULL);
+
+    hash_entry_t *entry = entry_create(key, key_len, hash, size ? size : 1);
+    if (!entry)
+        return NULL;
+
+    if (link)
+        replace_entry(link, entry);
+    else
+        insert_entry(ht, entry);
+    return entry->value;
+}
+
+static void *get_entry_value(hash_table_t *ht, const char *key, size_t key_len, uint64_t hash)
+{
+    rehash_if_needed(ht);
+
+    hash_entry_t **link = find_link(ht, key, key_len, hash, NULL);
+    return link ? (*link)->value : NULL;
+}
+
+void *hash_table_get(hash_table_t *ht, const char *key)
+{
+    size_t key_len = strlen(key);
+    return get_entry_value(ht, key, key_len, hash_bytes(key, key_len));
+}
+
+void *hash_table_get_hashed(hash_table_t *ht, const char *key, uint64_t hash)
+{
+    return get_entry_value(ht, key, strlen(key), hash);
+}
+
+/*
+ * Warm the cache for upcoming lookups of the keys with these hashes. Each
+ * step touches one level (bucket slot, entry with its inline key, then the
+ * value) for the whole batch before moving down, so the misses of
+ * different keys overlap instead of being paid one after the other by the
+ * lookups, which take the same hashes through hash_table_get_hashed().
+ */
+void hash_table_prefetch(hash_table_t *ht, const uint64_t *hashes, size_t count)
+{
+    hash_entry_t **slots[HASH_TABLE_PREFETCH_MAX];
+    hash_entry_t *entries[HASH_TABLE_PREFETCH_MAX];
+    if (count > HASH_TABLE_PREFETCH_MAX)
+        count = HASH_TABLE_PREFETCH_MAX;
+
+    for (size_t i = 0; i < count; i++) {
+        slots[i] = bucket_for(ht, hashes[i]);
+        __builtin_prefetch(slots[i]);
+    }
+    for (size_t i = 0; i < count; i++) {
+        entries[i] = *slots[i];
+        if (entries[i])
+            __builtin_prefetch(entries[i]);
+    }
+    for (size_t i = 0; i < count; i++) {
+        if (entries[i] && !entries[i]->embedded)
+            __builtin_prefetch(entries[i]->value);
     }
-    
-    free(ht->buckets);
-    free(ht);
 }
 
-void hash_table_destroy_with_free(hash_table_t *ht, void (*free_value)(void *)) {
-    if (!ht) return;
+static void delete_entry(hash_table_t *ht, const char *key, size_t key_len, uint64_t hash)
+{
+    rehash_if_needed(ht);
+
+    hash_table_buckets_t *table;
+    hash_entry_t **link = find_link(ht, key, key_len, hash, &table);
+    if (link) {
+        hash_entry_t *entry = *link;
+        *link = entry->next;
+        table->used--;
+        ht->count--;
+        free(entry);
+    }
+
+    // Give memory back once mostly empty, but not while an iterator may still be walking it
+    if (!is_rehashing(ht) && ht->iterators == 0 && ht->tables[0].size > HASH_TABLE_MIN_SIZE &&
+        ht->tables[0].used * 8 < ht->tables[0].size)
+        hash_table_resize(ht, next_power(ht->tables[0].used));
+}
+
+void hash_table_delete(hash_table_t *ht, const char *key)
+{
+    size_t key_len = strlen(key);
+    delete_entry(ht, key, key_len, hash_bytes(key, key_len));
+}
 
-    for (size_t i = 0; i < ht->size; i++) {
-        hash_entry_t *entry = ht->buckets[i];
+void hash_table_delete_hashed(hash_table_t *ht, const char *key, uint64_t hash)
+{
+    delete_entry(ht, key, strlen(key), hash);
+}
+
+static void free_buckets(hash_table_buckets_t *table, void (*free_value)(void *))
+{
+    for (size_t i = 0; i < table->size; i++) {
+        hash_entry_t *entry = table->slots[i];
         while (entry) {
             hash_entry_t *next = entry->next;
             if (free_value && entry->value) {
                 free_value(entry->value);
             }
-            free(entry->key);
             free(entry);
             entry = next;
         }
     }
+    free(table->slots);
+}
 
-    free(ht->buckets);
+void hash_table_destroy(hash_table_t *ht) {
+    hash_table_destroy_with_free(ht, NULL);
+}
+
+void hash_table_destroy_with_free(hash_table_t *ht, void (*free_value)(void *)) {
+    if (!ht) return;
+
+    free_buckets(&ht->tables[0], free_value);
+    free_buckets(&ht->tables[1], free_value);
     free(ht);
 }
 
+static unsigned long reverse_bits(unsigned long v)
+{
+    unsigned long s = 8 * sizeof(v);
+    unsigned long mask = ~0UL;
+    while ((s >>= 1) > 0) {
+        mask ^= (mask << s);
+        v = ((v >> s) & mask) | ((v << s) & ~mask);
+    }
+    return v;
+}
+
+static void scan_bucket(hash_entry_t *entry, hash_table_scan_fn fn, void *privdata)
+{
+    for (; entry; entry = entry->next)
+        fn(privdata, entry->key, entry->value);
+}
+
+/*
+ * The cursor counts with its bits reversed: the high bits of a bucket
+ * index advance first. Doubling a table splits bucket i into i and
+ * i + size, shrinking merges them back, and both keep the buckets still
+ * to visit after the cursor, so a resize between calls neither skips nor
+ * restarts. While rehashing, one smaller-table bucket is visited with all
+ * the larger-table buckets that it expands to.
+ */
+unsigned long hash_table_scan(hash_table_t *ht, unsigned long cursor, hash_table_scan_fn fn, void *privdata)
+{
+    if (ht->count == 0)
+        return 0;
+
+    if (!is_rehashing(ht)) {
+        unsigned long mask = ht->tables[0].size - 1;
+        scan_bucket(ht->tables[0].slots[cursor & mask], fn, privdata);
+
+        cursor |= ~mask;
+        cursor = reverse_bits(cursor);
+        cursor++;
+        return reverse_bits(cursor);
+    }
+
+    hash_table_buckets_t *small = &ht->tables[0];
+    hash_table_buckets_t *large = &ht->tables[1];
+    if (small->size > large->size) {
+        small = &ht->tables[1];
+        large = &ht->tables[0];
+    }
+    unsigned long small_mask = small->size - 1;
+    unsigned long large_mask = large->size - 1;
+
+    scan_bucket(small->slots[cursor & small_mask], fn, privdata);
+    do {
+        scan_bucket(large->slots[cursor & large_mask], fn, privdata);
+
+        cursor |= ~large_mask;
+        cursor = reverse_bits(cursor);
+        cursor++;
+        cursor = reverse_bits(cursor);
+    } while (cursor & (small_mask ^ large_mask));
+
+    return cursor;
+}
+
+// Point iter at the first entry from (table, bucket_idx) on; tables[1] only exists while rehashing
+static void iterator_advance(hash_table_iterator_t *iter)
+{
+    for (; iter->table < 2; iter->table++, iter->bucket_idx = 0) {
+        hash_table_buckets_t *table = &iter->ht->tables[iter->table];
+        while (iter->bucket_idx < table->size) {
+            hash_entry_t *entry = table->slots[iter->bucket_idx++];
+            if (entry) {
+                iter->current = entry;
+                iter->next = entry->next;
+                return;
+            }
+        }
+    }
+    iter->current = NULL;
+    iter->next = NULL;
+}
 
 hash_table_iterator_t *hash_table_iterator_create(hash_table_t *ht) {
     if (!ht) return NULL;
-    
+
     hash_table_iterator_t *iter = malloc(sizeof(hash_table_iterator_t));
     if (!iter) return NULL;
-    
+
     iter->ht = ht;
+    iter->table = 0;
     iter->bucket_idx = 0;
-    iter->current = NULL;
-    iter->next = NULL;
-    
-    // Find first non-empty bucket
-    while (iter->bucket_idx < ht->size && !ht->buckets[iter->bucket_idx]) {
-        iter->bucket_idx++;
-    }
-    
-    if (iter->bucket_idx < ht->size) {
-        iter->current = ht->buckets[iter->bucket_idx];
-        if (iter->current) {
-            iter->next = iter->current->next;
-        }
-    }
-    
+    ht->iterators++;
+    iterator_advance(iter);
     return iter;
 }
 
@@ -164,33 +470,21 @@ int hash_table_iterator_next(hash_table_iterator_t *iter, char **key, void **dat
         *key = iter->current->key;
     if (data)
         *data = iter->current->value;
-    
-    // Move to next element
+
+    // Move to next element; next was read before the caller could delete current
     iter->current = iter->next;
-    
-    // Update next pointer
     if (iter->current) {
         iter->next = iter->current->next;
     } else {
-        // Current bucket exhausted, find next non-empty bucket
-        iter->bucket_idx++;
-        while (iter->bucket_idx < iter->ht->size && !iter->ht->buckets[iter->bucket_idx]) {
-            iter->bucket_idx++;
-        }
-        
-        if (iter->bucket_idx < iter->ht->size) {
-            iter->current = iter->ht->buckets[iter->bucket_idx];
-            if (iter->current) {
-                iter->next = iter->current->next;
-            }
-        }
+        iterator_advance(iter);
     }
-    
+
     return 1;
 }
 
 void hash_table_iterator_destroy(hash_table_iterator_t *iter) {
     if (iter) {
+        iter->ht->iterators--;
         free(iter);
     }
-}
\ No newline at end of file
+}
@@ -4,37 +4,86 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stdint.h>
 
+/* Keys one hash_table_prefetch() call looks ahead at */
+#define HASH_TABLE_PREFETCH_MAX 16
+#define HASH_TABLE_MIN_SIZE 4
+
+/*
+ * An entry is a single allocation: the header, then the key bytes (with
+ * their NUL), then, for hash_table_set_embedded(), the value itself at
+ * the next 8-byte boundary.
+ */
 typedef struct hash_entry{
-    char *key;
     void *value;
+    uint64_t hash;              // cached so rehashing and mismatches skip the key
     struct hash_entry *next;
+    uint32_t key_len;
+    uint8_t embedded;           // value points into this allocation
+    char key[];
 }hash_entry_t;
 
+/* One power-of-two bucket array */
+typedef struct hash_table_buckets {
+    hash_entry_t **slots;
+    size_t size;                // 0 for tables[1] unless rehashing
+    size_t used;
+} hash_table_buckets_t;
+
+/*
+ * Chained hash table keyed by C strings. It doubles once it holds as many
+ * entries as buckets and shrinks below 1/8 full; the move to the new array
+ * is incremental: every operation rehashes one bucket, and
+ * hash_table_rehash_ms() does more when the server is idle. While that
+ * runs entries live in both arrays, new ones always in tables[1].
+ */
 typedef struct hash_table {
-    hash_entry_t **buckets;
-    size_t size;
+    hash_table_buckets_t tables[2];
+    long rehash_idx;            // next bucket of tables[0] to move, -1 when not rehashing
+    int iterators;              // rehashing pauses while any iterator is live
     size_t count;
 }hash_table_t;
 
 typedef struct hash_table_iterator {
     hash_table_t *ht;
+    int table;
     size_t bucket_idx;
     hash_entry_t *current;
     hash_entry_t *next;  // For safe iteration during modifications
 } hash_table_iterator_t;
 
 
+void hash_table_set_seed(const uint8_t seed[16]);
+uint64_t hash_table_hash_key(const char *key);
 hash_table_t *hash_table_create (size_t size);
 void hash_table_set (hash_table_t *ht, const char *key, void *value);
+// Store size bytes of value inside key's entry and return them; any previous entry is replaced
+void *hash_table_set_embedded(hash_table_t *ht, const char *key, size_t size);
 void *hash_table_get(hash_table_t *ht, const char *key);
 void hash_table_delete(hash_table_t *ht, const char *key);
+// hash must be hash_table_hash_key(key); lets a caller that prefetched reuse the hashes
+void *hash_table_get_hashed(hash_table_t *ht, const char *key, uint64_t hash);
+void hash_table_delete_hashed(hash_table_t *ht, const char *key, uint64_t hash);
+void hash_table_prefetch(hash_table_t *ht, const uint64_t *hashes, size_t count);
 void hash_table_destroy(hash_table_t *ht);
+int hash_table_rehash_ms(hash_table_t *ht, int ms);
+
+/*
+ * Cursor walk: visit the entries of a few buckets, return the cursor to
+ * pass next, 0 when done. Every entry present for the whole walk is seen
+ * at least once even if the table grows, shrinks or rehashes in between;
+ * some may be seen twice. fn must not modify the table.
+ */
+typedef void (*hash_table_scan_fn)(void *privdata, const char *key, void *value);
+unsigned long hash_table_scan(hash_table_t *ht, unsigned long cursor, hash_table_scan_fn fn, void *privdata);
 
 // Destroy and free values using provided callback before freeing the table
 void hash_table_destroy_with_free(hash_table_t *ht, void (*free_value)(void *));
+
+// The current entry may be deleted while iterating; rehashing waits until the iterator is destroyed
 hash_table_iterator_t *hash_table_iterator_create(hash_table_t *ht);
 int hash_table_iterator_next(hash_table_iterator_t *iter, char **key, void **value);
 void hash_table_iterator_destroy(hash_table_iterator_t *iter);
 
-#endif
\ No newline at end of file
+#endif
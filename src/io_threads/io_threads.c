@@ -0,0 +1,164 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include "io_threads.h"
+
+/*
+ * Fixed pool of I/O threads. The main thread splits a batch of items
+ * round-robin, hands one slice to every worker, processes slice 0 itself
+ * and then waits until all workers are done. Command execution never runs
+ * here, so the database keeps a single writer.
+ */
+typedef struct io_thread {
+    pthread_t tid;
+    int id;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    redis_list_t *items;
+    io_thread_job_t job;
+    void *ctx;
+    atomic_size_t pending;      // items left in the current batch, 0 when idle
+} io_thread_t;
+
+static io_thread_t io_threads[IO_THREADS_MAX];
+static int io_threads_num = 1;
+static atomic_int io_threads_stop;
+
+static void run_items(redis_list_t *items, io_thread_job_t job, void *ctx)
+{
+    for (list_node_t *node = items->head; node; node = node->next) {
+        job(node->data, ctx);
+    }
+}
+
+static void *io_thread_main(void *arg)
+{
+    io_thread_t *t = (io_thread_t *)arg;
+
+    while (1) {
+        pthread_mutex_lock(&t->lock);
+        while (atomic_load_explicit(&t->pending, memory_order_acquire) == 0 &&
+               !atomic_load(&io_threads_stop)) {
+            pthread_cond_wait(&t->cond, &t->lock);
+        }
+        pthread_mutex_unlock(&t->lock);
+
+        if (atomic_load(&io_threads_stop)) {
+            break;
+        }
+
+        run_items(t->items, t->job, t->ctx);
+        atomic_store_explicit(&t->pending, 0, memory_order_release);
+    }
+    return NULL;
+}
+
+int io_threads_init(int num_threads)
+{
+    if (num_threads < 1 || num_threads > IO_THREADS_MAX) {
+        return -1;
+    }
+
+    io_threads_num = num_threads;
+    atomic_store(&io_threads_stop, 0);
+
+    // Slot 0 is the main thread itself
+    for (int i = 1; i < io_threads_num; i++) {
+        io_thread_t *t = &io_threads[i];
+        t->id = i;
+        t->items = list_create();
+        atomic_store(&t->pending, 0);
+        pthread_mutex_init(&t->lock, NULL);
+        pthread_cond_init(&t->cond, NULL);
+
+        if (!t->items || pthread_create(&t->tid, NULL, io_thread_main, t) != 0) {
+            perror("io_threads_init");
+            io_threads_num = i;
+            io_threads_shutdown();
+            return -1;
+        }
+    }
+
+    printf("Started %d I/O threads\n", io_threads_num);
+    return 0;
+}
+
+void io_threads_shutdown(void)
+{
+    atomic_store(&io_threads_stop, 1);
+    for (int i = 1; i < io_threads_num; i++) {
+        io_thread_t *t = &io_threads[i];
+        pthread_mutex_lock(&t->lock);
+        pthread_cond_signal(&t->cond);
+        pthread_mutex_unlock(&t->lock);
+        pthread_join(t->tid, NULL);
+        list_destroy(t->items);
+        pthread_mutex_destroy(&t->lock);
+        pthread_cond_destroy(&t->cond);
+    }
+    io_threads_num = 1;
+}
+
+int io_threads_active(void)
+{
+    return io_threads_num > 1;
+}
+
+int io_threads_count(void)
+{
+    return io_threads_num;
+}
+
+/* Run job on every item, spread across the pool. Returns when all are done. */
+void io_threads_run(redis_list_t *items, io_thread_job_t job, void *ctx)
+{
+    if (!items || items->length == 0) {
+        return;
+    }
+
+    // Not worth waking the workers for a handful of clients
+    if (io_threads_num == 1 || items->length < (size_t)io_threads_num) {
+        run_items(items, job, ctx);
+        return;
+    }
+
+    redis_list_t *main_items = list_create();
+    if (!main_items) {
+        run_items(items, job, ctx);
+        return;
+    }
+
+    int target = 0;
+    for (list_node_t *node = items->head; node; node = node->next) {
+        if (target == 0) {
+            list_rpush(main_items, node->data);
+        } else {
+            list_rpush(io_threads[target].items, node->data);
+        }
+        target = (target + 1) % io_threads_num;
+    }
+
+    for (int i = 1; i < io_threads_num; i++) {
+        io_thread_t *t = &io_threads[i];
+        pthread_mutex_lock(&t->lock);
+        t->job = job;
+        t->ctx = ctx;
+        atomic_store_explicit(&t->pending, t->items->length, memory_order_release);
+        pthread_cond_signal(&t->cond);
+        pthread_mutex_unlock(&t->lock);
+    }
+
+    run_items(main_items, job, ctx);
+    list_destroy(main_items);
+
+    for (int i = 1; i < io_threads_num; i++) {
+        io_thread_t *t = &io_threads[i];
+        while (atomic_load_explicit(&t->pending, memory_order_acquire) != 0) {
+            sched_yield();
+        }
+        while (list_lpop(t->items) != NULL) {
+        }
+    }
+}
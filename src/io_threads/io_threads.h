@@ -0,0 +1,17 @@
+#ifndef IO_THREADS_H
+#define IO_THREADS_H
+
+#include "../lib/list.h"
+
+#define IO_THREADS_MAX 64
+
+// Work done for one client on an I/O thread; must not touch shared server state
+typedef void (*io_thread_job_t)(void *item, void *ctx);
+
+int io_threads_init(int num_threads);
+void io_threads_shutdown(void);
+int io_threads_active(void);
+int io_threads_count(void);
+void io_threads_run(redis_list_t *items, io_thread_job_t job, void *ctx);
+
+#endif
@@ -0,0 +1,101 @@
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include "latency_monitor.h"
+
+latency_monitor_t *latency_monitor_create(long long threshold_ms) {
+    latency_monitor_t *monitor = calloc(1, sizeof(latency_monitor_t));
+    if (!monitor) {
+        return NULL;
+    }
+    monitor->threshold_ms = threshold_ms;
+    return monitor;
+}
+
+void latency_monitor_destroy(latency_monitor_t *monitor) {
+    free(monitor);
+}
+
+latency_series_t *latency_monitor_find(latency_monitor_t *monitor, const char *event) {
+    for (int i = 0; monitor && i < monitor->count; i++) {
+        if (strcasecmp(monitor->events[i].event, event) == 0) {
+            return &monitor->events[i];
+        }
+    }
+    return NULL;
+}
+
+// Several stalls within the same second are folded into one sample holding the worst
+void latency_monitor_add_sample(latency_monitor_t *monitor, const char *event, uint64_t duration_ns) {
+    if (!monitor || monitor->threshold_ms <= 0) {
+        return;
+    }
+    uint64_t latency_ms = duration_ns / 1000000;
+    if (latency_ms < (uint64_t)monitor->threshold_ms) {
+        return;
+    }
+    if (latency_ms > UINT32_MAX) {
+        latency_ms = UINT32_MAX;
+    }
+
+    latency_series_t *series = latency_monitor_find(monitor, event);
+    if (!series) {
+        if (monitor->count == LATENCY_MONITOR_EVENTS_MAX) {
+            return;
+        }
+        series = &monitor->events[monitor->count++];
+        memset(series, 0, sizeof(*series));
+        strncpy(series->event, event, sizeof(series->event) - 1);
+    }
+
+    time_t now = time(NULL);
+    if (latency_ms > series->max_ms) {
+        series->max_ms = (uint32_t)latency_ms;
+    }
+
+    int last = (series->next + LATENCY_MONITOR_HISTORY_LEN - 1) % LATENCY_MONITOR_HISTORY_LEN;
+    if (series->len > 0 && series->samples[last].time == now) {
+        if (latency_ms > series->samples[last].latency_ms) {
+            series->samples[last].latency_ms = (uint32_t)latency_ms;
+        }
+        return;
+    }
+
+    series->samples[series->next].time = now;
+    series->samples[series->next].latency_ms = (uint32_t)latency_ms;
+    series->next = (series->next + 1) % LATENCY_MONITOR_HISTORY_LEN;
+    if (series->len < LATENCY_MONITOR_HISTORY_LEN) {
+        series->len++;
+    }
+}
+
+// index 0 is the oldest sample still kept
+const latency_sample_t *latency_series_get(const latency_series_t *series, int index) {
+    if (index < 0 || index >= series->len) {
+        return NULL;
+    }
+    int first = (series->next - series->len + LATENCY_MONITOR_HISTORY_LEN) % LATENCY_MONITOR_HISTORY_LEN;
+    return &series->samples[(first + index) % LATENCY_MONITOR_HISTORY_LEN];
+}
+
+// Drops the named events, or all of them without names; returns how many were dropped
+int latency_monitor_reset(latency_monitor_t *monitor, char **events, int count) {
+    if (!monitor) {
+        return 0;
+    }
+    if (count == 0) {
+        int dropped = monitor->count;
+        monitor->count = 0;
+        return dropped;
+    }
+
+    int dropped = 0;
+    for (int i = 0; i < count; i++) {
+        latency_series_t *series = latency_monitor_find(monitor, events[i]);
+        if (series) {
+            *series = monitor->events[--monitor->count];
+            dropped++;
+        }
+    }
+    return dropped;
+}
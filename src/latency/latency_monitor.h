@@ -0,0 +1,61 @@
+#ifndef LATENCY_MONITOR_H
+#define LATENCY_MONITOR_H
+
+#include <stdint.h>
+#include <time.h>
+#include "../lib/latency_histogram.h"
+
+#define LATENCY_MONITOR_HISTORY_LEN 160   // samples kept per event, at most one per second
+#define LATENCY_MONITOR_EVENTS_MAX 16
+#define LATENCY_MONITOR_EVENT_NAME_LEN 32
+
+/* Stalls timed outside of command execution, plus the commands themselves */
+#define LATENCY_EVENT_COMMAND "command"
+#define LATENCY_EVENT_FAST_COMMAND "fast-command"
+#define LATENCY_EVENT_RDB_SAVE "rdb-save"
+#define LATENCY_EVENT_RDB_TRANSFER "rdb-transfer"
+#define LATENCY_EVENT_BLOCKED_SCAN "blocked-clients-scan"
+#define LATENCY_EVENT_EXPIRE_CYCLE "expire-cycle"
+
+typedef struct latency_sample {
+    time_t time;
+    uint32_t latency_ms;
+} latency_sample_t;
+
+typedef struct latency_series {
+    char event[LATENCY_MONITOR_EVENT_NAME_LEN];
+    int next;                   // slot for the next sample, the ring is full once len reaches the history size
+    int len;
+    uint32_t max_ms;
+    latency_sample_t samples[LATENCY_MONITOR_HISTORY_LEN];
+} latency_series_t;
+
+/*
+ * LATENCY LATEST / HISTORY: events that took at least threshold_ms are
+ * kept per event name, a threshold of 0 turns the monitor off.
+ */
+typedef struct latency_monitor {
+    long long threshold_ms;
+    int count;
+    latency_series_t events[LATENCY_MONITOR_EVENTS_MAX];
+} latency_monitor_t;
+
+latency_monitor_t *latency_monitor_create(long long threshold_ms);
+void latency_monitor_destroy(latency_monitor_t *monitor);
+void latency_monitor_add_sample(latency_monitor_t *monitor, const char *event, uint64_t duration_ns);
+latency_series_t *latency_monitor_find(latency_monitor_t *monitor, const char *event);
+const latency_sample_t *latency_series_get(const latency_series_t *series, int index);
+int latency_monitor_reset(latency_monitor_t *monitor, char **events, int count);
+
+/* Brackets a stall; with the monitor off start returns 0 and no clock is read */
+static inline uint64_t latency_monitor_start(const latency_monitor_t *monitor) {
+    return monitor && monitor->threshold_ms > 0 ? latency_now_ns() : 0;
+}
+
+static inline void latency_monitor_end(latency_monitor_t *monitor, const char *event, uint64_t start_ns) {
+    if (start_ns) {
+        latency_monitor_add_sample(monitor, event, latency_now_ns() - start_ns);
+    }
+}
+
+#endif
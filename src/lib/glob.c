@@ -0,0 +1,160 @@
+#include <ctype.h>
+#include <string.h>
+#include "glob.h"
+
+#define GLOB_MAX_NESTING 1000      // '*'s deep; keeps a hostile pattern off the stack limit
+
+static int same_byte(char a, char b, int nocase)
+{
+    if (nocase)
+        return tolower((unsigned char)a) == tolower((unsigned char)b);
+    return a == b;
+}
+
+/*
+ * Once a '*' fails to match any suffix of the string, no later '*' can do
+ * better with a shorter one, so skip_longer unwinds the recursion instead
+ * of retrying: patterns like "a*a*a*a*b" stay linear-ish instead of
+ * exponential.
+ */
+static int glob_match_impl(const char *p, size_t plen, const char *s, size_t slen,
+                           int nocase, int *skip_longer, int nesting)
+{
+    if (nesting > GLOB_MAX_NESTING)
+        return 0;
+
+    while (plen && slen) {
+        switch (p[0]) {
+        case '*':
+            while (plen > 1 && p[1] == '*') {
+                p++;
+                plen--;
+            }
+            if (plen == 1)
+                return 1;
+            while (slen) {
+                if (glob_match_impl(p + 1, plen - 1, s, slen, nocase, skip_longer, nesting + 1))
+                    return 1;
+                if (*skip_longer)
+                    return 0;
+                s++;
+                slen--;
+            }
+            *skip_longer = 1;
+            return 0;
+        case '?':
+            s++;
+            slen--;
+            break;
+        case '[': {
+            p++;
+            plen--;
+            int negate = plen && p[0] == '^';
+            if (negate) {
+                p++;
+                plen--;
+            }
+
+            int match = 0;
+            for (;;) {
+                if (plen == 0) {
+                    // Unterminated class: step back so the loop below ends on its last byte
+                    p--;
+                    plen++;
+                    break;
+                }
+                if (p[0] == '\\' && plen >= 2) {
+                    p++;
+                    plen--;
+                    if (p[0] == s[0])
+                        match = 1;
+                } else if (p[0] == ']') {
+                    break;
+                } else if (plen >= 3 && p[1] == '-') {
+                    int start = (unsigned char)p[0];
+                    int end = (unsigned char)p[2];
+                    int c = (unsigned char)s[0];
+                    if (start > end) {
+                        int tmp = start;
+                        start = end;
+                        end = tmp;
+                    }
+                    if (nocase) {
+                        start = tolower(start);
+                        end = tolower(end);
+                        c = tolower(c);
+                    }
+                    p += 2;
+                    plen -= 2;
+                    if (c >= start && c <= end)
+                        match = 1;
+                } else if (same_byte(p[0], s[0], nocase)) {
+                    match = 1;
+                }
+                p++;
+                plen--;
+            }
+            if (negate)
+                match = !match;
+            if (!match)
+                return 0;
+            s++;
+            slen--;
+            break;
+        }
+        case '\\':
+            if (plen >= 2) {
+                p++;
+                plen--;
+            }
+            /* fall through */
+        default:
+            if (!same_byte(p[0], s[0], nocase))
+                return 0;
+            s++;
+            slen--;
+            break;
+        }
+
+        p++;
+        plen--;
+    }
+
+    // Trailing '*'s match the empty rest
+    if (slen == 0) {
+        while (plen && p[0] == '*') {
+            p++;
+            plen--;
+        }
+    }
+    return plen == 0 && slen == 0;
+}
+
+int glob_match(const char *pattern, size_t pattern_len, const char *str, size_t str_len, int nocase)
+{
+    int skip_longer = 0;
+    return glob_match_impl(pattern, pattern_len, str, str_len, nocase, &skip_longer, 0);
+}
+
+void glob_compile(glob_pattern_t *glob, const char *pattern, size_t len)
+{
+    size_t literal = 0;
+    while (literal < len && !strchr("*?[\\", pattern[literal]))
+        literal++;
+
+    size_t rest = literal;
+    while (rest < len && pattern[rest] == '*')
+        rest++;
+
+    glob->pattern = pattern;
+    glob->len = len;
+    glob->literal_len = literal;
+    if (literal == len)
+        glob->kind = GLOB_EXACT;
+    else if (rest < len)
+        glob->kind = GLOB_GENERIC;
+    else if (literal == 0)
+        glob->kind = GLOB_MATCH_ALL;
+    else
+        glob->kind = GLOB_PREFIX;
+}
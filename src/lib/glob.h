@@ -0,0 +1,49 @@
+#ifndef GLOB_H
+#define GLOB_H
+
+#include <stddef.h>
+#include <string.h>
+
+/*
+ * Redis-style glob match of str against pattern: '*' any run, '?' one
+ * byte, [abc], [^abc] and [a-z] classes, and '\' to take the next byte
+ * literally. Both sides are byte strings with explicit lengths.
+ */
+int glob_match(const char *pattern, size_t pattern_len, const char *str, size_t str_len, int nocase);
+
+typedef enum glob_kind {
+    GLOB_MATCH_ALL,     // only '*'s
+    GLOB_EXACT,         // no wildcard at all
+    GLOB_PREFIX,        // a literal followed by only '*'s, e.g. "user:*"
+    GLOB_GENERIC
+} glob_kind_t;
+
+/*
+ * A pattern looked at once before matching many strings. The common
+ * shapes resolve to a length check plus memcmp; everything else falls
+ * back to glob_match(). The pattern bytes are not copied.
+ */
+typedef struct glob_pattern {
+    glob_kind_t kind;
+    const char *pattern;
+    size_t len;
+    size_t literal_len;         // bytes before the first wildcard
+} glob_pattern_t;
+
+void glob_compile(glob_pattern_t *glob, const char *pattern, size_t len);
+
+static inline int glob_pattern_match(const glob_pattern_t *glob, const char *str, size_t len)
+{
+    switch (glob->kind) {
+    case GLOB_MATCH_ALL:
+        return 1;
+    case GLOB_EXACT:
+        return len == glob->literal_len && memcmp(str, glob->pattern, len) == 0;
+    case GLOB_PREFIX:
+        return len >= glob->literal_len && memcmp(str, glob->pattern, glob->literal_len) == 0;
+    default:
+        return glob_match(glob->pattern, glob->len, str, len, 0);
+    }
+}
+
+#endif
@@ -0,0 +1,36 @@
+#include "latency_histogram.h"
+
+// Largest value recorded into the bucket
+static uint64_t latency_bucket_upper(int bucket)
+{
+    if (bucket < LATENCY_SUB_BUCKETS) {
+        return (uint64_t)bucket;
+    }
+    int shift = bucket / LATENCY_SUB_BUCKETS - 1;
+    uint64_t sub = (uint64_t)(bucket % LATENCY_SUB_BUCKETS);
+    return ((LATENCY_SUB_BUCKETS + sub + 1) << shift) - 1;
+}
+
+/* Upper bound in ns of the bucket holding the given percentile (0-100),
+ * 0 for an empty histogram */
+uint64_t latency_histogram_percentile(const latency_histogram_t *histogram, double percentile)
+{
+    if (histogram->count == 0) {
+        return 0;
+    }
+
+    double exact = percentile / 100.0 * (double)histogram->count;
+    uint64_t rank = (uint64_t)exact;
+    if ((double)rank < exact || rank == 0) {
+        rank++;
+    }
+
+    uint64_t seen = 0;
+    for (int i = 0; i < LATENCY_BUCKETS; i++) {
+        seen += histogram->buckets[i];
+        if (seen >= rank) {
+            return latency_bucket_upper(i);
+        }
+    }
+    return latency_bucket_upper(LATENCY_BUCKETS - 1);
+}
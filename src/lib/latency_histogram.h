@@ -0,0 +1,51 @@
+#ifndef LATENCY_HISTOGRAM_H
+#define LATENCY_HISTOGRAM_H
+
+#include <stdint.h>
+#include <time.h>
+
+/*
+ * Log-linear latency histogram over nanoseconds, in the spirit of
+ * HdrHistogram: each power of two is split into LATENCY_SUB_BUCKETS linear
+ * buckets, so a value is reported at most 12.5% high and recording costs a
+ * clz and two shifts. Covers up to ~137 s; longer values land in the last
+ * bucket.
+ */
+#define LATENCY_SUB_BUCKET_BITS 3
+#define LATENCY_SUB_BUCKETS (1 << LATENCY_SUB_BUCKET_BITS)
+#define LATENCY_MAX_BIT 36
+#define LATENCY_BUCKETS ((LATENCY_MAX_BIT - LATENCY_SUB_BUCKET_BITS + 2) * LATENCY_SUB_BUCKETS)
+
+typedef struct latency_histogram {
+    uint64_t count;
+    uint64_t buckets[LATENCY_BUCKETS];
+} latency_histogram_t;
+
+/* CLOCK_MONOTONIC goes through the vDSO (~20ns); the _COARSE clock only
+ * ticks every few milliseconds, too slow for commands that take a few µs */
+static inline uint64_t latency_now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+static inline void latency_histogram_record(latency_histogram_t *histogram, uint64_t ns) {
+    int bucket;
+    if (ns < LATENCY_SUB_BUCKETS) {
+        bucket = (int)ns;
+    } else {
+        int msb = 63 - __builtin_clzll(ns);
+        if (msb > LATENCY_MAX_BIT) {
+            bucket = LATENCY_BUCKETS - 1;
+        } else {
+            int shift = msb - LATENCY_SUB_BUCKET_BITS;
+            bucket = (shift + 1) * LATENCY_SUB_BUCKETS + (int)((ns >> shift) & (LATENCY_SUB_BUCKETS - 1));
+        }
+    }
+    histogram->buckets[bucket]++;
+    histogram->count++;
+}
+
+uint64_t latency_histogram_percentile(const latency_histogram_t *histogram, double percentile);
+
+#endif
@@ -0,0 +1,16 @@
+#ifndef SIPHASH_H
+#define SIPHASH_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define SIPHASH_KEY_LEN 16
+
+/*
+ * SipHash-1-2: a keyed hash, so without the key nobody can precompute
+ * keys that all land in one bucket. One compression and two finalization
+ * rounds, the variant Redis uses for its dict.
+ */
+uint64_t siphash(const uint8_t *in, size_t inlen, const uint8_t key[SIPHASH_KEY_LEN]);
+
+#endif
@@ -0,0 +1,62 @@
+#include <stdlib.h>
+#include "spsc_queue.h"
+
+spsc_queue_t *spsc_queue_create(size_t capacity)
+{
+    size_t size = 2;
+    while (size < capacity) {
+        size <<= 1;
+    }
+
+    spsc_queue_t *queue = aligned_alloc(SPSC_CACHE_LINE, sizeof(spsc_queue_t));
+    if (!queue) return NULL;
+
+    queue->slots = calloc(size, sizeof(void *));
+    if (!queue->slots) {
+        free(queue);
+        return NULL;
+    }
+    queue->mask = size - 1;
+    atomic_init(&queue->head, 0);
+    atomic_init(&queue->tail, 0);
+    queue->cached_head = 0;
+    queue->cached_tail = 0;
+    return queue;
+}
+
+void spsc_queue_destroy(spsc_queue_t *queue)
+{
+    if (!queue) return;
+    free(queue->slots);
+    free(queue);
+}
+
+int spsc_queue_push(spsc_queue_t *queue, void *item)
+{
+    size_t tail = atomic_load_explicit(&queue->tail, memory_order_relaxed);
+    if (tail - queue->cached_head > queue->mask) {
+        queue->cached_head = atomic_load_explicit(&queue->head, memory_order_acquire);
+        if (tail - queue->cached_head > queue->mask) {
+            return -1;
+        }
+    }
+
+    queue->slots[tail & queue->mask] = item;
+    atomic_store_explicit(&queue->tail, tail + 1, memory_order_release);
+    return 0;
+}
+
+void *spsc_queue_pop(spsc_queue_t *queue)
+{
+    size_t head = atomic_load_explicit(&queue->head, memory_order_relaxed);
+    if (head == queue->cached_tail) {
+        queue->cached_tail = atomic_load_explicit(&queue->tail, memory_order_acquire);
+        if (head == queue->cached_tail) {
+            return NULL;
+        }
+    }
+
+    void *item = queue->slots[head & queue->mask];
+    atomic_store_explicit(&queue->head, head + 1, memory_order_release);
+    return item;
+}
@@ -0,0 +1,32 @@
+#ifndef SPSC_QUEUE_H
+#define SPSC_QUEUE_H
+
+#include <stddef.h>
+#include <stdatomic.h>
+
+#define SPSC_CACHE_LINE 64
+
+/*
+ * Bounded lock-free queue of pointers with exactly one producer thread and
+ * one consumer thread. head and tail live on separate cache lines, and each
+ * side keeps a private copy of the other's index so it only touches the
+ * shared line when its copy says the queue looks full/empty.
+ */
+typedef struct spsc_queue {
+    void **slots;
+    size_t mask;
+
+    _Alignas(SPSC_CACHE_LINE) atomic_size_t head;   // next slot to pop, written by the consumer
+    size_t cached_tail;
+
+    _Alignas(SPSC_CACHE_LINE) atomic_size_t tail;   // next slot to push, written by the producer
+    size_t cached_head;
+} spsc_queue_t;
+
+// capacity is rounded up to a power of two
+spsc_queue_t *spsc_queue_create(size_t capacity);
+void spsc_queue_destroy(spsc_queue_t *queue);
+int spsc_queue_push(spsc_queue_t *queue, void *item);   // 0, or -1 when full
+void *spsc_queue_pop(spsc_queue_t *queue);              // NULL when empty
+
+#endif
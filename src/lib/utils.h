@@ -5,6 +5,7 @@
 #include <stdbool.h>
 #include <string.h>
 #include <ctype.h> 
+#include <limits.h>
 
 static inline bool isInteger(const char *str) {
     if (str == NULL || *str == '\0') { 
@@ -44,4 +45,88 @@ static inline int get_digit_count(int num) {
     return count;
 }
 
+/*
+ * Write value in decimal to buf (no terminating NUL, at most 20 bytes) and
+ * return the length. Peels off two digits per division instead of going
+ * through snprintf; reply headers and integer replies are formatted with it.
+ */
+static inline int ll_to_str(char *buf, long long value) {
+    static const char pairs[201] =
+        "0001020304050607080910111213141516171819202122232425262728293031323334353637383940414243444546474849"
+        "5051525354555657585960616263646566676869707172737475767778798081828384858687888990919293949596979899";
+    unsigned long long v = value < 0 ? 0ULL - (unsigned long long)value : (unsigned long long)value;
+    char tmp[20];
+    int pos = sizeof(tmp);
+
+    while (v >= 100) {
+        int i = (int)(v % 100) * 2;
+        v /= 100;
+        tmp[--pos] = pairs[i + 1];
+        tmp[--pos] = pairs[i];
+    }
+    if (v < 10) {
+        tmp[--pos] = (char)('0' + v);
+    } else {
+        int i = (int)v * 2;
+        tmp[--pos] = pairs[i + 1];
+        tmp[--pos] = pairs[i];
+    }
+    if (value < 0) {
+        tmp[--pos] = '-';
+    }
+
+    int len = (int)sizeof(tmp) - pos;
+    memcpy(buf, tmp + pos, len);
+    return len;
+}
+
+/*
+ * Parse len bytes of s as a decimal long long. Only the canonical form is
+ * accepted (no sign but '-', no leading zeros, no "-0", no overflow), so a
+ * value that parses prints back as exactly the same bytes.
+ */
+static inline bool string_to_ll(const char *s, size_t len, long long *value) {
+    if (len == 0 || len > 20) {
+        return false;
+    }
+    if (len == 1 && s[0] == '0') {
+        *value = 0;
+        return true;
+    }
+
+    size_t i = 0;
+    bool negative = s[0] == '-';
+    if (negative) {
+        i = 1;
+    }
+    if (i == len || s[i] < '1' || s[i] > '9') {
+        return false;
+    }
+
+    unsigned long long v = 0;
+    for (; i < len; i++) {
+        if (s[i] < '0' || s[i] > '9') {
+            return false;
+        }
+        unsigned digit = (unsigned)(s[i] - '0');
+        if (v > (ULLONG_MAX - digit) / 10) {
+            return false;
+        }
+        v = v * 10 + digit;
+    }
+
+    if (negative) {
+        if (v > (unsigned long long)LLONG_MAX + 1) {
+            return false;
+        }
+        *value = v == (unsigned long long)LLONG_MAX + 1 ? LLONG_MIN : -(long long)v;
+    } else {
+        if (v > (unsigned long long)LLONG_MAX) {
+            return false;
+        }
+        *value = (long long)v;
+    }
+    return true;
+}
+
 #endif
\ No newline at end of file
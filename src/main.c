@@ -4,10 +4,14 @@
 #include <netinet/in.h>
 #include <netinet/ip.h>
 #include <string.h>
+#include <strings.h>
 #include <errno.h>
 #include <unistd.h>
 #include <sys/epoll.h>
 #include <fcntl.h>
+#include <sys/resource.h>
+#include <sys/random.h>
+#include <time.h>
 #include <unistd.h>
 #include "redis_server/redis_server.h"
 #include "hash_table/hash_table.h"
@@ -15,6 +19,10 @@
 #include "rdb/io_buffer.h"
 #include "rdb/rdb.h"
 #include "lib/radix_tree.h"
+#include "io_threads/io_threads.h"
+#include "event_loop/event_loop.h"
+#include "shards/shard.h"
+#include "server/server.h"
 
 #define BUFFER_SIZE 1024
 #define REDIS_DEFAULT_PORT 6379
@@ -26,6 +34,24 @@ void print_usage(const char *program_name)
 {
     fprintf(stderr, "Usage: %s [--port PORT]\n", program_name);
     fprintf(stderr, "  --port PORT    Port number to listen on (default: %d)\n", REDIS_DEFAULT_PORT);
+    fprintf(stderr, "  --client-query-buffer-limit BYTES    Max pending input per client (default: %d)\n",
+            CLIENT_DEFAULT_MAX_QUERYBUF_LEN);
+    fprintf(stderr, "  --io-threads N    Threads for socket reads/parsing and writes, 1 disables (default: 1)\n");
+    fprintf(stderr, "  --event-loop epoll|io_uring    Event loop backend (default: epoll)\n");
+    fprintf(stderr, "  --shards N    Split the keyspace across N event loops, one per core (default: 1)\n");
+    fprintf(stderr, "  --tcp-backlog N    Listen queue length for pending connections (default: %d)\n",
+            SERVER_DEFAULT_TCP_BACKLOG);
+    fprintf(stderr, "  --client-output-buffer-limit \"normal|pubsub HARD SOFT SECONDS\"    Disconnect clients whose\n"
+                    "      pending output passes HARD, or stays over SOFT for SECONDS; sizes take kb/mb/gb, 0 disables\n"
+                    "      (default: \"pubsub 32mb 8mb 60\")\n");
+    fprintf(stderr, "  --unixsocket PATH    Also accept clients on a unix domain socket\n");
+    fprintf(stderr, "  --unixsocketperm MODE    Octal permissions of the unix socket file (default: umask)\n");
+    fprintf(stderr, "  --shared-integers N    Integer replies 0..N-1 are encoded once at startup (default: %d)\n",
+            SHARED_REPLY_INTEGERS_DEFAULT);
+    fprintf(stderr, "  --slowlog-log-slower-than USEC    Log commands that ran at least this long, -1 disables (default: %d)\n",
+            SLOWLOG_DEFAULT_SLOWER_THAN);
+    fprintf(stderr, "  --slowlog-max-len N    Entries kept in the slow log (default: %d)\n", SLOWLOG_DEFAULT_MAX_LEN);
+    fprintf(stderr, "  --latency-monitor-threshold MS    Record stalls of at least MS milliseconds, 0 disables (default: 0)\n");
 }
 
 int parse_port(const char *port_str)
@@ -42,13 +68,146 @@ int parse_port(const char *port_str)
     return (int)port;
 }
 
+// Bytes with an optional k/kb/m/mb/g/gb suffix, as in redis.conf
+static int parse_memory(const char *str, unsigned long long *bytes)
+{
+    char *endptr;
+    unsigned long long value = strtoull(str, &endptr, 10);
+    if (endptr == str)
+    {
+        return -1;
+    }
+
+    unsigned long long unit = 1;
+    if (strcasecmp(endptr, "k") == 0 || strcasecmp(endptr, "kb") == 0)
+        unit = 1024ULL;
+    else if (strcasecmp(endptr, "m") == 0 || strcasecmp(endptr, "mb") == 0)
+        unit = 1024ULL * 1024;
+    else if (strcasecmp(endptr, "g") == 0 || strcasecmp(endptr, "gb") == 0)
+        unit = 1024ULL * 1024 * 1024;
+    else if (*endptr != '\0')
+        return -1;
+
+    *bytes = value * unit;
+    return 0;
+}
+
+// "pubsub 32mb 8mb 60": class, hard limit, soft limit, seconds over the soft limit
+static int parse_output_limit(const char *spec, client_type_t *type, client_output_limit_t *limit)
+{
+    char class_name[16], hard[32], soft[32];
+    long seconds;
+    unsigned long long hard_bytes, soft_bytes;
+    if (sscanf(spec, "%15s %31s %31s %ld", class_name, hard, soft, &seconds) != 4 || seconds < 0 ||
+        parse_memory(hard, &hard_bytes) < 0 || parse_memory(soft, &soft_bytes) < 0)
+    {
+        return -1;
+    }
+
+    if (strcasecmp(class_name, "normal") == 0)
+        *type = CLIENT_TYPE_NORMAL;
+    else if (strcasecmp(class_name, "pubsub") == 0)
+        *type = CLIENT_TYPE_PUBSUB;
+    else
+        return -1;
 
+    limit->hard_bytes = (size_t)hard_bytes;
+    limit->soft_bytes = (size_t)soft_bytes;
+    limit->soft_seconds = (time_t)seconds;
+    return 0;
+}
 
+// Every connection is an fd, so lift the soft limit as far as the hard limit allows
+static void raise_open_files_limit(void)
+{
+    struct rlimit limit;
+    if (getrlimit(RLIMIT_NOFILE, &limit) < 0 || limit.rlim_cur == limit.rlim_max)
+    {
+        return;
+    }
+
+    rlim_t old_limit = limit.rlim_cur;
+    // An unlimited hard limit still cannot go past fs.nr_open
+    limit.rlim_cur = limit.rlim_max == RLIM_INFINITY ? 1048576 : limit.rlim_max;
+    if (setrlimit(RLIMIT_NOFILE, &limit) < 0)
+    {
+        perror("setrlimit");
+        return;
+    }
+    printf("Raised open files limit from %llu to %llu\n",
+           (unsigned long long)old_limit, (unsigned long long)limit.rlim_cur);
+}
+
+// Dict hashes are keyed per process so clients cannot aim keys at one bucket
+static void seed_hash_tables(void)
+{
+    uint8_t seed[16];
+    if (getrandom(seed, sizeof(seed), 0) != (ssize_t)sizeof(seed))
+    {
+        struct timespec ts;
+        clock_gettime(CLOCK_REALTIME, &ts);
+        unsigned long long mix[2] = {(unsigned long long)ts.tv_nsec ^ ((unsigned long long)getpid() << 32),
+                                     (unsigned long long)ts.tv_sec ^ (unsigned long long)(uintptr_t)&ts};
+        memcpy(seed, mix, sizeof(seed));
+    }
+    hash_table_set_seed(seed);
+}
+
+// Every shard is a complete server bound to the same port with SO_REUSEPORT
+static int run_sharded(int port, int tcp_backlog, int shards_num, const char *rdb_dir,
+                       const char *rdb_filename, size_t client_max_querybuf_len,
+                       const client_output_limit_t *output_limits,
+                       const char *unixsocket, mode_t unixsocket_perm,
+                       long long slowlog_slower_than, size_t slowlog_max_len, long long latency_threshold)
+{
+    printf("Starting Redis server on port %d with %d shards\n", port, shards_num);
+
+    shard_group_t *group = shard_group_create(port, tcp_backlog, shards_num);
+    if (!group)
+    {
+        fprintf(stderr, "Failed to create %d shards on port %d: %s\n", shards_num, port, strerror(errno));
+        return 1;
+    }
+
+    for (int i = 0; i < group->count; i++)
+    {
+        redis_server_t *server = group->shards[i]->server;
+        if (redis_server_configure_master(server) != 0)
+        {
+            fprintf(stderr, "Failed to configure shard %d\n", i);
+            shard_group_destroy(group);
+            return 1;
+        }
+        server->rdb_dir = strdup(rdb_dir);
+        server->rdb_filename = strdup(rdb_filename);
+        server->client_max_querybuf_len = client_max_querybuf_len;
+        memcpy(server->client_output_limits, output_limits, sizeof(server->client_output_limits));
+        if (server->slowlog)
+            slowlog_configure(server->slowlog, slowlog_slower_than, slowlog_max_len);
+        if (server->latency_monitor)
+            server->latency_monitor->threshold_ms = latency_threshold;
+    }
+
+    // A socket path cannot be shared like a port; shard 0 accepts and routes keys as usual
+    if (unixsocket &&
+        redis_server_listen_unix(group->shards[0]->server, unixsocket, unixsocket_perm, tcp_backlog) < 0)
+    {
+        fprintf(stderr, "Failed to listen on unix socket %s: %s\n", unixsocket, strerror(errno));
+        shard_group_destroy(group);
+        return 1;
+    }
+
+    shard_group_run(group);
+    shard_group_destroy(group);
+    return 0;
+}
 
 int main(int argc, char *argv[])
 {
     setbuf(stdout, NULL);
     setbuf(stderr, NULL);
+    raise_open_files_limit();
+    seed_hash_tables();
 
     int port = REDIS_DEFAULT_PORT;
     int8_t is_replica = 0;
@@ -56,6 +215,20 @@ int main(int argc, char *argv[])
     int master_port = 0;
     char *rdb_dir = "/tmp";           
     char *rdb_filename = "dump.rdb";  
+    size_t client_max_querybuf_len = CLIENT_DEFAULT_MAX_QUERYBUF_LEN;
+    int io_threads_num = 1;
+    int shards_num = 1;
+    int tcp_backlog = SERVER_DEFAULT_TCP_BACKLOG;
+    char *unixsocket = NULL;
+    client_output_limit_t output_limits[CLIENT_TYPE_COUNT] = {
+        [CLIENT_TYPE_PUBSUB] = {CLIENT_PUBSUB_OUTPUT_HARD_LIMIT, CLIENT_PUBSUB_OUTPUT_SOFT_LIMIT,
+                                CLIENT_PUBSUB_OUTPUT_SOFT_SECONDS},
+    };
+    mode_t unixsocket_perm = 0;
+    long long shared_integers = SHARED_REPLY_INTEGERS_DEFAULT;
+    long long slowlog_slower_than = SLOWLOG_DEFAULT_SLOWER_THAN;
+    size_t slowlog_max_len = SLOWLOG_DEFAULT_MAX_LEN;
+    long long latency_threshold = 0;
 
 
     for (int i = 1; i < argc; i++)
@@ -157,6 +330,212 @@ int main(int argc, char *argv[])
             rdb_filename = argv[i + 1];
             i++; 
         }
+        else if (strcmp(argv[i], "--client-query-buffer-limit") == 0)
+        {
+            if (i + 1 >= argc)
+            {
+                fprintf(stderr, "Error: --client-query-buffer-limit requires a value\n");
+                print_usage(argv[0]);
+                return 1;
+            }
+            char *endptr;
+            unsigned long long limit = strtoull(argv[i + 1], &endptr, 10);
+            if (*endptr != '\0' || limit == 0)
+            {
+                fprintf(stderr, "Error: Invalid query buffer limit '%s'\n", argv[i + 1]);
+                return 1;
+            }
+            client_max_querybuf_len = (size_t)limit;
+            i++;
+        }
+        else if (strcmp(argv[i], "--event-loop") == 0)
+        {
+            if (i + 1 >= argc)
+            {
+                fprintf(stderr, "Error: --event-loop requires a value\n");
+                print_usage(argv[0]);
+                return 1;
+            }
+            if (event_loop_set_default_backend(argv[i + 1]) < 0)
+            {
+                fprintf(stderr, "Error: unknown event loop backend '%s'\n", argv[i + 1]);
+                return 1;
+            }
+            i++;
+        }
+        else if (strcmp(argv[i], "--tcp-backlog") == 0)
+        {
+            if (i + 1 >= argc)
+            {
+                fprintf(stderr, "Error: --tcp-backlog requires a value\n");
+                print_usage(argv[0]);
+                return 1;
+            }
+            char *endptr;
+            long backlog = strtol(argv[i + 1], &endptr, 10);
+            if (*endptr != '\0' || backlog < 1 || backlog > 65535)
+            {
+                fprintf(stderr, "Error: --tcp-backlog must be between 1 and 65535\n");
+                return 1;
+            }
+            tcp_backlog = (int)backlog;
+            i++;
+        }
+        else if (strcmp(argv[i], "--client-output-buffer-limit") == 0)
+        {
+            if (i + 1 >= argc)
+            {
+                fprintf(stderr, "Error: --client-output-buffer-limit requires a value\n");
+                print_usage(argv[0]);
+                return 1;
+            }
+            client_type_t type;
+            client_output_limit_t limit;
+            if (parse_output_limit(argv[i + 1], &type, &limit) < 0)
+            {
+                fprintf(stderr, "Error: Invalid client output buffer limit '%s'\n", argv[i + 1]);
+                return 1;
+            }
+            output_limits[type] = limit;
+            i++;
+        }
+        else if (strcmp(argv[i], "--unixsocket") == 0)
+        {
+            if (i + 1 >= argc)
+            {
+                fprintf(stderr, "Error: --unixsocket requires a value\n");
+                print_usage(argv[0]);
+                return 1;
+            }
+            unixsocket = argv[i + 1];
+            i++;
+        }
+        else if (strcmp(argv[i], "--unixsocketperm") == 0)
+        {
+            if (i + 1 >= argc)
+            {
+                fprintf(stderr, "Error: --unixsocketperm requires a value\n");
+                print_usage(argv[0]);
+                return 1;
+            }
+            char *endptr;
+            long perm = strtol(argv[i + 1], &endptr, 8);
+            if (*endptr != '\0' || perm < 0 || perm > 0777)
+            {
+                fprintf(stderr, "Error: Invalid unix socket permissions '%s'\n", argv[i + 1]);
+                return 1;
+            }
+            unixsocket_perm = (mode_t)perm;
+            i++;
+        }
+        else if (strcmp(argv[i], "--shared-integers") == 0)
+        {
+            if (i + 1 >= argc)
+            {
+                fprintf(stderr, "Error: --shared-integers requires a value\n");
+                print_usage(argv[0]);
+                return 1;
+            }
+            char *endptr;
+            long long integers = strtoll(argv[i + 1], &endptr, 10);
+            if (*endptr != '\0' || integers < 0 || integers > SHARED_REPLY_INTEGERS_MAX)
+            {
+                fprintf(stderr, "Error: --shared-integers must be between 0 and %d\n", SHARED_REPLY_INTEGERS_MAX);
+                return 1;
+            }
+            shared_integers = integers;
+            i++;
+        }
+        else if (strcmp(argv[i], "--slowlog-log-slower-than") == 0)
+        {
+            if (i + 1 >= argc)
+            {
+                fprintf(stderr, "Error: --slowlog-log-slower-than requires a value\n");
+                print_usage(argv[0]);
+                return 1;
+            }
+            char *endptr;
+            long long usec = strtoll(argv[i + 1], &endptr, 10);
+            if (*endptr != '\0' || usec < -1)
+            {
+                fprintf(stderr, "Error: Invalid slow log threshold '%s'\n", argv[i + 1]);
+                return 1;
+            }
+            slowlog_slower_than = usec;
+            i++;
+        }
+        else if (strcmp(argv[i], "--slowlog-max-len") == 0)
+        {
+            if (i + 1 >= argc)
+            {
+                fprintf(stderr, "Error: --slowlog-max-len requires a value\n");
+                print_usage(argv[0]);
+                return 1;
+            }
+            char *endptr;
+            long long len = strtoll(argv[i + 1], &endptr, 10);
+            if (*endptr != '\0' || len < 0 || len > 1000000)
+            {
+                fprintf(stderr, "Error: --slowlog-max-len must be between 0 and 1000000\n");
+                return 1;
+            }
+            slowlog_max_len = (size_t)len;
+            i++;
+        }
+        else if (strcmp(argv[i], "--latency-monitor-threshold") == 0)
+        {
+            if (i + 1 >= argc)
+            {
+                fprintf(stderr, "Error: --latency-monitor-threshold requires a value\n");
+                print_usage(argv[0]);
+                return 1;
+            }
+            char *endptr;
+            long long ms = strtoll(argv[i + 1], &endptr, 10);
+            if (*endptr != '\0' || ms < 0)
+            {
+                fprintf(stderr, "Error: Invalid latency monitor threshold '%s'\n", argv[i + 1]);
+                return 1;
+            }
+            latency_threshold = ms;
+            i++;
+        }
+        else if (strcmp(argv[i], "--shards") == 0)
+        {
+            if (i + 1 >= argc)
+            {
+                fprintf(stderr, "Error: --shards requires a value\n");
+                print_usage(argv[0]);
+                return 1;
+            }
+            char *endptr;
+            long shards = strtol(argv[i + 1], &endptr, 10);
+            if (*endptr != '\0' || shards < 1 || shards > SHARDS_MAX)
+            {
+                fprintf(stderr, "Error: --shards must be between 1 and %d\n", SHARDS_MAX);
+                return 1;
+            }
+            shards_num = (int)shards;
+            i++;
+        }
+        else if (strcmp(argv[i], "--io-threads") == 0)
+        {
+            if (i + 1 >= argc)
+            {
+                fprintf(stderr, "Error: --io-threads requires a value\n");
+                print_usage(argv[0]);
+                return 1;
+            }
+            char *endptr;
+            long threads = strtol(argv[i + 1], &endptr, 10);
+            if (*endptr != '\0' || threads < 1 || threads > IO_THREADS_MAX)
+            {
+                fprintf(stderr, "Error: --io-threads must be between 1 and %d\n", IO_THREADS_MAX);
+                return 1;
+            }
+            io_threads_num = (int)threads;
+            i++;
+        }
         else
         {
             fprintf(stderr, "Error: Unknown argument '%s'\n", argv[i]);
@@ -165,6 +544,31 @@ int main(int argc, char *argv[])
         }
     }
 
+    // Read-only once built, so every shard and I/O thread uses the same tables
+    if (shared_replies_init(shared_integers) < 0)
+    {
+        fprintf(stderr, "Failed to allocate the shared reply tables\n");
+        return 1;
+    }
+    redis_shared_integers_init();
+
+    if (shards_num > 1)
+    {
+        if (is_replica)
+        {
+            fprintf(stderr, "Error: --shards cannot be combined with --replicaof\n");
+            return 1;
+        }
+        if (io_threads_num > 1)
+        {
+            fprintf(stderr, "Error: --shards cannot be combined with --io-threads\n");
+            return 1;
+        }
+        return run_sharded(port, tcp_backlog, shards_num, rdb_dir, rdb_filename, client_max_querybuf_len,
+                           output_limits, unixsocket, unixsocket_perm,
+                           slowlog_slower_than, slowlog_max_len, latency_threshold);
+    }
+
     if (is_replica)
     {
         printf("Starting Redis replica server on port %d, master at %s:%d\n",
@@ -175,7 +579,7 @@ int main(int argc, char *argv[])
         printf("Starting Redis server on port %d\n", port);
     }
 
-    g_server = redis_server_create(port);
+    g_server = redis_server_create(port, tcp_backlog);
     if (!g_server)
     {
     fprintf(stderr, "Failed to create Redis server on port %d: %s\n", port, strerror(errno));
@@ -203,8 +607,22 @@ int main(int argc, char *argv[])
         }
     }
 
+    if (unixsocket && redis_server_listen_unix(g_server, unixsocket, unixsocket_perm, tcp_backlog) < 0)
+    {
+        fprintf(stderr, "Failed to listen on unix socket %s: %s\n", unixsocket, strerror(errno));
+        redis_server_destroy(g_server);
+        return 1;
+    }
+
     g_server->rdb_filename = rdb_filename;
     g_server->rdb_dir = rdb_dir;
+    g_server->client_max_querybuf_len = client_max_querybuf_len;
+    memcpy(g_server->client_output_limits, output_limits, sizeof(g_server->client_output_limits));
+    g_server->io_threads_num = io_threads_num;
+    if (g_server->slowlog)
+        slowlog_configure(g_server->slowlog, slowlog_slower_than, slowlog_max_len);
+    if (g_server->latency_monitor)
+        g_server->latency_monitor->threshold_ms = latency_threshold;
     redis_server_run(g_server);
 
     redis_server_destroy(g_server);
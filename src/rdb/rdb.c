@@ -14,7 +14,7 @@
 #include "../streams/redis_stream.h"
 #include "../lib/radix_tree.h"
 
-#define RDB_ENC_INT8 0xF0
+#define RDB_ENC_INT8 0xC0
 #define RDB_TYPE_STRING 0x00
 #define RDB_TYPE_LIST 0x01
 #define RDB_TYPE_SET 0x02
@@ -89,11 +89,7 @@ int save_object(io_buffer *rdb, sds key, redis_object_t *obj)
         }
     }
     case REDIS_NUMBER:
-    {
-        char *c_str = (char *)obj->ptr;
-        int64_t intval = strtoll(c_str, NULL, 10);
-        return encode_int(rdb, intval);
-    }
+        return encode_int(rdb, obj->ival);
     case REDIS_LIST:
     {
         redis_list_t *list = (redis_list_t *)(obj->ptr);
@@ -134,16 +130,12 @@ int save_object(io_buffer *rdb, sds key, redis_object_t *obj)
         return -1;
     }
     
-    // Save last_id if it exists
-    if (stream->last_id) {
-        if (save_string(rdb, sdsnew(stream->last_id)) == -1) {
-            return -1;
-        }
-    } else {
-        // Save empty string for last_id
-        if (save_string(rdb, sdsempty()) == -1) {
-            return -1;
-        }
+    // Save last_id if it exists, an empty string otherwise
+    sds last_id = stream->last_id ? sdsnew(stream->last_id) : sdsempty();
+    ssize_t saved = save_string(rdb, last_id);
+    sdsfree(last_id);
+    if (saved == -1) {
+        return -1;
     }
     
     // Save max_len
@@ -282,7 +274,7 @@ size_t encode_int(io_buffer *rdb, int64_t val)
     if (val >= INT8_MIN && val <= INT8_MAX)
     {
         unsigned char buf[2];
-        buf[0] = RDB_TYPE_STRING;
+        buf[0] = RDB_ENC_INT8;
         buf[1] = val & 0xFF;
         return buffer_write(rdb, buf, 2);
     }
@@ -428,7 +420,7 @@ int rdb_load_full(const char *path, redis_db_t *db)
         }
         case RDB_TYPE_STREAM: // 0x0F
         {
-            lseek(loader.fd, -1, SEEK_CUR);
+            // load_stream_entry_full starts at the key, the type byte is consumed
             if (load_stream_entry_full(&loader, db) == -1) {
                 fprintf(stderr, "Failed to load stream entry\n");
                 close(loader.fd);
@@ -529,9 +521,7 @@ int load_string_entry(RDBLoader *loader, redis_db_t *db, int has_expire, uint64_
             int8_t intval;
             read(loader->fd, &intval, 1);
             
-            char int_str[32];
-            snprintf(int_str, sizeof(int_str), "%d", intval);
-            obj = redis_object_create_number(int_str);
+            obj = redis_object_create_number(intval);
                 printf("DB %d: Key='%s' → Value=%d (INT8)\n", loader->dbnum, temp_key, intval);
         }
         else if (first_byte == 0xC1) { // 16-bit integer (little-endian)
@@ -539,9 +529,7 @@ int load_string_entry(RDBLoader *loader, redis_db_t *db, int has_expire, uint64_
             read(loader->fd, &intval, 2);
             // Convert from little-endian if needed
             
-            char int_str[32];
-            snprintf(int_str, sizeof(int_str), "%u", intval);
-            obj = redis_object_create_number(int_str);
+            obj = redis_object_create_number(intval);
             
             printf("DB %d: Key='%s' → Value=%u (INT16)\n", loader->dbnum, temp_key, intval);
         }
@@ -550,9 +538,7 @@ int load_string_entry(RDBLoader *loader, redis_db_t *db, int has_expire, uint64_
             read(loader->fd, &intval, 4);
             // Convert from little-endian if needed
             
-            char int_str[32];
-            snprintf(int_str, sizeof(int_str), "%u", intval);
-            obj = redis_object_create_number(int_str);
+            obj = redis_object_create_number(intval);
             
             printf("DB %d: Key='%s' → Value=%u (INT32)\n", loader->dbnum, temp_key, intval);
         }
@@ -585,7 +571,15 @@ int load_string_entry(RDBLoader *loader, redis_db_t *db, int has_expire, uint64_
     if(has_expire)
       obj->expiry = expiry;
 
-    if (obj) {
+    if (obj && (obj->type == REDIS_STRING || obj->type == REDIS_NUMBER)) {
+        // Stored again through the db so values end up shared or inside their dict entry
+        redis_object_t *stored = obj->type == REDIS_NUMBER
+            ? redis_db_set_integer(db, temp_key, obj->ival, obj->expiry)
+            : redis_db_set_string(db, temp_key, (char *)obj->ptr, obj->expiry);
+        redis_object_destroy(obj);
+        obj = stored;
+    }
+    else if (obj) {
         hash_table_set(db->dict, temp_key, obj);
     }
 
@@ -646,7 +640,6 @@ int load_list_entry(RDBLoader *loader, redis_db_t *db)
         list_rpush(list, element);
         
         printf("  Element %u: '%s'\n", i, element);
-        free(element);
     }
 
     hash_table_set(db->dict, temp_key, list_obj);
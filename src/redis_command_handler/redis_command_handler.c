@@ -5,6 +5,8 @@
 #include <fcntl.h>
 #include <errno.h>
 #include <ctype.h>
+#include <stdint.h>
+#include <inttypes.h>
 #include <sys/stat.h>
 #include "../resp_praser/resp_parser.h"
 #include "redis_command_handler.h"
@@ -21,8 +23,12 @@
 #include "../rdb/io_buffer.h"
 #include "../channels/channel.h"
 #include "../lib/sorted_set.h"
+#include "../shards/shard.h"
+#include "../lib/sds.h"
+#include "../slowlog/slowlog.h"
+#include "../latency/latency_monitor.h"
+#include "../lib/glob.h"
 
-#define NULL_RESP_VALUE "$-1\r\n"
 #define PSYNC_RESPONSE_SIZE 1024
 #define RDB_RESPONSE_SIZE 4096
 #define RDB_DEFAULT_DIR "/tmp/redis-files"
@@ -30,224 +36,498 @@
 #define RDB_DEFAULT_FILE "dump.rdb"
 #define RESP_DEFAULT_ERROR "-ERR unknown error\r\n"
 #define RESP_MEMORY_ERROR "-ERR out of memory\r\n"
-// Global command hash table
-static hash_table_t *command_table = NULL;
+#define SCAN_DEFAULT_COUNT 10
+#define SCAN_MAX_EMPTY_FACTOR 10        // buckets one call may visit per requested item
+static int xread_get_keys(char **args, int argc, int *positions, int max_positions);
 
 // Command definitions
+// Key positions are first_key, last_key (negative counts from the end) and key_step;
+// get_keys takes over when they depend on the arguments.
 static redis_command_t commands[] = {
-    {"echo", handle_echo_command, 2, 2},
-    {"ping", handle_ping_command, 1, 2},
-    {"set", handle_set_command, 3, -1},
-    {"get", handle_get_command, 2, 2},
-    {"rpush", handle_rpush_command, 3, -1},
-    {"lpush", handle_lpush_command, 3, -1},
-    {"llen", handle_llen_command, 2, 2},
-    {"rpop", handle_rpop_command, 2, 2},
-    {"lpop", handle_lpop_command, 2, 3},
-    {"lrange", handle_lrange_command, 4, 4},
-    {"blpop", handle_blpop_command, 3, -1},
-    {"type", handle_type_command, 2, 2},
-    {"xadd", handle_xadd_command, 4, -1},
-    {"xrange", handle_xrange_command, 4, 6},
-    {"xread", handle_xread_command, 4, -1},
-    {"incr", handle_incr_command, 2, -1},
-    {"multi", handle_multi_command, 1, 1},
-    {"exec", handle_exec_command, 1, 1},
-    {"discard", handle_discard_command, 1, 1},
-    {"info", handle_info_command, 2, -1},
-    {"replconf", handle_replconf_command, 2, -1},
-    {"psync", handle_psync_command, 3, -1},
-    {"wait", handle_wait_command, 3, 3},
-    {"config", handle_config_get_command, 2, -1},
-    {"keys", handle_keys_command, 2, 2},
-    {"subscribe", handle_subscribe_command, 2, 2},
-    {"publish", handle_publish_command, 3, -1},
-    {"unsubscribe", handle_unsubscribe_command, 2, -1},
-    {"zadd", handle_zadd_command, 4, -1},
-    {"zrange", handle_zrange_command, 4, 5},
-    {"zrem", handle_zrem_command, 3, -1},
-    {"zcard", handle_zcard_command, 2, 2},
-    {"zscore", handle_zscore_command, 3, 3},
-    {"zrank", handle_zrank_command, 3, 3},
-
-    {NULL, NULL, 0, 0}};
-
-static const char *pubsub_allowed_commands[] = {
-    "subscribe",
-    "publish",
-    "unsubscribe",
-    "psubscribe",
-    "punsubscribe",
-    "ping",
-    "quit",
-    "reset",
-    NULL};
+    {"echo", handle_echo_command, 2, 2, CMD_FAST, 0, 0, 0, NULL},
+    {"ping", handle_ping_command, 1, 2, CMD_FAST | CMD_PUBSUB, 0, 0, 0, NULL},
+    {"set", handle_set_command, 3, -1, CMD_WRITE, 1, 1, 1, NULL},
+    {"get", handle_get_command, 2, 2, CMD_READONLY | CMD_FAST, 1, 1, 1, NULL},
+    {"mget", handle_mget_command, 2, -1, CMD_READONLY | CMD_FAST, 1, -1, 1, NULL},
+    {"mset", handle_mset_command, 3, -1, CMD_WRITE, 1, -1, 2, NULL},
+    {"msetnx", handle_msetnx_command, 3, -1, CMD_WRITE, 1, -1, 2, NULL},
+    {"del", handle_del_command, 2, -1, CMD_WRITE, 1, -1, 1, NULL},
+    {"unlink", handle_del_command, 2, -1, CMD_WRITE | CMD_FAST, 1, -1, 1, NULL},
+    {"exists", handle_exists_command, 2, -1, CMD_READONLY | CMD_FAST, 1, -1, 1, NULL},
+    {"rpush", handle_rpush_command, 3, -1, CMD_WRITE | CMD_FAST, 1, 1, 1, NULL},
+    {"lpush", handle_lpush_command, 3, -1, CMD_WRITE | CMD_FAST, 1, 1, 1, NULL},
+    {"llen", handle_llen_command, 2, 2, CMD_READONLY | CMD_FAST, 1, 1, 1, NULL},
+    {"rpop", handle_rpop_command, 2, 2, CMD_WRITE | CMD_FAST, 1, 1, 1, NULL},
+    {"lpop", handle_lpop_command, 2, 3, CMD_WRITE | CMD_FAST, 1, 1, 1, NULL},
+    {"lrange", handle_lrange_command, 4, 4, CMD_READONLY, 1, 1, 1, NULL},
+    {"blpop", handle_blpop_command, 3, -1, CMD_WRITE | CMD_BLOCKING, 1, -2, 1, NULL},
+    {"type", handle_type_command, 2, 2, CMD_READONLY | CMD_FAST, 1, 1, 1, NULL},
+    {"xadd", handle_xadd_command, 4, -1, CMD_WRITE | CMD_FAST, 1, 1, 1, NULL},
+    {"xrange", handle_xrange_command, 4, 6, CMD_READONLY, 1, 1, 1, NULL},
+    {"xread", handle_xread_command, 4, -1, CMD_READONLY | CMD_BLOCKING, 0, 0, 0, xread_get_keys},
+    {"incr", handle_incr_command, 2, 2, CMD_WRITE | CMD_FAST, 1, 1, 1, NULL},
+    {"decr", handle_decr_command, 2, 2, CMD_WRITE | CMD_FAST, 1, 1, 1, NULL},
+    {"incrby", handle_incrby_command, 3, 3, CMD_WRITE | CMD_FAST, 1, 1, 1, NULL},
+    {"decrby", handle_decrby_command, 3, 3, CMD_WRITE | CMD_FAST, 1, 1, 1, NULL},
+    {"incrbyfloat", handle_incrbyfloat_command, 3, 3, CMD_WRITE | CMD_FAST, 1, 1, 1, NULL},
+    {"multi", handle_multi_command, 1, 1, CMD_NO_MULTI | CMD_FAST, 0, 0, 0, NULL},
+    {"exec", handle_exec_command, 1, 1, CMD_NO_MULTI, 0, 0, 0, NULL},
+    {"discard", handle_discard_command, 1, 1, CMD_NO_MULTI | CMD_FAST, 0, 0, 0, NULL},
+    {"watch", handle_watch_command, 2, -1, CMD_NO_MULTI | CMD_FAST, 1, -1, 1, NULL},
+    {"unwatch", handle_unwatch_command, 1, 1, CMD_FAST, 0, 0, 0, NULL},
+    {"info", handle_info_command, 1, -1, 0, 0, 0, 0, NULL},
+    {"replconf", handle_replconf_command, 2, -1, CMD_REPLICATION, 0, 0, 0, NULL},
+    {"psync", handle_psync_command, 3, -1, CMD_REPLICATION, 0, 0, 0, NULL},
+    {"wait", handle_wait_command, 3, 3, CMD_BLOCKING, 0, 0, 0, NULL},
+    {"config", handle_config_get_command, 2, -1, 0, 0, 0, 0, NULL},
+    {"keys", handle_keys_command, 2, 2, CMD_READONLY | CMD_FANOUT_CONCAT, 0, 0, 0, NULL},
+    {"scan", handle_scan_command, 2, -1, CMD_READONLY, 0, 0, 0, NULL},
+    {"zscan", handle_zscan_command, 3, -1, CMD_READONLY, 1, 1, 1, NULL},
+    {"subscribe", handle_subscribe_command, 2, 2, CMD_PUBSUB, 0, 0, 0, NULL},
+    {"publish", handle_publish_command, 3, -1, CMD_PUBSUB | CMD_FAST | CMD_FANOUT_SUM, 0, 0, 0, NULL},
+    {"unsubscribe", handle_unsubscribe_command, 2, -1, CMD_PUBSUB, 0, 0, 0, NULL},
+    {"psubscribe", handle_psubscribe_command, 2, -1, CMD_PUBSUB, 0, 0, 0, NULL},
+    {"punsubscribe", handle_punsubscribe_command, 1, -1, CMD_PUBSUB, 0, 0, 0, NULL},
+    {"zadd", handle_zadd_command, 4, -1, CMD_WRITE | CMD_FAST, 1, 1, 1, NULL},
+    {"zrange", handle_zrange_command, 4, 5, CMD_READONLY, 1, 1, 1, NULL},
+    {"zrem", handle_zrem_command, 3, -1, CMD_WRITE | CMD_FAST, 1, 1, 1, NULL},
+    {"zcard", handle_zcard_command, 2, 2, CMD_READONLY | CMD_FAST, 1, 1, 1, NULL},
+    {"zscore", handle_zscore_command, 3, 3, CMD_READONLY | CMD_FAST, 1, 1, 1, NULL},
+    {"zrank", handle_zrank_command, 3, 3, CMD_READONLY | CMD_FAST, 1, 1, 1, NULL},
+    {"slowlog", handle_slowlog_command, 2, 3, 0, 0, 0, 0, NULL},
+    {"latency", handle_latency_command, 2, -1, 0, 0, 0, 0, NULL},
+
+    {NULL, NULL, 0, 0, 0, 0, 0, 0, NULL}};
+
+/*
+ * Command lookup is a perfect hash over the names above: init_command_table()
+ * searches for a seed under which no two names share a slot, so a lookup is
+ * one hash of the name plus a single strcasecmp to reject unknown commands.
+ */
+#define COMMAND_HASH_SLOTS 512      // power of two, keep it well above 8x the command count
+static redis_command_t *command_slots[COMMAND_HASH_SLOTS];
+static uint32_t command_hash_seed;
+static int command_table_ready;
+
+// FNV-1a over the name with ASCII letters folded to lower case
+static uint32_t command_hash(const char *name, uint32_t seed)
+{
+    uint32_t hash = 2166136261u ^ (seed * 2654435761u);
+    for (const unsigned char *p = (const unsigned char *)name; *p; p++)
+    {
+        hash ^= *p | 0x20;
+        hash *= 16777619u;
+    }
+    return hash & (COMMAND_HASH_SLOTS - 1);
+}
 
 void init_command_table(void)
 {
-    if (command_table != NULL)
+    if (command_table_ready)
         return;
 
-    command_table = hash_table_create(32);
-
-    for (int i = 0; commands[i].name != NULL; i++)
+    for (uint32_t seed = 0;; seed++)
     {
-        hash_table_set(command_table, commands[i].name, &commands[i]);
+        memset(command_slots, 0, sizeof(command_slots));
 
-        char *lower = strdup(commands[i].name);
-        for (char *p = lower; *p; p++)
+        int i;
+        for (i = 0; commands[i].name != NULL; i++)
         {
-            *p = tolower(*p);
+            uint32_t slot = command_hash(commands[i].name, seed);
+            if (command_slots[slot])
+                break;
+            command_slots[slot] = &commands[i];
+        }
+
+        if (commands[i].name == NULL)
+        {
+            command_hash_seed = seed;
+            break;
         }
-        hash_table_set(command_table, lower, &commands[i]);
-        free(lower);
     }
+    command_table_ready = 1;
 }
 
-static int extract_timeout(char *timeout);
-static char *build_xread_response_for_blocked_client(redis_server_t *server, client_t *client, const char *stream_key, const char *new_id);
-static void add_command_to_transaction(redis_server_t *server, char *buffer, char **args, int argc, void *client);
-
-static int create_rdb_snapshot(redis_db_t *db);
-static int send_rdb_file_to_client(int client_fd, const char *rdb_path);
-static long get_file_size_stat(const char *filepath);
-static int rename_rdb_file(const char *temp_path, const char *main_path);
-int add_replica(redis_server_t *server, int replica_fd);
-static int is_pubsub_command(const char *command);
-// Parse all arguments into an array
-static char **parse_command_args(resp_buffer_t *resp_buffer, int *argc)
+redis_command_t *lookup_command(const char *name)
 {
-    char *array_count = parse_resp_array(resp_buffer);
-    if (!array_count)
-        return NULL;
+    redis_command_t *cmd = command_slots[command_hash(name, command_hash_seed)];
+    return cmd && strcasecmp(cmd->name, name) == 0 ? cmd : NULL;
+}
 
-    *argc = atoi(array_count);
-    free(array_count);
+#define COMMAND_COUNT (sizeof(commands) / sizeof(commands[0]) - 1)
 
-    if (*argc <= 0)
-        return NULL;
+command_stats_t *command_stats_create(void)
+{
+    return calloc(COMMAND_COUNT, sizeof(command_stats_t));
+}
 
-    char **args = calloc(*argc, sizeof(char *));
-    if (!args)
-        return NULL;
+void command_stats_reset(command_stats_t *stats)
+{
+    if (stats)
+        memset(stats, 0, COMMAND_COUNT * sizeof(command_stats_t));
+}
+
+static void command_stats_reject(redis_server_t *server, redis_command_t *cmd)
+{
+    if (server->command_stats)
+        server->command_stats[cmd - commands].rejected_calls++;
+}
 
-    for (int i = 0; i < *argc; i++)
+// XREAD [COUNT n] [BLOCK ms] STREAMS key [key ...] id [id ...]
+static int xread_get_keys(char **args, int argc, int *positions, int max_positions)
+{
+    for (int i = 1; i < argc; i++)
     {
-        args[i] = parse_resp_array(resp_buffer);
-        if (!args[i])
+        if (strcasecmp(args[i], "streams") == 0)
         {
-            for (int j = 0; j < i; j++)
+            int num_keys = (argc - i - 1) / 2;
+            if (num_keys > max_positions)
+                return -1;
+            for (int k = 0; k < num_keys; k++)
             {
-                free(args[j]);
+                positions[k] = i + 1 + k;
             }
-            free(args);
-            return NULL;
+            return num_keys;
         }
     }
+    return 0;
+}
 
-    return args;
+/*
+ * Fill positions with the argument indexes holding keys. Returns the number
+ * of keys, or -1 if there are more than max_positions.
+ */
+int get_command_keys(redis_command_t *cmd, char **args, int argc, int *positions, int max_positions)
+{
+    if (cmd->get_keys)
+        return cmd->get_keys(args, argc, positions, max_positions);
+
+    if (cmd->first_key <= 0)
+        return 0;
+
+    int count = 0;
+    int last = cmd->last_key < 0 ? argc + cmd->last_key : cmd->last_key;
+    if (last >= argc)
+        last = argc - 1;
+    for (int i = cmd->first_key; i <= last; i += cmd->key_step)
+    {
+        if (count == max_positions)
+            return -1;
+        positions[count++] = i;
+    }
+    return count;
 }
 
-static void free_command_args(char **args, int argc)
+/*
+ * Prefetches the dict entries of the keys of the next commands in a
+ * pipeline, up to HASH_TABLE_PREFETCH_MAX keys. Returns how many of the
+ * commands were covered, at least one when count > 0. The keys and their
+ * hashes stay in server->prefetched_keys for the lookups of the commands.
+ */
+int prefetch_command_keys(redis_server_t *server, parsed_command_t *cmds, int count)
 {
-    if (!args) return;
-    
-    for (int i = 0; i < argc; i++)
+    uint64_t hashes[HASH_TABLE_PREFETCH_MAX];
+    int positions[COMMAND_MAX_KEYS];
+    int num_keys = 0;
+    int covered = 0;
+
+    for (; covered < count; covered++)
     {
-        if (args[i]) {
-            free(args[i]);
-            args[i] = NULL;
+        parsed_command_t *parsed = &cmds[covered];
+        redis_command_t *cmd = parsed->args && parsed->argc > 0 ? lookup_command(parsed->args[0]) : NULL;
+        if (!cmd || !cmd->first_key)
+            continue;
+
+        int n = get_command_keys(cmd, parsed->args, parsed->argc, positions, COMMAND_MAX_KEYS);
+        if (n > 0 && num_keys > 0 && num_keys + n > HASH_TABLE_PREFETCH_MAX)
+            break;
+        for (int i = 0; i < n && num_keys < HASH_TABLE_PREFETCH_MAX; i++)
+        {
+            prefetched_key_t *pk = &server->prefetched_keys[num_keys];
+            pk->key = parsed->args[positions[i]];
+            pk->hash = hashes[num_keys++] = hash_table_hash_key(pk->key);
+            pk->command = covered;
         }
     }
-    free(args);
+
+    server->prefetched_keys_count = num_keys;
+    hash_table_prefetch(server->db->dict, hashes, num_keys);
+    return covered;
 }
 
-char *handle_command(redis_server_t *server, char *buffer, void *client)
+// key's dict hash, taken from the pipeline prefetch when key is an argument of the running command
+static uint64_t key_hash(redis_server_t *server, const char *key)
 {
-     if (!server || !buffer)
-        return NULL;
+    if (server->running_prefetched >= 0)
+    {
+        for (int i = 0; i < server->prefetched_keys_count; i++)
+        {
+            prefetched_key_t *pk = &server->prefetched_keys[i];
+            if (pk->key == key && pk->command == server->running_prefetched)
+                return pk->hash;
+        }
+    }
+    return hash_table_hash_key(key);
+}
 
-    client_t *c = (client_t *)client;
+// Hash up to HASH_TABLE_PREFETCH_MAX of keys into hashes and prefetch their entries; returns how many
+static int prefetch_keys(redis_server_t *server, char **keys, int count, uint64_t *hashes)
+{
+    if (count > HASH_TABLE_PREFETCH_MAX)
+        count = HASH_TABLE_PREFETCH_MAX;
+    for (int i = 0; i < count; i++)
+    {
+        hashes[i] = key_hash(server, keys[i]);
+    }
+    hash_table_prefetch(server->db->dict, hashes, count);
+    return count;
+}
 
-    resp_buffer_t *resp_buffer = calloc(1, sizeof(resp_buffer_t));
-    if (!resp_buffer)
-        return NULL;
+static int extract_timeout(char *timeout);
+static void add_reply_stream_entry(client_t *client, stream_entry_t *entry);
+static int queue_transaction_command(client_t *c, redis_command_t *cmd, char *buffer, size_t len, char **args, int argc);
+static char *call_command(redis_server_t *server, redis_command_t *cmd, char *buffer, size_t len, char **args, int argc, client_t *c);
+static int watched_keys_expired(redis_server_t *server, client_t *c);
+static void block_timed_out(redis_server_t *server, client_t *client);
 
-    resp_buffer->buffer = buffer;
-    resp_buffer->size = strlen(buffer);
-    resp_buffer->pos = 0;
+static int create_rdb_snapshot(redis_db_t *db);
+static int send_rdb_file_to_client(int client_fd, const char *rdb_path);
+static long get_file_size_stat(const char *filepath);
+static int rename_rdb_file(const char *temp_path, const char *main_path);
+int add_replica(redis_server_t *server, int replica_fd);
+// Arguments come from resp_parser_argv(), a single block
+void free_command_args(char **args, int argc)
+{
+    (void)argc;
+    free(args);
+}
 
-    int argc;
-    char **args = parse_command_args(resp_buffer, &argc);
-    if (!args || argc < 1)
+/*
+ * Parse one complete RESP command frame into an argument array. Touches no
+ * server state, so I/O threads can call it for their clients.
+ */
+char **parse_command(char *buffer, size_t len, int *argc)
+{
+    resp_parser_t parser;
+    resp_parser_init(&parser);
+
+    char **args = NULL;
+    *argc = 0;
+    if (resp_parser_feed(&parser, buffer, len) == RESP_PARSE_OK)
     {
-        free(resp_buffer);
-        return strdup("-ERR protocol error\r\n");
+        args = resp_parser_argv(&parser);
+        *argc = args ? parser.argi : 0;
     }
+    resp_parser_free(&parser);
+    return args;
+}
+
+char *handle_command(redis_server_t *server, char *buffer, size_t len, void *client)
+{
+     if (!server || !buffer)
+        return NULL;
 
-    char *cmd_lower = strdup(args[0]);
-    for (char *p = cmd_lower; *p; p++)
+    int argc;
+    char **args = parse_command(buffer, len, &argc);
+    if (!args)
     {
-        *p = tolower(*p);
+        return strdup("-ERR protocol error\r\n");
     }
-
-    if (c && c->is_queued &&
-        strcmp(cmd_lower, "exec") != 0 &&
-        strcmp(cmd_lower, "discard") != 0 &&
-        strcmp(cmd_lower, "multi") != 0)
+    if (argc == 0)
     {
-        // Queue the command instead of executing
-        add_command_to_transaction(server, buffer, args, argc, client);
-        free(cmd_lower);
+        // An empty "*0" command does nothing
         free_command_args(args, argc);
-        free(resp_buffer);
-        return strdup("+QUEUED\r\n");
+        return NULL;
     }
 
-    // Look up and execute command normally...
-    redis_command_t *cmd = (redis_command_t *)hash_table_get(command_table, cmd_lower);
+    char *response = handle_parsed_command(server, buffer, len, args, argc, client);
+    free_command_args(args, argc);
+    return response;
+}
+
+// Execute an already parsed command; buffer/len is its raw frame. The caller keeps ownership of args.
+char *handle_parsed_command(redis_server_t *server, char *buffer, size_t len, char **args, int argc, void *client)
+{
+    client_t *c = (client_t *)client;
+    redis_command_t *cmd = lookup_command(args[0]);
 
     if (!cmd)
     {
-        char response[256];
-        sprintf(response, "-ERR unknown command '%s'\r\n", args[0]);
-        free_command_args(args, argc);
-        free(resp_buffer);
-        return strdup(response);
+        // A transaction with a command that could not be queued is refused as a whole by EXEC
+        if (c && c->is_queued)
+            c->txn_dirty = 1;
+        // The name is the client's bytes: cut it short and blank control bytes so it stays one line
+        char name[129];
+        size_t name_len = 0;
+        for (; args[0][name_len] && name_len < sizeof(name) - 1; name_len++)
+            name[name_len] = (unsigned char)args[0][name_len] < ' ' ? ' ' : args[0][name_len];
+        name[name_len] = '\0';
+
+        char msg[sizeof(name) + 32];
+        snprintf(msg, sizeof(msg), "ERR unknown command '%s'", name);
+        client_add_reply_error(c, msg);
+        return NULL;
     }
 
     // Validate argument count
     if (argc < cmd->min_args || (cmd->max_args != -1 && argc > cmd->max_args))
     {
+        if (c && c->is_queued)
+            c->txn_dirty = 1;
+        command_stats_reject(server, cmd);
         char response[256];
         sprintf(response, "-ERR wrong number of arguments for '%s' command\r\n", cmd->name);
-        free_command_args(args, argc);
-        free(resp_buffer);
         return strdup(response);
     }
-    if (c && c->sub_mode)
+
+    if (c && c->is_queued && !(cmd->flags & CMD_NO_MULTI))
     {
-        if (!is_pubsub_command(cmd_lower))
+        if (server->shard)
         {
-            char response[256];
-            snprintf(response, sizeof(response),
-                     "-ERR Can't execute '%s': only (P|S)SUBSCRIBE / (P|S)UNSUBSCRIBE / PING / QUIT / RESET are allowed in this context\r\n",
-                     args[0]);
+            char *error = shard_check_queued_command(server, c, cmd, args, argc);
+            if (error)
+            {
+                c->txn_dirty = 1;
+                return error;
+            }
+        }
 
-            free_command_args(args, argc);
-            free(resp_buffer);
-            return strdup(response);
+        // Queue the command instead of executing
+        if (queue_transaction_command(c, cmd, buffer, len, args, argc) < 0)
+        {
+            c->txn_dirty = 1;
+            client_add_reply_shared(c, &shared_replies.oom);
+            return NULL;
         }
+        client_add_reply_shared(c, &shared_replies.queued);
+        return NULL;
+    }
+
+    if (c && c->sub_mode && !(cmd->flags & CMD_PUBSUB))
+    {
+        command_stats_reject(server, cmd);
+        char response[256];
+        snprintf(response, sizeof(response),
+                 "-ERR Can't execute '%s': only (P|S)SUBSCRIBE / (P|S)UNSUBSCRIBE / PING / QUIT / RESET are allowed in this context\r\n",
+                 args[0]);
+        return strdup(response);
+    }
+
+    char *response;
+    if (server->shard && c && shard_route_command(server, cmd, buffer, len, args, argc, c, &response))
+    {
+        // Runs (or was refused) elsewhere; a NULL response means the reply comes later
+        return response;
+    }
+
+    return call_command(server, cmd, buffer, len, args, argc, c);
+}
+
+// Writes invalidate WATCH by their key specs, whether or not the value actually changed
+static void touch_command_keys(redis_server_t *server, redis_command_t *cmd, char **args, int argc)
+{
+    // Keys are distinct argument indexes, so argc positions always fit them all
+    int stack_positions[COMMAND_MAX_KEYS];
+    int *positions = stack_positions;
+    if (argc > COMMAND_MAX_KEYS)
+        positions = malloc(sizeof(int) * argc);
+
+    if (!positions)
+    {
+        // Out of memory: touching every argument over-invalidates but never misses a key
+        for (int i = 1; i < argc; i++)
+            touch_watched_key(server, args[i]);
+        return;
+    }
+
+    int count = get_command_keys(cmd, args, argc, positions, argc > COMMAND_MAX_KEYS ? argc : COMMAND_MAX_KEYS);
+    for (int i = 0; i < count; i++)
+    {
+        touch_watched_key(server, args[positions[i]]);
+    }
+    if (positions != stack_positions)
+        free(positions);
+}
+
+// Run a resolved and checked command: time it, then hand its writes to the replicas
+static char *call_command(redis_server_t *server, redis_command_t *cmd, char *buffer, size_t len, char **args, int argc, client_t *c)
+{
+    // EXEC nests back in here for every queued command
+    int outer_rewritten = server->propagate_rewritten;
+    server->propagate_rewritten = 0;
+
+    uint64_t start_ns = latency_now_ns();
+    char *response = cmd->handler(server, args, argc, c);
+    uint64_t duration_ns = latency_now_ns() - start_ns;
+
+    if (server->command_stats)
+    {
+        command_stats_t *stats = &server->command_stats[cmd - commands];
+        stats->calls++;
+        stats->total_ns += duration_ns;
+        if (duration_ns > stats->max_ns)
+            stats->max_ns = duration_ns;
+        latency_histogram_record(&stats->latency, duration_ns);
+    }
+    slowlog_push_if_needed(server->slowlog, args, argc, (long long)(duration_ns / 1000), c ? c->fd : -1);
+    latency_monitor_add_sample(server->latency_monitor,
+                               (cmd->flags & CMD_FAST) ? LATENCY_EVENT_FAST_COMMAND : LATENCY_EVENT_COMMAND,
+                               duration_ns);
+
+    // Replicas get every write that ran, in execution order; a blocked command has not run yet
+    if ((cmd->flags & CMD_WRITE) && !(c && c->is_blocked))
+    {
+        if (!server->propagate_rewritten)
+            propagate_command(server, buffer, len);
+        if (server->watched_keys && server->watched_keys->count > 0)
+            touch_command_keys(server, cmd, args, argc);
+    }
+    propagate_pending(server);
+    server->propagate_rewritten = outer_rewritten;
+
+    // Nothing can wake a client inside EXEC: a command that would block times out at once, as in Redis
+    if ((cmd->flags & CMD_BLOCKING) && c && c->in_exec && c->is_blocked)
+    {
+        block_timed_out(server, c);
+        client_add_reply_null_array(c);
     }
 
-    char *response = cmd->handler(server, args, argc, client);
-    free(cmd_lower);
-    free_command_args(args, argc);
-    free(resp_buffer);
-    
     return response;
 }
 // For BLPOP - timeout is in seconds (can be fractional)
+/* Timer callback armed by BLPOP and XREAD BLOCK: replies nil and unblocks the client */
+static long long handle_block_timeout(event_loop_t *loop, event_timer_t *timer, void *data)
+{
+    (void)timer;
+    redis_server_t *server = (redis_server_t *)loop->server_data;
+    client_t *client = (client_t *)data;
+
+    // the loop frees the timer once we return
+    client->block_timer = NULL;
+    printf("Client fd=%d timed out\n", client->fd);
+
+    const char *nil_response = "*-1\r\n";
+    reply_to_client(server, client, nil_response, strlen(nil_response));
+
+    block_timed_out(server, client);
+    queue_unblocked_client(server, client);
+    return EVENT_TIMER_NOMORE;
+}
+
+// Drop a blocked BLPOP or XREAD BLOCK without serving it; the caller sends the nil reply
+static void block_timed_out(redis_server_t *server, client_t *client)
+{
+    if (client->stream_block)
+    {
+        client_unblock_stream(client);
+    }
+    else
+    {
+        client_unblock(client);
+    }
+    remove_client_from_list(server->blocked_clients, client);
+}
+
 static long long extract_blpop_timeout_ms(char *timeout_str)
 {
     double timeout_seconds = atof(timeout_str);
@@ -279,6 +559,7 @@ static void check_blocked_clients_for_key(redis_server_t *server, const char *ke
     if (!server || !server->blocked_clients || !key)
         return;
 
+    uint64_t scan_start = latency_monitor_start(server->latency_monitor);
     list_node_t *node = server->blocked_clients->head;
     while (node)
     {
@@ -301,30 +582,36 @@ static void check_blocked_clients_for_key(redis_server_t *server, const char *ke
 
                     if (value)
                     {
-                        char response[1024];
-                        snprintf(response, sizeof(response),
-                                 "*2\r\n$%zu\r\n%s\r\n$%zu\r\n%s\r\n",
-                                 strlen(key), key, strlen(value), value);
-                        send(blocked_client->fd, response, strlen(response), MSG_NOSIGNAL);
+                        // Replicas have no blocked clients: they see the pop after the push
+                        char *lpop_args[2] = {"LPOP", (char *)key};
+                        propagate_also(server, lpop_args, 2);
+                        touch_watched_key(server, key);
+
+                        if (client_accepts_replies(blocked_client))
+                        {
+                            client_add_reply_array_len(blocked_client, 2);
+                            client_add_reply_bulk_cstr(blocked_client, key);
+                            client_add_reply_bulk_cstr(blocked_client, value);
+                            reply_added(server, blocked_client);
+                        }
 
                         // Unblock client
                         client_unblock(blocked_client);
                         remove_client_from_list(server->blocked_clients, blocked_client);
+                        queue_unblocked_client(server, blocked_client);
 
                         free(value);
-
-                        printf("Unblocked client fd=%d with data from key '%s'\n",
-                               blocked_client->fd, key);
                     }
                 }
             }
-            if (obj && obj->type == REDIS_STREAM)
+            if (obj && obj->type == REDIS_STREAM && notify)
             {
-                send(blocked_client->fd, notify, strlen(notify), MSG_NOSIGNAL);
+                reply_to_client(server, blocked_client, notify, strlen(notify));
             }
         }
         node = next;
     }
+    latency_monitor_end(server->latency_monitor, LATENCY_EVENT_BLOCKED_SCAN, scan_start);
 }
 
 static void check_blocked_clients_for_stream(redis_server_t *server, const char *key, const char *new_id)
@@ -335,6 +622,15 @@ static void check_blocked_clients_for_stream(redis_server_t *server, const char
     printf("check_blocked_clients_for_stream: key='%s', new_id='%s', blocked_clients=%zu\n",
            key, new_id, list_length(server->blocked_clients));
 
+    redis_object_t *obj = (redis_object_t *)hash_table_get(server->db->dict, key);
+    if (!obj || obj->type != REDIS_STREAM)
+        return;
+    stream_entry_t *entry = (stream_entry_t *)radix_search(((redis_stream_t *)obj->ptr)->entries_tree,
+                                                           (char *)new_id, strlen(new_id));
+    if (!entry)
+        return;
+
+    uint64_t scan_start = latency_monitor_start(server->latency_monitor);
     list_node_t *node = server->blocked_clients->head;
     while (node)
     {
@@ -355,41 +651,35 @@ static void check_blocked_clients_for_stream(redis_server_t *server, const char
 
                 if (strcmp(blocked_client->xread_streams[i], key) == 0)
                 {
-                    printf("Found matching stream! Building response...\n");
-
-                    char *response = build_xread_response_for_blocked_client(server, blocked_client, key, new_id);
-                    if (response)
-                    {
-                        printf("Sending response to client fd=%d: %.100s...\n",
-                               blocked_client->fd, response);
-
-                        send(blocked_client->fd, response, strlen(response), MSG_NOSIGNAL);
-
-                        client_unblock_stream(blocked_client);
-                        remove_client_from_list(server->blocked_clients, blocked_client);
-
-                        free(response);
-                        printf("Unblocked XREAD client fd=%d with new entry from stream '%s'\n",
-                               blocked_client->fd, key);
-                    }
-                    else
+                    // [[key, [entry]]]: just this stream and its new entry
+                    if (client_accepts_replies(blocked_client))
                     {
-                        printf("Failed to build response for client fd=%d\n", blocked_client->fd);
+                        client_add_reply_array_len(blocked_client, 1);
+                        client_add_reply_array_len(blocked_client, 2);
+                        client_add_reply_bulk_cstr(blocked_client, key);
+                        client_add_reply_array_len(blocked_client, 1);
+                        add_reply_stream_entry(blocked_client, entry);
+                        reply_added(server, blocked_client);
                     }
+
+                    client_unblock_stream(blocked_client);
+                    remove_client_from_list(server->blocked_clients, blocked_client);
+                    queue_unblocked_client(server, blocked_client);
                     break;
                 }
             }
         }
         node = next;
     }
+    latency_monitor_end(server->latency_monitor, LATENCY_EVENT_BLOCKED_SCAN, scan_start);
 }
 
 char *handle_echo_command(redis_server_t *server, char **args, int argc, void *client)
 {
     (void)server;
-    (void)client;
     (void)argc;
-    return encode_bulk_string(args[1]);
+    client_add_reply_bulk_cstr(client, args[1]);
+    return NULL;
 }
 
 char *handle_ping_command(redis_server_t *server, char **args, int argc, void *client)
@@ -398,116 +688,233 @@ char *handle_ping_command(redis_server_t *server, char **args, int argc, void *c
     client_t *c = (client_t *)client;
     if (c && c->sub_mode)
     {
-        char **response_args = malloc(2 * sizeof(char *));
-        if (!response_args)
-        {
-            return strdup("-ERR out of memory\r\n");
-        }
+        client_add_reply_array_len(c, 2);
+        client_add_reply_bulk(c, "pong", 4);
+        client_add_reply_bulk(c, "", 0);
+        return NULL;
+    }
 
-        response_args[0] = strdup("pong");
-        response_args[1] = strdup("");
-        char *result = encode_resp_array(response_args, 2);
+    if (argc == 2)
+    {
+        client_add_reply_bulk_cstr(c, args[1]);
+        return NULL;
+    }
 
-        free(response_args[0]);
-        free(response_args[1]);
-        free(response_args);
+    client_add_reply_shared(c, &shared_replies.pong);
+    return NULL;
+}
 
-        return result;
+// The live object stored at key; an expired one is deleted on the way and reported missing
+static redis_object_t *lookup_key_hashed(redis_server_t *server, const char *key, uint64_t hash)
+{
+    redis_object_t *obj = (redis_object_t *)hash_table_get_hashed(server->db->dict, key, hash);
+    if (obj && is_expired(obj))
+    {
+        redis_object_destroy(obj);
+        hash_table_delete_hashed(server->db->dict, key, hash);
+        touch_watched_key(server, key);
+        return NULL;
     }
+    return obj;
+}
 
-    if (argc == 2)
+static redis_object_t *lookup_key(redis_server_t *server, const char *key)
+{
+    return lookup_key_hashed(server, key, key_hash(server, key));
+}
+
+// Bulk reply with a string's bytes; numbers are formatted straight from the stored value
+static void add_reply_string_object(void *client, redis_object_t *obj)
+{
+    if (obj->encoding == REDIS_ENCODING_INT)
     {
-        return encode_bulk_string(args[1]);
+        char buf[20];
+        client_add_reply_bulk(client, buf, ll_to_str(buf, obj->ival));
+        return;
     }
-
-    return encode_simple_string("PONG");
+    client_add_reply_bulk(client, (char *)obj->ptr, obj->len);
 }
 
+// SET key value [EX seconds | PX milliseconds | KEEPTTL]
 char *handle_set_command(redis_server_t *server, char **args, int argc, void *client)
 {
-    (void)client;
     char *key = args[1];
     char *value = args[2];
-    char *expiry_ms = NULL;
+    long long expiry_ms = -1;
+    int keep_ttl = 0;
 
     int i = 3;
     while (i < argc)
     {
-        if (strcasecmp(args[i], "px") == 0 && i + 1 < argc)
+        if (strcasecmp(args[i], "px") == 0 && i + 1 < argc && expiry_ms < 0 && !keep_ttl)
         {
-            expiry_ms = args[i + 1];
+            expiry_ms = atoll(args[i + 1]);
             i += 2;
         }
-        else if (strcasecmp(args[i], "ex") == 0 && i + 1 < argc)
+        else if (strcasecmp(args[i], "ex") == 0 && i + 1 < argc && expiry_ms < 0 && !keep_ttl)
         {
-            int seconds = atoi(args[i + 1]);
-            char ms_buf[32];
-            sprintf(ms_buf, "%d", seconds * 1000);
-            expiry_ms = ms_buf;
+            expiry_ms = atoll(args[i + 1]) * 1000;
             i += 2;
         }
+        else if (strcasecmp(args[i], "keepttl") == 0 && expiry_ms < 0)
+        {
+            keep_ttl = 1;
+            i++;
+        }
         else
         {
-            return strdup("-ERR syntax error\r\n");
+            client_add_reply_shared(client, &shared_replies.syntax_error);
+            return NULL;
         }
     }
 
-    // Check if key already exists and free it
-    redis_object_t *existing_obj = (redis_object_t *)hash_table_get(server->db->dict, key);
-    if (existing_obj) {
-        redis_object_destroy(existing_obj);
+    long long expiry = 0;
+    if (expiry_ms >= 0)
+    {
+        expiry = get_current_time_ms() + expiry_ms;
     }
-
-    redis_object_t *obj;
-    if (isInteger(value))
-        obj = redis_object_create_number(value);
-    else
-        obj = redis_object_create_string(value);
-
-    if (!obj) {
-        return strdup("-ERR out of memory\r\n");
+    else if (keep_ttl)
+    {
+        redis_object_t *existing = lookup_key(server, key);
+        expiry = existing ? existing->expiry : 0;
     }
 
-    if (expiry_ms)
-    {
-        set_expiry_ms(obj, atoi(expiry_ms));
+    if (!redis_db_set_string(server->db, key, value, expiry)) {
+        client_add_reply_shared(client, &shared_replies.oom);
+        return NULL;
     }
 
-    /* hash_table_set duplicates key internally; no need to strdup here */
-    hash_table_set(server->db->dict, key, obj);
-    return encode_simple_string("OK");
+    client_add_reply_shared(client, &shared_replies.ok);
+    return NULL;
 }
 
 char *handle_get_command(redis_server_t *server, char **args, int argc, void *client)
 {
     (void)argc;
-    (void)client;
-    char *key = args[1];
-    redis_object_t *obj = (redis_object_t *)hash_table_get(server->db->dict, key);
+    redis_object_t *obj = lookup_key(server, args[1]);
 
     if (!obj)
     {
-        return strdup(NULL_RESP_VALUE);
+        client_add_reply_null(client);
+        return NULL;
+    }
+
+    if (obj->type != REDIS_STRING && obj->type != REDIS_NUMBER)
+    {
+        client_add_reply_shared(client, &shared_replies.wrongtype);
+        return NULL;
     }
 
-    if (is_expired(obj))
+    add_reply_string_object(client, obj);
+    return NULL;
+}
+
+// MGET key [key ...]: one array reply, nil for missing keys and non-strings; keys are prefetched in windows
+char *handle_mget_command(redis_server_t *server, char **args, int argc, void *client)
+{
+    uint64_t hashes[HASH_TABLE_PREFETCH_MAX];
+    client_add_reply_array_len(client, argc - 1);
+    for (int i = 1; i < argc; i++)
     {
-        redis_object_destroy(obj);
-        hash_table_delete(server->db->dict, key);
-        return strdup(NULL_RESP_VALUE);
+        if ((i - 1) % HASH_TABLE_PREFETCH_MAX == 0)
+            prefetch_keys(server, args + i, argc - i, hashes);
+        redis_object_t *obj = lookup_key_hashed(server, args[i], hashes[(i - 1) % HASH_TABLE_PREFETCH_MAX]);
+        if (obj && (obj->type == REDIS_STRING || obj->type == REDIS_NUMBER))
+            add_reply_string_object(client, obj);
+        else
+            client_add_reply_null(client);
     }
+    return NULL;
+}
 
-    if (obj->type != REDIS_STRING && obj->type != REDIS_NUMBER)
+// MSET key value [key value ...]
+char *handle_mset_command(redis_server_t *server, char **args, int argc, void *client)
+{
+    if (argc % 2 == 0)
+    {
+        return strdup("-ERR wrong number of arguments for 'mset' command\r\n");
+    }
+
+    for (int i = 1; i < argc; i += 2)
+    {
+        if (!redis_db_set_string(server->db, args[i], args[i + 1], 0))
+        {
+            client_add_reply_shared(client, &shared_replies.oom);
+            return NULL;
+        }
+    }
+    client_add_reply_shared(client, &shared_replies.ok);
+    return NULL;
+}
+
+// MSETNX key value [key value ...]: sets all the keys, or none if any of them exists
+char *handle_msetnx_command(redis_server_t *server, char **args, int argc, void *client)
+{
+    if (argc % 2 == 0)
+    {
+        return strdup("-ERR wrong number of arguments for 'msetnx' command\r\n");
+    }
+
+    for (int i = 1; i < argc; i += 2)
+    {
+        if (lookup_key(server, args[i]))
+        {
+            client_add_reply_shared(client, &shared_replies.czero);
+            return NULL;
+        }
+    }
+    for (int i = 1; i < argc; i += 2)
+    {
+        if (!redis_db_set_string(server->db, args[i], args[i + 1], 0))
+        {
+            client_add_reply_shared(client, &shared_replies.oom);
+            return NULL;
+        }
+    }
+    client_add_reply_shared(client, &shared_replies.cone);
+    return NULL;
+}
+
+// DEL key [key ...]; UNLINK shares it, values are freed in line either way
+char *handle_del_command(redis_server_t *server, char **args, int argc, void *client)
+{
+    uint64_t hashes[HASH_TABLE_PREFETCH_MAX];
+    long long deleted = 0;
+    for (int i = 1; i < argc; i++)
     {
-        return strdup("-WRONGTYPE Operation against a key holding the wrong kind of value\r\n");
+        if ((i - 1) % HASH_TABLE_PREFETCH_MAX == 0)
+            prefetch_keys(server, args + i, argc - i, hashes);
+        uint64_t hash = hashes[(i - 1) % HASH_TABLE_PREFETCH_MAX];
+        redis_object_t *obj = lookup_key_hashed(server, args[i], hash);
+        if (obj)
+        {
+            redis_object_destroy(obj);
+            hash_table_delete_hashed(server->db->dict, args[i], hash);
+            deleted++;
+        }
     }
+    client_add_reply_integer(client, deleted);
+    return NULL;
+}
 
-    return encode_bulk_string((char *)obj->ptr);
+// EXISTS key [key ...]: a key named twice is counted twice
+char *handle_exists_command(redis_server_t *server, char **args, int argc, void *client)
+{
+    uint64_t hashes[HASH_TABLE_PREFETCH_MAX];
+    long long found = 0;
+    for (int i = 1; i < argc; i++)
+    {
+        if ((i - 1) % HASH_TABLE_PREFETCH_MAX == 0)
+            prefetch_keys(server, args + i, argc - i, hashes);
+        if (lookup_key_hashed(server, args[i], hashes[(i - 1) % HASH_TABLE_PREFETCH_MAX]))
+            found++;
+    }
+    client_add_reply_integer(client, found);
+    return NULL;
 }
 
 char *handle_rpush_command(redis_server_t *server, char **args, int argc, void *client)
 {
-    (void)client;
     char *key = args[1];
     redis_object_t *obj = (redis_object_t *)hash_table_get(server->db->dict, key);
 
@@ -519,7 +926,8 @@ char *handle_rpush_command(redis_server_t *server, char **args, int argc, void *
     }
     else if (obj->type != REDIS_LIST)
     {
-        return strdup("-WRONGTYPE Operation against a key holding the wrong kind of value\r\n");
+        client_add_reply_shared(client, &shared_replies.wrongtype);
+        return NULL;
     }
 
     redis_list_t *list = (redis_list_t *)obj->ptr;
@@ -534,15 +942,13 @@ char *handle_rpush_command(redis_server_t *server, char **args, int argc, void *
 
     check_blocked_clients_for_key(server, key, NULL);
 
-    char response[32];
-    sprintf(response, ":%zu\r\n", list_len);
-    return strdup(response);
+    client_add_reply_integer(client, list_len);
+    return NULL;
 }
 
 // Same fix for LPUSH
 char *handle_lpush_command(redis_server_t *server, char **args, int argc, void *client)
 {
-    (void)client;
     char *key = args[1];
     redis_object_t *obj = (redis_object_t *)hash_table_get(server->db->dict, key);
 
@@ -553,7 +959,8 @@ char *handle_lpush_command(redis_server_t *server, char **args, int argc, void *
     }
     else if (obj->type != REDIS_LIST)
     {
-        return strdup("-WRONGTYPE Operation against a key holding the wrong kind of value\r\n");
+        client_add_reply_shared(client, &shared_replies.wrongtype);
+        return NULL;
     }
 
     redis_list_t *list = (redis_list_t *)obj->ptr;
@@ -570,9 +977,8 @@ char *handle_lpush_command(redis_server_t *server, char **args, int argc, void *
     check_blocked_clients_for_key(server, key, NULL);
 
     // Return the original length
-    char response[32];
-    sprintf(response, ":%zu\r\n", list_len);
-    return strdup(response);
+    client_add_reply_integer(client, list_len);
+    return NULL;
 }
 
 
@@ -606,12 +1012,14 @@ char *handle_blpop_command(redis_server_t *server, char **args, int argc, void *
                 char *value = (char *)list_lpop(list);
                 if (value)
                 {
-                    char response[1024];
-                    snprintf(response, sizeof(response),
-                             "*2\r\n$%zu\r\n%s\r\n$%zu\r\n%s\r\n",
-                             strlen(key), key, strlen(value), value);
+                    char *lpop_args[2] = {"LPOP", key};
+                    propagate_rewrite(server, lpop_args, 2);
+
+                    client_add_reply_array_len(c, 2);
+                    client_add_reply_bulk_cstr(c, key);
+                    client_add_reply_bulk_cstr(c, value);
                     free(value);
-                    return strdup(response);
+                    return NULL;
                 }
             }
         }
@@ -629,6 +1037,10 @@ char *handle_blpop_command(redis_server_t *server, char **args, int argc, void *
 
     // Use millisecond timeout for BLPOP
     c->block_timeout_ms = timeout_timestamp_ms;
+    if (timeout_ms > 0)
+    {
+        c->block_timer = event_loop_add_timer(server->event_loop, timeout_ms, handle_block_timeout, c);
+    }
     c->is_blocked = true;
     c->blocked_key = strdup(args[1]); // Block on first key
     add_client_to_list(server->blocked_clients, c);
@@ -647,31 +1059,32 @@ char *handle_llen_command(redis_server_t *server, char **args, int argc, void *c
 
     if (!obj)
     {
-        return strdup(":0\r\n");
+        client_add_reply_integer(client, 0);
+        return NULL;
     }
 
     if (obj->type != REDIS_LIST)
     {
-        return strdup("-WRONGTYPE Operation against a key holding the wrong kind of value\r\n");
+        client_add_reply_shared(client, &shared_replies.wrongtype);
+        return NULL;
     }
 
     redis_list_t *list = (redis_list_t *)obj->ptr;
-    char response[32];
-    sprintf(response, ":%zu\r\n", list_length(list));
-    return strdup(response);
+    client_add_reply_integer(client, list_length(list));
+    return NULL;
 }
 
 char *handle_rpop_command(redis_server_t *server, char **args, int argc, void *client)
 {
     (void)argc;
-    (void)client;
     char *key = args[1];
 
     redis_object_t *obj = (redis_object_t *)hash_table_get(server->db->dict, key);
 
     if (!obj || obj->type != REDIS_LIST)
     {
-        return strdup(NULL_RESP_VALUE);
+        client_add_reply_null(client);
+        return NULL;
     }
 
     redis_list_t *list = (redis_list_t *)obj->ptr;
@@ -679,17 +1092,17 @@ char *handle_rpop_command(redis_server_t *server, char **args, int argc, void *c
 
     if (!value)
     {
-        return strdup(NULL_RESP_VALUE);
+        client_add_reply_null(client);
+        return NULL;
     }
 
-    char *response = encode_bulk_string(value);
+    client_add_reply_bulk_cstr(client, value);
     free(value);
-    return response;
+    return NULL;
 }
 
 char *handle_lpop_command(redis_server_t *server, char **args, int argc, void *client)
 {
-    (void)client;
     char *key = args[1];
     size_t count = 0;
     if (argc >= 3)
@@ -701,7 +1114,8 @@ char *handle_lpop_command(redis_server_t *server, char **args, int argc, void *c
 
     if (!obj || obj->type != REDIS_LIST)
     {
-        return strdup(NULL_RESP_VALUE);
+        client_add_reply_null(client);
+        return NULL;
     }
 
     redis_list_t *list = (redis_list_t *)obj->ptr;
@@ -709,52 +1123,38 @@ char *handle_lpop_command(redis_server_t *server, char **args, int argc, void *c
     if (count == 0)
         count = 1;
 
-    char **values = calloc(count, sizeof(char *));
-    int actual_count = 0;
-
-    for (int i = 0; i < count; i++)
+    size_t available = list_length(list);
+    if (available == 0)
     {
-        values[i] = (char *)list_lpop(list);
-        if (values[i])
-        {
-            actual_count++;
-        }
-        else
-        {
-            break;
-        }
-    }
-
-    if (actual_count == 0)
-    {
-        free(values);
-        return strdup("*0\r\n");
+        client_add_reply_array_len(client, 0);
+        return NULL;
     }
 
-    char *response;
-    if (argc < 3 && actual_count == 1)
+    if (argc < 3)
     {
         // Single value response for LPOP without count
-        response = encode_bulk_string(values[0]);
-        free(values[0]);
+        char *value = (char *)list_lpop(list);
+        client_add_reply_bulk_cstr(client, value);
+        free(value);
+        return NULL;
     }
-    else
+
+    // Array response for LPOP with count
+    if (count > available)
+        count = available;
+    client_add_reply_array_len(client, count);
+    for (size_t i = 0; i < count; i++)
     {
-        // Array response for LPOP with count
-        response = encode_resp_array(values, actual_count);
-        for (int i = 0; i < actual_count; i++)
-        {
-            free(values[i]);
-        }
+        char *value = (char *)list_lpop(list);
+        client_add_reply_bulk_cstr(client, value);
+        free(value);
     }
 
-    free(values);
-    return response;
+    return NULL;
 }
 
 char *handle_lrange_command(redis_server_t *server, char **args, int argc, void *client)
 {
-    (void)client;
     if (argc != 4)
     {
         return strdup("-ERR wrong number of arguments for 'lrange' command\r\n");
@@ -762,112 +1162,55 @@ char *handle_lrange_command(redis_server_t *server, char **args, int argc, void
 
     char *key = args[1];
     int start = atoi(args[2]);
-    int stop = atoi(args[3]);
-
-    redis_object_t *obj = hash_table_get(server->db->dict, key);
-    if (!obj)
-    {
-        return strdup("*0\r\n");
-    }
-
-    if (obj->type != REDIS_LIST)
-    {
-        return strdup("-WRONGTYPE Operation against a key holding the wrong kind of value\r\n");
-    }
-
-    redis_list_t *list = (redis_list_t *)obj->ptr;
-    int count;
-    char **values = list_range(list, start, stop, &count);
-
-    if (!values)
-    {
-        return strdup("*0\r\n");
-    }
-
-    char *response = encode_resp_array(values, count);
-    free(values);
-
-    return response;
-}
-
-void check_blocked_clients_timeout(redis_server_t *server)
-{
-    if (!server || !server->blocked_clients)
-        return;
-
-    long long now_ms = get_current_time_ms();
-    list_node_t *node = server->blocked_clients->head;
-
-
-    while (node)
-    {
-        list_node_t *next = node->next;
-        client_t *client = (client_t *)node->data;
-
-        if (client->block_timeout_ms > 0 && client->block_timeout_ms <= now_ms)
-        {
-            printf("Client fd=%d timed out! timeout=%lld, now=%lld\n",
-                   client->fd, client->block_timeout_ms, now_ms);
-
-            const char *nil_response = "*-1\r\n";
-            send(client->fd, nil_response, strlen(nil_response), MSG_NOSIGNAL);
+    int stop = atoi(args[3]);
 
-            if (client->stream_block)
-            {
-                client_unblock_stream(client);
-                printf("Sent timeout response to XREAD client fd=%d\n", client->fd);
-            }
-            else
-            {
-                client_unblock(client);
-                printf("Sent timeout response to BLPOP client fd=%d\n", client->fd);
-            }
+    redis_object_t *obj = hash_table_get(server->db->dict, key);
+    if (!obj)
+    {
+        client_add_reply_array_len(client, 0);
+        return NULL;
+    }
 
-            remove_client_from_list(server->blocked_clients, client);
-        }
-        else if (client->blocked_key && !client->stream_block)
-        {
-            redis_object_t *obj = hash_table_get(server->db->dict, client->blocked_key);
-            if (obj && obj->type == REDIS_LIST)
-            {
-                redis_list_t *list = (redis_list_t *)obj->ptr;
-                if (list_length(list) > 0)
-                {
-                    char *value = (char *)list_lpop(list);
-                    if (value)
-                    {
-                        char response[1024];
-                        snprintf(response, sizeof(response),
-                                 "*2\r\n$%zu\r\n%s\r\n$%zu\r\n%s\r\n",
-                                 strlen(client->blocked_key), client->blocked_key,
-                                 strlen(value), value);
-                        send(client->fd, response, strlen(response), MSG_NOSIGNAL);
+    if (obj->type != REDIS_LIST)
+    {
+        client_add_reply_shared(client, &shared_replies.wrongtype);
+        return NULL;
+    }
 
-                        client_unblock(client);
-                        remove_client_from_list(server->blocked_clients, client);
+    redis_list_t *list = (redis_list_t *)obj->ptr;
+    int count;
+    char **values = list_range(list, start, stop, &count);
 
-                        free(value);
-                        printf("Client fd=%d unblocked by timer check\n", client->fd);
-                    }
-                }
-            }
-        }
+    if (!values)
+    {
+        client_add_reply_array_len(client, 0);
+        return NULL;
+    }
 
-        node = next;
+    client_add_reply_array_len(client, count);
+    for (int i = 0; i < count; i++)
+    {
+        client_add_reply_bulk_cstr(client, values[i]);
     }
+    free(values);
+
+    return NULL;
 }
+
 char *handle_type_command(redis_server_t *server, char **args, int argc, void *client)
 {
+    (void)argc;
     char *key = args[1];
     void *value = hash_table_get(server->db->dict, key);
     if (!value)
     {
-        return encode_simple_string("none");
+        client_add_reply_simple(client, "none");
+        return NULL;
     }
     redis_object_t *obj = (redis_object_t *)value;
-    char *response = encode_simple_string(redis_type_to_string(obj->type));
+    client_add_reply_simple(client, redis_type_to_string(obj->type));
 
-    return response;
+    return NULL;
 }
 
 char *handle_xadd_command(redis_server_t *server, char **args, int argc, void *client)
@@ -891,7 +1234,8 @@ char *handle_xadd_command(redis_server_t *server, char **args, int argc, void *c
     {
         free(field_names);
         free(field_values);
-        return strdup("-ERR out of memory\r\n");
+        client_add_reply_shared(client, &shared_replies.oom);
+        return NULL;
     }
 
     for (size_t i = 0; i < field_count; i++)
@@ -931,7 +1275,8 @@ char *handle_xadd_command(redis_server_t *server, char **args, int argc, void *c
         {
             free(field_names);
             free(field_values);
-            return strdup("-WRONGTYPE Operation against a key holding the wrong kind of value\r\n");
+            client_add_reply_shared(client, &shared_replies.wrongtype);
+            return NULL;
         }
         stream = (redis_stream_t *)obj->ptr;
     }
@@ -951,7 +1296,8 @@ char *handle_xadd_command(redis_server_t *server, char **args, int argc, void *c
         case 2:
             return strdup("-ERR The ID specified in XADD is equal or smaller than the target stream top item\r\n");
         case 3:
-            return strdup("-ERR out of memory\r\n");
+            client_add_reply_shared(client, &shared_replies.oom);
+            return NULL;
         case 4:
             return strdup("-ERR invalid parameters\r\n");
         case 5:
@@ -963,13 +1309,21 @@ char *handle_xadd_command(redis_server_t *server, char **args, int argc, void *c
         }
     }
 
-    char *response = encode_bulk_string(generated_id);
+    client_add_reply_bulk_cstr(c, generated_id);
+
+    if (strchr(id, '*'))
+    {
+        // Replicas must store the ID picked here, not pick their own
+        args[2] = generated_id;
+        propagate_rewrite(server, args, argc);
+        args[2] = id;
+    }
 
     check_blocked_clients_for_stream(server, key, generated_id);
 
     free(generated_id);
 
-    return response;
+    return NULL;
 }
 static int extract_timeout(char *timeout_st)
 {
@@ -1001,9 +1355,21 @@ static int extract_timeout(char *timeout_st)
     return timeout_seconds;
 }
 
+/* One stream entry as XRANGE/XREAD return it: [id, [field, value, ...]] */
+static void add_reply_stream_entry(client_t *client, stream_entry_t *entry)
+{
+    client_add_reply_array_len(client, 2);
+    client_add_reply_bulk_cstr(client, entry->id);
+    client_add_reply_array_len(client, entry->field_count * 2);
+    for (size_t i = 0; i < entry->field_count; i++)
+    {
+        client_add_reply_bulk_cstr(client, entry->fields[i].name);
+        client_add_reply_bulk_cstr(client, entry->fields[i].value);
+    }
+}
+
 char *handle_xrange_command(redis_server_t *server, char **args, int argc, void *client)
 {
-    (void)client;
 
     if (argc < 4)
     {
@@ -1017,12 +1383,14 @@ char *handle_xrange_command(redis_server_t *server, char **args, int argc, void
     redis_object_t *obj = (redis_object_t *)hash_table_get(server->db->dict, key);
     if (!obj)
     {
-        return strdup("*0\r\n");
+        client_add_reply_array_len(client, 0);
+        return NULL;
     }
 
     if (obj->type != REDIS_STREAM)
     {
-        return strdup("-WRONGTYPE Operation against a key holding the wrong kind of value\r\n");
+        client_add_reply_shared(client, &shared_replies.wrongtype);
+        return NULL;
     }
 
     redis_stream_t *stream = (redis_stream_t *)obj->ptr;
@@ -1031,44 +1399,15 @@ char *handle_xrange_command(redis_server_t *server, char **args, int argc, void
 
     radix_tree_range(stream->entries_tree, start_id, end_id, &raw_results, &result_count);
 
-    if (!raw_results || result_count == 0)
+    client_add_reply_array_len(client, raw_results ? result_count : 0);
+    for (int i = 0; raw_results && i < result_count; i++)
     {
-        free(raw_results);
-        return strdup("*0\r\n");
-    }
-
-    size_t response_size = 1024;
-    char *response = malloc(response_size);
-    int pos = 0;
-
-    pos += sprintf(response + pos, "*%d\r\n", result_count);
-
-    for (int i = 0; i < result_count; i++)
-    {
-        stream_entry_t *entry = (stream_entry_t *)raw_results[i];
-
-        pos += sprintf(response + pos, "*2\r\n");
-        pos += sprintf(response + pos, "$%zu\r\n%s\r\n", strlen(entry->id), entry->id);
-        pos += sprintf(response + pos, "*%zu\r\n", entry->field_count * 2);
-
-        for (size_t j = 0; j < entry->field_count; j++)
-        {
-            pos += sprintf(response + pos, "$%zu\r\n%s\r\n",
-                           strlen(entry->fields[j].name), entry->fields[j].name);
-            pos += sprintf(response + pos, "$%zu\r\n%s\r\n",
-                           strlen(entry->fields[j].value), entry->fields[j].value);
-        }
-
-        if (pos > response_size - 1000)
-        {
-            response_size *= 2;
-            response = realloc(response, response_size);
-        }
+        add_reply_stream_entry(client, (stream_entry_t *)raw_results[i]);
     }
 
     free(raw_results);
 
-    return response;
+    return NULL;
 }
 
 char *handle_xread_command(redis_server_t *server, char **args, int argc, void *client)
@@ -1116,7 +1455,8 @@ char *handle_xread_command(redis_server_t *server, char **args, int argc, void *
 
     if (streams_pos == -1)
     {
-        return strdup("-ERR syntax error\r\n");
+        client_add_reply_shared(client, &shared_replies.syntax_error);
+        return NULL;
     }
 
     int remaining_args = argc - streams_pos - 1;
@@ -1192,6 +1532,10 @@ char *handle_xread_command(redis_server_t *server, char **args, int argc, void *
         }
 
         c->block_timeout_ms = timeout_timestamp_ms;
+        if (timeout_ms > 0)
+        {
+            c->block_timer = event_loop_add_timer(server->event_loop, timeout_ms, handle_block_timeout, c);
+        }
         c->stream_block = true;
         c->is_blocked = true;
         add_client_to_list(server->blocked_clients, c);
@@ -1214,44 +1558,23 @@ char *handle_xread_command(redis_server_t *server, char **args, int argc, void *
         }
         free(all_results);
         free(all_counts);
-        return strdup("*0\r\n");
+        client_add_reply_array_len(c, 0);
+        return NULL;
     }
 
-    size_t response_size = 4096;
-    char *response = malloc(response_size);
-    int pos = 0;
-
-    pos += sprintf(response + pos, "*%d\r\n", streams_with_data);
+    client_add_reply_array_len(c, streams_with_data);
 
     for (int i = 0; i < num_streams; i++)
     {
         if (all_counts[i] == 0)
             continue;
 
-        pos += sprintf(response + pos, "*2\r\n");
-        pos += sprintf(response + pos, "$%zu\r\n%s\r\n", strlen(stream_keys[i]), stream_keys[i]);
-        pos += sprintf(response + pos, "*%d\r\n", all_counts[i]);
-
+        client_add_reply_array_len(c, 2);
+        client_add_reply_bulk_cstr(c, stream_keys[i]);
+        client_add_reply_array_len(c, all_counts[i]);
         for (int j = 0; j < all_counts[i]; j++)
         {
-            stream_entry_t *entry = (stream_entry_t *)all_results[i][j];
-            pos += sprintf(response + pos, "*2\r\n");
-            pos += sprintf(response + pos, "$%zu\r\n%s\r\n", strlen(entry->id), entry->id);
-            pos += sprintf(response + pos, "*%zu\r\n", entry->field_count * 2);
-
-            for (size_t k = 0; k < entry->field_count; k++)
-            {
-                pos += sprintf(response + pos, "$%zu\r\n%s\r\n",
-                               strlen(entry->fields[k].name), entry->fields[k].name);
-                pos += sprintf(response + pos, "$%zu\r\n%s\r\n",
-                               strlen(entry->fields[k].value), entry->fields[k].value);
-            }
-        }
-
-        if (pos > response_size - 1000)
-        {
-            response_size *= 2;
-            response = realloc(response, response_size);
+            add_reply_stream_entry(c, (stream_entry_t *)all_results[i][j]);
         }
     }
 
@@ -1262,232 +1585,569 @@ char *handle_xread_command(redis_server_t *server, char **args, int argc, void *
     free(all_results);
     free(all_counts);
 
-    return response;
+    return NULL;
+}
+
+/*
+ * Add incr to the number at key (0 when missing). A private number is
+ * updated in place; a shared one is swapped for the result, which stays
+ * allocation-free while the counter is inside the shared range.
+ */
+static void incr_decr_key(redis_server_t *server, const char *key, long long incr, void *client)
+{
+    redis_object_t *obj = lookup_key(server, key);
+    long long value = 0;
+    if (obj)
+    {
+        if (obj->type == REDIS_STRING)
+        {
+            client_add_reply_shared(client, &shared_replies.not_integer);
+            return;
+        }
+        if (obj->type != REDIS_NUMBER)
+        {
+            client_add_reply_shared(client, &shared_replies.wrongtype);
+            return;
+        }
+        value = obj->ival;
+    }
+
+    if ((incr < 0 && value < LLONG_MIN - incr) || (incr > 0 && value > LLONG_MAX - incr))
+    {
+        client_add_reply_error(client, "ERR increment or decrement would overflow");
+        return;
+    }
+    value += incr;
+
+    if (obj && obj->refcount != REDIS_OBJECT_SHARED_REFCOUNT)
+    {
+        obj->ival = value;
+    }
+    else if (!redis_db_set_integer(server->db, key, value, obj ? obj->expiry : 0))
+    {
+        client_add_reply_shared(client, &shared_replies.oom);
+        return;
+    }
+
+    client_add_reply_integer(client, value);
+}
+
+char *handle_incr_command(redis_server_t *server, char **args, int argc, void *client)
+{
+    (void)argc;
+    incr_decr_key(server, args[1], 1, client);
+    return NULL;
+}
+
+char *handle_decr_command(redis_server_t *server, char **args, int argc, void *client)
+{
+    (void)argc;
+    incr_decr_key(server, args[1], -1, client);
+    return NULL;
 }
 
-static char *build_xread_response_for_blocked_client(redis_server_t *server, client_t *client, const char *stream_key, const char *new_id)
+char *handle_incrby_command(redis_server_t *server, char **args, int argc, void *client)
 {
-    if (!server || !client || !stream_key || !new_id)
+    (void)argc;
+    long long incr;
+    if (!string_to_ll(args[2], strlen(args[2]), &incr))
     {
+        client_add_reply_shared(client, &shared_replies.not_integer);
         return NULL;
     }
+    incr_decr_key(server, args[1], incr, client);
+    return NULL;
+}
 
-    redis_object_t *obj = (redis_object_t *)hash_table_get(server->db->dict, stream_key);
-    if (!obj || obj->type != REDIS_STREAM)
+char *handle_decrby_command(redis_server_t *server, char **args, int argc, void *client)
+{
+    (void)argc;
+    long long decr;
+    if (!string_to_ll(args[2], strlen(args[2]), &decr))
+    {
+        client_add_reply_shared(client, &shared_replies.not_integer);
+        return NULL;
+    }
+    if (decr == LLONG_MIN)
     {
+        client_add_reply_error(client, "ERR decrement would overflow");
         return NULL;
     }
+    incr_decr_key(server, args[1], -decr, client);
+    return NULL;
+}
 
-    redis_stream_t *stream = (redis_stream_t *)obj->ptr;
+// A whole string that strtold accepts as a finite number
+static int string_to_ld(const char *s, long double *value)
+{
+    char *end;
+    if (*s == '\0' || isspace((unsigned char)*s))
+        return 0;
+    errno = 0;
+    *value = strtold(s, &end);
+    return *end == '\0' && errno != ERANGE && !isnan(*value) && !isinf(*value);
+}
 
-    stream_entry_t *entry = (stream_entry_t *)radix_search(stream->entries_tree, (char *)new_id, strlen(new_id));
-    if (!entry)
+/*
+ * INCRBYFLOAT key increment. The result is stored as text (or as a number
+ * when it comes out integral) and replicated as SET ... KEEPTTL, so
+ * replicas never redo the floating point math.
+ */
+char *handle_incrbyfloat_command(redis_server_t *server, char **args, int argc, void *client)
+{
+    (void)argc;
+    char *key = args[1];
+    long double incr, value = 0;
+    if (!string_to_ld(args[2], &incr))
     {
+        client_add_reply_error(client, "ERR value is not a valid float");
         return NULL;
     }
 
-    size_t response_size = 1024;
-    char *response = malloc(response_size);
-    int pos = 0;
+    redis_object_t *obj = lookup_key(server, key);
+    if (obj)
+    {
+        if (obj->type == REDIS_NUMBER)
+        {
+            value = (long double)obj->ival;
+        }
+        else if (obj->type != REDIS_STRING)
+        {
+            client_add_reply_shared(client, &shared_replies.wrongtype);
+            return NULL;
+        }
+        else if (!string_to_ld((char *)obj->ptr, &value))
+        {
+            client_add_reply_error(client, "ERR value is not a valid float");
+            return NULL;
+        }
+    }
 
-    pos += sprintf(response + pos, "*1\r\n");
-    pos += sprintf(response + pos, "*2\r\n");
-    pos += sprintf(response + pos, "$%zu\r\n%s\r\n", strlen(stream_key), stream_key);
+    value += incr;
+    if (isnan(value) || isinf(value))
+    {
+        client_add_reply_error(client, "ERR increment would produce NaN or Infinity");
+        return NULL;
+    }
 
-    pos += sprintf(response + pos, "*1\r\n");
-    pos += sprintf(response + pos, "*2\r\n");
-    pos += sprintf(response + pos, "$%zu\r\n%s\r\n", strlen(entry->id), entry->id);
-    pos += sprintf(response + pos, "*%zu\r\n", entry->field_count * 2);
+    // Fixed 17 decimals, then trailing zeros trimmed: 10.5 + 0.1 prints as 10.6
+    char buf[5 * 1024];
+    int len = snprintf(buf, sizeof(buf), "%.17Lf", value);
+    if (len < 0 || len >= (int)sizeof(buf))
+    {
+        client_add_reply_error(client, "ERR increment would produce NaN or Infinity");
+        return NULL;
+    }
+    while (buf[len - 1] == '0')
+        len--;
+    if (buf[len - 1] == '.')
+        len--;
+    buf[len] = '\0';
+    if (strcmp(buf, "-0") == 0)
+        strcpy(buf, "0");
 
-    for (size_t i = 0; i < entry->field_count; i++)
+    // Text stays in place in a string; integral results become numbers through the db
+    long long ival;
+    if (obj && obj->type == REDIS_STRING && !string_to_ll(buf, len, &ival))
+    {
+        if (redis_object_set_string(obj, buf) == -1)
+        {
+            client_add_reply_shared(client, &shared_replies.oom);
+            return NULL;
+        }
+    }
+    else if (!redis_db_set_string(server->db, key, buf, obj ? obj->expiry : 0))
     {
-        pos += sprintf(response + pos, "$%zu\r\n%s\r\n",
-                       strlen(entry->fields[i].name), entry->fields[i].name);
-        pos += sprintf(response + pos, "$%zu\r\n%s\r\n",
-                       strlen(entry->fields[i].value), entry->fields[i].value);
+        client_add_reply_shared(client, &shared_replies.oom);
+        return NULL;
     }
 
-    return response;
+    char *set_args[4] = {"SET", key, buf, "KEEPTTL"};
+    propagate_rewrite(server, set_args, 4);
+
+    client_add_reply_bulk_cstr(client, buf);
+    return NULL;
 }
-char *handle_incr_command(redis_server_t *server, char **args, int argc, void *client)
+
+char *handle_multi_command(redis_server_t *server, char **args, int argc, void *client)
+{
+    client_t *c = (client_t *)client;
+    if (!c)
+        return NULL;
+
+    if (c->is_queued)
+    {
+        return strdup("-ERR MULTI calls can not be nested\r\n");
+    }
+
+    c->transaction_commands = list_create();
+    if (!c->transaction_commands)
+        return NULL;
+    c->is_queued = 1;
+    c->txn_dirty = 0;
+
+    client_add_reply_shared(c, &shared_replies.ok);
+    return NULL;
+}
+
+// Copies the frame and arguments behind the entry so EXEC needs neither a parse nor a lookup
+static int queue_transaction_command(client_t *c, redis_command_t *cmd, char *buffer, size_t len, char **args, int argc)
+{
+    if (!c->transaction_commands)
+        return -1;
+
+    size_t bytes = sizeof(transaction_command_t) + argc * sizeof(char *) + len;
+    for (int i = 0; i < argc; i++)
+    {
+        bytes += strlen(args[i]) + 1;
+    }
+
+    transaction_command_t *queued = malloc(bytes);
+    if (!queued)
+        return -1;
+
+    queued->cmd = cmd;
+    queued->argc = argc;
+    queued->args = (char **)(queued + 1);
+    queued->buffer = (char *)(queued->args + argc);
+    queued->len = len;
+    memcpy(queued->buffer, buffer, len);
+
+    char *data = queued->buffer + len;
+    for (int i = 0; i < argc; i++)
+    {
+        size_t arg_len = strlen(args[i]);
+        memcpy(data, args[i], arg_len + 1);
+        queued->args[i] = data;
+        data += arg_len + 1;
+    }
+
+    list_rpush(c->transaction_commands, queued);
+    return 0;
+}
+
+char *handle_exec_command(redis_server_t *server, char **args, int argc, void *client)
 {
+    (void)args;
     (void)argc;
-    (void)client;
 
-    char *key = args[1];
-    redis_object_t *obj = (redis_object_t *)hash_table_get(server->db->dict, key);
+    client_t *c = (client_t *)client;
+    if (!c || !c->is_queued || !c->transaction_commands)
+    {
+        return strdup("-ERR EXEC without MULTI\r\n");
+    }
 
-    if (!obj)
+    if (c->txn_dirty)
     {
-        obj = redis_object_create_number("1");
-        hash_table_set(server->db->dict, key, obj);
-        return encode_number("1");
+        unwatch_all_keys(server, c);
+        cleanup_transaction(c);
+        return strdup("-EXECABORT Transaction discarded because of previous errors.\r\n");
+    }
+
+    // Optimistic lock lost: a watched key was written, or expired since WATCH
+    if (c->watch_dirty || watched_keys_expired(server, c))
+    {
+        unwatch_all_keys(server, c);
+        cleanup_transaction(c);
+        client_add_reply_shared(c, &shared_replies.null_array);
+        return NULL;
     }
+    unwatch_all_keys(server, c);
+
+    size_t command_count = list_length(c->transaction_commands);
 
-    if (obj->type != REDIS_NUMBER)
+    c->is_queued = 0;
+    c->in_exec = 1;
+
+    // Each queued command's reply is built right behind the array header
+    client_add_reply_array_len(c, command_count);
+
+    for (list_node_t *node = c->transaction_commands->head; node; node = node->next)
     {
-        return strdup("-ERR value is not an integer or out of range\r\n");
+        transaction_command_t *queued = (transaction_command_t *)node->data;
+        char *response = call_command(server, queued->cmd, queued->buffer, queued->len,
+                                      queued->args, queued->argc, c);
+        if (response)
+        {
+            client_add_reply(c, response, strlen(response));
+            free(response);
+        }
     }
+    c->in_exec = 0;
+
+    cleanup_transaction(c);
+
+    return NULL;
+}
+
+char *handle_discard_command(redis_server_t *server, char **args, int argc, void *client)
+{
+    (void)server;
+    (void)args;
+    (void)argc;
 
-    char *value = (char *)obj->ptr;
-    long long num = atoll(value);
+    client_t *c = (client_t *)client;
+    if (!c || !c->is_queued)
+    {
+        return strdup("-ERR DISCARD without MULTI\r\n");
+    }
 
-    num++;
+    unwatch_all_keys(server, c);
+    cleanup_transaction(c);
+    client_add_reply_shared(c, &shared_replies.ok);
+    return NULL;
+}
 
-    char new_value[32];
-    snprintf(new_value, sizeof(new_value), "%lld", num);
+/*
+ * WATCH: server->watched_keys maps each watched key to the clients watching
+ * it, so a write only has to look up its own keys; with nothing watched the
+ * check is a single counter test.
+ */
+static void watch_key(redis_server_t *server, client_t *c, const char *key)
+{
+    // Already watching: c is among the key's watchers, so the check costs one
+    // lookup rather than a scan of every key c watches
+    redis_list_t *clients = hash_table_get(server->watched_keys, key);
+    if (clients)
+    {
+        for (list_node_t *node = clients->head; node; node = node->next)
+        {
+            if (node->data == c)
+                return;
+        }
+    }
+    else
+    {
+        clients = list_create();
+        if (!clients)
+            return;
+        hash_table_set(server->watched_keys, key, clients);
+    }
 
-    free(obj->ptr);
-    obj->ptr = strdup(new_value);
+    size_t key_len = strlen(key);
+    watched_key_t *watched = malloc(sizeof(watched_key_t) + key_len + 1);
+    if (!watched)
+        return;
+    redis_object_t *obj = hash_table_get(server->db->dict, key);
+    watched->expired = obj && is_expired(obj);
+    memcpy(watched->key, key, key_len + 1);
 
-    return encode_number(new_value);
+    list_rpush(c->watched_keys, watched);
+    list_rpush(clients, c);
 }
 
-char *handle_multi_command(redis_server_t *server, char **args, int argc, void *client)
+void unwatch_all_keys(redis_server_t *server, client_t *client)
 {
-    client_t *c = (client_t *)client;
-    if (!c)
-        return NULL;
-
-    c->transaction_commands = list_create();
-    if (!c->transaction_commands)
-        return NULL;
-    c->is_queued = 1;
+    if (!client || !client->watched_keys)
+        return;
 
-    return encode_simple_string("OK");
+    watched_key_t *watched;
+    while ((watched = list_lpop(client->watched_keys)) != NULL)
+    {
+        redis_list_t *clients = hash_table_get(server->watched_keys, watched->key);
+        if (clients)
+        {
+            list_remove(clients, client);
+            if (list_length(clients) == 0)
+            {
+                hash_table_delete(server->watched_keys, watched->key);
+                list_destroy(clients);
+            }
+        }
+        free(watched);
+    }
+    list_destroy(client->watched_keys);
+    client->watched_keys = NULL;
+    client->watch_dirty = 0;
 }
 
-static void add_command_to_transaction(redis_server_t *server, char *buffer, char **args, int argc, void *client)
+void touch_watched_key(redis_server_t *server, const char *key)
 {
-    (void)server;
-    (void)args; 
-    (void)argc; 
-
-    client_t *c = (client_t *)client;
-    if (!c || !c->transaction_commands)
+    if (!server->watched_keys || server->watched_keys->count == 0)
         return;
 
-    list_rpush(c->transaction_commands, strdup(buffer));
+    redis_list_t *clients = hash_table_get(server->watched_keys, key);
+    if (!clients)
+        return;
+    for (list_node_t *node = clients->head; node; node = node->next)
+    {
+        ((client_t *)node->data)->watch_dirty = 1;
+    }
 }
 
-char *handle_exec_command(redis_server_t *server, char **args, int argc, void *client)
+// Expiring is lazy, so a watched key that timed out may not have been touched yet
+static int watched_keys_expired(redis_server_t *server, client_t *c)
 {
-    (void)args;
-    (void)argc;
+    if (!c->watched_keys)
+        return 0;
 
-    client_t *c = (client_t *)client;
-    if (!c || !c->is_queued || !c->transaction_commands)
+    for (list_node_t *node = c->watched_keys->head; node; node = node->next)
     {
-        return strdup("-ERR EXEC without MULTI\r\n");
+        watched_key_t *watched = (watched_key_t *)node->data;
+        redis_object_t *obj = hash_table_get(server->db->dict, watched->key);
+        if (!watched->expired && obj && is_expired(obj))
+            return 1;
     }
+    return 0;
+}
 
-    size_t command_count = list_length(c->transaction_commands);
+char *handle_watch_command(redis_server_t *server, char **args, int argc, void *client)
+{
+    client_t *c = (client_t *)client;
+    if (!c)
+        return NULL;
 
-    if (command_count == 0)
+    if (server->shard)
     {
-        cleanup_transaction(c);
-        return strdup("*0\r\n");
+        return strdup("-ERR WATCH is not supported in sharded mode\r\n");
     }
-
-    char **responses = calloc(command_count, sizeof(char *));
-    if (!responses)
+    if (c->is_queued)
     {
-        cleanup_transaction(c);
-        return strdup("-ERR out of memory\r\n");
+        return strdup("-ERR WATCH inside MULTI is not allowed\r\n");
     }
-
-    c->is_queued = 0;
-
-    list_node_t *node = c->transaction_commands->head;
-    for (size_t i = 0; i < command_count && node; i++)
+    if (!server->watched_keys)
     {
-        char *command_buffer = (char *)node->data;
-
-        responses[i] = handle_command(server, command_buffer, client);
-
-        if (!responses[i])
-        {
-            responses[i] = strdup("+OK\r\n");
-        }
-
-        node = node->next;
+        client_add_reply_shared(c, &shared_replies.oom);
+        return NULL;
     }
 
-    size_t total_size = 64;
-    for (size_t i = 0; i < command_count; i++)
+    if (!c->watched_keys)
     {
-        total_size += strlen(responses[i]);
+        c->watched_keys = list_create();
+        if (!c->watched_keys)
+        {
+            client_add_reply_shared(c, &shared_replies.oom);
+            return NULL;
+        }
     }
-
-    char *final_response = malloc(total_size);
-    int pos = sprintf(final_response, "*%zu\r\n", command_count);
-
-    for (size_t i = 0; i < command_count; i++)
+    for (int i = 1; i < argc; i++)
     {
-        strcpy(final_response + pos, responses[i]);
-        pos += strlen(responses[i]);
-        free(responses[i]);
+        watch_key(server, c, args[i]);
     }
 
-    free(responses);
-    cleanup_transaction(c);
-
-    return final_response;
+    client_add_reply_shared(c, &shared_replies.ok);
+    return NULL;
 }
 
-char *handle_discard_command(redis_server_t *server, char **args, int argc, void *client)
+char *handle_unwatch_command(redis_server_t *server, char **args, int argc, void *client)
 {
-    (void)server;
     (void)args;
     (void)argc;
 
-    client_t *c = (client_t *)client;
-    if (!c || !c->is_queued)
+    unwatch_all_keys(server, (client_t *)client);
+    client_add_reply_shared(client, &shared_replies.ok);
+    return NULL;
+}
+
+// Sections outside the default set are only sent when named, or for "all"/"everything"
+static int info_section_wanted(char **args, int argc, const char *section, int in_default)
+{
+    if (argc < 2)
     {
-        return strdup("-ERR DISCARD without MULTI\r\n");
+        return in_default;
+    }
+    for (int i = 1; i < argc; i++)
+    {
+        if (strcasecmp(args[i], section) == 0 || strcasecmp(args[i], "all") == 0 ||
+            strcasecmp(args[i], "everything") == 0 ||
+            (in_default && strcasecmp(args[i], "default") == 0))
+        {
+            return 1;
+        }
     }
+    return 0;
+}
 
-    cleanup_transaction(c);
-    return strdup("+OK\r\n");
+static sds info_commandstats(redis_server_t *server, sds info)
+{
+    info = sdscat(info, "# Commandstats\r\n");
+    for (size_t i = 0; server->command_stats && i < COMMAND_COUNT; i++)
+    {
+        command_stats_t *stats = &server->command_stats[i];
+        if (stats->calls == 0 && stats->rejected_calls == 0)
+            continue;
+        info = sdscatprintf(info, "cmdstat_%s:calls=%lld,usec=%llu,usec_per_call=%.2f,max_usec=%llu,rejected_calls=%lld\r\n",
+                            commands[i].name, stats->calls,
+                            (unsigned long long)(stats->total_ns / 1000),
+                            stats->calls ? (double)stats->total_ns / 1000.0 / stats->calls : 0.0,
+                            (unsigned long long)(stats->max_ns / 1000),
+                            stats->rejected_calls);
+    }
+    return sdscat(info, "\r\n");
 }
 
-char *handle_info_command(redis_server_t *server, char **args, int argc, void *client)
+static sds info_latencystats(redis_server_t *server, sds info)
 {
-    (void)client;
-    (void)args;
-    (void)argc;
+    info = sdscat(info, "# Latencystats\r\n");
+    for (size_t i = 0; server->command_stats && i < COMMAND_COUNT; i++)
+    {
+        latency_histogram_t *latency = &server->command_stats[i].latency;
+        if (latency->count == 0)
+            continue;
+        info = sdscatprintf(info, "latency_percentiles_usec_%s:p50=%.3f,p99=%.3f,p99.9=%.3f\r\n",
+                            commands[i].name,
+                            latency_histogram_percentile(latency, 50.0) / 1000.0,
+                            latency_histogram_percentile(latency, 99.0) / 1000.0,
+                            latency_histogram_percentile(latency, 99.9) / 1000.0);
+    }
+    return sdscat(info, "\r\n");
+}
 
+char *handle_info_command(redis_server_t *server, char **args, int argc, void *client)
+{
     if (!server->replication_info)
     {
         return strdup("-ERR server not configured\r\n");
     }
+    if (server->replication_info->role != MASTER && server->replication_info->role != SLAVE)
+    {
+        return strdup("-ERR unknown role\r\n");
+    }
 
-    char info_buffer[256];
-    int offset = 0;
-    if (server->replication_info->role == MASTER)
+    sds info = sdsempty();
+    if (info_section_wanted(args, argc, "clients", 1))
     {
-        offset += snprintf(info_buffer + offset, sizeof(info_buffer) - offset,
-                           "role:master\r\nconnected_slaves:%d",
-                           server->replication_info->connected_slaves);
+        info = sdscatprintf(info, "# Clients\r\nconnected_clients:%zu\r\nblocked_clients:%zu\r\n\r\n",
+                            list_length(server->clients), list_length(server->blocked_clients));
     }
-    else if (server->replication_info->role == SLAVE)
+    if (info_section_wanted(args, argc, "stats", 1))
     {
-        offset += snprintf(info_buffer + offset, sizeof(info_buffer) - offset,
-                           "role:slave\r\nmaster_host:%s\r\nmaster_port:%d",
-                           server->replication_info->master_host ? server->replication_info->master_host : "unknown",
-                           server->replication_info->master_port);
+        info = sdscatprintf(info, "# Stats\r\nclient_output_buffer_limit_disconnections:%lld\r\n"
+                                  "pubsub_messages_dropped:%lld\r\n\r\n",
+                            server->stat_output_limit_disconnections, server->stat_pubsub_dropped_messages);
     }
-    else
+    if (info_section_wanted(args, argc, "commandstats", 0))
     {
-        return strdup("-ERR unknown role\r\n");
+        info = info_commandstats(server, info);
     }
-    if (server->replication_info->replication_id && server->replication_info->master_repl_offset >= 0)
+    if (info_section_wanted(args, argc, "latencystats", 0))
     {
-        offset += snprintf(info_buffer + offset, sizeof(info_buffer) - offset, "\r\nmaster_replid:%s\r\nmaster_repl_offset:%d", server->replication_info->replication_id,
-                           server->replication_info->master_repl_offset);
+        info = info_latencystats(server, info);
+    }
+    if (info_section_wanted(args, argc, "replication", 1))
+    {
+        info = sdscat(info, "# Replication\r\n");
+        if (server->replication_info->role == MASTER)
+        {
+            info = sdscatprintf(info, "role:master\r\nconnected_slaves:%d",
+                                server->replication_info->connected_slaves);
+        }
+        else
+        {
+            info = sdscatprintf(info, "role:slave\r\nmaster_host:%s\r\nmaster_port:%d",
+                                server->replication_info->master_host ? server->replication_info->master_host : "unknown",
+                                server->replication_info->master_port);
+        }
+        if (server->replication_info->replication_id && server->replication_info->master_repl_offset >= 0)
+        {
+            info = sdscatprintf(info, "\r\nmaster_replid:%s\r\nmaster_repl_offset:%" PRIu64, server->replication_info->replication_id,
+                                server->replication_info->master_repl_offset);
+        }
     }
 
-    return encode_bulk_string(info_buffer);
+    client_add_reply_bulk(client, info, sdslen(info));
+    sdsfree(info);
+    return NULL;
 }
 
 char *handle_replconf_command(redis_server_t *server, char **args, int argc, void *client)
@@ -1502,15 +2162,15 @@ char *handle_replconf_command(redis_server_t *server, char **args, int argc, voi
         if (server->replication_info && server->replication_info->role == SLAVE)
         {
             char offset_str[32];
-            snprintf(offset_str, sizeof(offset_str), "%lu", server->replication_info->replica_offset);
-            int offset_digits = snprintf(NULL, 0, "%lu", server->replication_info->replica_offset);
+            snprintf(offset_str, sizeof(offset_str), "%" PRIu64, server->replication_info->replica_offset);
+            int offset_digits = snprintf(NULL, 0, "%" PRIu64, server->replication_info->replica_offset);
 
             char response[256];
             snprintf(response, sizeof(response),
                      "*3\r\n$8\r\nREPLCONF\r\n$3\r\nACK\r\n$%d\r\n%s\r\n",
                      offset_digits, offset_str);
 
-            printf("Sending ACK with offset: %lu\n", server->replication_info->replica_offset);
+            printf("Sending ACK with offset: %" PRIu64 "\n", server->replication_info->replica_offset);
             return strdup(response);
         }
         else
@@ -1558,7 +2218,8 @@ char *handle_replconf_command(redis_server_t *server, char **args, int argc, voi
         {
             client_t *c = (client_t *)client;
             add_replica(server, c->fd);
-            return encode_simple_string("OK");
+            client_add_reply_shared(client, &shared_replies.ok);
+            return NULL;
         }
         return NULL;
     }
@@ -1569,7 +2230,8 @@ char *handle_replconf_command(redis_server_t *server, char **args, int argc, voi
         {
             // For now, just acknowledge the capability
             printf("Received replica capability: %s\n", argc > 2 ? args[2] : "unknown");
-            return encode_simple_string("OK");
+            client_add_reply_shared(client, &shared_replies.ok);
+            return NULL;
         }
         return strdup("-ERR CAPA can only be sent to masters\r\n");
     }
@@ -1585,14 +2247,16 @@ char *handle_psync_command(redis_server_t *server, char **args, int argc, void *
     if (strcmp(args[1], "?") == 0)
     {
         offset += snprintf(buffer + offset, sizeof(buffer) - offset,
-                           "FULLRESYNC %s %d",
+                           "FULLRESYNC %s %" PRIu64,
                            server->replication_info->replication_id,
                            server->replication_info->master_repl_offset);
 
         client_t *client_conn = (client_t *)client;
         int client_fd = client_conn->fd;
 
+        uint64_t save_start = latency_monitor_start(server->latency_monitor);
         int rdb_fd = create_rdb_snapshot(server->db);
+        latency_monitor_end(server->latency_monitor, LATENCY_EVENT_RDB_SAVE, save_start);
         if (rdb_fd == -1)
         {
             return encode_simple_string("ERR Failed to create RDB snapshot");
@@ -1604,7 +2268,10 @@ char *handle_psync_command(redis_server_t *server, char **args, int argc, void *
         write(client_fd, response, strlen(response));
         free(response);
 
-        if (send_rdb_file_to_client(client_fd, RDB_TEMP_FILE) == -1)
+        uint64_t transfer_start = latency_monitor_start(server->latency_monitor);
+        int sent = send_rdb_file_to_client(client_fd, RDB_TEMP_FILE);
+        latency_monitor_end(server->latency_monitor, LATENCY_EVENT_RDB_TRANSFER, transfer_start);
+        if (sent == -1)
         {
             unlink(RDB_TEMP_FILE);
             return NULL;
@@ -1644,7 +2311,8 @@ char *handle_wait_command(redis_server_t *server, char **args, int argc, void *c
 
     if (server->replication_info->connected_slaves == 0)
     {
-        return strdup(":0\r\n");
+        client_add_reply_shared(client, &shared_replies.czero);
+        return NULL;
     }
 
     uint64_t current_offset = server->replication_info->master_repl_offset;
@@ -1667,7 +2335,8 @@ char *handle_wait_command(redis_server_t *server, char **args, int argc, void *c
         }
     }
 
-    if (already_acked >= expected_replicas)
+    // Inside EXEC there is no waiting: the count is what has been acked so far, as in Redis
+    if (already_acked >= expected_replicas || ((client_t *)client)->in_exec)
     {
         char response[32];
         sprintf(response, ":%d\r\n", already_acked);
@@ -1680,7 +2349,10 @@ char *handle_wait_command(redis_server_t *server, char **args, int argc, void *c
     server->pending_wait.start_time = get_current_time_ms();
     server->pending_wait.timeout_ms = timeout_ms;
     server->pending_wait.active = 1;
+    schedule_wait_timeout(server);
 
+    // GETACK must reach the replicas after the writes it is asking about
+    flush_replica_output(server);
     char getack_cmd[] = "*3\r\n$8\r\nREPLCONF\r\n$6\r\nGETACK\r\n$1\r\n*\r\n";
     for (int i = 0; i < MAX_REPLICAS; i++)
     {
@@ -1850,6 +2522,9 @@ int add_replica(redis_server_t *server, int replica_fd)
 
     replication_info_t *repl_info = server->replication_info;
 
+    // Writes buffered so far predate this replica and go to the ones already attached
+    flush_replica_output(server);
+
     for (int i = 0; i < repl_info->connected_slaves; i++)
     {
         if (repl_info->replicas_fd[i] == replica_fd)
@@ -1873,112 +2548,522 @@ int add_replica(redis_server_t *server, int replica_fd)
     return -1; 
 }
 
-char *handle_config_get_command(redis_server_t *server, char **args, int argc, void *client)
+char *handle_config_get_command(redis_server_t *server, char **args, int argc, void *client)
+{
+    if (strcasecmp(args[1], "resetstat") == 0)
+    {
+        command_stats_reset(server->command_stats);
+        server->stat_output_limit_disconnections = 0;
+        server->stat_pubsub_dropped_messages = 0;
+        client_add_reply_shared(client, &shared_replies.ok);
+        return NULL;
+    }
+
+    if (argc < 3)
+    {
+        return strdup("-ERR wrong number of arguments for 'config get' command\r\n");
+    }
+
+    if (strcasecmp(args[1], "get") == 0)
+    {
+        char *param = args[2];
+        const char *value;
+
+        if (strcasecmp(param, "dir") == 0)
+        {
+            value = server->rdb_dir;
+        }
+        else if (strcasecmp(param, "dbfilename") == 0)
+        {
+            value = server->rdb_dir;
+        }
+        else if (strcasecmp(param, "slowlog-log-slower-than") == 0 && server->slowlog)
+        {
+            client_add_reply_array_len(client, 2);
+            client_add_reply_bulk_cstr(client, param);
+            client_add_reply_bulk_ll(client, server->slowlog->slower_than_us);
+            return NULL;
+        }
+        else if (strcasecmp(param, "slowlog-max-len") == 0 && server->slowlog)
+        {
+            client_add_reply_array_len(client, 2);
+            client_add_reply_bulk_cstr(client, param);
+            client_add_reply_bulk_ll(client, (long long)server->slowlog->max_len);
+            return NULL;
+        }
+        else if (strcasecmp(param, "latency-monitor-threshold") == 0 && server->latency_monitor)
+        {
+            client_add_reply_array_len(client, 2);
+            client_add_reply_bulk_cstr(client, param);
+            client_add_reply_bulk_ll(client, server->latency_monitor->threshold_ms);
+            return NULL;
+        }
+        else
+        {
+            client_add_reply_array_len(client, 0);
+            return NULL;
+        }
+
+        client_add_reply_array_len(client, 2);
+        client_add_reply_bulk_cstr(client, param);
+        client_add_reply_bulk_cstr(client, value);
+        return NULL;
+    }
+
+    return strdup("-ERR unknown CONFIG subcommand\r\n");
+}
+
+// SLOWLOG GET [count] | LEN | RESET
+char *handle_slowlog_command(redis_server_t *server, char **args, int argc, void *client)
+{
+    slowlog_t *slowlog = server->slowlog;
+
+    if (strcasecmp(args[1], "len") == 0 && argc == 2)
+    {
+        client_add_reply_integer(client, slowlog ? (long long)slowlog->len : 0);
+        return NULL;
+    }
+    if (strcasecmp(args[1], "reset") == 0 && argc == 2)
+    {
+        slowlog_reset(slowlog);
+        client_add_reply_shared(client, &shared_replies.ok);
+        return NULL;
+    }
+    if (strcasecmp(args[1], "get") != 0)
+    {
+        return strdup("-ERR unknown SLOWLOG subcommand, try GET, LEN or RESET\r\n");
+    }
+
+    long long count = 10;
+    if (argc == 3)
+    {
+        char *endptr;
+        count = strtoll(args[2], &endptr, 10);
+        if (*endptr != '\0' || count < -1)
+        {
+            return strdup("-ERR count should be greater than or equal to -1\r\n");
+        }
+    }
+    size_t len = slowlog ? slowlog->len : 0;
+    if (count == -1 || (unsigned long long)count > len)
+    {
+        count = (long long)len;
+    }
+
+    client_add_reply_array_len(client, count);
+    for (long long i = 0; i < count; i++)
+    {
+        const slowlog_entry_t *entry = slowlog_get(slowlog, (size_t)i);
+        char client_name[32];
+        snprintf(client_name, sizeof(client_name), "fd=%d", entry->client_fd);
+
+        client_add_reply_array_len(client, 6);
+        client_add_reply_integer(client, entry->id);
+        client_add_reply_integer(client, (long long)entry->time);
+        client_add_reply_integer(client, entry->duration_us);
+        client_add_reply_array_len(client, entry->argc);
+        for (int j = 0; j < entry->argc; j++)
+        {
+            client_add_reply_bulk(client, entry->argv[j], sdslen(entry->argv[j]));
+        }
+        client_add_reply_bulk_cstr(client, client_name);
+        client_add_reply_bulk(client, "", 0);
+    }
+    return NULL;
+}
+
+// LATENCY LATEST | HISTORY event | RESET [event ...]
+char *handle_latency_command(redis_server_t *server, char **args, int argc, void *client)
+{
+    latency_monitor_t *monitor = server->latency_monitor;
+
+    if (strcasecmp(args[1], "latest") == 0 && argc == 2)
+    {
+        int count = monitor ? monitor->count : 0;
+        client_add_reply_array_len(client, count);
+        for (int i = 0; i < count; i++)
+        {
+            latency_series_t *series = &monitor->events[i];
+            const latency_sample_t *latest = latency_series_get(series, series->len - 1);
+
+            client_add_reply_array_len(client, 4);
+            client_add_reply_bulk_cstr(client, series->event);
+            client_add_reply_integer(client, (long long)latest->time);
+            client_add_reply_integer(client, latest->latency_ms);
+            client_add_reply_integer(client, series->max_ms);
+        }
+        return NULL;
+    }
+    if (strcasecmp(args[1], "history") == 0 && argc == 3)
+    {
+        latency_series_t *series = latency_monitor_find(monitor, args[2]);
+        int len = series ? series->len : 0;
+        client_add_reply_array_len(client, len);
+        for (int i = 0; i < len; i++)
+        {
+            const latency_sample_t *sample = latency_series_get(series, i);
+            client_add_reply_array_len(client, 2);
+            client_add_reply_integer(client, (long long)sample->time);
+            client_add_reply_integer(client, sample->latency_ms);
+        }
+        return NULL;
+    }
+    if (strcasecmp(args[1], "reset") == 0)
+    {
+        client_add_reply_integer(client, latency_monitor_reset(monitor, args + 2, argc - 2));
+        return NULL;
+    }
+
+    return strdup("-ERR unknown LATENCY subcommand, try LATEST, HISTORY or RESET\r\n");
+}
+
+// KEYS pattern: every live key matching the glob, in one reply
+char *handle_keys_command(redis_server_t *server, char **args, int argc, void *client)
+{
+    if (argc != 2)
+    {
+        return strdup("-ERR wrong number of arguments for 'keys' command\r\n");
+    }
+
+    glob_pattern_t glob;
+    glob_compile(&glob, args[1], strlen(args[1]));
+
+    /*
+     * Matches are collected first because the reply starts with their
+     * count. Nothing is deleted during the walk (expired keys are only
+     * skipped), so pointers to the dict's own key bytes stay valid.
+     */
+    size_t count = 0, capacity = 0;
+    char **matches = NULL;
+
+    hash_table_iterator_t *iter = hash_table_iterator_create(server->db->dict);
+    if (!iter)
+    {
+        client_add_reply_shared(client, &shared_replies.oom);
+        return NULL;
+    }
+
+    char *key;
+    void *value;
+    while (hash_table_iterator_next(iter, &key, &value))
+    {
+        if (!glob_pattern_match(&glob, key, strlen(key)) || is_expired((redis_object_t *)value))
+            continue;
+
+        if (count == capacity)
+        {
+            capacity = capacity ? capacity * 2 : 64;
+            char **grown = realloc(matches, capacity * sizeof(char *));
+            if (!grown)
+            {
+                free(matches);
+                hash_table_iterator_destroy(iter);
+                client_add_reply_shared(client, &shared_replies.oom);
+                return NULL;
+            }
+            matches = grown;
+        }
+        matches[count++] = key;
+    }
+    hash_table_iterator_destroy(iter);
+
+    client_add_reply_array_len(client, (long long)count);
+    for (size_t i = 0; i < count; i++)
+    {
+        client_add_reply_bulk_cstr(client, matches[i]);
+    }
+    free(matches);
+
+    return NULL;
+}
+
+/* What one SCAN/ZSCAN call collected, copied out so filtering may delete expired keys */
+typedef struct scan_batch
+{
+    sds *items;
+    double *scores;         // ZSCAN only
+    size_t count;
+    size_t capacity;
+    int oom;
+} scan_batch_t;
+
+typedef struct scan_options
+{
+    glob_pattern_t match;
+    long count;
+    const char *type;       // SCAN only
+} scan_options_t;
+
+static void scan_batch_add(scan_batch_t *batch, const char *item, double score)
+{
+    if (batch->oom)
+        return;
+    if (batch->count == batch->capacity)
+    {
+        size_t capacity = batch->capacity ? batch->capacity * 2 : 16;
+        sds *items = realloc(batch->items, capacity * sizeof(sds));
+        if (items)
+            batch->items = items;
+        double *scores = realloc(batch->scores, capacity * sizeof(double));
+        if (scores)
+            batch->scores = scores;
+        if (!items || !scores)
+        {
+            batch->oom = 1;
+            return;
+        }
+        batch->capacity = capacity;
+    }
+
+    sds copy = sdsnew(item);
+    if (!copy)
+    {
+        batch->oom = 1;
+        return;
+    }
+    batch->items[batch->count] = copy;
+    batch->scores[batch->count] = score;
+    batch->count++;
+}
+
+static void scan_collect_key(void *privdata, const char *key, void *value)
+{
+    (void)value;
+    scan_batch_add(privdata, key, 0);
+}
+
+static void scan_collect_member(void *privdata, const char *member, void *value)
+{
+    scan_batch_add(privdata, member, *(double *)value);
+}
+
+static void scan_batch_free(scan_batch_t *batch)
+{
+    for (size_t i = 0; i < batch->count; i++)
+        sdsfree(batch->items[i]);
+    free(batch->items);
+    free(batch->scores);
+}
+
+// Cursors are plain unsigned decimals, as SCAN returned them
+static int parse_scan_cursor(const char *str, unsigned long *cursor)
+{
+    char *end;
+    if (!isdigit((unsigned char)str[0]))
+        return 0;
+    errno = 0;
+    *cursor = strtoul(str, &end, 10);
+    return *end == '\0' && errno != ERANGE;
+}
+
+// [MATCH pattern] [COUNT count] [TYPE type] from args[first] on; replies and returns -1 on error
+static int parse_scan_options(char **args, int argc, int first, int allow_type, scan_options_t *opts, void *client)
 {
-    if (argc < 3)
-    {
-        return strdup("-ERR wrong number of arguments for 'config get' command\r\n");
-    }
+    glob_compile(&opts->match, "*", 1);
+    opts->count = SCAN_DEFAULT_COUNT;
+    opts->type = NULL;
 
-    if (strcmp(args[1], "get") == 0)
+    for (int i = first; i < argc; i += 2)
     {
-        char *param = args[2];
-
-        char **response_args = malloc(2 * sizeof(char *));
-        if (!response_args)
+        if (i + 1 >= argc)
         {
-            return strdup(RESP_MEMORY_ERROR);
+            client_add_reply_shared(client, &shared_replies.syntax_error);
+            return -1;
         }
-
-        response_args[0] = strdup(param);
-
-        if (strcmp(param, "dir") == 0)
+        if (strcasecmp(args[i], "match") == 0)
+        {
+            glob_compile(&opts->match, args[i + 1], strlen(args[i + 1]));
+        }
+        else if (strcasecmp(args[i], "count") == 0)
         {
-            response_args[1] = strdup(server->rdb_dir);
+            long long count;
+            if (!string_to_ll(args[i + 1], strlen(args[i + 1]), &count))
+            {
+                client_add_reply_shared(client, &shared_replies.not_integer);
+                return -1;
+            }
+            if (count < 1)
+            {
+                client_add_reply_shared(client, &shared_replies.syntax_error);
+                return -1;
+            }
+            opts->count = count > LONG_MAX / SCAN_MAX_EMPTY_FACTOR ? LONG_MAX / SCAN_MAX_EMPTY_FACTOR : (long)count;
         }
-        else if (strcmp(param, "dbfilename") == 0)
+        else if (allow_type && strcasecmp(args[i], "type") == 0)
         {
-            response_args[1] = strdup(server->rdb_dir);
+            opts->type = args[i + 1];
         }
         else
         {
-            free(response_args[0]);
-            free(response_args);
-            return encode_resp_array(NULL, 0);
+            client_add_reply_shared(client, &shared_replies.syntax_error);
+            return -1;
         }
+    }
+    return 0;
+}
 
-        char *result = encode_resp_array(response_args, 2);
-
-        free(response_args[0]);
-        free(response_args[1]);
-        free(response_args);
+/*
+ * Collect from ht until count items came out or count * 10 buckets were
+ * visited, whichever is first, so a sparse table cannot turn one call into
+ * a full walk. Returns the next cursor.
+ */
+static unsigned long scan_collect(hash_table_t *ht, unsigned long cursor, long count,
+                                  hash_table_scan_fn fn, scan_batch_t *batch)
+{
+    long max_buckets = count * SCAN_MAX_EMPTY_FACTOR;
+    do
+    {
+        cursor = hash_table_scan(ht, cursor, fn, batch);
+    } while (cursor && max_buckets-- && batch->count < (size_t)count && !batch->oom);
+    return cursor;
+}
 
-        return result;
-    }
+static int scan_item_matches(const scan_options_t *opts, sds item)
+{
+    return glob_pattern_match(&opts->match, item, sdslen(item));
+}
 
-    return strdup("-ERR unknown CONFIG subcommand\r\n");
+static void add_reply_scan_cursor(void *client, unsigned long cursor)
+{
+    char buf[32];
+    int len = snprintf(buf, sizeof(buf), "%lu", cursor);
+    client_add_reply_array_len(client, 2);
+    client_add_reply_bulk(client, buf, len);
 }
 
-char *handle_keys_command(redis_server_t *server, char **args, int argc, void *client)
+/*
+ * SCAN cursor [MATCH pattern] [COUNT count] [TYPE type]. In sharded mode
+ * the cursor is dict_cursor * shards + shard: routing sends it to that
+ * shard, and when its dict is done the walk moves on to the next one.
+ */
+char *handle_scan_command(redis_server_t *server, char **args, int argc, void *client)
 {
-    if (argc != 2)
+    unsigned long cursor;
+    if (!parse_scan_cursor(args[1], &cursor))
     {
-        return strdup("-ERR wrong number of arguments for 'keys' command\r\n");
+        client_add_reply_error(client, "ERR invalid cursor");
+        return NULL;
     }
+    scan_options_t opts;
+    if (parse_scan_options(args, argc, 2, 1, &opts, client) < 0)
+        return NULL;
 
-    char *pattern = args[1];
+    unsigned long shards = server->shard ? (unsigned long)server->shard->group->count : 1;
+    unsigned long shard_id = server->shard ? (unsigned long)server->shard->id : 0;
+    if (cursor % shards != shard_id)
+    {
+        // Only inside MULTI, which runs on the transaction's shard whatever the cursor says
+        client_add_reply_error(client, "ERR invalid cursor");
+        return NULL;
+    }
 
-    if (strcmp(pattern, "*") != 0)
+    scan_batch_t batch = {0};
+    unsigned long next = scan_collect(server->db->dict, cursor / shards, opts.count, scan_collect_key, &batch);
+    if (batch.oom)
     {
-        return strdup("*0\r\n");
+        scan_batch_free(&batch);
+        client_add_reply_shared(client, &shared_replies.oom);
+        return NULL;
     }
 
-    hash_table_iterator_t *iter = hash_table_iterator_create(server->db->dict);
-    if (!iter)
+    // Filter in place; lookup_key also drops keys that expired
+    size_t kept = 0;
+    for (size_t i = 0; i < batch.count; i++)
     {
-        return strdup("*0\r\n");
+        sds key = batch.items[i];
+        redis_object_t *obj = NULL;
+        if (scan_item_matches(&opts, key))
+            obj = lookup_key(server, key);
+        if (obj && (!opts.type || strcasecmp(opts.type, redis_type_to_string(obj->type)) == 0))
+        {
+            batch.items[kept++] = key;
+        }
+        else
+        {
+            sdsfree(key);
+        }
     }
+    batch.count = kept;
 
-    int key_count = 0;
-    char *key;
-    void *value;
+    if (next)
+        next = next * shards + shard_id;
+    else if (shard_id + 1 < shards)
+        next = shard_id + 1;
 
-    while (hash_table_iterator_next(iter, &key, &value))
+    add_reply_scan_cursor(client, next);
+    client_add_reply_array_len(client, (long long)batch.count);
+    for (size_t i = 0; i < batch.count; i++)
+        client_add_reply_bulk(client, batch.items[i], sdslen(batch.items[i]));
+    scan_batch_free(&batch);
+    return NULL;
+}
+
+// ZSCAN key cursor [MATCH pattern] [COUNT count]: member, score pairs
+char *handle_zscan_command(redis_server_t *server, char **args, int argc, void *client)
+{
+    unsigned long cursor;
+    if (!parse_scan_cursor(args[2], &cursor))
     {
-        key_count++;
+        client_add_reply_error(client, "ERR invalid cursor");
+        return NULL;
     }
+    scan_options_t opts;
+    if (parse_scan_options(args, argc, 3, 0, &opts, client) < 0)
+        return NULL;
 
-    if (key_count == 0)
+    redis_object_t *obj = lookup_key(server, args[1]);
+    if (!obj)
     {
-        hash_table_iterator_destroy(iter);
-        return strdup("*0\r\n");
+        add_reply_scan_cursor(client, 0);
+        client_add_reply_shared(client, &shared_replies.empty_array);
+        return NULL;
     }
-
-    // Collect all keys
-    char **keys_array = malloc(key_count * sizeof(char *));
-    if (!keys_array)
+    if (obj->type != REDIS_SORTED_SET)
     {
-        hash_table_iterator_destroy(iter);
-        return strdup("-ERR out of memory\r\n");
+        client_add_reply_shared(client, &shared_replies.wrongtype);
+        return NULL;
     }
 
-    hash_table_iterator_destroy(iter);
-    iter = hash_table_iterator_create(server->db->dict);
-
-    int i = 0;
-    while (hash_table_iterator_next(iter, &key, &value) && i < key_count)
+    redis_sorted_set_t *zset = (redis_sorted_set_t *)obj->ptr;
+    scan_batch_t batch = {0};
+    unsigned long next = scan_collect(zset->dict, cursor, opts.count, scan_collect_member, &batch);
+    if (batch.oom)
     {
-        keys_array[i] = key; 
-        i++;
+        scan_batch_free(&batch);
+        client_add_reply_shared(client, &shared_replies.oom);
+        return NULL;
     }
 
-    char *response = encode_resp_array(keys_array, i);
+    size_t kept = 0;
+    for (size_t i = 0; i < batch.count; i++)
+    {
+        if (scan_item_matches(&opts, batch.items[i]))
+        {
+            batch.items[kept] = batch.items[i];
+            batch.scores[kept++] = batch.scores[i];
+        }
+        else
+        {
+            sdsfree(batch.items[i]);
+        }
+    }
+    batch.count = kept;
 
-    // Cleanup
-    free(keys_array);
-    hash_table_iterator_destroy(iter);
+    add_reply_scan_cursor(client, next);
+    client_add_reply_array_len(client, (long long)batch.count * 2);
+    for (size_t i = 0; i < batch.count; i++)
+    {
+        client_add_reply_bulk(client, batch.items[i], sdslen(batch.items[i]));
+        client_add_reply_double(client, batch.scores[i]);
+    }
+    scan_batch_free(&batch);
+    return NULL;
+}
 
-    return response;
+// What SUBSCRIBE and friends report: channels and patterns together
+static int client_subscription_count(client_t *c)
+{
+    return c->subscribed_channels + c->subscribed_patterns;
 }
 
 char *handle_subscribe_command(redis_server_t *server, char **args, int argc, void *client)
@@ -2023,31 +3108,30 @@ char *handle_subscribe_command(redis_server_t *server, char **args, int argc, vo
         list_rpush(list, c);
     }
 
-    int channel_len = strlen(channel_name);
-    int response_size = 64 + channel_len;
-    char *response = malloc(response_size);
-    if (!response)
-    {
-        return strdup("-ERR out of memory\r\n");
-    }
-
-    snprintf(response, response_size,
-             "*3\r\n$9\r\nsubscribe\r\n$%d\r\n%s\r\n:%d\r\n",
-             channel_len, channel_name, c->subscribed_channels);
+    client_add_reply_array_len(c, 3);
+    client_add_reply_bulk(c, "subscribe", 9);
+    client_add_reply_bulk_cstr(c, channel_name);
+    client_add_reply_integer(c, client_subscription_count(c));
 
-    return response;
+    return NULL;
 }
 
-static int is_pubsub_command(const char *command)
+// Queue an encoded message for one subscriber; 1 when it will be delivered
+static int publish_to_client(redis_server_t *server, client_t *cur, const char *response, size_t response_len)
 {
-    for (int i = 0; pubsub_allowed_commands[i] != NULL; i++)
+    if (!cur || cur->fd <= 0)
     {
-        if (strcmp(command, pubsub_allowed_commands[i]) == 0)
-        {
-            return 1;
-        }
+        return 0;
     }
-    return 0;
+
+    reply_to_client(server, cur, response, response_len);
+    if (cur->close_asap)
+    {
+        // Over its output limit: the message goes away with the connection
+        server->stat_pubsub_dropped_messages++;
+        return 0;
+    }
+    return 1;
 }
 
 char *handle_publish_command(redis_server_t *server, char **args, int argc, void *client)
@@ -2059,64 +3143,51 @@ char *handle_publish_command(redis_server_t *server, char **args, int argc, void
 
     char *channel_name = args[1];
     char *message = args[2];
+    int sent_count = 0;
 
     redis_object_t *obj = hash_table_get(server->channels_map, channel_name);
-    if (!obj)
-    {
-        return encode_number("0");
-    }
-
-    channel_t *channel = (channel_t *)obj->ptr;
-    if (!channel || !channel->clients || channel->clients->length == 0)
+    channel_t *channel = obj ? (channel_t *)obj->ptr : NULL;
+    if (channel && channel->clients && channel->clients->length > 0)
     {
-        return encode_number("0");
-    }
+        // Encoded once and copied into every subscriber's buffer
+        char *response_args[3] = {"message", channel_name, message};
+        char *response = encode_resp_array(response_args, 3);
+        if (!response)
+        {
+            client_add_reply_shared(client, &shared_replies.oom);
+            return NULL;
+        }
 
-    char **response_args = malloc(3 * sizeof(char *));
-    if (!response_args)
-    {
-        return strdup("-ERR out of memory\r\n");
+        size_t response_len = strlen(response);
+        for (list_node_t *node = channel->clients->head; node; node = node->next)
+        {
+            sent_count += publish_to_client(server, (client_t *)node->data, response, response_len);
+        }
+        free(response);
     }
 
-    response_args[0] = strdup("message");
-    response_args[1] = strdup(channel_name);
-    response_args[2] = strdup(message);
-
-    char *response = encode_resp_array(response_args, 3);
-    if (!response)
+    // The pmessage names the pattern, so each match gets its own encoding
+    size_t channel_len = strlen(channel_name);
+    for (list_node_t *node = server->pubsub_patterns->head; node; node = node->next)
     {
-        free(response_args[0]);
-        free(response_args[1]);
-        free(response_args[2]);
-        free(response_args);
-        return strdup("-ERR out of memory\r\n");
-    }
+        pubsub_pattern_t *pat = (pubsub_pattern_t *)node->data;
+        if (!glob_pattern_match(&pat->glob, channel_name, channel_len))
+        {
+            continue;
+        }
 
-    int sent_count = 0;
-    list_node_t *node = channel->clients->head;
-    while (node)
-    {
-        client_t *cur = (client_t *)node->data;
-        if (cur && cur->fd > 0)
+        char *response_args[4] = {"pmessage", pat->pattern, channel_name, message};
+        char *response = encode_resp_array(response_args, 4);
+        if (!response)
         {
-            ssize_t sent = send(cur->fd, response, strlen(response), MSG_DONTWAIT);
-            if (sent > 0)
-            {
-                sent_count++;
-            }
+            continue;
         }
-        node = node->next;
+        sent_count += publish_to_client(server, pat->client, response, strlen(response));
+        free(response);
     }
 
-    free(response_args[0]);
-    free(response_args[1]);
-    free(response_args[2]);
-    free(response_args);
-    free(response);
-
-    char n_str[32];
-    snprintf(n_str, sizeof(n_str), "%d", sent_count);
-    return encode_number(n_str);
+    client_add_reply_integer(client, sent_count);
+    return NULL;
 }
 
 char *handle_unsubscribe_command(redis_server_t *server, char **args, int argc, void *client)
@@ -2132,14 +3203,11 @@ char *handle_unsubscribe_command(redis_server_t *server, char **args, int argc,
     redis_object_t *obj = hash_table_get(server->channels_map, channel_name);
     if (!obj)
     {
-        char *response_args[3];
-        response_args[0] = "unsubscribe";
-        response_args[1] = channel_name;
-        char count_str[32];
-        snprintf(count_str, sizeof(count_str), "%d", c->subscribed_channels);
-        response_args[2] = count_str;
-
-        return encode_resp_array(response_args, 3);
+        client_add_reply_array_len(c, 3);
+        client_add_reply_bulk(c, "unsubscribe", 11);
+        client_add_reply_bulk_cstr(c, channel_name);
+        client_add_reply_integer(c, client_subscription_count(c));
+        return NULL;
     }
 
     channel_t *channel = (channel_t *)obj->ptr;
@@ -2150,7 +3218,7 @@ char *handle_unsubscribe_command(redis_server_t *server, char **args, int argc,
             c->subscribed_channels--;
             channel->n_clients--;
 
-            if (c->subscribed_channels == 0)
+            if (client_subscription_count(c) == 0)
             {
                 c->sub_mode = 0;
             }
@@ -2162,25 +3230,132 @@ char *handle_unsubscribe_command(redis_server_t *server, char **args, int argc,
         }
     }
 
-    int channel_len = strlen(channel_name);
-    int response_size = 128 + channel_len;
-    char *response = malloc(response_size);
-    if (!response)
+    client_add_reply_array_len(c, 3);
+    client_add_reply_bulk(c, "unsubscribe", 11);
+    client_add_reply_bulk_cstr(c, channel_name);
+    client_add_reply_integer(c, client_subscription_count(c));
+
+    return NULL;
+}
+
+static pubsub_pattern_t *find_pubsub_pattern(redis_server_t *server, client_t *c, const char *pattern)
+{
+    for (list_node_t *node = server->pubsub_patterns->head; node; node = node->next)
+    {
+        pubsub_pattern_t *pat = (pubsub_pattern_t *)node->data;
+        if (pat->client == c && strcmp(pat->pattern, pattern) == 0)
+        {
+            return pat;
+        }
+    }
+    return NULL;
+}
+
+static void add_reply_pattern_subscription(client_t *c, const char *kind, const char *pattern)
+{
+    client_add_reply_array_len(c, 3);
+    client_add_reply_bulk_cstr(c, kind);
+    if (pattern)
+    {
+        client_add_reply_bulk_cstr(c, pattern);
+    }
+    else
+    {
+        client_add_reply_null(c);
+    }
+    client_add_reply_integer(c, client_subscription_count(c));
+}
+
+static void remove_pubsub_pattern(redis_server_t *server, client_t *c, pubsub_pattern_t *pat)
+{
+    list_remove(server->pubsub_patterns, pat);
+    free(pat);
+    c->subscribed_patterns--;
+    if (client_subscription_count(c) == 0)
+    {
+        c->sub_mode = 0;
+    }
+}
+
+// PSUBSCRIBE pattern [pattern ...]
+char *handle_psubscribe_command(redis_server_t *server, char **args, int argc, void *client)
+{
+    if (!server || !args || argc < 2 || !client)
+    {
+        return strdup("-ERR invalid arguments\r\n");
+    }
+
+    client_t *c = (client_t *)client;
+    for (int i = 1; i < argc; i++)
+    {
+        if (!find_pubsub_pattern(server, c, args[i]))
+        {
+            pubsub_pattern_t *pat = create_pubsub_pattern(c, args[i]);
+            if (!pat)
+            {
+                client_add_reply_shared(client, &shared_replies.oom);
+                return NULL;
+            }
+            list_rpush(server->pubsub_patterns, pat);
+            c->subscribed_patterns++;
+            c->sub_mode = 1;
+        }
+        add_reply_pattern_subscription(c, "psubscribe", args[i]);
+    }
+
+    return NULL;
+}
+
+// PUNSUBSCRIBE [pattern ...]; without patterns drops all of the client's
+char *handle_punsubscribe_command(redis_server_t *server, char **args, int argc, void *client)
+{
+    if (!server || !args || !client)
     {
-        return strdup("-ERR out of memory\r\n");
+        return strdup("-ERR invalid arguments\r\n");
     }
 
-    snprintf(response, response_size,
-             "*3\r\n$11\r\nunsubscribe\r\n$%d\r\n%s\r\n:%d\r\n",
-             channel_len, channel_name, c->subscribed_channels);
+    client_t *c = (client_t *)client;
+    if (argc > 1)
+    {
+        for (int i = 1; i < argc; i++)
+        {
+            pubsub_pattern_t *pat = find_pubsub_pattern(server, c, args[i]);
+            if (pat)
+            {
+                remove_pubsub_pattern(server, c, pat);
+            }
+            add_reply_pattern_subscription(c, "punsubscribe", args[i]);
+        }
+        return NULL;
+    }
 
-    return response;
+    if (c->subscribed_patterns == 0)
+    {
+        add_reply_pattern_subscription(c, "punsubscribe", NULL);
+        return NULL;
+    }
+
+    list_node_t *node = server->pubsub_patterns->head;
+    while (node)
+    {
+        list_node_t *next = node->next;
+        pubsub_pattern_t *pat = (pubsub_pattern_t *)node->data;
+        if (pat->client == c)
+        {
+            // The reply needs the name after the subscription is gone
+            char *pattern = strdup(pat->pattern);
+            remove_pubsub_pattern(server, c, pat);
+            add_reply_pattern_subscription(c, "punsubscribe", pattern ? pattern : "");
+            free(pattern);
+        }
+        node = next;
+    }
+
+    return NULL;
 }
 
 char *handle_zadd_command(redis_server_t *server, char **args, int argc, void *client)
 {
-    (void)client;
-
     if (argc < 4 || (argc - 2) % 2 != 0)
     {
         return strdup("-ERR wrong number of arguments for 'zadd' command\r\n");
@@ -2194,14 +3369,16 @@ char *handle_zadd_command(redis_server_t *server, char **args, int argc, void *c
         obj = redis_object_create_sorted_set();
         if (!obj)
         {
-            return strdup("-ERR out of memory\r\n");
+            client_add_reply_shared(client, &shared_replies.oom);
+            return NULL;
         }
     /* hash_table_set duplicates the key internally */
     hash_table_set(server->db->dict, key, obj);
     }
     else if (obj->type != REDIS_SORTED_SET)
     {
-        return strdup("-WRONGTYPE Operation against a key holding the wrong kind of value\r\n");
+        client_add_reply_shared(client, &shared_replies.wrongtype);
+        return NULL;
     }
 
     redis_sorted_set_t *zset = (redis_sorted_set_t *)obj->ptr;
@@ -2226,19 +3403,17 @@ char *handle_zadd_command(redis_server_t *server, char **args, int argc, void *c
         }
         else if (result == -1)
         {
-            return strdup("-ERR out of memory\r\n");
+            client_add_reply_shared(client, &shared_replies.oom);
+            return NULL;
         }
     }
 
-    char response[32];
-    sprintf(response, ":%d\r\n", added_count);
-    return strdup(response);
+    client_add_reply_integer(client, added_count);
+    return NULL;
 }
 
 char *handle_zrange_command(redis_server_t *server, char **args, int argc, void *client)
 {
-    (void)client;
-
     if (argc < 4 || argc > 5)
     {
         return strdup("-ERR wrong number of arguments for 'zrange' command\r\n");
@@ -2257,19 +3432,22 @@ char *handle_zrange_command(redis_server_t *server, char **args, int argc, void
         }
         else
         {
-            return strdup("-ERR syntax error\r\n");
+            client_add_reply_shared(client, &shared_replies.syntax_error);
+            return NULL;
         }
     }
 
     redis_object_t *obj = (redis_object_t *)hash_table_get(server->db->dict, key);
     if (!obj)
     {
-        return strdup("*0\r\n");
+        client_add_reply_array_len(client, 0);
+        return NULL;
     }
 
     if (obj->type != REDIS_SORTED_SET)
     {
-        return strdup("-WRONGTYPE Operation against a key holding the wrong kind of value\r\n");
+        client_add_reply_shared(client, &shared_replies.wrongtype);
+        return NULL;
     }
 
     redis_sorted_set_t *zset = (redis_sorted_set_t *)obj->ptr;
@@ -2279,82 +3457,26 @@ char *handle_zrange_command(redis_server_t *server, char **args, int argc, void
 
     if (count <= 0 || !members)
     {
-        return strdup("*0\r\n");
-    }
-
-    size_t response_size = 1024;
-    char *response = malloc(response_size);
-    if (!response)
-    {
-        free(members);
-        return strdup("-ERR out of memory\r\n");
+        client_add_reply_array_len(client, 0);
+        return NULL;
     }
 
-    int pos = 0;
-
-    if (with_scores)
-    {
-        pos += sprintf(response + pos, "*%d\r\n", count * 2);
-
-        for (int i = 0; i < count; i++)
-        {
-            pos += sprintf(response + pos, "$%zu\r\n%s\r\n",
-                           strlen(members[i].member), members[i].member);
-
-            char score_str[32];
-            if (members[i].score == (long long)members[i].score)
-            {
-                sprintf(score_str, "%lld", (long long)members[i].score);
-            }
-            else
-            {
-                sprintf(score_str, "%.17g", members[i].score);
-            }
-            pos += sprintf(response + pos, "$%zu\r\n%s\r\n",
-                           strlen(score_str), score_str);
-
-            if (pos > response_size - 200)
-            {
-                response_size *= 2;
-                response = realloc(response, response_size);
-                if (!response)
-                {
-                    free(members);
-                    return strdup("-ERR out of memory\r\n");
-                }
-            }
-        }
-    }
-    else
+    client_add_reply_array_len(client, with_scores ? count * 2 : count);
+    for (int i = 0; i < count; i++)
     {
-        pos += sprintf(response + pos, "*%d\r\n", count);
-
-        for (int i = 0; i < count; i++)
+        client_add_reply_bulk_cstr(client, members[i].member);
+        if (with_scores)
         {
-            pos += sprintf(response + pos, "$%zu\r\n%s\r\n",
-                           strlen(members[i].member), members[i].member);
-
-            if (pos > response_size - 200)
-            {
-                response_size *= 2;
-                response = realloc(response, response_size);
-                if (!response)
-                {
-                    free(members);
-                    return strdup("-ERR out of memory\r\n");
-                }
-            }
+            client_add_reply_double(client, members[i].score);
         }
     }
 
     free(members);
-    return response;
+    return NULL;
 }
 
 char *handle_zrem_command(redis_server_t *server, char **args, int argc, void *client)
 {
-    (void)client;
-
     if (argc < 3)
     {
         return strdup("-ERR wrong number of arguments for 'zrem' command\r\n");
@@ -2365,12 +3487,14 @@ char *handle_zrem_command(redis_server_t *server, char **args, int argc, void *c
 
     if (!obj)
     {
-        return strdup(":0\r\n");
+        client_add_reply_integer(client, 0);
+        return NULL;
     }
 
     if (obj->type != REDIS_SORTED_SET)
     {
-        return strdup("-WRONGTYPE Operation against a key holding the wrong kind of value\r\n");
+        client_add_reply_shared(client, &shared_replies.wrongtype);
+        return NULL;
     }
 
     redis_sorted_set_t *zset = (redis_sorted_set_t *)obj->ptr;
@@ -2388,18 +3512,16 @@ char *handle_zrem_command(redis_server_t *server, char **args, int argc, void *c
     // If sorted set is empty, remove the key from database
     if (sorted_set_card(zset) == 0)
     {
-        hash_table_delete(server->db->dict, key);
         redis_object_destroy(obj);
+        hash_table_delete(server->db->dict, key);
     }
 
-    char response[32];
-    sprintf(response, ":%d\r\n", removed_count);
-    return strdup(response);
+    client_add_reply_integer(client, removed_count);
+    return NULL;
 }
 
 char *handle_zcard_command(redis_server_t *server, char **args, int argc, void *client)
 {
-    (void)client;
     (void)argc;
 
     char *key = args[1];
@@ -2407,25 +3529,23 @@ char *handle_zcard_command(redis_server_t *server, char **args, int argc, void *
 
     if (!obj)
     {
-        return strdup(":0\r\n");
+        client_add_reply_integer(client, 0);
+        return NULL;
     }
 
     if (obj->type != REDIS_SORTED_SET)
     {
-        return strdup("-WRONGTYPE Operation against a key holding the wrong kind of value\r\n");
+        client_add_reply_shared(client, &shared_replies.wrongtype);
+        return NULL;
     }
 
     redis_sorted_set_t *zset = (redis_sorted_set_t *)obj->ptr;
-    size_t cardinality = sorted_set_card(zset);
-
-    char response[32];
-    sprintf(response, ":%zu\r\n", cardinality);
-    return strdup(response);
+    client_add_reply_integer(client, sorted_set_card(zset));
+    return NULL;
 }
 
 char *handle_zscore_command(redis_server_t *server, char **args, int argc, void *client)
 {
-    (void)client;
     (void)argc;
 
     char *key = args[1];
@@ -2435,12 +3555,14 @@ char *handle_zscore_command(redis_server_t *server, char **args, int argc, void
 
     if (!obj)
     {
-        return strdup("$-1\r\n");
+        client_add_reply_null(client);
+        return NULL;
     }
 
     if (obj->type != REDIS_SORTED_SET)
     {
-        return strdup("-WRONGTYPE Operation against a key holding the wrong kind of value\r\n");
+        client_add_reply_shared(client, &shared_replies.wrongtype);
+        return NULL;
     }
 
     redis_sorted_set_t *zset = (redis_sorted_set_t *)obj->ptr;
@@ -2448,25 +3570,16 @@ char *handle_zscore_command(redis_server_t *server, char **args, int argc, void
 
     if (sorted_set_score(zset, member, &score) == 0)
     {
-        return strdup("$-1\r\n");
-    }
-
-    char score_str[32];
-    if (score == (long long)score)
-    {
-        sprintf(score_str, "%lld", (long long)score);
-    }
-    else
-    {
-        sprintf(score_str, "%.17g", score);
+        client_add_reply_null(client);
+        return NULL;
     }
 
-    return encode_bulk_string(score_str);
+    client_add_reply_double(client, score);
+    return NULL;
 }
 
 char *handle_zrank_command(redis_server_t *server, char **args, int argc, void *client)
 {
-    (void)client;
     (void)argc;
 
     char *key = args[1];
@@ -2476,12 +3589,14 @@ char *handle_zrank_command(redis_server_t *server, char **args, int argc, void *
 
     if (!obj)
     {
-        return strdup("$-1\r\n");
+        client_add_reply_null(client);
+        return NULL;
     }
 
     if (obj->type != REDIS_SORTED_SET)
     {
-        return strdup("-WRONGTYPE Operation against a key holding the wrong kind of value\r\n");
+        client_add_reply_shared(client, &shared_replies.wrongtype);
+        return NULL;
     }
 
     redis_sorted_set_t *zset = (redis_sorted_set_t *)obj->ptr;
@@ -2489,16 +3604,17 @@ char *handle_zrank_command(redis_server_t *server, char **args, int argc, void *
     double score;
     if (sorted_set_score(zset, member, &score) == 0)
     {
-        return strdup("$-1\r\n");
+        client_add_reply_null(client);
+        return NULL;
     }
 
     long long rank = sorted_set_rank(zset, member, score);
     if (rank == -1)
     {
-        return strdup("$-1\r\n");
+        client_add_reply_null(client);
+        return NULL;
     }
 
-    char response[32];
-    sprintf(response, ":%lld\r\n", rank);
-    return strdup(response);
+    client_add_reply_integer(client, rank);
+    return NULL;
 }
\ No newline at end of file
@@ -3,26 +3,77 @@
 
 #include "../redis_db/redis_db.h"
 #include "../redis_server/redis_server.h"
-// Command handler function type
+#include "../lib/latency_histogram.h"
+/*
+ * Command handler function type. A handler either returns a malloc'd RESP
+ * reply, or writes it straight into the client with the client_add_reply_*
+ * builders (client.h) and returns NULL. NULL with nothing written means no
+ * reply yet (blocked or forwarded to another shard).
+ */
 typedef char* (*command_handler_t)(redis_server_t *server, char **args, int argc, void *client);
 
+/* Command flags */
+#define CMD_WRITE          (1 << 0)   /* modifies the keyspace, propagated to replicas */
+#define CMD_READONLY       (1 << 1)
+#define CMD_PUBSUB         (1 << 2)   /* allowed while the client is subscribed */
+#define CMD_BLOCKING       (1 << 3)   /* may block the client */
+#define CMD_FAST           (1 << 4)   /* O(1) or O(log N) */
+#define CMD_NO_MULTI       (1 << 5)   /* runs right away inside MULTI instead of being queued */
+#define CMD_REPLICATION    (1 << 6)   /* replication handshake, refused in sharded mode */
+#define CMD_FANOUT_SUM     (1 << 7)   /* sharded mode: runs on every shard, integer replies added up */
+#define CMD_FANOUT_CONCAT  (1 << 8)   /* sharded mode: runs on every shard, array replies concatenated */
+
+/* Key positions for commands whose keys depend on the arguments */
+typedef int (*command_getkeys_t)(char **args, int argc, int *positions, int max_positions);
+
 typedef struct redis_command {
     char *name;
     command_handler_t handler;
     int min_args;
     int max_args;
+    int flags;
+    int first_key;      // 0 when the command takes no keys
+    int last_key;       // negative values count back from argc
+    int key_step;
+    command_getkeys_t get_keys;     // overrides first/last/step when set
 } redis_command_t;
+
+/* Counters kept per command by each server (every shard has its own) */
+typedef struct command_stats {
+    long long calls;
+    long long rejected_calls;       // refused before running: arity, pub/sub context
+    uint64_t total_ns;
+    uint64_t max_ns;
+    latency_histogram_t latency;
+} command_stats_t;
+
+#define COMMAND_MAX_KEYS 256
 // Initialize command table
 void init_command_table(void);
 
 // Main command handler
-char *handle_command(redis_server_t *server, char *buffer, void *client);
+char *handle_command(redis_server_t *server, char *buffer, size_t len, void *client);
+char *handle_parsed_command(redis_server_t *server, char *buffer, size_t len, char **args, int argc, void *client);
+char **parse_command(char *buffer, size_t len, int *argc);
+void free_command_args(char **args, int argc);
+redis_command_t *lookup_command(const char *name);
+command_stats_t *command_stats_create(void);
+void command_stats_reset(command_stats_t *stats);
+int get_command_keys(redis_command_t *cmd, char **args, int argc, int *positions, int max_positions);
+int prefetch_command_keys(redis_server_t *server, parsed_command_t *cmds, int count);
+void touch_watched_key(redis_server_t *server, const char *key);
+void unwatch_all_keys(redis_server_t *server, client_t *client);
 
 // Command handlers
 char *handle_echo_command(redis_server_t *server, char **args, int argc, void *client);
 char *handle_ping_command(redis_server_t *server, char **args, int argc, void *client);
 char *handle_set_command(redis_server_t *server, char **args, int argc, void *client);
 char *handle_get_command(redis_server_t *server, char **args, int argc, void *client);
+char *handle_mget_command(redis_server_t *server, char **args, int argc, void *client);
+char *handle_mset_command(redis_server_t *server, char **args, int argc, void *client);
+char *handle_msetnx_command(redis_server_t *server, char **args, int argc, void *client);
+char *handle_del_command(redis_server_t *server, char **args, int argc, void *client);
+char *handle_exists_command(redis_server_t *server, char **args, int argc, void *client);
 char *handle_rpush_command(redis_server_t *server, char **args, int argc, void *client);
 char *handle_lpush_command(redis_server_t *server, char **args, int argc, void *client);
 char *handle_llen_command(redis_server_t *server, char **args, int argc, void *client);
@@ -35,25 +86,36 @@ char *handle_xadd_command(redis_server_t *server, char **args, int argc, void *c
 char *handle_xrange_command(redis_server_t *server, char **args, int argc, void *client);
 char *handle_xread_command(redis_server_t *server, char **args, int argc, void *client);
 char *handle_incr_command(redis_server_t *server, char **args, int argc, void *client);
+char *handle_decr_command(redis_server_t *server, char **args, int argc, void *client);
+char *handle_incrby_command(redis_server_t *server, char **args, int argc, void *client);
+char *handle_decrby_command(redis_server_t *server, char **args, int argc, void *client);
+char *handle_incrbyfloat_command(redis_server_t *server, char **args, int argc, void *client);
 char *handle_multi_command(redis_server_t *server, char **args, int argc, void *client);
 char *handle_exec_command(redis_server_t *server, char **args, int argc, void *client);
 char *handle_discard_command(redis_server_t *server, char **args, int argc, void *client);
+char *handle_watch_command(redis_server_t *server, char **args, int argc, void *client);
+char *handle_unwatch_command(redis_server_t *server, char **args, int argc, void *client);
 char *handle_info_command(redis_server_t *server, char **args, int argc, void *client);
 char *handle_replconf_command(redis_server_t *server, char **args, int argc, void *client);
 char *handle_psync_command(redis_server_t *server, char **args, int argc, void *client);
 char *handle_wait_command(redis_server_t *server, char **args, int argc, void *client);
 char *handle_config_get_command(redis_server_t *server, char **args, int argc, void *client);
 char *handle_keys_command(redis_server_t *server, char **args, int argc, void *client);
+char *handle_scan_command(redis_server_t *server, char **args, int argc, void *client);
+char *handle_zscan_command(redis_server_t *server, char **args, int argc, void *client);
 char *handle_subscribe_command(redis_server_t *server, char **args, int argc, void *client);
 char *handle_publish_command(redis_server_t *server, char **args, int argc, void *client);
 char *handle_unsubscribe_command(redis_server_t *server, char **args, int argc, void *client);
+char *handle_psubscribe_command(redis_server_t *server, char **args, int argc, void *client);
+char *handle_punsubscribe_command(redis_server_t *server, char **args, int argc, void *client);
 char *handle_zadd_command(redis_server_t *server, char **args, int argc, void *client);
 char *handle_zrange_command(redis_server_t *server, char **args, int argc, void *client);
 char *handle_zrem_command(redis_server_t *server, char **args, int argc, void *client);
 char *handle_zcard_command(redis_server_t *server, char **args, int argc, void *client);
 char *handle_zscore_command(redis_server_t *server, char **args, int argc, void *client);
 char *handle_zrank_command(redis_server_t *server, char **args, int argc, void *client);
-void check_blocked_clients_timeout(redis_server_t *server);
+char *handle_slowlog_command(redis_server_t *server, char **args, int argc, void *client);
+char *handle_latency_command(redis_server_t *server, char **args, int argc, void *client);
 
 
 
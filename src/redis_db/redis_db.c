@@ -6,6 +6,11 @@
 #include "../streams/redis_stream.h"
 #include "../channels/channel.h"
 #include "../lib/sorted_set.h"
+#include "../lib/utils.h"
+
+static redis_object_t shared_integers[REDIS_SHARED_INTEGERS];
+static int shared_integers_ready;
+
 redis_db_t *redis_db_create(int id) {
     redis_db_t *db = calloc(1, sizeof(redis_db_t));
     if (!db) {
@@ -62,7 +67,11 @@ redis_object_t *redis_object_create_string(const char *value) {
     char *str = strdup(value);
     if (!str) return NULL;
     
-    return redis_object_create(REDIS_STRING, str);
+    redis_object_t *obj = redis_object_create(REDIS_STRING, str);
+    if (obj) {
+        obj->len = (uint32_t)strlen(str);
+    }
+    return obj;
 }
 
 redis_object_t *redis_object_create_list(void) {
@@ -92,16 +101,143 @@ redis_object_t *redis_object_create_channel(char *name) {
     return redis_object_create(REDIS_CHANNEL, channel);
 }
 
-redis_object_t *redis_object_create_number (const char *value)
+redis_object_t *redis_object_create_number (long long value)
 {
+    redis_object_t *obj = redis_object_create(REDIS_NUMBER, NULL);
+    if (!obj) return NULL;
+
+    obj->encoding = REDIS_ENCODING_INT;
+    obj->ival = value;
+    return obj;
+}
+
+// Read-only once built, like the shared reply tables; call before any shard starts
+void redis_shared_integers_init(void)
+{
+    for (long long i = 0; i < REDIS_SHARED_INTEGERS; i++) {
+        shared_integers[i].type = REDIS_NUMBER;
+        shared_integers[i].encoding = REDIS_ENCODING_INT;
+        shared_integers[i].refcount = REDIS_OBJECT_SHARED_REFCOUNT;
+        shared_integers[i].ival = i;
+    }
+    shared_integers_ready = 1;
+}
+
+// A header (plus extra bytes) allocated inside key's dict entry
+static redis_object_t *create_embedded(redis_db_t *db, const char *key, redis_type_t type, size_t extra)
+{
+    redis_object_t *obj = hash_table_set_embedded(db->dict, key, sizeof(redis_object_t) + extra);
+    if (!obj) {
+        return NULL;
+    }
+
+    memset(obj, 0, sizeof(*obj));
+    obj->type = type;
+    obj->refcount = 1;
+    obj->embedded = 1;
+    return obj;
+}
+
+// Release what key holds before it is overwritten; a failed store then drops the key
+static void release_existing(redis_db_t *db, const char *key)
+{
+    redis_object_t *existing = hash_table_get(db->dict, key);
+    if (existing) {
+        redis_object_destroy(existing);
+    }
+}
+
+/*
+ * Store a number at key, replacing what was there. Small values without a
+ * TTL point at the shared pool and cost no object at all (the expiry lives
+ * in the object, so a TTL needs a private one); others get a header inside
+ * the dict entry.
+ */
+redis_object_t *redis_db_set_integer(redis_db_t *db, const char *key, long long value, long long expiry)
+{
+    release_existing(db, key);
+
+    if (expiry == 0 && shared_integers_ready && value >= 0 && value < REDIS_SHARED_INTEGERS) {
+        hash_table_set(db->dict, key, &shared_integers[value]);
+        return &shared_integers[value];
+    }
+
+    redis_object_t *obj = create_embedded(db, key, REDIS_NUMBER, 0);
+    if (!obj) {
+        hash_table_delete(db->dict, key);
+        return NULL;
+    }
+    obj->encoding = REDIS_ENCODING_INT;
+    obj->ival = value;
+    obj->expiry = expiry;
+    return obj;
+}
+
+/*
+ * Store a string at key, replacing what was there. Canonical integers
+ * become numbers; other short values share one allocation with the dict
+ * entry: entry header, key, object header and the value bytes back to
+ * back, so a GET touches one block instead of four. Longer ones keep a
+ * separate buffer.
+ */
+redis_object_t *redis_db_set_string(redis_db_t *db, const char *key, const char *value, long long expiry)
+{
+    size_t len = strlen(value);
+    long long ival;
+    if (string_to_ll(value, len, &ival)) {
+        return redis_db_set_integer(db, key, ival, expiry);
+    }
+
+    release_existing(db, key);
+
+    redis_object_t *obj;
+    if (len > REDIS_EMBSTR_SIZE_LIMIT) {
+        obj = redis_object_create_string(value);
+        if (obj) {
+            hash_table_set(db->dict, key, obj);
+        }
+    } else {
+        obj = create_embedded(db, key, REDIS_STRING, len + 1);
+        if (obj) {
+            obj->encoding = REDIS_ENCODING_EMBSTR;
+            obj->ptr = obj + 1;
+            obj->len = (uint32_t)len;
+            memcpy(obj->ptr, value, len + 1);
+        }
+    }
+
+    if (!obj) {
+        hash_table_delete(db->dict, key);
+        return NULL;
+    }
+    obj->expiry = expiry;
+    return obj;
+}
+
+// Overwrite a string in place, moving it to its own buffer if it no longer fits; -1 when out of memory
+int redis_object_set_string(redis_object_t *obj, const char *value)
+{
+    size_t len = strlen(value);
+    if (obj->encoding == REDIS_ENCODING_EMBSTR && len <= obj->len) {
+        memcpy(obj->ptr, value, len + 1);
+        obj->len = (uint32_t)len;
+        return 0;
+    }
+
     char *str = strdup(value);
-    if(!str) return NULL;
+    if (!str) return -1;
 
-    return redis_object_create(REDIS_NUMBER, str);
+    if (obj->encoding == REDIS_ENCODING_RAW) {
+        free(obj->ptr);
+    }
+    obj->ptr = str;
+    obj->encoding = REDIS_ENCODING_RAW;
+    obj->len = (uint32_t)len;
+    return 0;
 }
 
 void redis_object_destroy(redis_object_t *obj) {
-    if (!obj) return;
+    if (!obj || obj->refcount == REDIS_OBJECT_SHARED_REFCOUNT) return;
     
     obj->refcount--;
     if (obj->refcount > 0) {
@@ -109,8 +245,11 @@ void redis_object_destroy(redis_object_t *obj) {
     }
     switch (obj->type) {
         case REDIS_STRING:
+            if (obj->encoding == REDIS_ENCODING_RAW) {
+                free(obj->ptr);
+            }
+            break;
         case REDIS_NUMBER:
-            free(obj->ptr);
             break;
         case REDIS_LIST:
             // List nodes may contain heap-allocated strings/objects; free them too
@@ -127,16 +266,21 @@ void redis_object_destroy(redis_object_t *obj) {
            break;    
     }
     
-    free(obj);
+    // An embedded header goes away with its dict entry
+    if (!obj->embedded) {
+        free(obj);
+    }
 }
 
 // Get string representation of Redis type
 const char *redis_type_to_string(redis_type_t type) {
     switch (type) {
-        case REDIS_STRING: return "string";
+        case REDIS_STRING:
+        case REDIS_NUMBER: return "string";
         case REDIS_LIST: return "list";
         case REDIS_STREAM: return "stream";
-        case REDIS_ZSET: return "zset";
+        case REDIS_ZSET:
+        case REDIS_SORTED_SET: return "zset";
         case REDIS_CHANNEL: return "channel";
         default: return "unknown";
     }
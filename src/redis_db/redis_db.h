@@ -6,13 +6,27 @@
 #include <string.h>
 #include "type_enums.h"
 #include "../hash_table/hash_table.h"
+#include <stdint.h>
+#include <limits.h>
 #include <time.h>
 
+/* Longest string value stored inline with its dict entry */
+#define REDIS_EMBSTR_SIZE_LIMIT 44
+/* Numbers 0 .. REDIS_SHARED_INTEGERS-1 without a TTL all point at one immutable object */
+#define REDIS_SHARED_INTEGERS 10000
+#define REDIS_OBJECT_SHARED_REFCOUNT INT_MAX
+
 typedef struct redis_object {
     redis_type_t type;     
-    void *ptr;              
     int refcount;
+    union {
+        void *ptr;              
+        long long ival;     // REDIS_ENCODING_INT
+    };
     long long expiry;
+    uint8_t encoding;       // redis_encoding_t, only meaningful for strings and numbers
+    uint8_t embedded;       // the header lives inside its dict entry and goes away with it
+    uint32_t len;           // byte length of a string, so replies skip strlen
 
 } redis_object_t;
 
@@ -30,8 +44,12 @@ void redis_object_destroy(redis_object_t *obj);
 redis_object_t *redis_object_create_string(const char *value);
 redis_object_t *redis_object_create_list(void);
 redis_object_t *redis_object_create_stream(void *stream_ptr);
-redis_object_t *redis_object_create_number (const char *value);
+redis_object_t *redis_object_create_number (long long value);
 redis_object_t *redis_object_create_channel(char *name);
 redis_object_t *redis_object_create_sorted_set(void);
+int redis_object_set_string(redis_object_t *obj, const char *value);
+void redis_shared_integers_init(void);
+redis_object_t *redis_db_set_string(redis_db_t *db, const char *key, const char *value, long long expiry);
+redis_object_t *redis_db_set_integer(redis_db_t *db, const char *key, long long value, long long expiry);
 const char *redis_type_to_string(redis_type_t type);
 #endif
\ No newline at end of file
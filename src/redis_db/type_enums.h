@@ -13,4 +13,11 @@ typedef enum {
     REDIS_SORTED_SET
 } redis_type_t;
 
+/* How a string or number object holds its value */
+typedef enum {
+    REDIS_ENCODING_RAW,     // ptr is a separate heap buffer
+    REDIS_ENCODING_EMBSTR,  // the bytes follow the object header in the same allocation
+    REDIS_ENCODING_INT      // ival holds the value itself (REDIS_NUMBER)
+} redis_encoding_t;
+
 #endif
\ No newline at end of file
@@ -9,6 +9,7 @@
 #include <netinet/in.h>
 #include <arpa/inet.h>  
 #include <ctype.h>
+#include <time.h>
 #include "../redis_command_handler/redis_command_handler.h"
 #include "../lib/list.h"
 #include "../clients/client.h"
@@ -17,18 +18,36 @@
 #include "../rdb/io_buffer.h"
 #include "../rdb/rdb.h"
 #include "../expiry_utils/expiry_utils.h"
+#include "../channels/channel.h"
+#include "../io_threads/io_threads.h"
+#include "../shards/shard.h"
 
 static void handle_server_accept(event_loop_t *loop, int fd, uint32_t events, void *data);
 static void handle_client_data(event_loop_t *loop, int fd, uint32_t events, void *data);
-static void handle_timer_interrupt(event_loop_t *loop, int fd, uint32_t events, void *data);
+static void handle_accepted_client(event_loop_t *loop, int fd, int client_fd, void *data);
+static void handle_client_read(event_loop_t *loop, int fd, const char *buf, int len, void *data);
+static int listen_for_clients(event_loop_t *loop, int fd, redis_server_t *redis);
 static void handle_master_data(event_loop_t *loop, int fd, uint32_t events, void *data);
 static void send_next_handshake_command(redis_server_t *server);
 
 static void generate_replication_id(char *repl_id);
 static void connect_to_master(redis_server_t *server);
-static void propagate_to_replicas(redis_server_t *server, const char *command_buffer, size_t buffer_len);
-static int is_write_command(const char *buffer);
-static void process_multiple_commands(redis_server_t *server, char *buffer, size_t buffer_len);
+static int repl_buffer_append(char **buf, size_t *len, size_t *cap, const char *data, size_t data_len);
+static int process_query_buffer(redis_server_t *redis, client_t *client);
+static void parse_query_buffer(client_t *client);
+static void free_client_connection(redis_server_t *redis, event_loop_t *loop, client_t *client);
+static int write_client_replies(redis_server_t *redis, client_t *client);
+static int update_write_registration(redis_server_t *redis, client_t *client, int status);
+static void handle_clients_with_pending_writes(event_loop_t *loop, void *data);
+static void handle_clients_with_pending_reads(event_loop_t *loop, void *data);
+static void handle_unblocked_clients(event_loop_t *loop, void *data);
+static void handle_replica_output(event_loop_t *loop, void *data);
+static void handle_clients_to_close(event_loop_t *loop, void *data);
+static long long server_cron(event_loop_t *loop, event_timer_t *timer, void *data);
+static void read_client_job(void *item, void *ctx);
+static void write_client_job(void *item, void *ctx);
+static void unsubscribe_client_from_all(redis_server_t *redis, client_t *client);
+static void punsubscribe_client_from_all(redis_server_t *redis, client_t *client);
 static int load_rdb_file(redis_server_t *server, const char *rdb_path);
 static void handle_rdb_data(redis_server_t *server, const char *data, ssize_t data_len);
 static void prepare_rdb_reception(redis_server_t *server);
@@ -39,27 +58,49 @@ static void process_rdb_data(redis_server_t *server, const char *data, ssize_t d
 static void handle_rdb_buffer(redis_server_t *server, const char *buffer, ssize_t bytes_read);
 static int count_acked_replicas(redis_server_t *server, uint64_t target_offset);
 static void complete_wait_command(redis_server_t *server, int acked_count);
-redis_server_t* redis_server_create(int port)
+static redis_server_t* redis_server_init(int port, int tcp_backlog, struct shard *shard)
 {
     redis_server_t *redis = calloc(1, sizeof(redis_server_t));
     if(!redis)
       return NULL;
     
-    server_t *server = server_create(port);
+    redis->shard = shard;
+    server_t *server = server_create(port, shard != NULL, tcp_backlog);
     if(!server){
         free(redis);
         return NULL;
     }
     redis->server = server;
     redis->db = redis_db_create(0);
+    redis->client_max_querybuf_len = CLIENT_DEFAULT_MAX_QUERYBUF_LEN;
+    redis->running_prefetched = -1;
+    redis->client_output_limits[CLIENT_TYPE_PUBSUB].hard_bytes = CLIENT_PUBSUB_OUTPUT_HARD_LIMIT;
+    redis->client_output_limits[CLIENT_TYPE_PUBSUB].soft_bytes = CLIENT_PUBSUB_OUTPUT_SOFT_LIMIT;
+    redis->client_output_limits[CLIENT_TYPE_PUBSUB].soft_seconds = CLIENT_PUBSUB_OUTPUT_SOFT_SECONDS;
     init_command_table();
+    redis->command_stats = command_stats_create();   // NULL just means nothing is recorded
+    redis->slowlog = slowlog_create(SLOWLOG_DEFAULT_SLOWER_THAN, SLOWLOG_DEFAULT_MAX_LEN);
+    redis->latency_monitor = latency_monitor_create(0);
+    redis->watched_keys = hash_table_create(256);
     
     // Initialize client lists
     redis->clients = list_create();
     redis->blocked_clients = list_create();
-    if (!redis->clients || !redis->blocked_clients) {
+    redis->clients_pending_write = list_create();
+    redis->clients_pending_read = list_create();
+    redis->unblocked_clients = list_create();
+    redis->clients_to_close = list_create();
+    if (!redis->clients || !redis->blocked_clients ||
+        !redis->clients_pending_write || !redis->clients_pending_read ||
+        !redis->unblocked_clients || !redis->clients_to_close) {
         server_destroy(server);
         redis_db_destroy(redis->db);
+        list_destroy(redis->clients);
+        list_destroy(redis->blocked_clients);
+        list_destroy(redis->clients_pending_write);
+        list_destroy(redis->clients_pending_read);
+       list_destroy(redis->unblocked_clients);
+       list_destroy(redis->clients_to_close);
         free(redis);
         return NULL;
     }
@@ -70,37 +111,78 @@ redis_server_t* redis_server_create(int port)
         redis_db_destroy(redis->db);
         list_destroy(redis->clients);
         list_destroy(redis->blocked_clients);
+        list_destroy(redis->clients_pending_write);
+        list_destroy(redis->clients_pending_read);
+       list_destroy(redis->unblocked_clients);
+       list_destroy(redis->clients_to_close);
         free(redis);
         return NULL;
     }
     redis->event_loop = event_loop;
     
     
-    if(event_loop_add_fd(event_loop, server->fd, EPOLLIN, handle_server_accept, redis) < 0){
+    if(listen_for_clients(event_loop, server->fd, redis) < 0){
        server_destroy(server);
        event_loop_destroy(event_loop);
        redis_db_destroy(redis->db);
        list_destroy(redis->clients);
        list_destroy(redis->blocked_clients);
+       list_destroy(redis->clients_pending_write);
+       list_destroy(redis->clients_pending_read);
+       list_destroy(redis->unblocked_clients);
+       list_destroy(redis->clients_to_close);
        free(redis);
        return NULL;
     }
     
-    if(event_loop_add_fd(event_loop, event_loop->timer_fd, EPOLLIN, handle_timer_interrupt, redis) < 0){
-       server_destroy(server);
-       event_loop_destroy(event_loop);
-       redis_db_destroy(redis->db);
-       list_destroy(redis->clients);
-       list_destroy(redis->blocked_clients);
-       free(redis);
-       return NULL;
-    }
     event_loop->server_data = redis;
+    // Once per iteration, in this order: run what became runnable, then push all output out
+    event_loop_add_before_sleep(event_loop, handle_clients_with_pending_reads, redis);
+    event_loop_add_before_sleep(event_loop, handle_unblocked_clients, redis);
+    if (shard) {
+        event_loop_add_before_sleep(event_loop, shard_before_sleep, shard);
+    }
+    event_loop_add_before_sleep(event_loop, handle_replica_output, redis);
+    event_loop_add_before_sleep(event_loop, handle_clients_to_close, redis);
+    event_loop_add_before_sleep(event_loop, handle_clients_with_pending_writes, redis);
+    event_loop_add_timer(event_loop, SERVER_CRON_INTERVAL_MS, server_cron, redis);
 
     printf("Redis server listening on port %d\n", port);
     return redis;
 }
 
+// Accept local clients on a unix socket as well, in the same loop as TCP ones
+int redis_server_listen_unix(redis_server_t *redis, const char *path, mode_t perm, int backlog)
+{
+    server_t *listener = server_create_unix(path, perm, backlog);
+    if (!listener) {
+        return -1;
+    }
+    if (listen_for_clients(redis->event_loop, listener->fd, redis) < 0) {
+        server_destroy(listener);
+        return -1;
+    }
+    redis->unix_server = listener;
+    printf("Redis server listening on unix socket %s\n", path);
+    return 0;
+}
+
+redis_server_t* redis_server_create(int port, int tcp_backlog)
+{
+    return redis_server_init(port, tcp_backlog, NULL);
+}
+
+// One shard of --shards mode: listens on the shared port with SO_REUSEPORT
+redis_server_t* redis_server_create_shard(int port, int tcp_backlog, struct shard *shard)
+{
+    return redis_server_init(port, tcp_backlog, shard);
+}
+
+// Values of the watched keys index; the clients themselves are freed with the client list
+static void free_watching_clients(void *clients) {
+    list_destroy((redis_list_t *)clients);
+}
+
 void redis_server_destroy(redis_server_t *redis) {
     if (!redis) return;
     
@@ -122,6 +204,34 @@ void redis_server_destroy(redis_server_t *redis) {
     if (redis->blocked_clients) {
         list_destroy(redis->blocked_clients);
     }
+
+    if (redis->clients_pending_write) {
+        list_destroy(redis->clients_pending_write);
+    }
+
+    if (redis->clients_pending_read) {
+        list_destroy(redis->clients_pending_read);
+    }
+
+    if (redis->unblocked_clients) {
+        list_destroy(redis->unblocked_clients);
+    }
+
+    if (redis->clients_to_close) {
+        list_destroy(redis->clients_to_close);
+    }
+    free(redis->repl_output);
+    free(redis->repl_pending);
+    free(redis->command_stats);
+    slowlog_destroy(redis->slowlog);
+    latency_monitor_destroy(redis->latency_monitor);
+    if (redis->watched_keys) {
+        hash_table_destroy_with_free(redis->watched_keys, free_watching_clients);
+    }
+
+    if (io_threads_active()) {
+        io_threads_shutdown();
+    }
     
     if (redis->event_loop) {
         event_loop_destroy(redis->event_loop);
@@ -130,6 +240,10 @@ void redis_server_destroy(redis_server_t *redis) {
     if (redis->server) {
         server_destroy(redis->server);
     }
+
+    if (redis->unix_server) {
+        server_destroy(redis->unix_server);
+    }
     
     if(redis->db) {
         redis_db_destroy(redis->db);
@@ -149,6 +263,10 @@ void redis_server_destroy(redis_server_t *redis) {
     {
         free(redis->channels_map);
     }
+    if(redis->pubsub_patterns)
+    {
+        list_destroy_with_free(redis->pubsub_patterns, free);
+    }
 
     free(redis);
 }
@@ -160,31 +278,46 @@ void redis_server_run(redis_server_t *redis) {
     char rdb_path[512];
     snprintf(rdb_path, sizeof(rdb_path), "%s/%s", redis->rdb_dir, redis->rdb_filename);
     rdb_load_full(rdb_path, redis->db);
+    if (redis->shard) {
+        shard_drop_foreign_keys(redis);
+    }
     }
     init_channel_data(redis);
+    if (redis->io_threads_num > 1 && io_threads_init(redis->io_threads_num) < 0) {
+        fprintf(stderr, "Failed to start I/O threads, continuing single threaded\n");
+    }
     event_loop_run(redis->event_loop);
 }
 
 
-static void handle_server_accept(event_loop_t *event_loop, int fd, uint32_t events, void *data) {
+/*
+ * Background work that is fine to do a little at a time: finishes dict
+ * resizes the commands themselves have not gotten through.
+ */
+static long long server_cron(event_loop_t *loop, event_timer_t *timer, void *data) {
+    (void)loop;
+    (void)timer;
     redis_server_t *redis = (redis_server_t *)data;
-    
-    struct sockaddr_in client_addr;
-    int client_fd = server_accept_client(redis->server, &client_addr);
-    
-    if (client_fd < 0) {
-        if (errno != EAGAIN && errno != EWOULDBLOCK) {
-            perror("accept");
-        }
-        return;
+
+    if (hash_table_rehash_ms(redis->db->dict, SERVER_CRON_REHASH_MS) == 0) {
+        hash_table_rehash_ms(redis->db->expires, SERVER_CRON_REHASH_MS);
     }
-    
-    if (set_nonblocking(client_fd) < 0) {
-        perror("set_nonblocking");
-        close(client_fd);
-        return;
+    return SERVER_CRON_INTERVAL_MS;
+}
+
+/*
+ * A listener is polled for readiness; backends that can accept by
+ * themselves (io_uring) take over the accept() calls as well.
+ */
+static int listen_for_clients(event_loop_t *loop, int fd, redis_server_t *redis) {
+    if (event_loop_add_fd(loop, fd, EPOLLIN, handle_server_accept, redis) < 0) {
+        return -1;
     }
-    
+    event_loop_accept_completions(loop, fd, handle_accepted_client);
+    return 0;
+}
+
+static void accept_client_connection(redis_server_t *redis, event_loop_t *event_loop, int client_fd) {
     client_t *client = create_client(client_fd);
     if (!client) {
         perror("create_client");
@@ -192,6 +325,7 @@ static void handle_server_accept(event_loop_t *event_loop, int fd, uint32_t even
         return;
     }
     
+    client->id = ++redis->next_client_id;
     add_client_to_list(redis->clients, client);
     
     if (event_loop_add_fd(event_loop, client_fd, EPOLLIN | EPOLLET, 
@@ -202,74 +336,148 @@ static void handle_server_accept(event_loop_t *event_loop, int fd, uint32_t even
         close(client_fd);
         return;
     }
+    // Reads happen on I/O threads when there are any, otherwise the backend may do them
+    if (!io_threads_active()) {
+        event_loop_read_completions(event_loop, client_fd, handle_client_read);
+    }
     
     printf("Client connected (fd=%d), total clients: %zu\n", 
            client_fd, list_length(redis->clients));
 }
 
+/*
+ * Drain the accept queue, up to MAX_ACCEPTS_PER_CALL connections per wakeup
+ * so a connection storm cannot starve clients that are already connected.
+ * The listener is level-triggered, so anything left fires again next round.
+ */
+static void handle_server_accept(event_loop_t *event_loop, int fd, uint32_t events, void *data) {
+    (void)events;
+    redis_server_t *redis = (redis_server_t *)data;
+    // TCP and unix socket clients are served the same way once accepted
+    server_t *listener = redis->unix_server && fd == redis->unix_server->fd ? redis->unix_server : redis->server;
+    
+    for (int accepted = 0; accepted < MAX_ACCEPTS_PER_CALL; accepted++) {
+        struct sockaddr_in client_addr;
+        int client_fd = server_accept_client(listener, listener->unix_path ? NULL : &client_addr);
+        
+        if (client_fd < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) {
+                continue;
+            }
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                perror("accept");
+            }
+            return;
+        }
+        
+        accept_client_connection(redis, event_loop, client_fd);
+    }
+}
+
+// A connection the backend accepted on its own
+static void handle_accepted_client(event_loop_t *event_loop, int fd, int client_fd, void *data) {
+    (void)fd;
+    if (client_fd < 0) {
+        if (client_fd != -EINTR && client_fd != -ECONNABORTED && client_fd != -EAGAIN) {
+            errno = -client_fd;
+            perror("accept");
+        }
+        return;
+    }
+    accept_client_connection((redis_server_t *)data, event_loop, client_fd);
+}
+
+// Runs the commands that input appended to the query buffer; -1 drops the client
+static int client_input_arrived(redis_server_t *redis, client_t *client) {
+    if (process_query_buffer(redis, client) < 0) {
+        return -1;
+    }
+    if (client->querybuf_len > redis->client_max_querybuf_len) {
+        fprintf(stderr, "Closing client %d: query buffer of %zu bytes exceeds limit of %zu\n",
+                client->fd, client->querybuf_len, redis->client_max_querybuf_len);
+        return -1;
+    }
+    return 0;
+}
+
+// Input the backend read on its own; buf is only valid during the call
+static void handle_client_read(event_loop_t *loop, int fd, const char *buf, int len, void *data) {
+    client_t *client = (client_t *)data;
+    redis_server_t *redis = (redis_server_t *)loop->server_data;
+
+    if (len == 0) {
+        printf("Client %d disconnected\n", fd);
+        free_client_connection(redis, loop, client);
+        return;
+    }
+    if (len < 0) {
+        errno = -len;
+        perror("recv");
+        free_client_connection(redis, loop, client);
+        return;
+    }
+
+    char *buffer = client_querybuf_reserve(client, (size_t)len);
+    if (!buffer) {
+        fprintf(stderr, "Out of memory growing query buffer for client %d\n", fd);
+        free_client_connection(redis, loop, client);
+        return;
+    }
+    memcpy(buffer, buf, (size_t)len);
+    client->querybuf_len += (size_t)len;
+    client->querybuf[client->querybuf_len] = '\0';
+
+    if (client_input_arrived(redis, client) < 0) {
+        free_client_connection(redis, loop, client);
+    }
+}
+
 static void handle_client_data(event_loop_t *loop, int fd, uint32_t events, void *data) {
-    char buffer[1024];
     client_t *client = (client_t *)data;
     redis_server_t *redis = (redis_server_t *)loop->server_data;  
+
+    if (io_threads_active() && (events & EPOLLIN)) {
+        // Read and parse on an I/O thread from before_sleep; a hangup is
+        // seen there as EOF once the pending bytes are consumed.
+        if (!client->pending_read) {
+            client->pending_read = 1;
+            list_rpush(redis->clients_pending_read, client);
+        }
+        events &= ~(EPOLLIN | EPOLLHUP);
+    }
     
     if (events & EPOLLIN) {
-        // Skip if client is blocked
-        if (client->is_blocked) {
-            return;
-        }
-        
         while (1) {  
-            ssize_t bytes_read = read(fd, buffer, sizeof(buffer) - 1);
+            // Keep reading even while blocked so edge-triggered data is not lost;
+            // the buffered frames run once the client is unblocked.
+            char *buffer = client_querybuf_reserve(client, CLIENT_QUERYBUF_READ_LEN);
+            if (!buffer) {
+                fprintf(stderr, "Out of memory growing query buffer for client %d\n", fd);
+                free_client_connection(redis, loop, client);
+                return;
+            }
+
+            ssize_t bytes_read = read(fd, buffer, CLIENT_QUERYBUF_READ_LEN);
             
             if (bytes_read > 0) {
-                buffer[bytes_read] = '\0';
-                printf("Received from client %d: %s", fd, buffer);
-                
-                // Check if this is a write command and we're a master
-                int is_write_cmd = is_write_command(buffer);
-                
-                // Pass server and client to command handler
-                char *response = handle_command(redis, buffer, client);
-                
-                if (response) {
-                    send(fd, response, strlen(response), MSG_NOSIGNAL);
-                    free(response);
-                    
-                    if (is_write_cmd && 
-                        redis->replication_info && 
-                        redis->replication_info->role == MASTER &&
-                        redis->replication_info->connected_slaves > 0) {
-                        
-                        propagate_to_replicas(redis, buffer, bytes_read);
-                    }
+                client->querybuf_len += bytes_read;
+                client->querybuf[client->querybuf_len] = '\0';
+
+                if (client_input_arrived(redis, client) < 0) {
+                    free_client_connection(redis, loop, client);
+                    return;
                 }
             }
             else if (bytes_read == 0) {
                 printf("Client %d disconnected\n", fd);
-                
-                
-                // Clean up
-                if (client->is_blocked) {
-                    remove_client_from_list(redis->blocked_clients, client);
-                }
-                remove_client_from_list(redis->clients, client);
-                event_loop_remove_fd(loop, fd);
-                close(fd);
-                free_client(client);
+                free_client_connection(redis, loop, client);
                 return;
             } else {
                 if (errno == EAGAIN || errno == EWOULDBLOCK) {
                     break;
                 } else {
                     perror("read");
-        
-                    if (client->is_blocked) {
-                        remove_client_from_list(redis->blocked_clients, client);
-                    }
-                    remove_client_from_list(redis->clients, client);
-                    event_loop_remove_fd(loop, fd);
-                    close(fd);
-                    free_client(client);
+                    free_client_connection(redis, loop, client);
                     return;
                 }
             }
@@ -278,23 +486,589 @@ static void handle_client_data(event_loop_t *loop, int fd, uint32_t events, void
     
     if (events & (EPOLLHUP | EPOLLERR)) {
         printf("Client %d error or hangup\n", fd);
-        if (client->is_blocked) {
-            remove_client_from_list(redis->blocked_clients, client);
+        free_client_connection(redis, loop, client);
+        return;
+    }
+
+    if ((events & EPOLLOUT) && client->write_registered) {
+        if (write_client_replies(redis, client) < 0) {
+            free_client_connection(redis, loop, client);
+            return;
+        }
+    }
+}
+
+/*
+ * Splits every complete frame of the query buffer into client->parsed_cmds.
+ * Runs on I/O threads, and on the main thread before a batch is executed.
+ */
+static void parse_query_buffer(client_t *client) {
+    size_t offset = 0;
+    while (offset < client->querybuf_len) {
+        resp_parser_t *parser = &client->parser;
+        if (resp_parser_feed(parser, client->querybuf + offset, client->querybuf_len - offset) != RESP_PARSE_OK) {
+            break;   // partial frame kept in the parser, or a protocol error reported by process_query_buffer()
+        }
+
+        size_t frame_len = parser->pos;
+        int argc = parser->argi;
+        char **args = resp_parser_argv(parser);
+        resp_parser_reset(parser);
+        if (client_add_parsed_command(client, frame_len, args, argc) < 0) {
+            free_command_args(args, argc);
+            break;
+        }
+        offset += frame_len;
+    }
+}
+
+/*
+ * Executes every complete command sitting in the client's query buffer and
+ * keeps a trailing partial frame for the next read. Returns -1 when the
+ * input is not valid RESP and the connection should be dropped.
+ */
+static int process_query_buffer(redis_server_t *redis, client_t *client) {
+    size_t consumed = 0;
+    int next_parsed = 0;
+    int prefetched = 0;
+    int window = 0;
+
+    // The whole pipeline is parsed first so the keys of the next commands can be prefetched
+    if (client->parsed_count == 0 && !client->is_blocked && !client->shard.pending && !client->close_asap) {
+        parse_query_buffer(client);
+    }
+
+    while (!client->is_blocked && !client->shard.pending && !client->close_asap &&
+           consumed < client->querybuf_len) {
+        char *frame = client->querybuf + consumed;
+        ssize_t frame_len;
+        char **args = NULL;
+        int argc = 0;
+        int running = -1;
+
+        if (next_parsed < client->parsed_count) {
+            if (next_parsed == prefetched) {
+                window = next_parsed;
+                prefetched += prefetch_command_keys(redis, client->parsed_cmds + next_parsed,
+                                                    client->parsed_count - next_parsed);
+            }
+            // Lets the command's lookups reuse the hashes of the prefetch
+            running = next_parsed - window;
+            // Already split and parsed, by an I/O thread or parse_query_buffer()
+            parsed_command_t *parsed = &client->parsed_cmds[next_parsed++];
+            frame_len = parsed->frame_len;
+            args = parsed->args;
+            argc = parsed->argc;
+            parsed->args = NULL;
+        } else {
+            // Picks up where the last read left off inside a partial frame
+            resp_parse_status_t status = resp_parser_feed(&client->parser, frame, client->querybuf_len - consumed);
+            if (status == RESP_PARSE_INCOMPLETE) {
+                break;
+            }
+            frame_len = status == RESP_PARSE_OK ? (ssize_t)client->parser.pos : -1;
+            if (status == RESP_PARSE_OK) {
+                args = resp_parser_argv(&client->parser);
+                argc = client->parser.argi;
+                resp_parser_reset(&client->parser);
+            }
+        }
+
+        if (frame_len < 0) {
+            char error[64];
+            int error_len = frame[0] == '*' ?
+                snprintf(error, sizeof(error), "-ERR Protocol error: invalid multibulk or bulk length\r\n") :
+                snprintf(error, sizeof(error), "-ERR Protocol error: expected '*', got '%c'\r\n",
+                         isprint((unsigned char)frame[0]) ? frame[0] : '?');
+            // Best effort: flush what we have before the connection is dropped
+            client_add_reply(client, error, error_len);
+            client_write_replies(client);
+            client_clear_parsed_commands(client);
+            return -1;
+        }
+
+        consumed += frame_len;
+
+        // "*0\r\n" is an empty command: skipped without a reply, as Redis does
+        if (args && argc == 0) {
+            free_command_args(args, argc);
+            continue;
+        }
+
+        // Pass server and client to command handler
+        char *response;
+        if (args) {
+            redis->running_prefetched = running;
+            response = handle_parsed_command(redis, frame, frame_len, args, argc, client);
+            redis->running_prefetched = -1;
+            free_command_args(args, argc);
+        } else {
+            response = handle_command(redis, frame, frame_len, client);
+        }
+        
+        // Handlers either return the reply or build it in place on the client
+        if (response) {
+            client_add_reply(client, response, strlen(response));
+            free(response);
         }
+        reply_queued(redis, client);
+    }
+
+    // Anything left unexecuted (client got blocked) is parsed again later,
+    // from the first frame not run, so the parser must start over too
+    if (next_parsed < client->parsed_count) {
+        resp_parser_reset(&client->parser);
+    }
+    client_clear_parsed_commands(client);
+    client_querybuf_consume(client, consumed);
+    return 0;
+}
+
+static void free_client_connection(redis_server_t *redis, event_loop_t *loop, client_t *client) {
+    if (client->is_blocked) {
+        remove_client_from_list(redis->blocked_clients, client);
+    }
+    if (client->pending_write) {
+        remove_client_from_list(redis->clients_pending_write, client);
+    }
+    if (client->pending_read) {
+        remove_client_from_list(redis->clients_pending_read, client);
+    }
+    if (client->pending_unblocked) {
+        remove_client_from_list(redis->unblocked_clients, client);
+    }
+    if (client->close_asap) {
+        remove_client_from_list(redis->clients_to_close, client);
+    }
+    if (client->subscribed_channels > 0) {
+        unsubscribe_client_from_all(redis, client);
+    }
+    if (client->subscribed_patterns > 0) {
+        punsubscribe_client_from_all(redis, client);
+    }
+    if (client->watched_keys) {
+        unwatch_all_keys(redis, client);
+    }
+    if (redis->shard) {
+        shard_client_closed(redis->shard, client);
+    }
+    if (redis->pending_wait.active && redis->pending_wait.client == client) {
+        if (redis->pending_wait.timer) {
+            event_loop_del_timer(redis->pending_wait.timer);
+            redis->pending_wait.timer = NULL;
+        }
+        redis->pending_wait.active = 0;
+        redis->pending_wait.client = NULL;
+    }
     remove_client_from_list(redis->clients, client);
-    event_loop_remove_fd(loop, fd);
-    close(fd);
+    event_loop_remove_fd(loop, client->fd);
+    close(client->fd);
     free_client(client);
-    return;
+}
+
+// Subscribers keep raw client pointers, so drop them before the client is freed
+static void unsubscribe_client_from_all(redis_server_t *redis, client_t *client) {
+    if (!redis->channels_map) {
+        return;
+    }
+
+    hash_table_iterator_t *iter = hash_table_iterator_create(redis->channels_map);
+    if (!iter) {
+        return;
+    }
+
+    char *name;
+    void *value;
+    while (hash_table_iterator_next(iter, &name, &value)) {
+        channel_t *channel = (channel_t *)((redis_object_t *)value)->ptr;
+        if (channel && list_remove(channel->clients, client)) {
+            channel->n_clients--;
+        }
+    }
+    hash_table_iterator_destroy(iter);
+    client->subscribed_channels = 0;
+}
+
+static void punsubscribe_client_from_all(redis_server_t *redis, client_t *client) {
+    list_node_t *node = redis->pubsub_patterns ? redis->pubsub_patterns->head : NULL;
+    while (node) {
+        list_node_t *next = node->next;
+        pubsub_pattern_t *pat = (pubsub_pattern_t *)node->data;
+        if (pat->client == client) {
+            list_remove(redis->pubsub_patterns, pat);
+            free(pat);
+        }
+        node = next;
+    }
+    client->subscribed_patterns = 0;
+}
+
+/*
+ * Queue a reply for a client. The bytes are buffered on the client and
+ * written in one writev() per client from before_sleep, so a pipelined
+ * batch costs a single syscall instead of one send() per command.
+ */
+void reply_to_client(redis_server_t *server, client_t *client, const char *data, size_t len) {
+    if (!server || !client || len == 0 || !client_accepts_replies(client)) {
+        return;
+    }
+
+    if (client_add_reply(client, data, len) < 0) {
+        fprintf(stderr, "Out of memory queueing reply for client %d\n", client->fd);
+        return;
+    }
+    reply_added(server, client);
+}
+
+// Whether output for a client other than the running one is still wanted
+int client_accepts_replies(client_t *client) {
+    if (client->shard.origin >= 0) {
+        return 1;
+    }
+    return client->fd >= 0 && !client->close_asap;
+}
+
+/*
+ * Schedule output appended to such a client, by reply_to_client or with
+ * the client_add_reply_* builders.
+ */
+void reply_added(redis_server_t *server, client_t *client) {
+    if (client->shard.origin >= 0) {
+        // Running for another shard: the output travels back over its queue
+        shard_client_replied(server->shard, client);
+        return;
+    }
+    reply_queued(server, client);
+}
+
+/*
+ * Called after output was appended to a client, by reply_to_client or by a
+ * handler using the client_add_reply_* builders: enforces the output limits
+ * and schedules the flush.
+ */
+void reply_queued(redis_server_t *server, client_t *client) {
+    if (client->fd < 0 || client->close_asap || !client_has_pending_replies(client)) {
+        return;
+    }
+
+    client_type_t type = client_get_type(client);
+    if (client_output_limit_reached(client, &server->client_output_limits[type], time(NULL))) {
+        fprintf(stderr, "Closing client %d: %zu bytes of pending output exceed the %s output limit\n",
+                client->fd, client_pending_output(client), type == CLIENT_TYPE_PUBSUB ? "pubsub" : "normal");
+        server->stat_output_limit_disconnections++;
+        close_client_async(server, client);
+        return;
+    }
+
+    if (!client->pending_write && !client->write_registered) {
+        client->pending_write = 1;
+        list_rpush(server->clients_pending_write, client);
+    }
+}
+
+/*
+ * Flush a client's output. If the socket fills up, EPOLLOUT is installed so
+ * the rest goes out when it drains; it is removed again once empty.
+ * Returns -1 if the connection failed.
+ */
+static int write_client_replies(redis_server_t *redis, client_t *client) {
+    return update_write_registration(redis, client, client_write_replies(client));
+}
+
+static int update_write_registration(redis_server_t *redis, client_t *client, int status) {
+    if (status < 0) {
+        perror("writev");
+        return -1;
+    }
+
+    uint32_t events = EPOLLIN | EPOLLET;
+    if (status == 0 && !client->write_registered) {
+        if (event_loop_modify_fd(redis->event_loop, client->fd, events | EPOLLOUT) < 0) {
+            perror("event_loop_modify_fd");
+            return -1;
+        }
+        client->write_registered = 1;
+    } else if (status == 1 && client->write_registered) {
+        if (event_loop_modify_fd(redis->event_loop, client->fd, events) < 0) {
+            perror("event_loop_modify_fd");
+            return -1;
+        }
+        client->write_registered = 0;
+    }
+    return 0;
+}
+
+// Runs on an I/O thread: touch only this client
+static void write_client_job(void *item, void *ctx) {
+    (void)ctx;
+    client_t *client = (client_t *)item;
+    client->write_status = client_write_replies(client);
+}
+
+static void handle_clients_with_pending_writes(event_loop_t *loop, void *data) {
+    (void)loop;
+    redis_server_t *redis = (redis_server_t *)data;
+    redis_list_t *pending = redis->clients_pending_write;
+    if (list_length(pending) == 0) {
+        return;
+    }
+
+    // Clients waiting for EPOLLOUT are flushed from the write event instead
+    list_node_t *node = pending->head;
+    while (node) {
+        list_node_t *next = node->next;
+        client_t *client = (client_t *)node->data;
+        if (client->write_registered) {
+            client->pending_write = 0;
+            list_remove(pending, client);
+        }
+        node = next;
+    }
+
+    io_threads_run(pending, write_client_job, NULL);
+
+    client_t *client;
+    while ((client = list_lpop(pending)) != NULL) {
+        client->pending_write = 0;
+        if (update_write_registration(redis, client, client->write_status) < 0) {
+            free_client_connection(redis, redis->event_loop, client);
+        }
     }
 }
 
-static void propagate_to_replicas(redis_server_t *server, const char *command_buffer, size_t buffer_len) {
+// Runs on an I/O thread: drain the socket, then split and parse complete commands
+static void read_client_job(void *item, void *ctx) {
+    redis_server_t *redis = (redis_server_t *)ctx;
+    client_t *client = (client_t *)item;
+
+    client->io_status = CLIENT_IO_OK;
+    while (client->querybuf_len <= redis->client_max_querybuf_len) {
+        char *buffer = client_querybuf_reserve(client, CLIENT_QUERYBUF_READ_LEN);
+        if (!buffer) {
+            client->io_status = CLIENT_IO_ERROR;
+            return;
+        }
+
+        ssize_t bytes_read = read(client->fd, buffer, CLIENT_QUERYBUF_READ_LEN);
+        if (bytes_read > 0) {
+            client->querybuf_len += bytes_read;
+            client->querybuf[client->querybuf_len] = '\0';
+        } else if (bytes_read == 0) {
+            client->io_status = CLIENT_IO_EOF;
+            break;
+        } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            break;
+        } else if (errno != EINTR) {
+            client->io_status = CLIENT_IO_ERROR;
+            return;
+        }
+    }
+
+    if (client->querybuf_len > redis->client_max_querybuf_len) {
+        client->io_status = CLIENT_IO_OVERFLOW;
+        return;
+    }
+
+    if (client->is_blocked) {
+        return;
+    }
+
+    parse_query_buffer(client);
+}
+
+static void handle_clients_with_pending_reads(event_loop_t *loop, void *data) {
+    (void)loop;
+    redis_server_t *redis = (redis_server_t *)data;
+    redis_list_t *pending = redis->clients_pending_read;
+    if (list_length(pending) == 0) {
+        return;
+    }
+
+    io_threads_run(pending, read_client_job, redis);
+
+    // Commands still execute one at a time on this thread
+    client_t *client;
+    while ((client = list_lpop(pending)) != NULL) {
+        client->pending_read = 0;
+
+        int drop = 0;
+        if (process_query_buffer(redis, client) < 0) {
+            drop = 1;
+        } else if (client->io_status == CLIENT_IO_EOF) {
+            printf("Client %d disconnected\n", client->fd);
+            drop = 1;
+        } else if (client->io_status == CLIENT_IO_ERROR) {
+            fprintf(stderr, "Read error on client %d\n", client->fd);
+            drop = 1;
+        } else if (client->io_status == CLIENT_IO_OVERFLOW) {
+            fprintf(stderr, "Closing client %d: query buffer of %zu bytes exceeds limit of %zu\n",
+                    client->fd, client->querybuf_len, redis->client_max_querybuf_len);
+            drop = 1;
+        }
+
+        if (drop) {
+            free_client_connection(redis, redis->event_loop, client);
+        }
+    }
+}
+
+/*
+ * A client that was unblocked by another client's command or by its timeout
+ * may have more commands buffered behind the blocking one; run them now
+ * instead of waiting for it to send something else.
+ */
+void queue_unblocked_client(redis_server_t *server, client_t *client) {
+    if (client->fd < 0 || client->shard.origin >= 0 || client->pending_unblocked) {
+        return;
+    }
+    client->pending_unblocked = 1;
+    list_rpush(server->unblocked_clients, client);
+}
+
+static void handle_unblocked_clients(event_loop_t *loop, void *data) {
+    redis_server_t *redis = (redis_server_t *)data;
+
+    // Running a client's commands may unblock more clients, which join the tail
+    client_t *client;
+    while ((client = list_lpop(redis->unblocked_clients)) != NULL) {
+        client->pending_unblocked = 0;
+        if (client->querybuf_len > 0 && process_query_buffer(redis, client) < 0) {
+            free_client_connection(redis, loop, client);
+        }
+    }
+}
+
+/*
+ * Marks a client to be freed from before_sleep. Used where freeing it right
+ * away is unsafe, e.g. while PUBLISH is walking the channel's subscriber list.
+ * Nothing more is read from or written to it in the meantime.
+ */
+void close_client_async(redis_server_t *server, client_t *client) {
+    if (client->close_asap || client->fd < 0) {
+        return;
+    }
+    client->close_asap = 1;
+    list_rpush(server->clients_to_close, client);
+}
+
+static void handle_clients_to_close(event_loop_t *loop, void *data) {
+    redis_server_t *redis = (redis_server_t *)data;
+
+    client_t *client;
+    while ((client = list_lpop(redis->clients_to_close)) != NULL) {
+        client->close_asap = 0;
+        free_client_connection(redis, loop, client);
+    }
+}
+
+static void handle_replica_output(event_loop_t *loop, void *data) {
+    (void)loop;
+    flush_replica_output((redis_server_t *)data);
+}
+
+client_t *redis_server_find_client(redis_server_t *server, int fd, unsigned long long id) {
+    event_handler_entry_t *entry = event_loop_get_handler(server->event_loop, fd);
+    if (!entry || entry->handler != handle_client_data) {
+        return NULL;
+    }
+
+    client_t *client = (client_t *)entry->data;
+    return client->id == id ? client : NULL;
+}
+
+// Run the commands that piled up while the client waited on another shard
+void redis_server_resume_client(redis_server_t *server, client_t *client) {
+    if (process_query_buffer(server, client) < 0) {
+        free_client_connection(server, server->event_loop, client);
+    }
+}
+
+static int repl_buffer_append(char **buf, size_t *len, size_t *cap, const char *data, size_t data_len) {
+    if (*len + data_len > *cap) {
+        size_t new_cap = *cap ? *cap : 4096;
+        while (new_cap < *len + data_len) {
+            new_cap *= 2;
+        }
+        char *grown = realloc(*buf, new_cap);
+        if (!grown) {
+            fprintf(stderr, "Out of memory buffering %zu bytes for replicas\n", data_len);
+            return -1;
+        }
+        *buf = grown;
+        *cap = new_cap;
+    }
+    memcpy(*buf + *len, data, data_len);
+    *len += data_len;
+    return 0;
+}
+
+static int has_replicas(redis_server_t *server) {
+    return server->replication_info &&
+           server->replication_info->role == MASTER &&
+           server->replication_info->connected_slaves > 0;
+}
+
+/*
+ * Write commands are collected for the whole loop iteration and sent to
+ * each replica with one send() from before_sleep. The offset moves right
+ * away so WAIT issued later in the same batch targets the right position.
+ */
+void propagate_command(redis_server_t *server, const char *buffer, size_t len) {
+    if (!has_replicas(server)) {
+        return;
+    }
+    if (repl_buffer_append(&server->repl_output, &server->repl_output_len, &server->repl_output_cap,
+                           buffer, len) < 0) {
+        return;
+    }
+
+    server->replication_info->master_repl_offset += len;
+    printf("Master offset updated to: %lu\n", server->replication_info->master_repl_offset);
+}
+
+/*
+ * Queue a command for the replicas to run after the one executing now, e.g.
+ * the LPOP that serving a blocked BLPOP amounts to while an RPUSH runs.
+ */
+void propagate_also(redis_server_t *server, char **argv, int argc) {
+    if (!has_replicas(server)) {
+        return;
+    }
+    char *frame = encode_resp_array(argv, argc);
+    if (!frame) {
+        return;
+    }
+    repl_buffer_append(&server->repl_pending, &server->repl_pending_len, &server->repl_pending_cap,
+                       frame, strlen(frame));
+    free(frame);
+}
+
+/* The running command's effect is argv (BLPOP popped, XADD picked an ID):
+ * replicas get that instead of the frame the client sent. */
+void propagate_rewrite(redis_server_t *server, char **argv, int argc) {
+    server->propagate_rewritten = 1;
+    propagate_also(server, argv, argc);
+}
+
+// Called once the running command's own frame went out
+void propagate_pending(redis_server_t *server) {
+    if (server->repl_pending_len == 0) {
+        return;
+    }
+    propagate_command(server, server->repl_pending, server->repl_pending_len);
+    server->repl_pending_len = 0;
+}
+
+void flush_replica_output(redis_server_t *server) {
     replication_info_t *repl_info = server->replication_info;
-    
+    if (server->repl_output_len == 0 || !repl_info) {
+        return;
+    }
+
     for (int i = 0; i < MAX_REPLICAS; i++) {
         if (repl_info->replicas_fd[i] != -1) {  // Check for valid fd
-            ssize_t bytes_sent = send(repl_info->replicas_fd[i], command_buffer, buffer_len, MSG_NOSIGNAL);
+            ssize_t bytes_sent = send(repl_info->replicas_fd[i], server->repl_output,
+                                      server->repl_output_len, MSG_NOSIGNAL);
             
             if (bytes_sent < 0) {
                 printf("Failed to propagate to replica fd %zu: %s\n", 
@@ -303,26 +1077,11 @@ static void propagate_to_replicas(redis_server_t *server, const char *command_bu
                 repl_info->replicas_fd[i] = -1;
                 repl_info->connected_slaves--;
             } else {
-                printf("Propagated %zu bytes to replica fd %zu\n", buffer_len, repl_info->replicas_fd[i]);
+                printf("Propagated %zu bytes to replica fd %zu\n", server->repl_output_len, repl_info->replicas_fd[i]);
             }
         }
     }
-    
-    repl_info->master_repl_offset += buffer_len;
-    printf("Master offset updated to: %lu\n", repl_info->master_repl_offset);
-}
-
-static void handle_timer_interrupt(event_loop_t *loop, int fd, uint32_t events, void *data) {
-    (void)loop;
-    (void)events;
-    redis_server_t *redis = (redis_server_t *)data;
-    
-    uint64_t expirations;
-    read(fd, &expirations, sizeof(expirations));
-    
-    check_blocked_clients_timeout(redis);
-    
-    check_wait_completion(redis);
+    server->repl_output_len = 0;
 }
 
 int redis_server_configure_master(redis_server_t *server)
@@ -597,69 +1356,6 @@ static int load_rdb_file(redis_server_t *server, const char *rdb_path)
     return 0;
 }
 
-static int is_write_command(const char *buffer) {
-    if (buffer[0] != '*') {
-        return 0;  
-    }
-    
-    const char *cmd_start = strstr(buffer, "\r\n$");
-    if (!cmd_start) return 0;
-    
-    cmd_start = strstr(cmd_start + 3, "\r\n");
-    if (!cmd_start) return 0;
-    
-    cmd_start += 2;  
-    
-    if (strncasecmp(cmd_start, "SET", 3) == 0 ||
-        strncasecmp(cmd_start, "DEL", 3) == 0 ||
-        strncasecmp(cmd_start, "HSET", 4) == 0 ||
-        strncasecmp(cmd_start, "LPUSH", 5) == 0) {
-        return 1;
-    }
-    
-    // Skip replication commands
-    if (strncasecmp(cmd_start, "REPLCONF", 8) == 0 ||
-        strncasecmp(cmd_start, "PSYNC", 5) == 0 ||
-        strncasecmp(cmd_start, "PING", 4) == 0) {
-        return 0;
-    }
-    
-    return 0;
-}
-
-static void process_multiple_commands(redis_server_t *server, char *buffer, size_t buffer_len) {
-    char *current = buffer;
-    char *buffer_end = buffer + buffer_len;
-    
-    while (current < buffer_end) {
-        char *next_command = strstr(current + 1, "*");
-        
-        size_t cmd_len;
-        if (next_command && next_command < buffer_end) {
-            cmd_len = next_command - current;
-        } else {
-            cmd_len = buffer_end - current;
-        }
-        
-        if (cmd_len > 0) {
-            char *single_cmd = malloc(cmd_len + 1);
-            memcpy(single_cmd, current, cmd_len);
-            single_cmd[cmd_len] = '\0';
-            
-            printf("Executing: %s", single_cmd);
-            
-            char *response = handle_command(server, single_cmd, NULL);
-            if (response) free(response);
-            free(single_cmd);
-        }
-        
-        if (!next_command || next_command >= buffer_end) {
-            break;
-        }
-        current = next_command;
-    }
-}
-
 void track_replica_bytes(redis_server_t *server, const char *command_buffer) {
     if (!server || !server->replication_info || !command_buffer) {
         return;
@@ -732,7 +1428,7 @@ static void process_multiple_replication_commands(redis_server_t *server, const
                 printf("Successfully sent ACK response\n");
             }
         } else {
-            char *response = handle_command(server, single_cmd, NULL);
+            char *response = handle_command(server, single_cmd, cmd_len, NULL);
             if (response) {
                 free(response); 
             }
@@ -808,20 +1504,28 @@ static void handle_rdb_buffer(redis_server_t *server, const char *buffer, ssize_
     }
     
     wait_state_t *wait = &server->pending_wait;
-    long long current_time = get_current_time_ms();
-    
-    if (current_time >= wait->start_time + wait->timeout_ms) {
-        int acked_count = count_acked_replicas(server, wait->target_offset);
-        complete_wait_command(server, acked_count);
-        return;
-    }
-    
     int acked_count = count_acked_replicas(server, wait->target_offset);
     if (acked_count >= wait->expected_replicas) {
         complete_wait_command(server, acked_count);
     }
 }
 
+static long long handle_wait_timeout(event_loop_t *loop, event_timer_t *timer, void *data) {
+    (void)loop;
+    (void)timer;
+    redis_server_t *server = (redis_server_t *)data;
+
+    server->pending_wait.timer = NULL;
+    complete_wait_command(server, count_acked_replicas(server, server->pending_wait.target_offset));
+    return EVENT_TIMER_NOMORE;
+}
+
+// Called once pending_wait is filled in; a zero timeout answers on the next loop iteration
+void schedule_wait_timeout(redis_server_t *server) {
+    server->pending_wait.timer = event_loop_add_timer(server->event_loop, server->pending_wait.timeout_ms,
+                                                      handle_wait_timeout, server);
+}
+
 static int count_acked_replicas(redis_server_t *server, uint64_t target_offset) {
     int count = 0;
     for (int i = 0; i < MAX_REPLICAS; i++) {
@@ -839,20 +1543,25 @@ static void complete_wait_command(redis_server_t *server, int acked_count) {
     }
     
     char response[32];
-    sprintf(response, ":%d\r\n", acked_count);
+    int response_len = sprintf(response, ":%d\r\n", acked_count);
     
     client_t *client = server->pending_wait.client;
-    send(client->fd, response, strlen(response), MSG_NOSIGNAL);
+    reply_to_client(server, client, response, response_len);
     
     printf("WAIT completed: %d replicas acked\n", acked_count);
     
     server->pending_wait.active = 0;
     server->pending_wait.client = NULL;
+    if (server->pending_wait.timer) {
+        event_loop_del_timer(server->pending_wait.timer);
+        server->pending_wait.timer = NULL;
+    }
 }
 
 void init_channel_data(redis_server_t *server)
 {
    server->channels_map = hash_table_create(1024);
+   server->pubsub_patterns = list_create();
 }
 
 
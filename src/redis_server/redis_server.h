@@ -6,8 +6,13 @@
 #include "../redis_db/redis_db.h"
 #include "../lib/list.h"
 #include "../clients/client.h"
+#include "../slowlog/slowlog.h"
+#include "../latency/latency_monitor.h"
 
 #define MAX_REPLICAS 12
+#define MAX_ACCEPTS_PER_CALL 1000
+#define SERVER_CRON_INTERVAL_MS 100
+#define SERVER_CRON_REHASH_MS 1       // dict rehashing done per cron run while a resize is under way
 
 typedef enum {
     MASTER,
@@ -43,32 +48,84 @@ typedef struct {
     long long start_time;       // When WAIT started
     int timeout_ms;             // Timeout in milliseconds
     int active;                 // Is this wait active?
+    event_timer_t *timer;       // Replies with the acks so far once timeout_ms elapses
 } wait_state_t;
 
+/* A key hashed by the pipeline prefetch, so its command's lookup can skip hashing it again */
+typedef struct prefetched_key {
+    const char *key;            // the command's own argument, matched by address
+    uint64_t hash;
+    int command;                // index of the command in the prefetched window
+} prefetched_key_t;
+
+struct shard;
 
 typedef struct redis_server {
     server_t *server;
+    server_t *unix_server;        // --unixsocket listener, NULL when not configured
     event_loop_t *event_loop;
     redis_db_t *db;
     redis_list_t *clients;
     redis_list_t *blocked_clients;
+    redis_list_t *clients_pending_write;   // Clients with replies waiting to be flushed
+    redis_list_t *clients_pending_read;    // Readable clients handed to I/O threads
+    redis_list_t *unblocked_clients;       // Unblocked clients whose pipelined commands still wait
+    redis_list_t *clients_to_close;        // Clients marked close_asap, freed from before_sleep
     replication_info_t *replication_info;
     wait_state_t pending_wait;
+    char *repl_output;            // Write commands of this iteration, sent to replicas in before_sleep
+    size_t repl_output_len;
+    size_t repl_output_cap;
+    char *repl_pending;           // Commands a running command set off, propagated right after it
+    size_t repl_pending_len;
+    size_t repl_pending_cap;
+    int propagate_rewritten;      // The running command propagated its own rewrite instead of its frame
     char *rdb_dir;        // Directory for RDB files
     char *rdb_filename;
     hash_table_t *channels_map;
+    redis_list_t *pubsub_patterns;  // pubsub_pattern_t of every PSUBSCRIBE, checked by each PUBLISH
+    hash_table_t *watched_keys;   // key -> redis_list_t of the clients WATCHing it
     int n_channels;
+    size_t client_max_querybuf_len;   // Clients whose pending input grows past this are dropped
+    client_output_limit_t client_output_limits[CLIENT_TYPE_COUNT];
+    long long stat_output_limit_disconnections;
+    long long stat_pubsub_dropped_messages;   // not delivered because the subscriber is being dropped
+    struct command_stats *command_stats;      // per command, indexed like the command table
+    slowlog_t *slowlog;
+    latency_monitor_t *latency_monitor;
+    int io_threads_num;               // >1 offloads socket reads/parsing and writes to threads
+    struct shard *shard;              // set when the keyspace is split across shards (--shards)
+    unsigned long long next_client_id;
+    prefetched_key_t prefetched_keys[HASH_TABLE_PREFETCH_MAX];   // keys of the last prefetched window
+    int prefetched_keys_count;
+    int running_prefetched;           // window index of the running command, -1 when not prefetched
 
 
 } redis_server_t;
 
-redis_server_t* redis_server_create(int port);
+redis_server_t* redis_server_create(int port, int tcp_backlog);
+redis_server_t* redis_server_create_shard(int port, int tcp_backlog, struct shard *shard);
+int redis_server_listen_unix(redis_server_t *redis, const char *path, mode_t perm, int backlog);
 void redis_server_destroy(redis_server_t *redis);
 void redis_server_run(redis_server_t *redis);
 
 int redis_server_configure_master(redis_server_t *server);
 int redis_server_configure_replica(redis_server_t *server, char* master_host, int master_port);
 void check_wait_completion(redis_server_t *server);
+void schedule_wait_timeout(redis_server_t *server);
+void flush_replica_output(redis_server_t *server);
+void propagate_command(redis_server_t *server, const char *buffer, size_t len);
+void propagate_also(redis_server_t *server, char **argv, int argc);
+void propagate_rewrite(redis_server_t *server, char **argv, int argc);
+void propagate_pending(redis_server_t *server);
+void queue_unblocked_client(redis_server_t *server, client_t *client);
+void close_client_async(redis_server_t *server, client_t *client);
 void init_channel_data(redis_server_t *server);
+void reply_to_client(redis_server_t *server, client_t *client, const char *data, size_t len);
+void reply_queued(redis_server_t *server, client_t *client);
+int client_accepts_replies(client_t *client);
+void reply_added(redis_server_t *server, client_t *client);
+client_t *redis_server_find_client(redis_server_t *server, int fd, unsigned long long id);
+void redis_server_resume_client(redis_server_t *server, client_t *client);
 
 #endif 
\ No newline at end of file
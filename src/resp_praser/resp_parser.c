@@ -6,84 +6,222 @@
 #include <errno.h>
 #include <ctype.h>
 
-static void toLowerCase (char *str);
-char* extract_until_delimiter(resp_buffer_t *resp_buffer) {
-    const char *start = resp_buffer->buffer + resp_buffer->pos;
-    const char *end = strstr(start, "\r\n"); // search starting from current pos
-    if (!end) return NULL; // delimiter not found
-
-    size_t len = end - start;
-    char *result = malloc(len + 1);
-    if (!result) return NULL;
-
-    strncpy(result, start, len);
-    result[len] = '\0';
+// Reads a "<number>\r\n" header starting at buf[*pos]; returns 0 if the line is not complete yet
+static int read_frame_header(const char *buf, size_t len, size_t *pos, long long *value)
+{
+    const char *start = buf + *pos;
+    const char *cr = memchr(start, '\r', len - *pos);
+    if (!cr || (size_t)(cr - buf) + 1 >= len)
+        return 0;
+    if (cr[1] != '\n')
+        return -1;
 
-    resp_buffer->pos += (len + 2); 
+    char *end;
+    *value = strtoll(start, &end, 10);
+    if (end == start || end != cr)
+        return -1;
 
-    return result;
+    *pos = (cr - buf) + 2;
+    return 1;
 }
 
-char *parse_resp_array(resp_buffer_t *resp_buffer)
+/*
+ * Returns the size of the first complete "*<n>\r\n$<len>\r\n..." command in buf,
+ * 0 if more bytes are needed, or -1 if the bytes can never form a valid command.
+ * Accepts exactly the frames resp_parser_feed() does, "*0\r\n" included.
+ */
+ssize_t resp_frame_length(const char *buf, size_t len)
 {
-    if (!resp_buffer || resp_buffer->pos >= resp_buffer->size) {
-        return NULL;
+    if (len == 0)
+        return 0;
+    if (buf[0] != '*')
+        return -1;
+
+    size_t pos = 1;
+    long long argc;
+    int rc = read_frame_header(buf, len, &pos, &argc);
+    if (rc <= 0)
+        return rc;
+    if (argc < 0 || argc > RESP_MAX_ARGS)
+        return -1;
+
+    for (long long i = 0; i < argc; i++)
+    {
+        if (pos >= len)
+            return 0;
+        if (buf[pos] != '$')
+            return -1;
+        pos++;
+
+        long long bulk_len;
+        rc = read_frame_header(buf, len, &pos, &bulk_len);
+        if (rc <= 0)
+            return rc;
+        if (bulk_len < 0 || bulk_len > RESP_MAX_BULK_LEN)
+            return -1;
+
+        if (pos + bulk_len + 2 > len)
+            return 0;
+        if (buf[pos + bulk_len] != '\r' || buf[pos + bulk_len + 1] != '\n')
+            return -1;
+        pos += bulk_len + 2;
     }
-    
-    char *result = NULL;
-    
-    if (resp_buffer->buffer[resp_buffer->pos] == '*') {
-        resp_buffer->pos += 1;
-        result = extract_until_delimiter(resp_buffer);
-        return result;  
+
+    return (ssize_t)pos;
+}
+
+void resp_parser_init(resp_parser_t *parser)
+{
+    memset(parser, 0, sizeof(*parser));
+    parser->argc = -1;
+    parser->bulk_len = -1;
+}
+
+// Ready for the next frame; the argument arrays are kept for reuse
+void resp_parser_reset(resp_parser_t *parser)
+{
+    parser->pos = 0;
+    parser->argc = -1;
+    parser->bulk_len = -1;
+    parser->argi = 0;
+}
+
+void resp_parser_free(resp_parser_t *parser)
+{
+    free(parser->offsets);
+    free(parser->args);
+    resp_parser_init(parser);
+}
+
+static int resp_parser_reserve(resp_parser_t *parser, long long argc)
+{
+    if (argc <= parser->cap)
+        return 0;
+
+    // Trust a huge count only as far as arguments actually arrive
+    int cap = parser->cap ? parser->cap : 8;
+    while (cap < argc)
+        cap = cap > RESP_MAX_ARGS / 2 ? RESP_MAX_ARGS : cap * 2;
+
+    size_t *offsets = realloc(parser->offsets, cap * sizeof(size_t));
+    if (!offsets)
+        return -1;
+    parser->offsets = offsets;
+
+    resp_arg_t *args = realloc(parser->args, cap * sizeof(resp_arg_t));
+    if (!args)
+        return -1;
+    parser->args = args;
+    parser->cap = cap;
+    return 0;
+}
+
+/*
+ * Continue parsing the frame at the start of frame[0..len). len may only grow
+ * between calls for the same frame. On RESP_PARSE_OK, parser->pos is the
+ * frame length and parser->args holds argc slices into frame.
+ */
+resp_parse_status_t resp_parser_feed(resp_parser_t *parser, const char *frame, size_t len)
+{
+    if (parser->argc < 0)
+    {
+        if (len == 0)
+            return RESP_PARSE_INCOMPLETE;
+        if (frame[0] != '*')
+            return RESP_PARSE_ERROR;
+
+        size_t pos = 1;
+        long long argc;
+        int rc = read_frame_header(frame, len, &pos, &argc);
+        if (rc <= 0)
+            return rc < 0 ? RESP_PARSE_ERROR : RESP_PARSE_INCOMPLETE;
+        // "*0\r\n" is a complete frame with no arguments, left for the caller to skip
+        if (argc < 0 || argc > RESP_MAX_ARGS)
+            return RESP_PARSE_ERROR;
+
+        parser->argc = argc;
+        parser->pos = pos;
     }
-    
-    if (resp_buffer->buffer[resp_buffer->pos] == '$') {
-        result = parse_resp_bulk_string(resp_buffer); 
-        if (result) {
-            toLowerCase(result);  
+
+    while (parser->argi < parser->argc)
+    {
+        if (parser->bulk_len < 0)
+        {
+            if (parser->pos >= len)
+                return RESP_PARSE_INCOMPLETE;
+            if (frame[parser->pos] != '$')
+                return RESP_PARSE_ERROR;
+
+            size_t pos = parser->pos + 1;
+            long long bulk_len;
+            int rc = read_frame_header(frame, len, &pos, &bulk_len);
+            if (rc <= 0)
+                return rc < 0 ? RESP_PARSE_ERROR : RESP_PARSE_INCOMPLETE;
+            if (bulk_len < 0 || bulk_len > RESP_MAX_BULK_LEN)
+                return RESP_PARSE_ERROR;
+            if (resp_parser_reserve(parser, parser->argi + 1) < 0)
+                return RESP_PARSE_ERROR;
+
+            parser->bulk_len = bulk_len;
+            parser->pos = pos;
         }
-    }
-    
-    return result;
-}
 
-char *parse_resp_bulk_string(resp_buffer_t *resp_buffer) {
-    if (resp_buffer->buffer[resp_buffer->pos] != '$') {
-        return NULL;
+        // The payload is binary: only its length matters, then CRLF
+        if (parser->pos + parser->bulk_len + 2 > len)
+            return RESP_PARSE_INCOMPLETE;
+        if (frame[parser->pos + parser->bulk_len] != '\r' || frame[parser->pos + parser->bulk_len + 1] != '\n')
+            return RESP_PARSE_ERROR;
+
+        parser->offsets[parser->argi] = parser->pos;
+        parser->args[parser->argi].len = (size_t)parser->bulk_len;
+        parser->argi++;
+        parser->pos += parser->bulk_len + 2;
+        parser->bulk_len = -1;
     }
-    
-    resp_buffer->pos += 1;  
-    
-    char *len_str = extract_until_delimiter(resp_buffer);
-    if (!len_str) {
-        return NULL;
+
+    for (int i = 0; i < parser->argi; i++)
+    {
+        parser->args[i].ptr = frame + parser->offsets[i];
     }
-    
-    int len = atoi(len_str);
-    free(len_str);
-    
-    if (resp_buffer->pos + len > resp_buffer->size) {
-        return NULL;  
+    return RESP_PARSE_OK;
+}
+
+/*
+ * NUL-terminated copies of the parsed arguments for the command handlers,
+ * built in a single allocation: the NULL-terminated pointer array followed
+ * by the strings. Release it with free(). The command name is case-folded, the arguments are
+ * left exactly as sent.
+ */
+char **resp_parser_argv(const resp_parser_t *parser)
+{
+    // One more pointer for the NULL terminator, so even "*0" gets an array
+    size_t bytes = (parser->argi + 1) * sizeof(char *);
+    for (int i = 0; i < parser->argi; i++)
+    {
+        bytes += parser->args[i].len + 1;
     }
-    
-    char *result = malloc(len + 1);
-    if (!result) {
+
+    char **argv = malloc(bytes);
+    if (!argv)
         return NULL;
-    }
-    
-    memcpy(result, resp_buffer->buffer + resp_buffer->pos, len);
-    result[len] = '\0';
-    
-    resp_buffer->pos += len + 2; 
-    
-    return result;
-}
 
-static void toLowerCase(char *str) {
-    for (int i = 0; str[i]; i++) {
-        str[i] = tolower(str[i]);
+    char *data = (char *)(argv + parser->argi + 1);
+    argv[parser->argi] = NULL;
+    for (int i = 0; i < parser->argi; i++)
+    {
+        argv[i] = data;
+        memcpy(data, parser->args[i].ptr, parser->args[i].len);
+        data[parser->args[i].len] = '\0';
+        data += parser->args[i].len + 1;
+    }
+    if (parser->argi > 0)
+    {
+        for (char *p = argv[0]; *p; p++)
+        {
+            *p = tolower((unsigned char)*p);
+        }
     }
+    return argv;
 }
 
 char* encode_bulk_string(const char *str) {
@@ -2,6 +2,7 @@
 #define RESP_PARSER_H
 #include <stddef.h>
 #include <stdbool.h>
+#include <sys/types.h>
 typedef enum {
     RESP_SIMPLE_STRING,
     RESP_ERROR,
@@ -24,14 +25,44 @@ typedef struct resp_value {
 } resp_value_t;
 
 
-typedef struct resp_buffer {
-    char * buffer;
-    int pos;
-    int size;
-}resp_buffer_t;
+#define RESP_MAX_ARGS (1024 * 1024)
+#define RESP_MAX_BULK_LEN (512LL * 1024 * 1024)
 
-char *parse_resp_array(resp_buffer_t *buffer);
-char *parse_resp_bulk_string(resp_buffer_t *buffer);
+typedef enum {
+    RESP_PARSE_ERROR = -1,      // the bytes can never form a valid command
+    RESP_PARSE_INCOMPLETE = 0,  // feed again once more bytes arrived
+    RESP_PARSE_OK = 1
+} resp_parse_status_t;
+
+/* One argument of a parsed command: a slice of the frame, not NUL-terminated */
+typedef struct resp_arg {
+    const char *ptr;
+    size_t len;
+} resp_arg_t;
+
+/*
+ * Incremental parser for one "*<n>\r\n$<len>\r\n..." command frame. State is
+ * kept as offsets from the frame start, so a frame that arrives over several
+ * reads is never rescanned and the buffer holding it may be reallocated or
+ * moved between calls, as long as the frame's bytes stay the same.
+ */
+typedef struct resp_parser {
+    size_t pos;             // bytes of the frame consumed so far
+    long long argc;         // -1 until the "*<n>" header is read
+    long long bulk_len;     // -1 until the current argument's "$<len>" header is read
+    int argi;               // arguments completed
+    size_t *offsets;        // where each argument starts within the frame
+    resp_arg_t *args;       // slices into the frame, valid once RESP_PARSE_OK is returned
+    int cap;
+} resp_parser_t;
+
+void resp_parser_init(resp_parser_t *parser);
+void resp_parser_reset(resp_parser_t *parser);
+void resp_parser_free(resp_parser_t *parser);
+resp_parse_status_t resp_parser_feed(resp_parser_t *parser, const char *frame, size_t len);
+char **resp_parser_argv(const resp_parser_t *parser);
+
+ssize_t resp_frame_length(const char *buf, size_t len);
 char *encode_bulk_string(const char *str);
 char *encode_simple_string(const char *str);
 char *encode_resp_array(char **args, int argc);
@@ -2,14 +2,19 @@
 #define SERVER_H
 
 #include <netinet/in.h>
+#include <sys/types.h>
+
+#define SERVER_DEFAULT_TCP_BACKLOG 511
 
 typedef struct {
     int fd;
     int port;
     struct sockaddr_in addr;
+    char *unix_path;        // set for an AF_UNIX listener, unlinked on destroy
 } server_t;
 
-server_t* server_create(int port);
+server_t* server_create(int port, int reuse_port, int backlog);
+server_t* server_create_unix(const char *path, mode_t perm, int backlog);
 void server_destroy(server_t* server);
 int server_accept_client(server_t* server, struct sockaddr_in* client_addr);
 
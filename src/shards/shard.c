@@ -0,0 +1,743 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sched.h>
+#include <sys/eventfd.h>
+#include "shard.h"
+#include "../resp_praser/resp_parser.h"
+#include "../redis_db/redis_db.h"
+
+/*
+ * Shared-nothing mode. Every shard owns the keys that hash to it and only
+ * its own thread ever touches its data. Connections land on any shard
+ * (SO_REUSEPORT picks one); a command for keys owned elsewhere is copied
+ * into a message for the owning shard, which runs it on a pseudo-client
+ * and sends the reply bytes back. The connection stays paused until the
+ * reply arrives, so pipelined replies keep their order.
+ *
+ * Cross-shard rules:
+ *  - all keys of one command must hash to the same shard (use {hash tags}),
+ *    otherwise the command fails with -CROSSSLOT;
+ *  - the keys queued in one MULTI must all live on one shard; EXEC then
+ *    ships the whole transaction there, so it still runs atomically;
+ *  - PUBLISH and KEYS run on every shard and merge the replies. They are
+ *    not atomic across shards, and inside MULTI they only see the shard
+ *    running the transaction.
+ *  - SCAN cursors carry the shard they walk, so one SCAN loop visits every
+ *    shard in turn.
+ *  - blocking commands block on the owning shard and time out there.
+ */
+
+#define SHARD_DRAIN_BATCH 1024
+
+static void handle_shard_wakeup(event_loop_t *loop, int fd, uint32_t events, void *data);
+
+// FNV-1a
+static uint64_t shard_hash(const char *key, size_t len)
+{
+    uint64_t hash = 14695981039346656037ULL;
+    for (size_t i = 0; i < len; i++) {
+        hash ^= (unsigned char)key[i];
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+int shard_for_key(shard_group_t *group, const char *key)
+{
+    size_t len = strlen(key);
+
+    // As with cluster hash tags, only a non-empty {...} section is hashed
+    const char *open = memchr(key, '{', len);
+    if (open) {
+        const char *close = memchr(open + 1, '}', len - (size_t)(open + 1 - key));
+        if (close && close > open + 1) {
+            key = open + 1;
+            len = (size_t)(close - key);
+        }
+    }
+    return (int)(shard_hash(key, len) % (uint64_t)group->count);
+}
+
+static void shard_destroy(shard_t *shard)
+{
+    if (!shard) return;
+
+    if (shard->server) {
+        redis_server_destroy(shard->server);
+    }
+    for (int i = 0; i < SHARDS_MAX; i++) {
+        shard_msg_t *msg;
+        if (shard->inbox[i]) {
+            while ((msg = spsc_queue_pop(shard->inbox[i])) != NULL) {
+                free(msg->data);
+                free(msg);
+            }
+            spsc_queue_destroy(shard->inbox[i]);
+        }
+        if (shard->backlog[i]) {
+            while ((msg = list_lpop(shard->backlog[i])) != NULL) {
+                free(msg->data);
+                free(msg);
+            }
+            list_destroy(shard->backlog[i]);
+        }
+    }
+    if (shard->replying_clients) {
+        list_destroy(shard->replying_clients);
+    }
+    free_client(shard->exec_client);
+    if (shard->wake_fd >= 0) {
+        close(shard->wake_fd);
+    }
+    free(shard);
+}
+
+static shard_t *shard_create(shard_group_t *group, int id, int port, int tcp_backlog)
+{
+    shard_t *shard = calloc(1, sizeof(shard_t));
+    if (!shard) return NULL;
+
+    shard->id = id;
+    shard->group = group;
+    shard->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (shard->wake_fd < 0) {
+        perror("eventfd");
+        shard_destroy(shard);
+        return NULL;
+    }
+
+    for (int i = 0; i < group->count; i++) {
+        if (i == id) continue;
+        shard->inbox[i] = spsc_queue_create(SHARD_QUEUE_SIZE);
+        shard->backlog[i] = list_create();
+        if (!shard->inbox[i] || !shard->backlog[i]) {
+            shard_destroy(shard);
+            return NULL;
+        }
+    }
+
+    shard->replying_clients = list_create();
+    shard->exec_client = create_client(-1);
+    shard->server = redis_server_create_shard(port, tcp_backlog, shard);
+    if (!shard->replying_clients || !shard->exec_client || !shard->server) {
+        shard_destroy(shard);
+        return NULL;
+    }
+
+    if (event_loop_add_fd(shard->server->event_loop, shard->wake_fd, EPOLLIN,
+                          handle_shard_wakeup, shard) < 0) {
+        perror("event_loop_add_fd");
+        shard_destroy(shard);
+        return NULL;
+    }
+    return shard;
+}
+
+shard_group_t *shard_group_create(int port, int tcp_backlog, int count)
+{
+    if (count < 2 || count > SHARDS_MAX) {
+        return NULL;
+    }
+
+    shard_group_t *group = calloc(1, sizeof(shard_group_t));
+    if (!group) return NULL;
+
+    group->count = count;
+    for (int i = 0; i < count; i++) {
+        group->shards[i] = shard_create(group, i, port, tcp_backlog);
+        if (!group->shards[i]) {
+            fprintf(stderr, "Failed to create shard %d\n", i);
+            shard_group_destroy(group);
+            return NULL;
+        }
+    }
+    printf("Keyspace split across %d shards\n", count);
+    return group;
+}
+
+void shard_group_destroy(shard_group_t *group)
+{
+    if (!group) return;
+
+    for (int i = 0; i < group->count; i++) {
+        shard_destroy(group->shards[i]);
+    }
+    free(group);
+}
+
+static void pin_to_cpu(int id)
+{
+    long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+    if (ncpu <= 0) return;
+
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(id % ncpu, &set);
+    int err = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+    if (err != 0) {
+        fprintf(stderr, "Could not pin shard %d to CPU %ld: %s\n", id, id % ncpu, strerror(err));
+    }
+}
+
+static void *shard_thread_main(void *arg)
+{
+    shard_t *shard = (shard_t *)arg;
+    pin_to_cpu(shard->id);
+    redis_server_run(shard->server);
+    return NULL;
+}
+
+// Shard 0 runs on the calling thread, the others get a thread each
+void shard_group_run(shard_group_t *group)
+{
+    for (int i = 1; i < group->count; i++) {
+        shard_t *shard = group->shards[i];
+        if (pthread_create(&shard->thread, NULL, shard_thread_main, shard) != 0) {
+            perror("pthread_create");
+            exit(1);
+        }
+    }
+
+    pin_to_cpu(0);
+    redis_server_run(group->shards[0]->server);
+
+    for (int i = 1; i < group->count; i++) {
+        pthread_join(group->shards[i]->thread, NULL);
+    }
+}
+
+/*
+ * Queue a message for another shard. Takes ownership of data. The target is
+ * woken once per loop iteration from shard_before_sleep, not per message.
+ */
+static void shard_send(shard_t *shard, int to, shard_msg_type_t type, int client_fd,
+                       unsigned long long client_id, char *data, size_t len)
+{
+    shard_msg_t *msg = malloc(sizeof(shard_msg_t));
+    if (!msg) {
+        fprintf(stderr, "Out of memory sending message to shard %d\n", to);
+        free(data);
+        return;
+    }
+    msg->type = type;
+    msg->from = shard->id;
+    msg->client_fd = client_fd;
+    msg->client_id = client_id;
+    msg->data = data;
+    msg->len = len;
+
+    shard_t *target = shard->group->shards[to];
+    redis_list_t *backlog = shard->backlog[to];
+    if (list_length(backlog) > 0 || spsc_queue_push(target->inbox[shard->id], msg) < 0) {
+        list_rpush(backlog, msg);
+    }
+    shard->wake_pending[to] = 1;
+}
+
+static void shard_send_copy(shard_t *shard, int to, client_t *client, const char *buffer, size_t len)
+{
+    char *data = malloc(len + 1);
+    if (!data) {
+        fprintf(stderr, "Out of memory forwarding command to shard %d\n", to);
+        return;
+    }
+    memcpy(data, buffer, len);
+    data[len] = '\0';
+    shard_send(shard, to, SHARD_MSG_REQUEST, client->fd, client->id, data, len);
+}
+
+// Ship whatever a forwarded command produced back to the shard that asked
+static void shard_send_reply(shard_t *shard, client_t *client)
+{
+    size_t len;
+    char *data = client_take_replies(client, &len);
+    if (!data) {
+        data = strdup("-ERR out of memory\r\n");
+        len = data ? strlen(data) : 0;
+    }
+    shard_send(shard, client->shard.origin, SHARD_MSG_REPLY,
+               client->shard.origin_fd, client->shard.origin_id, data, len);
+}
+
+/*
+ * Shard owning every key of the command: -1 if it has no keys, -2 with an
+ * error in *error when the keys are spread over several shards.
+ */
+static int shard_command_target(shard_group_t *group, redis_command_t *cmd, char **args, int argc, char **error)
+{
+    int positions[COMMAND_MAX_KEYS];
+    int num_keys = get_command_keys(cmd, args, argc, positions, COMMAND_MAX_KEYS);
+    if (num_keys < 0) {
+        *error = strdup("-ERR too many keys in one command\r\n");
+        return -2;
+    }
+
+    int target = -1;
+    for (int i = 0; i < num_keys; i++) {
+        int owner = shard_for_key(group, args[positions[i]]);
+        if (target < 0) {
+            target = owner;
+        } else if (owner != target) {
+            *error = strdup("-CROSSSLOT Keys in request don't hash to the same shard\r\n");
+            return -2;
+        }
+    }
+    return target;
+}
+
+static void shard_merge_fanout(client_t *client, const char *data, size_t len)
+{
+    client_shard_state_t *state = &client->shard;
+    if (len == 0) return;
+
+    if (data[0] == '-') {
+        if (!state->acc_error) {
+            state->acc_error = strndup(data, len);
+        }
+    } else if (state->fanout == SHARD_FANOUT_SUM && data[0] == ':') {
+        state->acc_int += strtoll(data + 1, NULL, 10);
+    } else if (state->fanout == SHARD_FANOUT_CONCAT && data[0] == '*') {
+        char *end;
+        long count = strtol(data + 1, &end, 10);
+        const char *body = end + 2;
+        if (count <= 0 || body > data + len) {
+            return;
+        }
+
+        size_t body_len = (size_t)(data + len - body);
+        char *acc = realloc(state->acc, state->acc_len + body_len);
+        if (!acc) {
+            if (!state->acc_error) {
+                state->acc_error = strdup("-ERR out of memory\r\n");
+            }
+            return;
+        }
+        memcpy(acc + state->acc_len, body, body_len);
+        state->acc = acc;
+        state->acc_len += body_len;
+        state->acc_count += (size_t)count;
+    }
+}
+
+static void shard_finish_fanout(redis_server_t *server, client_t *client)
+{
+    client_shard_state_t *state = &client->shard;
+    char header[64];
+    int header_len;
+
+    if (state->acc_error) {
+        reply_to_client(server, client, state->acc_error, strlen(state->acc_error));
+    } else if (state->fanout == SHARD_FANOUT_SUM) {
+        header_len = snprintf(header, sizeof(header), ":%lld\r\n", state->acc_int);
+        reply_to_client(server, client, header, header_len);
+    } else {
+        header_len = snprintf(header, sizeof(header), "*%zu\r\n", state->acc_count);
+        reply_to_client(server, client, header, header_len);
+        if (state->acc_len > 0) {
+            reply_to_client(server, client, state->acc, state->acc_len);
+        }
+    }
+
+    free(state->acc);
+    free(state->acc_error);
+    state->acc = NULL;
+    state->acc_error = NULL;
+    state->acc_len = 0;
+    state->acc_count = 0;
+    state->acc_int = 0;
+    state->fanout = SHARD_FANOUT_NONE;
+}
+
+// Run the command on every shard; the local share runs right away
+static void shard_fanout(shard_t *shard, redis_command_t *cmd, char *buffer, size_t len,
+                         char **args, int argc, client_t *client, int mode)
+{
+    client->shard.fanout = mode;
+    client->shard.target = -1;
+    client->shard.pending = shard->group->count - 1;
+
+    for (int i = 0; i < shard->group->count; i++) {
+        if (i != shard->id) {
+            shard_send_copy(shard, i, client, buffer, len);
+        }
+    }
+
+    // Handlers build their reply on the client they are given, so the local
+    // share runs on the idle exec client and is taken back from there
+    client_t *scratch = shard->exec_client;
+    char *local = cmd->handler(shard->server, args, argc, scratch);
+    if (local) {
+        client_add_reply(scratch, local, strlen(local));
+        free(local);
+    }
+
+    size_t local_len;
+    local = client_take_replies(scratch, &local_len);
+    if (local) {
+        shard_merge_fanout(client, local, local_len);
+        free(local);
+    }
+}
+
+// EXEC of a transaction whose keys live elsewhere runs there as one MULTI ... EXEC batch
+static int shard_route_exec(shard_t *shard, client_t *client, char **response)
+{
+    int target = client->shard.txn_target;
+    // A transaction refused at queue time gets its EXECABORT from here
+    if (!client->is_queued || !client->transaction_commands || client->txn_dirty ||
+        target < 0 || target == shard->id) {
+        return 0;
+    }
+
+    static const char multi[] = "*1\r\n$5\r\nMULTI\r\n";
+    static const char exec[] = "*1\r\n$4\r\nEXEC\r\n";
+    size_t len = sizeof(multi) - 1 + sizeof(exec) - 1;
+    for (list_node_t *node = client->transaction_commands->head; node; node = node->next) {
+        len += ((transaction_command_t *)node->data)->len;
+    }
+
+    char *batch = malloc(len + 1);
+    if (!batch) {
+        cleanup_transaction(client);
+        *response = strdup("-ERR out of memory\r\n");
+        return 1;
+    }
+
+    size_t pos = 0;
+    memcpy(batch, multi, sizeof(multi) - 1);
+    pos += sizeof(multi) - 1;
+    for (list_node_t *node = client->transaction_commands->head; node; node = node->next) {
+        transaction_command_t *queued = (transaction_command_t *)node->data;
+        memcpy(batch + pos, queued->buffer, queued->len);
+        pos += queued->len;
+    }
+    memcpy(batch + pos, exec, sizeof(exec) - 1);
+    pos += sizeof(exec) - 1;
+    batch[pos] = '\0';
+    cleanup_transaction(client);
+
+    shard_send(shard, target, SHARD_MSG_REQUEST, client->fd, client->id, batch, pos);
+    client->shard.pending = 1;
+    client->shard.target = target;
+    *response = NULL;
+    return 1;
+}
+
+/*
+ * Decide where a command runs. Returns 0 to execute it here, or 1 when it
+ * was sent to other shards (*response NULL, the client pauses until the
+ * replies are in) or refused (*response holds the error).
+ */
+int shard_route_command(redis_server_t *server, redis_command_t *cmd, char *buffer, size_t len,
+                        char **args, int argc, client_t *client, char **response)
+{
+    shard_t *shard = server->shard;
+
+    // Forwarded work and the body of EXEC always run where they are
+    if (client->shard.origin >= 0 || client->in_exec) {
+        return 0;
+    }
+
+    if (cmd->flags & CMD_REPLICATION) {
+        *response = strdup("-ERR replication is not supported in sharded mode\r\n");
+        return 1;
+    }
+    if (cmd->handler == handle_exec_command) {
+        return shard_route_exec(shard, client, response);
+    }
+    if (cmd->flags & (CMD_FANOUT_SUM | CMD_FANOUT_CONCAT)) {
+        int mode = cmd->flags & CMD_FANOUT_SUM ? SHARD_FANOUT_SUM : SHARD_FANOUT_CONCAT;
+        shard_fanout(shard, cmd, buffer, len, args, argc, client, mode);
+        *response = NULL;
+        return 1;
+    }
+
+    int target;
+    if (cmd->handler == handle_scan_command) {
+        // SCAN walks one shard at a time and the cursor says which
+        target = (int)(strtoul(args[1], NULL, 10) % (unsigned long)shard->group->count);
+    } else {
+        target = shard_command_target(shard->group, cmd, args, argc, response);
+        if (target == -2) {
+            return 1;
+        }
+    }
+    if (target < 0 || target == shard->id) {
+        return 0;
+    }
+
+    shard_send_copy(shard, target, client, buffer, len);
+    client->shard.pending = 1;
+    client->shard.target = target;
+    *response = NULL;
+    return 1;
+}
+
+// Commands queued by MULTI must keep the transaction on a single shard
+char *shard_check_queued_command(redis_server_t *server, client_t *client, redis_command_t *cmd,
+                                 char **args, int argc)
+{
+    if (client->shard.origin >= 0) {
+        return NULL;
+    }
+
+    char *error = NULL;
+    int target = shard_command_target(server->shard->group, cmd, args, argc, &error);
+    if (target == -2) {
+        return error;
+    }
+    if (target < 0) {
+        return NULL;
+    }
+
+    if (client->shard.txn_target < 0) {
+        client->shard.txn_target = target;
+    } else if (client->shard.txn_target != target) {
+        return strdup("-CROSSSLOT Keys in a transaction must all hash to the same shard\r\n");
+    }
+    return NULL;
+}
+
+// A forwarded command that blocked got its reply; it is sent from before_sleep
+void shard_client_replied(shard_t *shard, client_t *client)
+{
+    if (client == shard->exec_client || client->pending_write) {
+        return;
+    }
+    client->pending_write = 1;
+    list_rpush(shard->replying_clients, client);
+}
+
+// Tell the shard running a blocked command for this connection to drop it
+void shard_client_closed(shard_t *shard, client_t *client)
+{
+    if (client->shard.pending > 0 && client->shard.target >= 0) {
+        shard_send(shard, client->shard.target, SHARD_MSG_CANCEL, client->fd, client->id, NULL, 0);
+    }
+}
+
+// After loading an RDB file every shard keeps only the keys it owns
+void shard_drop_foreign_keys(redis_server_t *server)
+{
+    shard_t *shard = server->shard;
+    redis_list_t *foreign = list_create();
+    if (!foreign) return;
+
+    hash_table_iterator_t *iter = hash_table_iterator_create(server->db->dict);
+    if (!iter) {
+        list_destroy(foreign);
+        return;
+    }
+
+    char *key;
+    void *value;
+    while (hash_table_iterator_next(iter, &key, &value)) {
+        if (shard_for_key(shard->group, key) != shard->id) {
+            list_rpush(foreign, strdup(key));
+        }
+    }
+    hash_table_iterator_destroy(iter);
+
+    size_t dropped = list_length(foreign);
+    while ((key = list_lpop(foreign)) != NULL) {
+        // Destroy first: a short string lives inside the entry the delete frees
+        redis_object_destroy(hash_table_get(server->db->dict, key));
+        hash_table_delete(server->db->dict, key);
+        hash_table_delete(server->db->expires, key);
+        free(key);
+    }
+    list_destroy(foreign);
+
+    printf("Shard %d: kept %zu keys, dropped %zu owned by other shards\n",
+           shard->id, server->db->dict->count, dropped);
+}
+
+static void shard_run_request(shard_t *shard, shard_msg_t *msg)
+{
+    client_t *client = shard->exec_client;
+    client->shard.origin = msg->from;
+    client->shard.origin_fd = msg->client_fd;
+    client->shard.origin_id = msg->client_id;
+
+    size_t offset = 0;
+    while (offset < msg->len) {
+        ssize_t frame_len = resp_frame_length(msg->data + offset, msg->len - offset);
+        if (frame_len <= 0) {
+            break;
+        }
+
+        // Only the last frame's reply goes back (EXEC for a transaction batch)
+        if (offset + (size_t)frame_len >= msg->len && client_has_pending_replies(client)) {
+            size_t discarded;
+            free(client_take_replies(client, &discarded));
+        }
+
+        char *response = handle_command(shard->server, msg->data + offset, frame_len, client);
+        if (response) {
+            client_add_reply(client, response, strlen(response));
+            free(response);
+        }
+        offset += frame_len;
+    }
+
+    if (client->is_blocked) {
+        // It keeps the origin details and replies once served or timed out
+        client_t *fresh = create_client(-1);
+        if (fresh) {
+            shard->exec_client = fresh;
+            return;
+        }
+        remove_client_from_list(shard->server->blocked_clients, client);
+        client_unblock(client);
+        client_unblock_stream(client);
+        client_add_reply(client, "-ERR out of memory\r\n", 20);
+    }
+
+    shard_send_reply(shard, client);
+    client->shard.origin = -1;
+}
+
+static void shard_handle_reply(shard_t *shard, shard_msg_t *msg)
+{
+    redis_server_t *server = shard->server;
+    client_t *client = redis_server_find_client(server, msg->client_fd, msg->client_id);
+    if (!client || client->shard.pending == 0) {
+        return;   // the connection went away meanwhile
+    }
+
+    if (client->shard.fanout != SHARD_FANOUT_NONE) {
+        shard_merge_fanout(client, msg->data, msg->len);
+    } else {
+        reply_to_client(server, client, msg->data, msg->len);
+    }
+
+    if (--client->shard.pending > 0) {
+        return;
+    }
+    if (client->shard.fanout != SHARD_FANOUT_NONE) {
+        shard_finish_fanout(server, client);
+    }
+    client->shard.target = -1;
+    redis_server_resume_client(server, client);
+}
+
+static void shard_handle_cancel(shard_t *shard, shard_msg_t *msg)
+{
+    redis_list_t *blocked = shard->server->blocked_clients;
+    for (list_node_t *node = blocked->head; node; node = node->next) {
+        client_t *client = (client_t *)node->data;
+        if (client->shard.origin == msg->from &&
+            client->shard.origin_fd == msg->client_fd &&
+            client->shard.origin_id == msg->client_id) {
+            remove_client_from_list(blocked, client);
+            if (client->pending_write) {
+                remove_client_from_list(shard->replying_clients, client);
+            }
+            free_client(client);
+            return;
+        }
+    }
+}
+
+static void handle_shard_wakeup(event_loop_t *loop, int fd, uint32_t events, void *data)
+{
+    (void)loop;
+    (void)events;
+    shard_t *shard = (shard_t *)data;
+
+    // Reset the counter first so messages pushed while draining wake us again
+    uint64_t count;
+    if (read(fd, &count, sizeof(count)) < 0 && errno != EAGAIN) {
+        perror("read eventfd");
+    }
+
+    int more = 0;
+    for (int i = 0; i < shard->group->count; i++) {
+        if (i == shard->id) continue;
+
+        shard_msg_t *msg;
+        int drained = 0;
+        while (drained < SHARD_DRAIN_BATCH && (msg = spsc_queue_pop(shard->inbox[i])) != NULL) {
+            switch (msg->type) {
+            case SHARD_MSG_REQUEST:
+                shard_run_request(shard, msg);
+                break;
+            case SHARD_MSG_REPLY:
+                shard_handle_reply(shard, msg);
+                break;
+            case SHARD_MSG_CANCEL:
+                shard_handle_cancel(shard, msg);
+                break;
+            }
+            free(msg->data);
+            free(msg);
+            drained++;
+        }
+        if (drained == SHARD_DRAIN_BATCH) {
+            more = 1;
+        }
+    }
+
+    if (more) {
+        // Let client sockets in before draining the rest
+        uint64_t one = 1;
+        if (write(shard->wake_fd, &one, sizeof(one)) < 0) {
+            perror("write eventfd");
+        }
+    }
+}
+
+/*
+ * Runs once per loop iteration: send replies of forwarded commands that got
+ * unblocked, move backlogged messages into the queues and wake every shard
+ * that has new messages with a single eventfd write.
+ */
+void shard_before_sleep(event_loop_t *loop, void *data)
+{
+    (void)loop;
+    shard_t *shard = (shard_t *)data;
+    client_t *client;
+    while ((client = list_lpop(shard->replying_clients)) != NULL) {
+        client->pending_write = 0;
+        if (client->is_blocked) {
+            continue;
+        }
+        shard_send_reply(shard, client);
+        free_client(client);
+    }
+
+    int retry = 0;
+    for (int i = 0; i < shard->group->count; i++) {
+        if (i == shard->id) continue;
+
+        shard_t *target = shard->group->shards[i];
+        redis_list_t *backlog = shard->backlog[i];
+        while (list_length(backlog) > 0) {
+            if (spsc_queue_push(target->inbox[shard->id], backlog->head->data) < 0) {
+                retry = 1;
+                break;
+            }
+            list_lpop(backlog);
+        }
+
+        if (shard->wake_pending[i]) {
+            uint64_t one = 1;
+            if (write(target->wake_fd, &one, sizeof(one)) < 0) {
+                perror("write eventfd");
+            }
+            shard->wake_pending[i] = 0;
+        }
+    }
+
+    if (retry) {
+        // The target queue is full; come back after it had a chance to drain
+        uint64_t one = 1;
+        if (write(shard->wake_fd, &one, sizeof(one)) < 0) {
+            perror("write eventfd");
+        }
+    }
+}
@@ -0,0 +1,73 @@
+#ifndef SHARD_H
+#define SHARD_H
+
+#include <pthread.h>
+#include <stdint.h>
+#include "../lib/list.h"
+#include "../lib/spsc_queue.h"
+#include "../clients/client.h"
+#include "../redis_server/redis_server.h"
+#include "../redis_command_handler/redis_command_handler.h"
+
+#define SHARDS_MAX 64
+#define SHARD_QUEUE_SIZE 4096
+
+/* How the replies of a command sent to every shard are combined */
+#define SHARD_FANOUT_NONE 0
+#define SHARD_FANOUT_SUM 1        // integer replies are added up (PUBLISH)
+#define SHARD_FANOUT_CONCAT 2     // array replies are concatenated (KEYS)
+
+typedef enum {
+    SHARD_MSG_REQUEST,      // run the frames in data, reply with the last one's output
+    SHARD_MSG_REPLY,
+    SHARD_MSG_CANCEL        // the origin connection is gone, drop its blocked request
+} shard_msg_type_t;
+
+typedef struct shard_msg {
+    shard_msg_type_t type;
+    int from;
+    int client_fd;              // connection on the origin shard
+    unsigned long long client_id;
+    char *data;
+    size_t len;
+} shard_msg_t;
+
+typedef struct shard_group shard_group_t;
+
+/*
+ * One reactor of the shared-nothing mode: a full redis_server_t with its own
+ * event loop, listener and slice of the keyspace, running on its own thread.
+ */
+typedef struct shard {
+    int id;
+    shard_group_t *group;
+    redis_server_t *server;
+    pthread_t thread;
+    int wake_fd;                            // eventfd poked when messages were queued for us
+    spsc_queue_t *inbox[SHARDS_MAX];        // inbox[i] is only written by shard i
+    redis_list_t *backlog[SHARDS_MAX];      // messages for shard i that did not fit its queue
+    int wake_pending[SHARDS_MAX];
+    client_t *exec_client;                  // runs forwarded commands on behalf of other shards
+    redis_list_t *replying_clients;         // forwarded commands that unblocked with a reply
+} shard_t;
+
+struct shard_group {
+    int count;
+    shard_t *shards[SHARDS_MAX];
+};
+
+shard_group_t *shard_group_create(int port, int tcp_backlog, int count);
+void shard_group_run(shard_group_t *group);
+void shard_group_destroy(shard_group_t *group);
+
+int shard_for_key(shard_group_t *group, const char *key);
+int shard_route_command(redis_server_t *server, redis_command_t *cmd, char *buffer, size_t len,
+                        char **args, int argc, client_t *client, char **response);
+char *shard_check_queued_command(redis_server_t *server, client_t *client, redis_command_t *cmd,
+                                 char **args, int argc);
+void shard_client_replied(shard_t *shard, client_t *client);
+void shard_client_closed(shard_t *shard, client_t *client);
+void shard_drop_foreign_keys(redis_server_t *server);
+void shard_before_sleep(event_loop_t *loop, void *data);
+
+#endif
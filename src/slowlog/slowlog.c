@@ -0,0 +1,111 @@
+#include <stdlib.h>
+#include <string.h>
+#include "slowlog.h"
+
+slowlog_t *slowlog_create(long long slower_than_us, size_t max_len) {
+    slowlog_t *slowlog = calloc(1, sizeof(slowlog_t));
+    if (!slowlog) {
+        return NULL;
+    }
+    if (slowlog_configure(slowlog, slower_than_us, max_len) < 0) {
+        free(slowlog);
+        return NULL;
+    }
+    return slowlog;
+}
+
+static void slowlog_entry_free(slowlog_entry_t *entry) {
+    for (int i = 0; i < entry->argc; i++) {
+        sdsfree(entry->argv[i]);
+    }
+    free(entry->argv);
+    entry->argv = NULL;
+    entry->argc = 0;
+}
+
+void slowlog_reset(slowlog_t *slowlog) {
+    if (!slowlog) return;
+
+    for (size_t i = 0; i < slowlog->len; i++) {
+        slowlog_entry_free(&slowlog->entries[i]);
+    }
+    slowlog->len = 0;
+    slowlog->head = 0;
+}
+
+void slowlog_destroy(slowlog_t *slowlog) {
+    if (!slowlog) return;
+
+    slowlog_reset(slowlog);
+    free(slowlog->entries);
+    free(slowlog);
+}
+
+// Resizing drops what was logged so far, like SLOWLOG RESET
+int slowlog_configure(slowlog_t *slowlog, long long slower_than_us, size_t max_len) {
+    slowlog->slower_than_us = slower_than_us;
+    if (slowlog->entries && max_len == slowlog->max_len) {
+        return 0;
+    }
+
+    slowlog_entry_t *entries = max_len ? calloc(max_len, sizeof(slowlog_entry_t)) : NULL;
+    if (max_len && !entries) {
+        return -1;
+    }
+    slowlog_reset(slowlog);
+    free(slowlog->entries);
+    slowlog->entries = entries;
+    slowlog->max_len = max_len;
+    return 0;
+}
+
+static sds slowlog_arg(const char *arg) {
+    size_t len = strlen(arg);
+    if (len <= SLOWLOG_ENTRY_MAX_STRING) {
+        return sdsnewlen(arg, len);
+    }
+    sds truncated = sdsnewlen(arg, SLOWLOG_ENTRY_MAX_STRING);
+    return sdscatprintf(truncated, "... (%zu more bytes)", len - SLOWLOG_ENTRY_MAX_STRING);
+}
+
+void slowlog_push_if_needed(slowlog_t *slowlog, char **argv, int argc, long long duration_us, int client_fd) {
+    if (!slowlog || slowlog->slower_than_us < 0 || slowlog->max_len == 0 ||
+        duration_us < slowlog->slower_than_us) {
+        return;
+    }
+
+    int logged_argc = argc > SLOWLOG_ENTRY_MAX_ARGC ? SLOWLOG_ENTRY_MAX_ARGC : argc;
+    sds *logged_argv = malloc(sizeof(sds) * logged_argc);
+    if (!logged_argv) {
+        return;
+    }
+    for (int i = 0; i < logged_argc; i++) {
+        if (i == logged_argc - 1 && logged_argc != argc) {
+            logged_argv[i] = sdscatprintf(sdsempty(), "... (%d more arguments)", argc - logged_argc + 1);
+        } else {
+            logged_argv[i] = slowlog_arg(argv[i]);
+        }
+    }
+
+    slowlog_entry_t *entry = &slowlog->entries[slowlog->head];
+    if (slowlog->len == slowlog->max_len) {
+        slowlog_entry_free(entry);
+    } else {
+        slowlog->len++;
+    }
+    entry->id = slowlog->next_id++;
+    entry->time = time(NULL);
+    entry->duration_us = duration_us;
+    entry->argv = logged_argv;
+    entry->argc = logged_argc;
+    entry->client_fd = client_fd;
+    slowlog->head = (slowlog->head + 1) % slowlog->max_len;
+}
+
+// index 0 is the newest entry
+const slowlog_entry_t *slowlog_get(const slowlog_t *slowlog, size_t index) {
+    if (!slowlog || index >= slowlog->len) {
+        return NULL;
+    }
+    return &slowlog->entries[(slowlog->head + slowlog->max_len - 1 - index) % slowlog->max_len];
+}
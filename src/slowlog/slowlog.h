@@ -0,0 +1,43 @@
+#ifndef SLOWLOG_H
+#define SLOWLOG_H
+
+#include <stddef.h>
+#include <time.h>
+#include "../lib/sds.h"
+
+#define SLOWLOG_DEFAULT_SLOWER_THAN 10000   // microseconds, as redis.conf
+#define SLOWLOG_DEFAULT_MAX_LEN 128
+#define SLOWLOG_ENTRY_MAX_ARGC 32           // the rest is summarized as "... (N more arguments)"
+#define SLOWLOG_ENTRY_MAX_STRING 128        // longer arguments are cut, "... (N more bytes)"
+
+typedef struct slowlog_entry {
+    long long id;
+    time_t time;                // unix time the command ran at
+    long long duration_us;
+    sds *argv;
+    int argc;
+    int client_fd;
+} slowlog_entry_t;
+
+/*
+ * The slowest commands, newest first, in a ring of max_len entries: once
+ * full every new entry overwrites the oldest one, so logging never allocates
+ * more than the truncated arguments.
+ */
+typedef struct slowlog {
+    slowlog_entry_t *entries;
+    size_t max_len;
+    size_t len;
+    size_t head;                // slot the next entry is written to
+    long long next_id;
+    long long slower_than_us;   // negative disables the log, 0 records every command
+} slowlog_t;
+
+slowlog_t *slowlog_create(long long slower_than_us, size_t max_len);
+void slowlog_destroy(slowlog_t *slowlog);
+int slowlog_configure(slowlog_t *slowlog, long long slower_than_us, size_t max_len);
+void slowlog_push_if_needed(slowlog_t *slowlog, char **argv, int argc, long long duration_us, int client_fd);
+const slowlog_entry_t *slowlog_get(const slowlog_t *slowlog, size_t index);
+void slowlog_reset(slowlog_t *slowlog);
+
+#endif
@@ -1,4 +1,21 @@
-void test_rdb_save_load()
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include "../src/redis_db/redis_db.h"
+#include "../src/hash_table/hash_table.h"
+#include "../src/lib/list.h"
+#include "../src/lib/radix_tree.h"
+#include "../src/streams/redis_stream.h"
+#include "../src/rdb/io_buffer.h"
+#include "../src/rdb/rdb.h"
+#include "../src/resp_praser/resp_parser.h"
+#include "../src/lib/glob.h"
+
+// Returns the number of failed checks
+int test_rdb_save_load()
 {
     printf("=== Testing RDB Save/Load Functionality ===\n");
 
@@ -14,22 +31,22 @@ void test_rdb_save_load()
     redis_object_t *obj4 = redis_object_create_string("RDB Format");
 
     // Add some numeric values
-    redis_object_t *obj5 = redis_object_create_number("42");
-    redis_object_t *obj6 = redis_object_create_number("100");
+    redis_object_t *obj5 = redis_object_create_number(42);
+    redis_object_t *obj6 = redis_object_create_number(100);
 
     // Add list test cases
     redis_object_t *list1 = redis_object_create_list();
     redis_list_t *list_data1 = (redis_list_t *)list1->ptr;
-    list_rpush(list_data1, "apple");
-    list_rpush(list_data1, "banana");
-    list_rpush(list_data1, "cherry");
+    list_rpush(list_data1, strdup("apple"));
+    list_rpush(list_data1, strdup("banana"));
+    list_rpush(list_data1, strdup("cherry"));
 
     redis_object_t *list2 = redis_object_create_list();
     redis_list_t *list_data2 = (redis_list_t *)list2->ptr;
-    list_rpush(list_data2, "first");
-    list_rpush(list_data2, "second");
-    list_rpush(list_data2, "third");
-    list_rpush(list_data2, "fourth");
+    list_rpush(list_data2, strdup("first"));
+    list_rpush(list_data2, strdup("second"));
+    list_rpush(list_data2, strdup("third"));
+    list_rpush(list_data2, strdup("fourth"));
 
     // Empty list test case
     redis_object_t *empty_list = redis_object_create_list();
@@ -204,6 +221,11 @@ void test_rdb_save_load()
                 free(results);
             }
         }
+        else if (obj->encoding == REDIS_ENCODING_INT)
+        {
+            printf("Key: '%s' -> Type: %d, Value: %lld\n",
+                   key, obj->type, obj->ival);
+        }
         else
         {
             printf("Key: '%s' -> Type: %d, Value: '%s'\n",
@@ -225,11 +247,12 @@ void test_rdb_save_load()
     {
         perror("Failed to open RDB file for writing");
         redis_db_destroy(test_db);
-        return;
+        return 1;
     }
 
     io_buffer rdb_buffer;
     buffer_init_with_fd(&rdb_buffer, fd);
+    int failures = 0;
 
     // Call your RDB save function
     if (rdb_save_database(&rdb_buffer, test_db) == 0)
@@ -256,13 +279,245 @@ void test_rdb_save_load()
             printf("Loaded Key: '%s' -> Type: %s\n", loaded_key, redis_type_to_string(loaded_obj->type));
             loaded_count++;
         }
+        hash_table_iterator_destroy(load_iter);
+        redis_db_destroy(test_load);
+
+        if (loaded_count != count)
+        {
+            printf("Loaded %d keys, saved %d\n", loaded_count, count);
+            failures++;
+        }
     }
     else
     {
         printf("Failed to save database to RDB file\n");
         close(fd);
+        failures++;
     }
 
     redis_db_destroy(test_db);
     printf("\n=== Test Complete ===\n");
+    return failures;
+}
+
+// Build a command frame with binary arguments (CR, LF and NUL bytes included); "*0" too
+static size_t build_random_frame(char *buf, size_t cap, int *argc_out)
+{
+    int argc = rand() % 7;
+    size_t pos = snprintf(buf, cap, "*%d\r\n", argc);
+    for (int i = 0; i < argc; i++)
+    {
+        int len = rand() % 40;
+        pos += snprintf(buf + pos, cap - pos, "$%d\r\n", len);
+        for (int j = 0; j < len; j++)
+        {
+            const char pick[] = "aZ0\r\n\0 *$";
+            buf[pos++] = rand() % 4 == 0 ? pick[rand() % 9] : 'a' + rand() % 26;
+        }
+        buf[pos++] = '\r';
+        buf[pos++] = '\n';
+    }
+    *argc_out = argc;
+    return pos;
+}
+
+int test_resp_parser_fuzz()
+{
+    printf("=== Fuzzing the incremental RESP parser ===\n");
+    srand(42);
+
+    char frame[4096];
+    int failures = 0;
+    for (int round = 0; round < 100000; round++)
+    {
+        int argc;
+        size_t len = build_random_frame(frame, sizeof(frame), &argc);
+
+        // Fed in random pieces it must agree with resp_frame_length on every prefix
+        resp_parser_t parser;
+        resp_parser_init(&parser);
+        size_t avail = 0;
+        resp_parse_status_t status = RESP_PARSE_INCOMPLETE;
+        while (status == RESP_PARSE_INCOMPLETE && avail < len)
+        {
+            avail += 1 + rand() % 16;
+            if (avail > len)
+                avail = len;
+            status = resp_parser_feed(&parser, frame, avail);
+            if ((status == RESP_PARSE_OK) != (resp_frame_length(frame, avail) > 0))
+                failures++;
+        }
+        if (status != RESP_PARSE_OK || parser.pos != len || parser.argi != argc)
+        {
+            printf("Round %d: status %d, pos %zu of %zu, %d of %d args\n",
+                   round, status, parser.pos, len, parser.argi, argc);
+            failures++;
+        }
+
+        // Random corruption may be rejected but never read past the buffer
+        resp_parser_reset(&parser);
+        frame[rand() % len] = (char)rand();
+        resp_parser_feed(&parser, frame, rand() % (len + 1));
+        resp_parser_free(&parser);
+    }
+    printf("%d failures\n", failures);
+    return failures;
+}
+
+void test_resp_parser_bench()
+{
+    printf("=== RESP parser benchmark ===\n");
+    const char *frame = "*3\r\n$3\r\nSET\r\n$16\r\nkey:000000000001\r\n$64\r\n"
+                        "vvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvv\r\n";
+    size_t len = strlen(frame);
+    int rounds = 5000000;
+
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    resp_parser_t parser;
+    resp_parser_init(&parser);
+    for (int i = 0; i < rounds; i++)
+    {
+        resp_parser_feed(&parser, frame, len);
+        char **argv = resp_parser_argv(&parser);
+        resp_parser_reset(&parser);
+        free(argv);
+    }
+    resp_parser_free(&parser);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    double ns = (end.tv_sec - start.tv_sec) * 1e9 + (end.tv_nsec - start.tv_nsec);
+    printf("%.1f ns per SET frame, one allocation each\n", ns / rounds);
+}
+
+/*
+ * Random lookups in a keyspace much larger than the last level cache,
+ * one by one and in HASH_TABLE_PREFETCH_MAX batches that hash and
+ * prefetch first, the way MGET and pipelines look keys up.
+ */
+void test_hash_table_prefetch_bench(size_t num_keys)
+{
+    printf("=== Hash table prefetch benchmark, %zu keys ===\n", num_keys);
+    hash_table_t *ht = hash_table_create(num_keys);
+    char **keys = malloc(sizeof(char *) * num_keys);
+    for (size_t i = 0; i < num_keys; i++)
+    {
+        char key[32];
+        snprintf(key, sizeof(key), "key:%012zu", i);
+        keys[i] = strdup(key);
+        hash_table_set(ht, keys[i], calloc(1, 64));
+    }
+
+    // The same random keys for both runs, each batch spread over the whole table
+    size_t lookups = 2000000;
+    char **order = malloc(sizeof(char *) * lookups);
+    srand(7);
+    for (size_t i = 0; i < lookups; i++)
+        order[i] = keys[((size_t)rand() * RAND_MAX + rand()) % num_keys];
+
+    struct timespec start, end;
+    size_t found = 0;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (size_t i = 0; i < lookups; i++)
+    {
+        char *value = hash_table_get(ht, order[i]);
+        found += value && value[0] == 0;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    double plain = (end.tv_sec - start.tv_sec) * 1e9 + (end.tv_nsec - start.tv_nsec);
+
+    uint64_t hashes[HASH_TABLE_PREFETCH_MAX];
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (size_t i = 0; i < lookups; i += HASH_TABLE_PREFETCH_MAX)
+    {
+        size_t batch = lookups - i < HASH_TABLE_PREFETCH_MAX ? lookups - i : HASH_TABLE_PREFETCH_MAX;
+        for (size_t j = 0; j < batch; j++)
+            hashes[j] = hash_table_hash_key(order[i + j]);
+        hash_table_prefetch(ht, hashes, batch);
+        for (size_t j = 0; j < batch; j++)
+        {
+            char *value = hash_table_get_hashed(ht, order[i + j], hashes[j]);
+            found += value && value[0] == 0;
+        }
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    double prefetched = (end.tv_sec - start.tv_sec) * 1e9 + (end.tv_nsec - start.tv_nsec);
+
+    printf("%.1f ns per lookup one by one, %.1f ns prefetched in batches of %d, %zu hits\n",
+           plain / lookups, prefetched / lookups, HASH_TABLE_PREFETCH_MAX, found);
+
+    hash_table_destroy_with_free(ht, free);
+    for (size_t i = 0; i < num_keys; i++)
+        free(keys[i]);
+    free(keys);
+    free(order);
+}
+
+/*
+ * KEYS-style matching of every key against a pattern, with glob_match()
+ * and with the compiled pattern; the two must agree on every key.
+ */
+int test_glob_bench(size_t num_keys)
+{
+    printf("=== Glob benchmark, %zu keys ===\n", num_keys);
+    char **keys = malloc(sizeof(char *) * num_keys);
+    size_t *lens = malloc(sizeof(size_t) * num_keys);
+    for (size_t i = 0; i < num_keys; i++)
+    {
+        char key[32];
+        lens[i] = snprintf(key, sizeof(key), i % 2 ? "user:%zu" : "session:%zu", i);
+        keys[i] = strdup(key);
+    }
+
+    const char *patterns[] = {"user:*", "user:1*", "*", "user:12345", "user:1?3*", "*:1[0-3]*"};
+    int failures = 0;
+    for (size_t p = 0; p < sizeof(patterns) / sizeof(patterns[0]); p++)
+    {
+        size_t pattern_len = strlen(patterns[p]);
+        glob_pattern_t glob;
+        glob_compile(&glob, patterns[p], pattern_len);
+
+        struct timespec start, end;
+        size_t matched = 0, compiled_matched = 0;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        for (size_t i = 0; i < num_keys; i++)
+            matched += glob_match(patterns[p], pattern_len, keys[i], lens[i], 0);
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        double plain = (end.tv_sec - start.tv_sec) * 1e3 + (end.tv_nsec - start.tv_nsec) / 1e6;
+
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        for (size_t i = 0; i < num_keys; i++)
+            compiled_matched += glob_pattern_match(&glob, keys[i], lens[i]);
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        double compiled = (end.tv_sec - start.tv_sec) * 1e3 + (end.tv_nsec - start.tv_nsec) / 1e6;
+
+        printf("%-12s %zu matches, glob_match %.1f ms, compiled %.1f ms\n",
+               patterns[p], matched, plain, compiled);
+        if (matched != compiled_matched)
+        {
+            printf("%s: compiled pattern matched %zu keys\n", patterns[p], compiled_matched);
+            failures++;
+        }
+    }
+
+    for (size_t i = 0; i < num_keys; i++)
+        free(keys[i]);
+    free(keys);
+    free(lens);
+    return failures;
+}
+
+int main(int argc, char **argv)
+{
+    int failures = 0;
+    failures += test_rdb_save_load();
+    failures += test_resp_parser_fuzz();
+    test_resp_parser_bench();
+    // Keys for the benchmarks; the default keeps ctest quick and still outgrows most caches
+    size_t bench_keys = argc > 1 ? strtoull(argv[1], NULL, 10) : 4000000;
+    test_hash_table_prefetch_bench(bench_keys);
+    failures += test_glob_bench(bench_keys);
+
+    printf("\n%d failure(s)\n", failures);
+    return failures ? EXIT_FAILURE : EXIT_SUCCESS;
 }